@@ -1,34 +1,25 @@
-// #ifndef BM_H_
-// #define BM_H_
+#define _DEFAULT_SOURCE
 
+#include "./bm.h"
 
-#include <stdio.h>
 #include <stdlib.h>
-#include <stdint.h>
+#include <limits.h>
+#include <stdarg.h>
 #include <assert.h>
 #include <string.h>
 #include <errno.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 
-
-#define ARRAY_SIZE(xs) (sizeof(xs)/sizeof((xs)[0]))
-#define BM_STACK_CAPACITY 1024
-#define BM_PROGRAM_CAPACITY 1024
-#define LABEL_CAPACITY 1024
-#define UNRESOLVED_JMPS_CAPACITY 1024
-
-typedef enum {
-    ERR_OK = 0, //everything is okay :)
-    ERR_STACK_OVERFLOW, 
-    ERR_STACK_UNDERFLOW, 
-    ERR_ILLEGAL_INST,
-    ERR_DIV_BY_ZERO, 
-    ERR_ILLEGAL_INST_ACCESS, 
-    ERR_ILLEGAL_OPERAND, 
-} Err; 
-
-// #endif
-// #ifdef BM_IMPLEMENTATION
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 const char *err_as_cstr(Err err) {
     switch (err) {
@@ -46,29 +37,23 @@ const char *err_as_cstr(Err err) {
             return "ERR_ILLEGAL_INST_ACCESS";
         case ERR_ILLEGAL_OPERAND:
             return "ERR_ILLEGAL_OPERAND";  
+        case ERR_IO:
+            return "ERR_IO";
+        case ERR_BAD_FORMAT:
+            return "ERR_BAD_FORMAT";
+        case ERR_OUT_OF_MEMORY:
+            return "ERR_OUT_OF_MEMORY";
+        case ERR_SYNTAX:
+            return "ERR_SYNTAX";
+        case ERR_FUEL_EXHAUSTED:
+            return "ERR_FUEL_EXHAUSTED";
+        case ERR_ILLEGAL_MEMORY_ACCESS:
+            return "ERR_ILLEGAL_MEMORY_ACCESS";
         default: 
-            assert(0 && "err_as_cstr: Unreachable"); 
+            return "ERR_UNKNOWN";
     }
 }
 
-typedef int64_t Word;  
-
-
-typedef enum {
-    INST_NOP = 0, 
-    INST_PUSH, 
-    INST_DUP, 
-    INST_PLUS,
-    INST_MINUS,
-    INST_MULT,
-    INST_DIV, 
-    INST_JMP, 
-    INST_JMP_IF, 
-    INST_EQ, 
-    INST_HALT, 
-    INST_PRINT_DEBUG,  
-} Inst_Type; 
-
 const char *inst_type_as_cstr(Inst_Type type){
     switch(type){
         case INST_NOP: return "INST_NOP"; 
@@ -83,34 +68,323 @@ const char *inst_type_as_cstr(Inst_Type type){
         case INST_EQ: return "INST_EQ"; 
         case INST_PRINT_DEBUG: return "INST_PRINT_DEBUG"; 
         case INST_DUP: return "INST_DUP"; 
-        default: assert(0 && "inst_type_as_cstr: Unreachable"); 
+        case INST_PUSH_PLUS: return "INST_PUSH_PLUS";
+        case INST_PUSH_MULT: return "INST_PUSH_MULT";
+        case INST_DUP2_PLUS: return "INST_DUP2_PLUS";
+        case INST_EQ_JMP_IF: return "INST_EQ_JMP_IF";
+        case INST_CALL: return "INST_CALL";
+        case INST_RET: return "INST_RET";
+        case INST_LOAD_LOCAL: return "INST_LOAD_LOCAL";
+        case INST_STORE_LOCAL: return "INST_STORE_LOCAL";
+        case INST_LOAD: return "INST_LOAD";
+        case INST_STORE: return "INST_STORE";
+        case INST_NATIVE: return "INST_NATIVE";
+        default: return "INST_UNKNOWN";
     }
 }
 
+typedef struct Bm_Jit Bm_Jit;
+typedef struct Bm_Block Bm_Block;
+
+// One instruction of the direct-threaded form of a program: the address of
+// its handler inside bm_execute_program_threaded() plus its operand. Jumps
+// store the resolved target instead of the raw address.
+typedef struct Bm_Threaded_Inst {
+    const void *label;
+    union {
+        Word operand;
+        const struct Bm_Threaded_Inst *target;
+    };
+} Bm_Threaded_Inst;
+
+// A binding of bm_bind_native(). `fn` is NULL for indices nothing is bound to.
+typedef struct {
+    Bm_Native fn;
+    void *data;
+    Word arity;
+    Word results;
+    char name[BM_NATIVE_NAME_CAPACITY];     // empty if it has none
+} Bm_Native_Entry;
+
+// Where the instructions of an assembled program came from (see
+// bm_source_location()). Label names are copied, so it outlives the source.
 typedef struct {
-    Inst_Type type; 
-    Word operand; 
-} Inst;
+    Word addr;
+    const char *name;
+} Bm_Debug_Label;
 
 typedef struct {
-    Word stack[BM_STACK_CAPACITY]; 
+    Word *lines;                // lines[i]: 1-based source line of instruction i
+    Word lines_capacity;
+    Bm_Debug_Label *labels;     // in address order
+    size_t labels_size;
+    char *names;
+} Bm_Debug;
+
+Arena arena_from_buffer(void *buffer, size_t capacity){
+    return (Arena) {.data = buffer, .capacity = capacity};
+}
+
+void *arena_alloc(Arena *arena, size_t size){
+    const size_t align = _Alignof(max_align_t);
+    const size_t start = (arena->size + align - 1) & ~(align - 1);
+    if (start > arena->capacity || size > arena->capacity - start){
+        return NULL;
+    }
+    arena->size = start + size;
+    return arena->data + start;
+}
+
+struct Bm {
+    Word *stack; 
     Word stack_size; 
+    Word stack_capacity;    // pushing past it is ERR_STACK_OVERFLOW
 
-    Inst program[BM_PROGRAM_CAPACITY]; 
+    Inst *program; 
     Word program_size; 
+    Word program_capacity;
     Word ip; 
 
     int halt; 
-} Bm; 
 
-#define MAKE_INST_PUSH(value) {.type = INST_PUSH, .operand = (value)}
-#define MAKE_INST_PLUS {.type = INST_PLUS }
-#define MAKE_INST_MINUS {.type = INST_MINUS }
-#define MAKE_INST_MULT {.type = INST_MULT }
-#define MAKE_INST_DIV {.type = INST_DIV }
-#define MAKE_INST_JMP(addr) {.type = INST_JMP, .operand = (addr)}
-#define MAKE_INST_HALT(addr) {.type = INST_HALT, .operand = (addr)}
-#define MAKE_INST_DUP(addr) {.type = INST_DUP, .operand = (addr)}
+    // instructions completed since bm_create() or bm_reset()
+    Word inst_count;
+
+    // One frame per active `call`, next to each other, holding only what
+    // `ret` restores; the locals themselves are on the stack above `fp`.
+    Bm_Frame *frames;
+    Word frames_size;
+    Word frames_capacity;   // calling past it is ERR_STACK_OVERFLOW
+    Word fp;
+
+    // see bm_set_memory()
+    Word *memory;
+    Word memory_size;
+
+    // see bm_bind_native(); always from malloc
+    Bm_Native_Entry *natives;
+    Word natives_size;
+
+    // print_debug output not sent yet, BM_OUTPUT_CAPACITY bytes from malloc
+    // on first use; see bm_flush_output(). `output_err` is the first error
+    // of a flush since bm_flush_output() last reported one.
+    char *output;
+    size_t output_size;
+    int output_fd;
+    Bm_Output output_fn;
+    void *output_data;
+    Bm_Output_Mode output_mode;
+    Err output_err;
+
+    // If set, `stack`, `frames` and `program` are carved out of it and never
+    // freed.
+    Arena *arena;
+
+    // If set, `program` points into this private mapping of a .bm file made
+    // by bm_map_program_from_file(). Pages are shared with the page cache
+    // until something writes to them.
+    void *mapping;
+    size_t mapping_size;
+
+    // If set, `program` belongs to this VM (see bm_share_program()): it is
+    // never written or freed here and `program_capacity` stays 0, so the
+    // first edit copies it. `stack_depth_shared` says the same about the
+    // verification result.
+    const Bm *program_owner;
+
+    // Cache of the threaded translation of `program`, built with the
+    // unchecked handlers if `threaded_unchecked` is set. Anything that
+    // replaces the program must call bm_program_changed().
+    Bm_Threaded_Inst *threaded;
+    int threaded_unchecked;
+
+    // The program as bm_execute_program_tos() runs it, with an end marker,
+    // translated on first use. `tos_failed` remembers that it has illegal
+    // instructions or jumps, which that engine leaves to the reference.
+    Inst *tos_code;
+    int tos_failed;
+
+    // bm_execute_program_blocks(): which instructions are jump targets, and
+    // the block starting at each of the `blocks_size` instructions, built
+    // the first time execution gets there. Made on first use.
+    uint8_t *block_leaders;
+    Bm_Block **blocks;
+    Word blocks_size;
+
+    // bm_program_hash() of `program`, if `program_hashed` is set
+    uint64_t program_hash;
+    int program_hashed;
+
+    // Filled by bm_verify_program(). stack_depth[i] is the stack size at
+    // instruction i relative to the size at instruction 0 (BM_DEPTH_UNKNOWN
+    // if unreachable). Running without checks is safe if the stack at
+    // instruction 0 held at least `min_stack_size` and at most
+    // stack_capacity - max_stack_depth values.
+    int verified;
+    Word *stack_depth;
+    int stack_depth_shared;
+    Word min_stack_size;
+    Word max_stack_depth;
+
+    // Native code for the JIT engine, compiled on first use. `jit_failed`
+    // remembers that the program could not be compiled.
+    Bm_Jit *jit;
+    int jit_failed;
+
+    // Source locations (see bm_source_location()). bm_translate_source()
+    // fills `debug` right away. A file with a debug section only leaves the
+    // encoded section here (in the mapping, in `debug_section_owned`, or in
+    // the owner's when shared), decoded on first use. Follows the program
+    // through bm_fuse_program() and is dropped by every loader.
+    Bm_Debug *debug;
+    const uint8_t *debug_section;
+    size_t debug_section_size;
+    uint8_t *debug_section_owned;
+    int debug_failed;
+
+    // see bm_error_message()
+    char error[256];
+};
+
+// The native bound to `index`, or NULL if there is none.
+static const Bm_Native_Entry *bm_native_at(const Bm *bm, Word index){
+    if (index < 0 || index >= bm->natives_size || bm->natives[index].fn == NULL){
+        return NULL;
+    }
+    return &bm->natives[index];
+}
+
+// Most bytes a value takes in the output: a sign, 19 digits and a newline.
+#define BM_OUTPUT_WORD_MAX 21
+
+// The decimal digits of `value` at `out`, two at a time. Returns how many
+// bytes that took.
+static size_t bm_format_word(char *out, Word value){
+    static const char pairs[] =
+        "0001020304050607080910111213141516171819202122232425262728293031323334353637383940414243444546474849"
+        "5051525354555657585960616263646566676869707172737475767778798081828384858687888990919293949596979899";
+    char digits[20];
+    size_t i = sizeof(digits);
+    uint64_t n = value < 0 ? 0 - (uint64_t) value : (uint64_t) value;
+    while (n >= 100){
+        const size_t d = (n % 100) * 2;
+        n /= 100;
+        digits[--i] = pairs[d + 1];
+        digits[--i] = pairs[d];
+    }
+    if (n >= 10){
+        digits[--i] = pairs[n * 2 + 1];
+        digits[--i] = pairs[n * 2];
+    } else {
+        digits[--i] = (char) ('0' + n);
+    }
+
+    size_t size = 0;
+    if (value < 0){
+        out[size++] = '-';
+    }
+    memcpy(out + size, digits + i, sizeof(digits) - i);
+    return size + sizeof(digits) - i;
+}
+
+static Err bm_output_write(Bm *bm, const char *bytes, size_t size){
+    if (bm->output_fn != NULL){
+        return bm->output_fn(bm->output_data, bytes, size);
+    }
+    // what the host printed to stdout so far goes first
+    if (bm->output_fd == STDOUT_FILENO && fflush(stdout) != 0){
+        return ERR_IO;
+    }
+    while (size > 0){
+        const ssize_t n = write(bm->output_fd, bytes, size);
+        if (n < 0){
+            if (errno == EINTR){
+                continue;
+            }
+            return ERR_IO;
+        }
+        bytes += n;
+        size -= n;
+    }
+    return ERR_OK;
+}
+
+static void bm_output_drain(Bm *bm){
+    if (bm->output_size == 0){
+        return;
+    }
+    const Err err = bm_output_write(bm, bm->output, bm->output_size);
+    bm->output_size = 0;
+    if (err != ERR_OK && bm->output_err == ERR_OK){
+        bm->output_err = err;
+    }
+}
+
+// Appends `value` to the output in its mode, draining or allocating the
+// buffer first if needed. Without a buffer the value goes out on its own.
+static void bm_print_word_slow(Bm *bm, Word value){
+    if (bm->output == NULL){
+        bm->output = malloc(BM_OUTPUT_CAPACITY);
+    }
+    if (bm->output == NULL){
+        char bytes[BM_OUTPUT_WORD_MAX];
+        size_t size = sizeof(value);
+        if (bm->output_mode == BM_OUTPUT_BINARY){
+            memcpy(bytes, &value, sizeof(value));
+        } else {
+            size = bm_format_word(bytes, value);
+            bytes[size++] = '\n';
+        }
+        const Err err = bm_output_write(bm, bytes, size);
+        if (err != ERR_OK && bm->output_err == ERR_OK){
+            bm->output_err = err;
+        }
+        return;
+    }
+
+    bm_output_drain(bm);
+    if (bm->output_mode == BM_OUTPUT_BINARY){
+        memcpy(bm->output, &value, sizeof(value));
+        bm->output_size = sizeof(value);
+    } else {
+        bm->output_size = bm_format_word(bm->output, value);
+        bm->output[bm->output_size++] = '\n';
+    }
+}
+
+// print_debug of every engine
+static inline void bm_print_word(Bm *bm, Word value){
+    if (bm->output == NULL || BM_OUTPUT_CAPACITY - bm->output_size < BM_OUTPUT_WORD_MAX){
+        bm_print_word_slow(bm, value);
+    } else if (bm->output_mode == BM_OUTPUT_BINARY){
+        memcpy(bm->output + bm->output_size, &value, sizeof(value));
+        bm->output_size += sizeof(value);
+    } else {
+        bm->output_size += bm_format_word(bm->output + bm->output_size, value);
+        bm->output[bm->output_size++] = '\n';
+    }
+}
+
+// Adds what a fuel-counting engine ran to `inst_count`. Every engine charges
+// an instruction that faults one unit of fuel, so that is the fuel used minus
+// the faulting instruction, if there was one.
+static void bm_count_insts(Bm *bm, int limit, uint64_t fuel, Err err){
+    const uint64_t start = limit < 0 ? UINT64_MAX : (uint64_t) limit;
+    bm->inst_count += (Word) (start - fuel) - (err != ERR_OK);
+}
+
+// Word arithmetic wraps around, in every engine and in bm_fold().
+static inline Word bm_word_plus(Word a, Word b){
+    return (Word) ((uint64_t) a + (uint64_t) b);
+}
+
+static inline Word bm_word_minus(Word a, Word b){
+    return (Word) ((uint64_t) a - (uint64_t) b);
+}
+
+static inline Word bm_word_mult(Word a, Word b){
+    return (Word) ((uint64_t) a * (uint64_t) b);
+}
 
 static inline Inst inst_plus(void){
     return (Inst) {.type = INST_PLUS}; 
@@ -119,7 +393,7 @@ static inline Inst inst_plus(void){
 
 Err bm_execute_inst (Bm *bm){
 
-    if (bm -> ip >= bm->program_size) {
+    if (bm->ip < 0 || bm->ip >= bm->program_size) {
         return ERR_ILLEGAL_INST_ACCESS; 
     }
 
@@ -132,7 +406,7 @@ Err bm_execute_inst (Bm *bm){
         break; 
 
     case INST_PUSH: 
-        if(bm->stack_size > BM_STACK_CAPACITY){
+        if(bm->stack_size >= bm->stack_capacity){
             return ERR_STACK_OVERFLOW; 
         }
         bm->stack[bm->stack_size++] = inst.operand; //pushing on the stack
@@ -142,7 +416,7 @@ Err bm_execute_inst (Bm *bm){
         if (bm->stack_size < 2){
             return ERR_STACK_UNDERFLOW; 
         }
-        bm->stack[bm->stack_size-2] += bm->stack[bm->stack_size-1];
+        bm->stack[bm->stack_size-2] = bm_word_plus(bm->stack[bm->stack_size-2], bm->stack[bm->stack_size-1]);
         bm->stack_size -= 1; 
         bm->ip += 1;
         break; 
@@ -151,7 +425,7 @@ Err bm_execute_inst (Bm *bm){
         if (bm->stack_size < 2){
             return ERR_STACK_UNDERFLOW; 
         }
-        bm->stack[bm->stack_size-2] -= bm->stack[bm->stack_size-1];
+        bm->stack[bm->stack_size-2] = bm_word_minus(bm->stack[bm->stack_size-2], bm->stack[bm->stack_size-1]);
         bm->stack_size -= 1; 
         bm->ip += 1;
         break; 
@@ -160,7 +434,7 @@ Err bm_execute_inst (Bm *bm){
         if (bm->stack_size < 2){
             return ERR_STACK_UNDERFLOW; 
         }
-        bm->stack[bm->stack_size-2] *= bm->stack[bm->stack_size-1];
+        bm->stack[bm->stack_size-2] = bm_word_mult(bm->stack[bm->stack_size-2], bm->stack[bm->stack_size-1]);
         bm->stack_size -= 1; 
         bm->ip += 1;
         break; 
@@ -174,7 +448,12 @@ Err bm_execute_inst (Bm *bm){
             return ERR_DIV_BY_ZERO; 
         }
 
-        bm->stack[bm->stack_size-2] /= bm->stack[bm->stack_size-1];
+        // INT64_MIN / -1 traps on x86, so -1 is handled as a wrapping negation
+        if (bm->stack[bm->stack_size-1] == -1){
+            bm->stack[bm->stack_size-2] = (Word) (0 - (uint64_t) bm->stack[bm->stack_size-2]);
+        } else {
+            bm->stack[bm->stack_size-2] /= bm->stack[bm->stack_size-1];
+        }
         bm->stack_size -= 1; 
         bm->ip += 1;
         break; 
@@ -214,7 +493,7 @@ Err bm_execute_inst (Bm *bm){
             return ERR_STACK_UNDERFLOW;
         }
 
-        printf("%ld\n", bm->stack[bm->stack_size - 1]); 
+        bm_print_word(bm, bm->stack[bm->stack_size - 1]);
         bm->stack_size -= 1;
         bm->ip += 1; 
         break; 
@@ -222,7 +501,7 @@ Err bm_execute_inst (Bm *bm){
     case INST_DUP: 
         // 0 1 2 3 
         //        ^
-        if(bm->stack_size > BM_STACK_CAPACITY){
+        if(bm->stack_size >= bm->stack_capacity){
             return ERR_STACK_OVERFLOW; 
         }
 
@@ -237,18 +516,165 @@ Err bm_execute_inst (Bm *bm){
         bm->ip += 1; 
         break; 
 
+    // the fused instructions fail like the first instruction of the
+    // sequence they replace that would have failed
+    case INST_PUSH_PLUS:
+        if (bm->stack_size >= bm->stack_capacity){
+            return ERR_STACK_OVERFLOW;
+        }
+        if (bm->stack_size < 1){
+            return ERR_STACK_UNDERFLOW;
+        }
+        bm->stack[bm->stack_size-1] = bm_word_plus(bm->stack[bm->stack_size-1], inst.operand);
+        bm->ip += 1;
+        break;
+
+    case INST_PUSH_MULT:
+        if (bm->stack_size >= bm->stack_capacity){
+            return ERR_STACK_OVERFLOW;
+        }
+        if (bm->stack_size < 1){
+            return ERR_STACK_UNDERFLOW;
+        }
+        bm->stack[bm->stack_size-1] = bm_word_mult(bm->stack[bm->stack_size-1], inst.operand);
+        bm->ip += 1;
+        break;
+
+    case INST_DUP2_PLUS:
+        if (bm->stack_size < 2){
+            return ERR_STACK_UNDERFLOW;
+        }
+        if (bm->stack_size + 1 >= bm->stack_capacity){
+            return ERR_STACK_OVERFLOW;
+        }
+        bm->stack[bm->stack_size] = bm_word_plus(bm->stack[bm->stack_size-2], bm->stack[bm->stack_size-1]);
+        bm->stack_size += 1;
+        bm->ip += 1;
+        break;
+
+    case INST_EQ_JMP_IF:
+        if (bm->stack_size < 2){
+            return ERR_STACK_UNDERFLOW;
+        }
+        if (bm->stack[bm->stack_size-1] == bm->stack[bm->stack_size-2]){
+            bm->stack_size -= 2;
+            bm->ip = inst.operand;
+        } else {
+            bm->stack[bm->stack_size-2] = 0;
+            bm->stack_size -= 1;
+            bm->ip += 1;
+        }
+        break;
+
+    case INST_CALL:
+        if (bm->frames_size >= bm->frames_capacity){
+            return ERR_STACK_OVERFLOW;
+        }
+        bm->frames[bm->frames_size++] = (Bm_Frame) {.return_ip = bm->ip + 1, .fp = bm->fp};
+        bm->fp = bm->stack_size;
+        bm->ip = inst.operand;
+        break;
+
+    case INST_RET: {
+        if (inst.operand < 0){
+            return ERR_ILLEGAL_OPERAND;
+        }
+        // something to return, and the arguments to drop
+        if (bm->frames_size == 0 || bm->stack_size <= bm->fp || bm->fp - inst.operand < 0){
+            return ERR_STACK_UNDERFLOW;
+        }
+        const Bm_Frame frame = bm->frames[--bm->frames_size];
+        bm->stack[bm->fp - inst.operand] = bm->stack[bm->stack_size - 1];
+        bm->stack_size = bm->fp - inst.operand + 1;
+        bm->fp = frame.fp;
+        bm->ip = frame.return_ip;
+    } break;
+
+    case INST_LOAD_LOCAL:
+        if (bm->stack_size >= bm->stack_capacity){
+            return ERR_STACK_OVERFLOW;
+        }
+        if (inst.operand < -bm->fp || inst.operand >= bm->stack_size - bm->fp){
+            return ERR_STACK_UNDERFLOW;
+        }
+        bm->stack[bm->stack_size] = bm->stack[bm->fp + inst.operand];
+        bm->stack_size += 1;
+        bm->ip += 1;
+        break;
+
+    case INST_STORE_LOCAL:
+        // the slot is below the value that goes there
+        if (inst.operand < -bm->fp || inst.operand >= bm->stack_size - 1 - bm->fp){
+            return ERR_STACK_UNDERFLOW;
+        }
+        bm->stack[bm->fp + inst.operand] = bm->stack[bm->stack_size - 1];
+        bm->stack_size -= 1;
+        bm->ip += 1;
+        break;
+
+    case INST_LOAD:
+        if (bm->stack_size < 1){
+            return ERR_STACK_UNDERFLOW;
+        }
+        if ((uint64_t) bm->stack[bm->stack_size - 1] >= (uint64_t) bm->memory_size){
+            return ERR_ILLEGAL_MEMORY_ACCESS;
+        }
+        bm->stack[bm->stack_size - 1] = bm->memory[bm->stack[bm->stack_size - 1]];
+        bm->ip += 1;
+        break;
+
+    case INST_STORE:
+        if (bm->stack_size < 2){
+            return ERR_STACK_UNDERFLOW;
+        }
+        if ((uint64_t) bm->stack[bm->stack_size - 2] >= (uint64_t) bm->memory_size){
+            return ERR_ILLEGAL_MEMORY_ACCESS;
+        }
+        bm->memory[bm->stack[bm->stack_size - 2]] = bm->stack[bm->stack_size - 1];
+        bm->stack_size -= 2;
+        bm->ip += 1;
+        break;
+
+    case INST_NATIVE: {
+        const Bm_Native_Entry *native = bm_native_at(bm, inst.operand);
+        if (native == NULL){
+            return ERR_ILLEGAL_OPERAND;
+        }
+        if (bm->stack_size < native->arity){
+            return ERR_STACK_UNDERFLOW;
+        }
+        if (native->results - native->arity > bm->stack_capacity - bm->stack_size){
+            return ERR_STACK_OVERFLOW;
+        }
+        const Err err = native->fn(bm, bm->stack + bm->stack_size - native->arity, native->data);
+        if (err != ERR_OK){
+            return err;
+        }
+        bm->stack_size += native->results - native->arity;
+        bm->ip += 1;
+    } break;
+
     default: 
         return ERR_ILLEGAL_INST; 
     }
 
+    bm->inst_count += 1;
     return ERR_OK; 
 
 }
 
 
 
+// defined next to the verifier below
+static Err bm_execute_program_unchecked(Bm *bm, int limit);
+static int bm_can_skip_checks(const Bm *bm);
+
 Err bm_execute_program(Bm *bm, int limit){
 
+    if (limit != 0 && !bm->halt && bm_can_skip_checks(bm)){
+        return bm_execute_program_unchecked(bm, limit);
+    }
+
     while(limit != 0 && !bm->halt){
         Err err = bm_execute_inst(bm);
         if (err != ERR_OK){
@@ -263,322 +689,6008 @@ Err bm_execute_program(Bm *bm, int limit){
     return ERR_OK; 
 }
 
+#define BM_DEPTH_UNKNOWN INT64_MIN
 
-void bm_dump_stack(FILE *stream, const Bm *bm){
-    fprintf(stream, "Stack:\n");
-    if (bm->stack_size > 0) {
-        for (Word i = 0; i < bm->stack_size; ++i){
-            fprintf(stream, " %ld\n", bm->stack[i]); 
-        }
-    } else {
-        fprintf(stream, " [empty]\n"); 
-    }
-    
+static void bm_discard_threaded(Bm *bm){
+    free(bm->threaded);
+    bm->threaded = NULL;
 }
 
-void bm_load_program_from_memory(Bm *bm, Inst *program, size_t program_size){
-    assert(program_size < BM_PROGRAM_CAPACITY); 
-    memcpy(bm->program, program, sizeof(program[0]) * program_size);
-    bm->program_size = program_size;  
+static void bm_discard_blocks(Bm *bm){
+    for (Word i = 0; i < bm->blocks_size; ++i){
+        free(bm->blocks[i]);
+    }
+    free(bm->blocks);
+    free(bm->block_leaders);
+    bm->blocks = NULL;
+    bm->block_leaders = NULL;
+    bm->blocks_size = 0;
 }
 
-void bm_load_program_from_file(Bm *bm, const char *file_path){
-    FILE *f = fopen(file_path, "rb"); 
-    if (f == NULL){
-        fprintf(stderr, "ERROR: Could not open file `%s` %s\n", file_path, strerror(errno));
-        exit(1); 
+static void bm_discard_verification(Bm *bm){
+    if (!bm->stack_depth_shared){
+        free(bm->stack_depth);
     }
+    bm->stack_depth = NULL;
+    bm->stack_depth_shared = 0;
+    bm->verified = 0;
+}
 
-    if (fseek(f, 0, SEEK_END) < 0){
-        fprintf(stderr, "ERROR: Could not read file `%s` %s\n", file_path, strerror(errno));
-        exit(1);   
-    }
+// Drops everything derived from `program`. Anything that replaces or edits
+// the program must call it.
+static void bm_jit_free(Bm_Jit *jit);
 
-    long m = ftell(f);
-    if (m < 0){
-        fprintf(stderr, "ERROR: Could not read file `%s` %s\n", file_path, strerror(errno));
-        exit(1);   
-    } 
+static void bm_program_changed(Bm *bm){
+    bm_discard_threaded(bm);
+    bm_discard_blocks(bm);
+    free(bm->tos_code);
+    bm->tos_code = NULL;
+    bm->tos_failed = 0;
+    bm->program_hashed = 0;
+    bm_jit_free(bm->jit);
+    bm->jit = NULL;
+    bm->jit_failed = 0;
+    bm_discard_verification(bm);
+}
 
-    assert(m % sizeof(bm->program[0]) == 0);
-    assert((size_t)m <= BM_PROGRAM_CAPACITY * sizeof(bm->program[0])); 
+// Load-time verifier. Rejects programs that can never be executed correctly:
+// illegal instruction types (ERR_ILLEGAL_INST), `dup` operands that are
+// negative or beyond the stack capacity (ERR_ILLEGAL_OPERAND) and jump targets
+// outside of the program (ERR_ILLEGAL_INST_ACCESS). The index of the offending
+// instruction is stored in `*fault_inst` (if not NULL).
+//
+// It then follows the control-flow graph from instruction 0 and computes the
+// stack size at every reachable instruction relative to the size at entry.
+// If every instruction has a single such depth, the program is marked
+// `verified` and the engines may run it without stack checks as long as the
+// current state agrees with the proof (see bm_can_skip_checks()). Programs
+// whose depth depends on the path taken (a loop that keeps pushing, like
+// examples/fib.ebasm) or that reach a `call` or `ret` are valid but stay
+// unverified and run checked. Locals and memory are checked at run time
+// either way. If the analysis runs out of memory it returns
+// ERR_OUT_OF_MEMORY and the program just stays unverified.
+Err bm_verify_program(Bm *bm, Word *fault_inst){
+    bm_discard_verification(bm);
 
-    if (fseek(f, 0, SEEK_SET) < 0){
-        fprintf(stderr, "ERROR: Could not read file `%s` %s\n", file_path, strerror(errno));
-        exit(1);           
-    }
+    const Word n = bm->program_size;
+    for (Word i = 0; i < n; ++i){
+        const Inst inst = bm->program[i];
+        Err err = ERR_OK;
 
-    bm->program_size = fread(bm->program, sizeof(bm->program[0]), m/sizeof(bm->program[0]), f); 
-    
-    if (ferror(f)){
-        fprintf(stderr, "ERROR: Could not read file `%s` %s\n", file_path, strerror(errno));
-        exit(1);          
-    }
+        switch (inst.type) {
+        case INST_NOP:
+        case INST_PUSH:
+        case INST_PLUS:
+        case INST_MINUS:
+        case INST_MULT:
+        case INST_DIV:
+        case INST_EQ:
+        case INST_HALT:
+        case INST_PRINT_DEBUG:
+        case INST_PUSH_PLUS:
+        case INST_PUSH_MULT:
+        case INST_DUP2_PLUS:
+        case INST_LOAD_LOCAL:
+        case INST_STORE_LOCAL:
+        case INST_LOAD:
+        case INST_STORE:
+            break;
 
-    fclose(f); 
+        case INST_DUP:
+            if (inst.operand < 0 || inst.operand >= bm->stack_capacity){
+                err = ERR_ILLEGAL_OPERAND;
+            }
+            break;
 
-}
+        case INST_RET:
+            if (inst.operand < 0){
+                err = ERR_ILLEGAL_OPERAND;
+            }
+            break;
 
-void bm_save_program_to_file(const Bm *bm, const char *file_path){
-    FILE *f = fopen(file_path, "wb"); 
-    if (f == NULL){
-        fprintf(stderr, "ERROR: Could not open file `%s` %s\n", file_path, strerror(errno));
-        exit(1); 
+        case INST_NATIVE:
+            if (bm_native_at(bm, inst.operand) == NULL){
+                err = ERR_ILLEGAL_OPERAND;
+            }
+            break;
+
+        case INST_JMP:
+        case INST_JMP_IF:
+        case INST_EQ_JMP_IF:
+        case INST_CALL:
+            if (inst.operand < 0 || inst.operand >= n){
+                err = ERR_ILLEGAL_INST_ACCESS;
+            }
+            break;
+
+        default:
+            err = ERR_ILLEGAL_INST;
+        }
+
+        if (err != ERR_OK){
+            if (fault_inst){
+                *fault_inst = i;
+            }
+            return err;
+        }
     }
 
-    fwrite(bm->program, sizeof(bm->program[0]), bm->program_size, f); 
+    if (n == 0){
+        return ERR_OK;
+    }
 
-    if (ferror(f)){
-        fprintf(stderr, "ERROR: Could not write to file `%s` %s\n", file_path, strerror(errno));
-        exit(1);   
+    Word *depth = malloc(sizeof(depth[0]) * n);
+    Word *worklist = malloc(sizeof(worklist[0]) * n);
+    if (depth == NULL || worklist == NULL){
+        free(depth);
+        free(worklist);
+        return ERR_OUT_OF_MEMORY;
+    }
+    for (Word i = 0; i < n; ++i){
+        depth[i] = BM_DEPTH_UNKNOWN;
     }
 
-    fclose(f); 
+    Word min_stack_size = 0;
+    Word max_stack_depth = 0;
+    int consistent = 1;
+    size_t worklist_size = 0;
 
+    depth[0] = 0;
+    worklist[worklist_size++] = 0;
 
-}
+    while (worklist_size > 0 && consistent){
+        const Word i = worklist[--worklist_size];
+        const Inst inst = bm->program[i];
+        const Word d = depth[i];
 
-// Bm bm = {0}; 
+        Word needed = 0;        // stack slots the instruction reads
+        Word next_depth = d;    // depth at i + 1
+        Word jump_depth = d;    // depth at the jump target
+        Word peak_depth = d;    // deepest within a fused instruction
+        int falls_through = 1;
+        int jumps = 0;
 
-// char *source_code = 
-//     "push 0\n" 
-//     "push 1\n" 
-//     "dup 1\n" 
-//     "dup 1\n" 
-//     "plus\n" 
-//     "jmp 2\n";
+        switch (inst.type) {
+        case INST_NOP:
+            break;
+        case INST_PUSH:
+            next_depth = d + 1;
+            break;
+        case INST_DUP:
+            needed = inst.operand + 1;
+            next_depth = d + 1;
+            break;
+        case INST_PLUS:
+        case INST_MINUS:
+        case INST_MULT:
+        case INST_DIV:
+        case INST_EQ:
+            needed = 2;
+            next_depth = d - 1;
+            break;
+        case INST_JMP:
+            falls_through = 0;
+            jumps = 1;
+            break;
+        case INST_JMP_IF:
+            needed = 1;
+            jump_depth = d - 1;
+            jumps = 1;
+            break;
+        case INST_HALT:
+            falls_through = 0;
+            break;
+        case INST_PRINT_DEBUG:
+            needed = 1;
+            next_depth = d - 1;
+            break;
+        case INST_PUSH_PLUS:
+        case INST_PUSH_MULT:
+            needed = 1;
+            peak_depth = d + 1;
+            break;
+        case INST_DUP2_PLUS:
+            needed = 2;
+            next_depth = d + 1;
+            peak_depth = d + 2;
+            break;
+        case INST_EQ_JMP_IF:
+            needed = 2;
+            next_depth = d - 1;
+            jump_depth = d - 2;
+            jumps = 1;
+            break;
+        case INST_LOAD_LOCAL:
+            next_depth = d + 1;
+            break;
+        case INST_STORE_LOCAL:
+            needed = 1;
+            next_depth = d - 1;
+            break;
+        case INST_LOAD:
+            needed = 1;
+            break;
+        case INST_STORE:
+            needed = 2;
+            next_depth = d - 2;
+            break;
+        case INST_NATIVE: {
+            const Bm_Native_Entry *native = bm_native_at(bm, inst.operand);
+            needed = native->arity;
+            next_depth = d - native->arity + native->results;
+        } break;
+        case INST_CALL:
+        case INST_RET:
+            // the depth after a call depends on the function: not proven
+            consistent = 0;
+            falls_through = 0;
+            break;
+        default:
+            assert(0 && "bm_verify_program: Unreachable");
+        }
 
-typedef struct {
-    size_t count;
-    const char *data;
-} String_View;
+        if (needed - d > min_stack_size){
+            min_stack_size = needed - d;
+        }
+        if (next_depth > max_stack_depth){
+            max_stack_depth = next_depth;
+        }
+        if (peak_depth > max_stack_depth){
+            max_stack_depth = peak_depth;
+        }
 
-String_View cstr_as_sv(const char *cstr){
-    return (String_View){
-        .count = strlen(cstr),
-        .data = cstr,
-    };
-}
+        // falling off the end is not an error here: the engines report
+        // ERR_ILLEGAL_INST_ACCESS there exactly like bm_execute_inst()
+        Word succ[2];
+        Word succ_depth[2];
+        size_t succ_count = 0;
+        if (falls_through && i + 1 < n){
+            succ[succ_count] = i + 1;
+            succ_depth[succ_count++] = next_depth;
+        }
+        if (jumps){
+            succ[succ_count] = inst.operand;
+            succ_depth[succ_count++] = jump_depth;
+        }
 
-String_View sv_trim_left(String_View sv){
+        for (size_t j = 0; j < succ_count; ++j){
+            if (depth[succ[j]] == BM_DEPTH_UNKNOWN){
+                depth[succ[j]] = succ_depth[j];
+                worklist[worklist_size++] = succ[j];
+            } else if (depth[succ[j]] != succ_depth[j]){
+                consistent = 0;
+            }
+        }
+    }
 
-    size_t i = 0; 
-    while (i < sv.count && isspace(sv.data[i])){
-        i += 1;
+    free(worklist);
+
+    if (!consistent || min_stack_size + max_stack_depth > bm->stack_capacity){
+        free(depth);
+        return ERR_OK;
     }
 
-    return (String_View) {
-            .count = sv.count - i,
-            .data = sv.data + i,
-    };
+    bm->stack_depth = depth;
+    bm->min_stack_size = min_stack_size;
+    bm->max_stack_depth = max_stack_depth;
+    bm->verified = 1;
+    return ERR_OK;
 }
 
-String_View sv_trim_right(String_View sv){
+// Whether execution may continue from the current state without stack
+// checks: the program is verified, `ip` is an instruction the proof reached
+// and the stack the proof started from (`stack_size` minus the depth of `ip`)
+// is deep enough for every read and shallow enough for every push.
+static int bm_can_skip_checks(const Bm *bm){
+    if (!bm->verified || bm->ip < 0 || bm->ip >= bm->program_size){
+        return 0;
+    }
 
-    size_t i = 0; 
-    while (i < sv.count && isspace(sv.data [sv.count - i - 1])){
-        i += 1;
+    const Word depth = bm->stack_depth[bm->ip];
+    if (depth == BM_DEPTH_UNKNOWN){
+        return 0;
     }
 
-    return (String_View) {
-            .count = sv.count - i,
-            .data = sv.data,
-    };
+    const Word base = bm->stack_size - depth;
+    return base >= bm->min_stack_size && base + bm->max_stack_depth <= bm->stack_capacity;
 }
 
-String_View sv_trim(String_View sv){
-    return sv_trim_right(sv_trim_left(sv)); 
-}
+// Fast path of bm_execute_program() for verified programs. Only the checks
+// the verifier can't discharge remain: division by zero and falling off the
+// end of the program.
+static Err bm_execute_program_unchecked(Bm *bm, int limit){
+    const Inst *const program = bm->program;
+    const Word program_size = bm->program_size;
+    Word ip = bm->ip;
+    Word *const stack = bm->stack;
+    Word *sp = bm->stack + bm->stack_size;
+    uint64_t fuel = limit < 0 ? UINT64_MAX : (uint64_t) limit;
+    Err err = ERR_OK;
 
-String_View sv_chop_by_delim(String_View *sv, char delim){
+    while (fuel > 0 && !bm->halt && err == ERR_OK){
+        fuel -= 1;
+        if (ip >= program_size){
+            err = ERR_ILLEGAL_INST_ACCESS;
+            break;
+        }
 
-    size_t i = 0;
-    while (i < sv->count && sv->data[i] != delim){
-        i += 1; 
-    }
+        const Inst inst = program[ip];
+        switch (inst.type) {
+        case INST_NOP:
+            ip += 1;
+            break;
 
-    String_View result = { 
-        .count = i,
-        .data = sv->data,
-    };
+        case INST_PUSH:
+            *sp++ = inst.operand;
+            ip += 1;
+            break;
 
-    if (i < sv->count){
-        sv->count -= i + 1;
-        sv->data += i + 1;
-    } else {
-        sv->count -= i;
-        sv->data -= i;
-    }
+        case INST_DUP:
+            sp[0] = sp[-1 - inst.operand];
+            sp += 1;
+            ip += 1;
+            break;
+
+        case INST_PLUS:
+            sp[-2] = bm_word_plus(sp[-2], sp[-1]);
+            sp -= 1;
+            ip += 1;
+            break;
+
+        case INST_MINUS:
+            sp[-2] = bm_word_minus(sp[-2], sp[-1]);
+            sp -= 1;
+            ip += 1;
+            break;
+
+        case INST_MULT:
+            sp[-2] = bm_word_mult(sp[-2], sp[-1]);
+            sp -= 1;
+            ip += 1;
+            break;
+
+        case INST_DIV:
+            if (sp[-1] == 0) {
+                err = ERR_DIV_BY_ZERO;
+                break;
+            }
+            if (sp[-1] == -1) {
+                sp[-2] = (Word) (0 - (uint64_t) sp[-2]);
+            } else {
+                sp[-2] /= sp[-1];
+            }
+            sp -= 1;
+            ip += 1;
+            break;
+
+        case INST_JMP:
+            ip = inst.operand;
+            break;
+
+        case INST_JMP_IF:
+            if (sp[-1]) {
+                sp -= 1;
+                ip = inst.operand;
+            } else {
+                ip += 1;
+            }
+            break;
+
+        case INST_EQ:
+            sp[-2] = sp[-1] == sp[-2];
+            sp -= 1;
+            ip += 1;
+            break;
+
+        case INST_HALT:
+            bm->halt = 1;
+            break;
+
+        case INST_PRINT_DEBUG:
+            bm_print_word(bm, sp[-1]);
+            sp -= 1;
+            ip += 1;
+            break;
+
+        case INST_PUSH_PLUS:
+            sp[-1] = bm_word_plus(sp[-1], inst.operand);
+            ip += 1;
+            break;
+
+        case INST_PUSH_MULT:
+            sp[-1] = bm_word_mult(sp[-1], inst.operand);
+            ip += 1;
+            break;
+
+        case INST_DUP2_PLUS:
+            sp[0] = bm_word_plus(sp[-2], sp[-1]);
+            sp += 1;
+            ip += 1;
+            break;
+
+        case INST_EQ_JMP_IF:
+            if (sp[-1] == sp[-2]) {
+                sp -= 2;
+                ip = inst.operand;
+            } else {
+                sp[-2] = 0;
+                sp -= 1;
+                ip += 1;
+            }
+            break;
+
+        case INST_LOAD_LOCAL:
+            if (inst.operand < -bm->fp || inst.operand >= (sp - stack) - bm->fp) {
+                err = ERR_STACK_UNDERFLOW;
+                break;
+            }
+            sp[0] = stack[bm->fp + inst.operand];
+            sp += 1;
+            ip += 1;
+            break;
+
+        case INST_STORE_LOCAL:
+            if (inst.operand < -bm->fp || inst.operand >= (sp - stack) - 1 - bm->fp) {
+                err = ERR_STACK_UNDERFLOW;
+                break;
+            }
+            stack[bm->fp + inst.operand] = sp[-1];
+            sp -= 1;
+            ip += 1;
+            break;
+
+        case INST_LOAD:
+            if ((uint64_t) sp[-1] >= (uint64_t) bm->memory_size) {
+                err = ERR_ILLEGAL_MEMORY_ACCESS;
+                break;
+            }
+            sp[-1] = bm->memory[sp[-1]];
+            ip += 1;
+            break;
+
+        case INST_STORE:
+            if ((uint64_t) sp[-2] >= (uint64_t) bm->memory_size) {
+                err = ERR_ILLEGAL_MEMORY_ACCESS;
+                break;
+            }
+            bm->memory[sp[-2]] = sp[-1];
+            sp -= 2;
+            ip += 1;
+            break;
+
+        case INST_NATIVE: {
+            // bound with this arity when the program was verified
+            const Bm_Native_Entry *native = &bm->natives[inst.operand];
+            err = native->fn(bm, sp - native->arity, native->data);
+            if (err != ERR_OK) {
+                break;
+            }
+            sp += native->results - native->arity;
+            ip += 1;
+        } break;
+
+        case INST_CALL:
+        case INST_RET:
+        default:
+            assert(0 && "bm_execute_program_unchecked: Unreachable");
+        }
+    }
+
+    bm->ip = ip;
+    bm->stack_size = sp - stack;
+    bm_count_insts(bm, limit, fuel, err);
+    return err;
+}
+
+// Second execution engine. Semantically identical to bm_execute_program()
+// (same Err results, same final stack, ip and halt, same `limit` accounting),
+// but `ip`, the stack pointer and the remaining limit live in locals and are
+// only written back to `bm` when the engine stops.
+//
+// With GCC/Clang the program is translated once into a direct-threaded form
+// (one handler address per instruction) and dispatched with computed goto.
+// Every other compiler gets a plain switch loop over the same locals.
+#if defined(__GNUC__)
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+
+Err bm_execute_program_threaded(Bm *bm, int limit){
+    static const void *const labels[] = {
+        [INST_NOP]         = &&do_nop,
+        [INST_PUSH]        = &&do_push,
+        [INST_DUP]         = &&do_dup,
+        [INST_PLUS]        = &&do_plus,
+        [INST_MINUS]       = &&do_minus,
+        [INST_MULT]        = &&do_mult,
+        [INST_DIV]         = &&do_div,
+        [INST_JMP]         = &&do_jmp,
+        [INST_JMP_IF]      = &&do_jmp_if,
+        [INST_EQ]          = &&do_eq,
+        [INST_HALT]        = &&do_halt,
+        [INST_PRINT_DEBUG] = &&do_print_debug,
+        [INST_PUSH_PLUS]   = &&do_push_plus,
+        [INST_PUSH_MULT]   = &&do_push_mult,
+        [INST_DUP2_PLUS]   = &&do_dup2_plus,
+        [INST_EQ_JMP_IF]   = &&do_eq_jmp_if,
+        [INST_CALL]        = &&do_call,
+        [INST_RET]         = &&do_ret,
+        [INST_LOAD_LOCAL]  = &&do_load_local,
+        [INST_STORE_LOCAL] = &&do_store_local,
+        [INST_LOAD]        = &&do_load,
+        [INST_STORE]       = &&do_store,
+        [INST_NATIVE]      = &&do_native,
+    };
+
+    // handlers that trust the verifier (see bm_can_skip_checks())
+    static const void *const labels_unchecked[] = {
+        [INST_NOP]         = &&do_nop,
+        [INST_PUSH]        = &&do_push_unchecked,
+        [INST_DUP]         = &&do_dup_unchecked,
+        [INST_PLUS]        = &&do_plus_unchecked,
+        [INST_MINUS]       = &&do_minus_unchecked,
+        [INST_MULT]        = &&do_mult_unchecked,
+        [INST_DIV]         = &&do_div_unchecked,
+        [INST_JMP]         = &&do_jmp,
+        [INST_JMP_IF]      = &&do_jmp_if_unchecked,
+        [INST_EQ]          = &&do_eq_unchecked,
+        [INST_HALT]        = &&do_halt,
+        [INST_PRINT_DEBUG] = &&do_print_debug_unchecked,
+        [INST_PUSH_PLUS]   = &&do_push_plus_unchecked,
+        [INST_PUSH_MULT]   = &&do_push_mult_unchecked,
+        [INST_DUP2_PLUS]   = &&do_dup2_plus_unchecked,
+        [INST_EQ_JMP_IF]   = &&do_eq_jmp_if_unchecked,
+        [INST_CALL]        = &&do_call,
+        [INST_RET]         = &&do_ret,
+        [INST_LOAD_LOCAL]  = &&do_load_local_unchecked,
+        [INST_STORE_LOCAL] = &&do_store_local,
+        [INST_LOAD]        = &&do_load_unchecked,
+        [INST_STORE]       = &&do_store_unchecked,
+        [INST_NATIVE]      = &&do_native_unchecked,
+    };
+
+    if (limit == 0 || bm->halt) {
+        return ERR_OK;
+    }
+
+    if (bm->ip < 0 || bm->ip >= bm->program_size) {
+        return ERR_ILLEGAL_INST_ACCESS;
+    }
+
+    const int unchecked = bm_can_skip_checks(bm);
+    if (bm->threaded != NULL && bm->threaded_unchecked != unchecked) {
+        bm_discard_threaded(bm);
+    }
+
+    if (bm->threaded == NULL) {
+        const void *const *table = unchecked ? labels_unchecked : labels;
+
+        // one extra slot past the end catches falling off the program
+        Bm_Threaded_Inst *code = malloc(sizeof(code[0]) * (bm->program_size + 1));
+        if (code == NULL) {
+            return bm_execute_program(bm, limit);
+        }
+
+        for (Word i = 0; i < bm->program_size; ++i) {
+            Inst inst = bm->program[i];
+            if ((size_t) inst.type >= ARRAY_SIZE(labels)) {
+                code[i].label = &&do_illegal;
+                code[i].operand = inst.operand;
+            } else if (inst.type == INST_JMP || inst.type == INST_JMP_IF || inst.type == INST_EQ_JMP_IF ||
+                       inst.type == INST_CALL) {
+                if (inst.operand < 0 || inst.operand > bm->program_size) {
+                    code[i].label = inst.type == INST_JMP    ? &&do_jmp_out
+                                  : inst.type == INST_JMP_IF ? &&do_jmp_if_out
+                                  : inst.type == INST_CALL   ? &&do_call_out
+                                  :                            &&do_eq_jmp_if_out;
+                    code[i].operand = inst.operand;
+                } else {
+                    code[i].label = table[inst.type];
+                    code[i].target = &code[inst.operand];
+                }
+            } else {
+                code[i].label = table[inst.type];
+                code[i].operand = inst.operand;
+            }
+        }
+        code[bm->program_size].label = &&do_end;
+        code[bm->program_size].operand = 0;
+
+        bm->threaded = code;
+        bm->threaded_unchecked = unchecked;
+    }
+
+    const Bm_Threaded_Inst *const code = bm->threaded;
+    const Bm_Threaded_Inst *ip = &code[bm->ip];
+    Word *const stack = bm->stack;
+    Word *const stack_end = bm->stack + bm->stack_capacity;
+    Word *sp = bm->stack + bm->stack_size;
+    Word fp = bm->fp;
+    Word *const memory = bm->memory;
+    const Word memory_size = bm->memory_size;
+    Word out = 0;   // where a jump out of the program goes
+    uint64_t fuel = limit < 0 ? UINT64_MAX : (uint64_t) limit;
+    Err err = ERR_OK;
+
+#define NEXT()                      \
+    do {                            \
+        if (fuel == 0) goto done;   \
+        fuel -= 1;                  \
+        goto *ip->label;            \
+    } while (0)
+
+#define FAIL(e)         \
+    do {                \
+        err = (e);      \
+        goto done;      \
+    } while (0)
+
+    NEXT();
+
+do_nop:
+    ip += 1;
+    NEXT();
+
+do_push:
+    if (sp >= stack_end) FAIL(ERR_STACK_OVERFLOW);
+do_push_unchecked:
+    *sp++ = ip->operand;
+    ip += 1;
+    NEXT();
+
+do_dup:
+    if (sp >= stack_end) FAIL(ERR_STACK_OVERFLOW);
+    if ((sp - stack) - ip->operand <= 0) FAIL(ERR_STACK_UNDERFLOW);
+    if (ip->operand < 0) FAIL(ERR_ILLEGAL_OPERAND);
+do_dup_unchecked:
+    sp[0] = sp[-1 - ip->operand];
+    sp += 1;
+    ip += 1;
+    NEXT();
+
+do_plus:
+    if (sp - stack < 2) FAIL(ERR_STACK_UNDERFLOW);
+do_plus_unchecked:
+    sp[-2] = bm_word_plus(sp[-2], sp[-1]);
+    sp -= 1;
+    ip += 1;
+    NEXT();
+
+do_minus:
+    if (sp - stack < 2) FAIL(ERR_STACK_UNDERFLOW);
+do_minus_unchecked:
+    sp[-2] = bm_word_minus(sp[-2], sp[-1]);
+    sp -= 1;
+    ip += 1;
+    NEXT();
+
+do_mult:
+    if (sp - stack < 2) FAIL(ERR_STACK_UNDERFLOW);
+do_mult_unchecked:
+    sp[-2] = bm_word_mult(sp[-2], sp[-1]);
+    sp -= 1;
+    ip += 1;
+    NEXT();
+
+do_div:
+    if (sp - stack < 2) FAIL(ERR_STACK_UNDERFLOW);
+do_div_unchecked:
+    if (sp[-1] == 0) FAIL(ERR_DIV_BY_ZERO);
+    if (sp[-1] == -1) {
+        sp[-2] = (Word) (0 - (uint64_t) sp[-2]);
+    } else {
+        sp[-2] /= sp[-1];
+    }
+    sp -= 1;
+    ip += 1;
+    NEXT();
+
+do_jmp:
+    ip = ip->target;
+    NEXT();
+
+do_jmp_if:
+    if (sp - stack < 1) FAIL(ERR_STACK_UNDERFLOW);
+do_jmp_if_unchecked:
+    if (sp[-1]) {
+        sp -= 1;
+        ip = ip->target;
+    } else {
+        ip += 1;
+    }
+    NEXT();
+
+do_eq:
+    if (sp - stack < 2) FAIL(ERR_STACK_UNDERFLOW);
+do_eq_unchecked:
+    sp[-2] = sp[-1] == sp[-2];
+    sp -= 1;
+    ip += 1;
+    NEXT();
+
+do_halt:
+    bm->halt = 1;
+    goto done;
+
+do_print_debug:
+    if (sp - stack < 1) FAIL(ERR_STACK_UNDERFLOW);
+do_print_debug_unchecked:
+    bm_print_word(bm, sp[-1]);
+    sp -= 1;
+    ip += 1;
+    NEXT();
+
+do_push_plus:
+    if (sp >= stack_end) FAIL(ERR_STACK_OVERFLOW);
+    if (sp - stack < 1) FAIL(ERR_STACK_UNDERFLOW);
+do_push_plus_unchecked:
+    sp[-1] = bm_word_plus(sp[-1], ip->operand);
+    ip += 1;
+    NEXT();
+
+do_push_mult:
+    if (sp >= stack_end) FAIL(ERR_STACK_OVERFLOW);
+    if (sp - stack < 1) FAIL(ERR_STACK_UNDERFLOW);
+do_push_mult_unchecked:
+    sp[-1] = bm_word_mult(sp[-1], ip->operand);
+    ip += 1;
+    NEXT();
+
+do_dup2_plus:
+    if (sp - stack < 2) FAIL(ERR_STACK_UNDERFLOW);
+    if (sp + 1 >= stack_end) FAIL(ERR_STACK_OVERFLOW);
+do_dup2_plus_unchecked:
+    sp[0] = bm_word_plus(sp[-2], sp[-1]);
+    sp += 1;
+    ip += 1;
+    NEXT();
+
+do_eq_jmp_if:
+    if (sp - stack < 2) FAIL(ERR_STACK_UNDERFLOW);
+do_eq_jmp_if_unchecked:
+    if (sp[-1] == sp[-2]) {
+        sp -= 2;
+        ip = ip->target;
+    } else {
+        sp[-2] = 0;
+        sp -= 1;
+        ip += 1;
+    }
+    NEXT();
+
+do_call:
+    if (bm->frames_size >= bm->frames_capacity) FAIL(ERR_STACK_OVERFLOW);
+    bm->frames[bm->frames_size++] = (Bm_Frame) {.return_ip = ip - code + 1, .fp = fp};
+    fp = sp - stack;
+    ip = ip->target;
+    NEXT();
+
+do_ret: {
+    const Word args = ip->operand;
+    if (args < 0) FAIL(ERR_ILLEGAL_OPERAND);
+    if (bm->frames_size == 0 || (sp - stack) <= fp || fp - args < 0) FAIL(ERR_STACK_UNDERFLOW);
+    const Bm_Frame frame = bm->frames[--bm->frames_size];
+    stack[fp - args] = sp[-1];
+    sp = stack + fp - args + 1;
+    fp = frame.fp;
+    // frames left by another program may point anywhere
+    if (frame.return_ip < 0 || frame.return_ip > bm->program_size) {
+        out = frame.return_ip;
+        goto leave;
+    }
+    ip = &code[frame.return_ip];
+    NEXT();
+}
+
+do_load_local:
+    if (sp >= stack_end) FAIL(ERR_STACK_OVERFLOW);
+do_load_local_unchecked:
+    if (ip->operand < -fp || ip->operand >= (sp - stack) - fp) FAIL(ERR_STACK_UNDERFLOW);
+    sp[0] = stack[fp + ip->operand];
+    sp += 1;
+    ip += 1;
+    NEXT();
+
+do_store_local:
+    if (ip->operand < -fp || ip->operand >= (sp - stack) - 1 - fp) FAIL(ERR_STACK_UNDERFLOW);
+    stack[fp + ip->operand] = sp[-1];
+    sp -= 1;
+    ip += 1;
+    NEXT();
+
+do_load:
+    if (sp - stack < 1) FAIL(ERR_STACK_UNDERFLOW);
+do_load_unchecked:
+    if ((uint64_t) sp[-1] >= (uint64_t) memory_size) FAIL(ERR_ILLEGAL_MEMORY_ACCESS);
+    sp[-1] = memory[sp[-1]];
+    ip += 1;
+    NEXT();
+
+do_store:
+    if (sp - stack < 2) FAIL(ERR_STACK_UNDERFLOW);
+do_store_unchecked:
+    if ((uint64_t) sp[-2] >= (uint64_t) memory_size) FAIL(ERR_ILLEGAL_MEMORY_ACCESS);
+    memory[sp[-2]] = sp[-1];
+    sp -= 2;
+    ip += 1;
+    NEXT();
+
+do_native: {
+    const Bm_Native_Entry *native = bm_native_at(bm, ip->operand);
+    if (native == NULL) FAIL(ERR_ILLEGAL_OPERAND);
+    if (sp - stack < native->arity) FAIL(ERR_STACK_UNDERFLOW);
+    if (native->results - native->arity > stack_end - sp) FAIL(ERR_STACK_OVERFLOW);
+    const Err native_err = native->fn(bm, sp - native->arity, native->data);
+    if (native_err != ERR_OK) FAIL(native_err);
+    sp += native->results - native->arity;
+    ip += 1;
+    NEXT();
+}
+
+do_native_unchecked: {
+    const Bm_Native_Entry *native = &bm->natives[ip->operand];
+    const Err native_err = native->fn(bm, sp - native->arity, native->data);
+    if (native_err != ERR_OK) FAIL(native_err);
+    sp += native->results - native->arity;
+    ip += 1;
+    NEXT();
+}
+
+do_illegal:
+    FAIL(ERR_ILLEGAL_INST);
+
+do_end:
+    FAIL(ERR_ILLEGAL_INST_ACCESS);
+
+do_call_out:
+    if (bm->frames_size >= bm->frames_capacity) FAIL(ERR_STACK_OVERFLOW);
+    bm->frames[bm->frames_size++] = (Bm_Frame) {.return_ip = ip - code + 1, .fp = fp};
+    fp = sp - stack;
+    goto do_jmp_out;
+
+do_jmp_if_out:
+    if (sp - stack < 1) FAIL(ERR_STACK_UNDERFLOW);
+    if (!sp[-1]) {
+        ip += 1;
+        NEXT();
+    }
+    sp -= 1;
+    goto do_jmp_out;
+
+do_eq_jmp_if_out:
+    if (sp - stack < 2) FAIL(ERR_STACK_UNDERFLOW);
+    if (sp[-1] != sp[-2]) {
+        sp[-2] = 0;
+        sp -= 1;
+        ip += 1;
+        NEXT();
+    }
+    sp -= 2;
+    // fallthrough
+do_jmp_out:
+    out = ip->operand;
+leave:
+    // the target can't be represented as a pointer into `code`, so finish
+    // the way the next bm_execute_inst() call would have, fuel included
+    bm->ip = out;
+    bm->stack_size = sp - stack;
+    bm->fp = fp;
+    if (fuel == 0) {
+        bm_count_insts(bm, limit, fuel, ERR_OK);
+        return ERR_OK;
+    }
+    bm_count_insts(bm, limit, fuel - 1, ERR_ILLEGAL_INST_ACCESS);
+    return ERR_ILLEGAL_INST_ACCESS;
+
+done:
+    bm->ip = ip - code;
+    bm->stack_size = sp - stack;
+    bm->fp = fp;
+    bm_count_insts(bm, limit, fuel, err);
+    return err;
+
+#undef NEXT
+#undef FAIL
+}
+
+#pragma GCC diagnostic pop
+
+#else
+
+Err bm_execute_program_threaded(Bm *bm, int limit){
+    if (limit != 0 && !bm->halt && bm_can_skip_checks(bm)) {
+        return bm_execute_program_unchecked(bm, limit);
+    }
+
+    Word ip = bm->ip;
+    Word *const stack = bm->stack;
+    Word *sp = bm->stack + bm->stack_size;
+    Word fp = bm->fp;
+    uint64_t fuel = limit < 0 ? UINT64_MAX : (uint64_t) limit;
+    Err err = ERR_OK;
+
+    while (fuel > 0 && !bm->halt && err == ERR_OK) {
+        fuel -= 1;
+
+        if (ip < 0 || ip >= bm->program_size) {
+            err = ERR_ILLEGAL_INST_ACCESS;
+            break;
+        }
+
+        const Inst inst = bm->program[ip];
+        switch (inst.type) {
+        case INST_NOP:
+            ip += 1;
+            break;
+
+        case INST_PUSH:
+            if (sp - stack >= bm->stack_capacity) { err = ERR_STACK_OVERFLOW; break; }
+            *sp++ = inst.operand;
+            ip += 1;
+            break;
+
+        case INST_DUP:
+            if (sp - stack >= bm->stack_capacity) { err = ERR_STACK_OVERFLOW; break; }
+            if ((sp - stack) - inst.operand <= 0) { err = ERR_STACK_UNDERFLOW; break; }
+            if (inst.operand < 0) { err = ERR_ILLEGAL_OPERAND; break; }
+            sp[0] = sp[-1 - inst.operand];
+            sp += 1;
+            ip += 1;
+            break;
+
+        case INST_PLUS:
+            if (sp - stack < 2) { err = ERR_STACK_UNDERFLOW; break; }
+            sp[-2] = bm_word_plus(sp[-2], sp[-1]);
+            sp -= 1;
+            ip += 1;
+            break;
+
+        case INST_MINUS:
+            if (sp - stack < 2) { err = ERR_STACK_UNDERFLOW; break; }
+            sp[-2] = bm_word_minus(sp[-2], sp[-1]);
+            sp -= 1;
+            ip += 1;
+            break;
+
+        case INST_MULT:
+            if (sp - stack < 2) { err = ERR_STACK_UNDERFLOW; break; }
+            sp[-2] = bm_word_mult(sp[-2], sp[-1]);
+            sp -= 1;
+            ip += 1;
+            break;
+
+        case INST_DIV:
+            if (sp - stack < 2) { err = ERR_STACK_UNDERFLOW; break; }
+            if (sp[-1] == 0) { err = ERR_DIV_BY_ZERO; break; }
+            if (sp[-1] == -1) {
+                sp[-2] = (Word) (0 - (uint64_t) sp[-2]);
+            } else {
+                sp[-2] /= sp[-1];
+            }
+            sp -= 1;
+            ip += 1;
+            break;
+
+        case INST_JMP:
+            ip = inst.operand;
+            break;
+
+        case INST_JMP_IF:
+            if (sp - stack < 1) { err = ERR_STACK_UNDERFLOW; break; }
+            if (sp[-1]) {
+                sp -= 1;
+                ip = inst.operand;
+            } else {
+                ip += 1;
+            }
+            break;
+
+        case INST_EQ:
+            if (sp - stack < 2) { err = ERR_STACK_UNDERFLOW; break; }
+            sp[-2] = sp[-1] == sp[-2];
+            sp -= 1;
+            ip += 1;
+            break;
+
+        case INST_HALT:
+            bm->halt = 1;
+            break;
+
+        case INST_PRINT_DEBUG:
+            if (sp - stack < 1) { err = ERR_STACK_UNDERFLOW; break; }
+            bm_print_word(bm, sp[-1]);
+            sp -= 1;
+            ip += 1;
+            break;
+
+        case INST_PUSH_PLUS:
+            if (sp - stack >= bm->stack_capacity) { err = ERR_STACK_OVERFLOW; break; }
+            if (sp - stack < 1) { err = ERR_STACK_UNDERFLOW; break; }
+            sp[-1] = bm_word_plus(sp[-1], inst.operand);
+            ip += 1;
+            break;
+
+        case INST_PUSH_MULT:
+            if (sp - stack >= bm->stack_capacity) { err = ERR_STACK_OVERFLOW; break; }
+            if (sp - stack < 1) { err = ERR_STACK_UNDERFLOW; break; }
+            sp[-1] = bm_word_mult(sp[-1], inst.operand);
+            ip += 1;
+            break;
+
+        case INST_DUP2_PLUS:
+            if (sp - stack < 2) { err = ERR_STACK_UNDERFLOW; break; }
+            if (sp - stack + 1 >= bm->stack_capacity) { err = ERR_STACK_OVERFLOW; break; }
+            sp[0] = bm_word_plus(sp[-2], sp[-1]);
+            sp += 1;
+            ip += 1;
+            break;
+
+        case INST_EQ_JMP_IF:
+            if (sp - stack < 2) { err = ERR_STACK_UNDERFLOW; break; }
+            if (sp[-1] == sp[-2]) {
+                sp -= 2;
+                ip = inst.operand;
+            } else {
+                sp[-2] = 0;
+                sp -= 1;
+                ip += 1;
+            }
+            break;
+
+        case INST_CALL:
+            if (bm->frames_size >= bm->frames_capacity) { err = ERR_STACK_OVERFLOW; break; }
+            bm->frames[bm->frames_size++] = (Bm_Frame) {.return_ip = ip + 1, .fp = fp};
+            fp = sp - stack;
+            ip = inst.operand;
+            break;
+
+        case INST_RET:
+            if (inst.operand < 0) { err = ERR_ILLEGAL_OPERAND; break; }
+            if (bm->frames_size == 0 || (sp - stack) <= fp || fp - inst.operand < 0) { err = ERR_STACK_UNDERFLOW; break; }
+            stack[fp - inst.operand] = sp[-1];
+            sp = stack + fp - inst.operand + 1;
+            bm->frames_size -= 1;
+            fp = bm->frames[bm->frames_size].fp;
+            ip = bm->frames[bm->frames_size].return_ip;
+            break;
+
+        case INST_LOAD_LOCAL:
+            if (sp - stack >= bm->stack_capacity) { err = ERR_STACK_OVERFLOW; break; }
+            if (inst.operand < -fp || inst.operand >= (sp - stack) - fp) { err = ERR_STACK_UNDERFLOW; break; }
+            sp[0] = stack[fp + inst.operand];
+            sp += 1;
+            ip += 1;
+            break;
+
+        case INST_STORE_LOCAL:
+            if (inst.operand < -fp || inst.operand >= (sp - stack) - 1 - fp) { err = ERR_STACK_UNDERFLOW; break; }
+            stack[fp + inst.operand] = sp[-1];
+            sp -= 1;
+            ip += 1;
+            break;
+
+        case INST_LOAD:
+            if (sp - stack < 1) { err = ERR_STACK_UNDERFLOW; break; }
+            if ((uint64_t) sp[-1] >= (uint64_t) bm->memory_size) { err = ERR_ILLEGAL_MEMORY_ACCESS; break; }
+            sp[-1] = bm->memory[sp[-1]];
+            ip += 1;
+            break;
+
+        case INST_STORE:
+            if (sp - stack < 2) { err = ERR_STACK_UNDERFLOW; break; }
+            if ((uint64_t) sp[-2] >= (uint64_t) bm->memory_size) { err = ERR_ILLEGAL_MEMORY_ACCESS; break; }
+            bm->memory[sp[-2]] = sp[-1];
+            sp -= 2;
+            ip += 1;
+            break;
+
+        case INST_NATIVE: {
+            const Bm_Native_Entry *native = bm_native_at(bm, inst.operand);
+            if (native == NULL) { err = ERR_ILLEGAL_OPERAND; break; }
+            if (sp - stack < native->arity) { err = ERR_STACK_UNDERFLOW; break; }
+            if (native->results - native->arity > bm->stack_capacity - (sp - stack)) { err = ERR_STACK_OVERFLOW; break; }
+            err = native->fn(bm, sp - native->arity, native->data);
+            if (err != ERR_OK) { break; }
+            sp += native->results - native->arity;
+            ip += 1;
+        } break;
+
+        default:
+            err = ERR_ILLEGAL_INST;
+        }
+    }
+
+    bm->ip = ip;
+    bm->stack_size = sp - stack;
+    bm->fp = fp;
+    bm_count_insts(bm, limit, fuel, err);
+    return err;
+}
+
+#endif
+
+// Third interpreter: bm_execute_program() semantics again, but the top one
+// or two values of the stack are kept in locals instead of bm->stack, so
+// `plus` and friends work on registers. Every handler exists once per cache
+// state and dispatches through that state's table:
+//
+//     S0  nothing cached, the whole stack is in memory below `sp`
+//     S1  the top in `tos`, the rest below `sp`
+//     S2  the top in `tos` and the one below it in `nos`
+//
+// Pushing in S2 spills `nos`; handlers that need a value that is not cached
+// in S0 load it first and continue as their S1 version. The cached values
+// are written back to bm->stack only when the engine stops, whatever the
+// reason, so errors and the limit leave the same stack as the reference.
+// Only GCC and Clang have computed goto; elsewhere this is the reference.
+#if defined(__GNUC__)
+
+#define BM_TOS_END (INST_NATIVE + 1)    // past the end of the program
+
+// A copy of the program ending in BM_TOS_END, so dispatch needs no bounds
+// checks. NULL for programs with illegal instructions, calls, locals,
+// memory or natives, or jumps out of the program, or if there is no memory.
+static Inst *bm_tos_translate(const Bm *bm){
+    for (Word i = 0; i < bm->program_size; ++i){
+        const Inst inst = bm->program[i];
+        if ((size_t) inst.type > INST_EQ_JMP_IF){
+            return NULL;
+        }
+        if ((inst.type == INST_JMP || inst.type == INST_JMP_IF || inst.type == INST_EQ_JMP_IF) &&
+            (inst.operand < 0 || inst.operand > bm->program_size)){
+            return NULL;
+        }
+    }
+
+    Inst *code = malloc(sizeof(code[0]) * (bm->program_size + 1));
+    if (code == NULL){
+        return NULL;
+    }
+    if (bm->program_size > 0){
+        memcpy(code, bm->program, sizeof(code[0]) * bm->program_size);
+    }
+    code[bm->program_size] = (Inst) {.type = BM_TOS_END};
+    return code;
+}
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+
+Err bm_execute_program_tos(Bm *bm, int limit){
+    static const void *const s0_labels[] = {
+        [INST_NOP]         = &&s0_nop,
+        [INST_PUSH]        = &&s0_push,
+        [INST_DUP]         = &&s0_dup,
+        [INST_PLUS]        = &&s0_plus,
+        [INST_MINUS]       = &&s0_minus,
+        [INST_MULT]        = &&s0_mult,
+        [INST_DIV]         = &&s0_div,
+        [INST_JMP]         = &&s0_jmp,
+        [INST_JMP_IF]      = &&s0_jmp_if,
+        [INST_EQ]          = &&s0_eq,
+        [INST_HALT]        = &&s0_halt,
+        [INST_PRINT_DEBUG] = &&s0_print_debug,
+        [INST_PUSH_PLUS]   = &&s0_push_plus,
+        [INST_PUSH_MULT]   = &&s0_push_mult,
+        [INST_DUP2_PLUS]   = &&s0_dup2_plus,
+        [INST_EQ_JMP_IF]   = &&s0_eq_jmp_if,
+        [BM_TOS_END]       = &&s0_end,
+    };
+    static const void *const s1_labels[] = {
+        [INST_NOP]         = &&s1_nop,
+        [INST_PUSH]        = &&s1_push,
+        [INST_DUP]         = &&s1_dup,
+        [INST_PLUS]        = &&s1_plus,
+        [INST_MINUS]       = &&s1_minus,
+        [INST_MULT]        = &&s1_mult,
+        [INST_DIV]         = &&s1_div,
+        [INST_JMP]         = &&s1_jmp,
+        [INST_JMP_IF]      = &&s1_jmp_if,
+        [INST_EQ]          = &&s1_eq,
+        [INST_HALT]        = &&s1_halt,
+        [INST_PRINT_DEBUG] = &&s1_print_debug,
+        [INST_PUSH_PLUS]   = &&s1_push_plus,
+        [INST_PUSH_MULT]   = &&s1_push_mult,
+        [INST_DUP2_PLUS]   = &&s1_dup2_plus,
+        [INST_EQ_JMP_IF]   = &&s1_eq_jmp_if,
+        [BM_TOS_END]       = &&s1_end,
+    };
+    static const void *const s2_labels[] = {
+        [INST_NOP]         = &&s2_nop,
+        [INST_PUSH]        = &&s2_push,
+        [INST_DUP]         = &&s2_dup,
+        [INST_PLUS]        = &&s2_plus,
+        [INST_MINUS]       = &&s2_minus,
+        [INST_MULT]        = &&s2_mult,
+        [INST_DIV]         = &&s2_div,
+        [INST_JMP]         = &&s2_jmp,
+        [INST_JMP_IF]      = &&s2_jmp_if,
+        [INST_EQ]          = &&s2_eq,
+        [INST_HALT]        = &&s2_halt,
+        [INST_PRINT_DEBUG] = &&s2_print_debug,
+        [INST_PUSH_PLUS]   = &&s2_push_plus,
+        [INST_PUSH_MULT]   = &&s2_push_mult,
+        [INST_DUP2_PLUS]   = &&s2_dup2_plus,
+        [INST_EQ_JMP_IF]   = &&s2_eq_jmp_if,
+        [BM_TOS_END]       = &&s2_end,
+    };
+
+    // handlers that trust the verifier (see bm_can_skip_checks())
+    static const void *const s0_labels_unchecked[] = {
+        [INST_NOP]         = &&s0_nop,
+        [INST_PUSH]        = &&s0_push_unchecked,
+        [INST_DUP]         = &&s0_dup_unchecked,
+        [INST_PLUS]        = &&s0_plus_unchecked,
+        [INST_MINUS]       = &&s0_minus_unchecked,
+        [INST_MULT]        = &&s0_mult_unchecked,
+        [INST_DIV]         = &&s0_div_unchecked,
+        [INST_JMP]         = &&s0_jmp,
+        [INST_JMP_IF]      = &&s0_jmp_if_unchecked,
+        [INST_EQ]          = &&s0_eq_unchecked,
+        [INST_HALT]        = &&s0_halt,
+        [INST_PRINT_DEBUG] = &&s0_print_debug_unchecked,
+        [INST_PUSH_PLUS]   = &&s0_push_plus_unchecked,
+        [INST_PUSH_MULT]   = &&s0_push_mult_unchecked,
+        [INST_DUP2_PLUS]   = &&s0_dup2_plus_unchecked,
+        [INST_EQ_JMP_IF]   = &&s0_eq_jmp_if_unchecked,
+        [BM_TOS_END]       = &&s0_end,
+    };
+    static const void *const s1_labels_unchecked[] = {
+        [INST_NOP]         = &&s1_nop,
+        [INST_PUSH]        = &&s1_push_unchecked,
+        [INST_DUP]         = &&s1_dup_unchecked,
+        [INST_PLUS]        = &&s1_plus_unchecked,
+        [INST_MINUS]       = &&s1_minus_unchecked,
+        [INST_MULT]        = &&s1_mult_unchecked,
+        [INST_DIV]         = &&s1_div_unchecked,
+        [INST_JMP]         = &&s1_jmp,
+        [INST_JMP_IF]      = &&s1_jmp_if,
+        [INST_EQ]          = &&s1_eq_unchecked,
+        [INST_HALT]        = &&s1_halt,
+        [INST_PRINT_DEBUG] = &&s1_print_debug,
+        [INST_PUSH_PLUS]   = &&s1_push_plus_unchecked,
+        [INST_PUSH_MULT]   = &&s1_push_mult_unchecked,
+        [INST_DUP2_PLUS]   = &&s1_dup2_plus_unchecked,
+        [INST_EQ_JMP_IF]   = &&s1_eq_jmp_if_unchecked,
+        [BM_TOS_END]       = &&s1_end,
+    };
+    static const void *const s2_labels_unchecked[] = {
+        [INST_NOP]         = &&s2_nop,
+        [INST_PUSH]        = &&s2_push_unchecked,
+        [INST_DUP]         = &&s2_dup_unchecked,
+        [INST_PLUS]        = &&s2_plus,
+        [INST_MINUS]       = &&s2_minus,
+        [INST_MULT]        = &&s2_mult,
+        [INST_DIV]         = &&s2_div,
+        [INST_JMP]         = &&s2_jmp,
+        [INST_JMP_IF]      = &&s2_jmp_if,
+        [INST_EQ]          = &&s2_eq,
+        [INST_HALT]        = &&s2_halt,
+        [INST_PRINT_DEBUG] = &&s2_print_debug,
+        [INST_PUSH_PLUS]   = &&s2_push_plus_unchecked,
+        [INST_PUSH_MULT]   = &&s2_push_mult_unchecked,
+        [INST_DUP2_PLUS]   = &&s2_dup2_plus_unchecked,
+        [INST_EQ_JMP_IF]   = &&s2_eq_jmp_if,
+        [BM_TOS_END]       = &&s2_end,
+    };
+
+    if (limit == 0 || bm->halt) {
+        return ERR_OK;
+    }
+
+    if (bm->ip < 0 || bm->ip >= bm->program_size) {
+        return ERR_ILLEGAL_INST_ACCESS;
+    }
+
+    if (bm->tos_code == NULL && !bm->tos_failed) {
+        bm->tos_code = bm_tos_translate(bm);
+        bm->tos_failed = bm->tos_code == NULL;
+    }
+    // calls, memory and natives are left to the threaded engine
+    if (bm->tos_code == NULL) {
+        return bm_execute_program_threaded(bm, limit);
+    }
+
+    const int unchecked = bm_can_skip_checks(bm);
+    const void *const *const s0 = unchecked ? s0_labels_unchecked : s0_labels;
+    const void *const *const s1 = unchecked ? s1_labels_unchecked : s1_labels;
+    const void *const *const s2 = unchecked ? s2_labels_unchecked : s2_labels;
+
+    const Inst *const code = bm->tos_code;
+    Word ip = bm->ip;
+    Word *const stack = bm->stack;
+    Word *sp = bm->stack + bm->stack_size;
+    const Word capacity = bm->stack_capacity;
+    Word tos = 0;
+    Word nos = 0;
+    uint64_t fuel = limit < 0 ? UINT64_MAX : (uint64_t) limit;
+    Err err = ERR_OK;
+
+    // the stack size in each state
+#define SIZE0 (sp - stack)
+#define SIZE1 (sp - stack + 1)
+#define SIZE2 (sp - stack + 2)
+
+#define DISPATCH(state)                                                     \
+    do {                                                                    \
+        if (fuel == 0) goto state##_done;                                   \
+        fuel -= 1;                                                          \
+        goto *state[code[ip].type];                                         \
+    } while (0)
+
+#define FAIL(state, e)          \
+    do {                        \
+        err = (e);              \
+        goto state##_done;      \
+    } while (0)
+
+#define OPERAND (code[ip].operand)
+
+    DISPATCH(s0);
+
+    // S0: nothing cached
+
+s0_nop:
+    ip += 1;
+    DISPATCH(s0);
+
+s0_push:
+    if (SIZE0 >= capacity) FAIL(s0, ERR_STACK_OVERFLOW);
+s0_push_unchecked:
+    tos = OPERAND;
+    ip += 1;
+    DISPATCH(s1);
+
+s0_dup:
+    if (SIZE0 >= capacity) FAIL(s0, ERR_STACK_OVERFLOW);
+    if (SIZE0 - OPERAND <= 0) FAIL(s0, ERR_STACK_UNDERFLOW);
+    if (OPERAND < 0) FAIL(s0, ERR_ILLEGAL_OPERAND);
+s0_dup_unchecked:
+    tos = sp[-1 - OPERAND];
+    ip += 1;
+    DISPATCH(s1);
+
+    // the ones that need a value load it and go on as in S1
+s0_plus:
+    if (SIZE0 < 2) FAIL(s0, ERR_STACK_UNDERFLOW);
+s0_plus_unchecked:
+    tos = *--sp;
+    goto s1_plus_unchecked;
+
+s0_minus:
+    if (SIZE0 < 2) FAIL(s0, ERR_STACK_UNDERFLOW);
+s0_minus_unchecked:
+    tos = *--sp;
+    goto s1_minus_unchecked;
+
+s0_mult:
+    if (SIZE0 < 2) FAIL(s0, ERR_STACK_UNDERFLOW);
+s0_mult_unchecked:
+    tos = *--sp;
+    goto s1_mult_unchecked;
+
+s0_div:
+    if (SIZE0 < 2) FAIL(s0, ERR_STACK_UNDERFLOW);
+s0_div_unchecked:
+    tos = *--sp;
+    goto s1_div_unchecked;
+
+s0_jmp:
+    ip = OPERAND;
+    DISPATCH(s0);
+
+s0_jmp_if:
+    if (SIZE0 < 1) FAIL(s0, ERR_STACK_UNDERFLOW);
+s0_jmp_if_unchecked:
+    tos = *--sp;
+    goto s1_jmp_if;
+
+s0_eq:
+    if (SIZE0 < 2) FAIL(s0, ERR_STACK_UNDERFLOW);
+s0_eq_unchecked:
+    tos = *--sp;
+    goto s1_eq_unchecked;
+
+s0_halt:
+    bm->halt = 1;
+    goto s0_done;
+
+s0_print_debug:
+    if (SIZE0 < 1) FAIL(s0, ERR_STACK_UNDERFLOW);
+s0_print_debug_unchecked:
+    tos = *--sp;
+    goto s1_print_debug;
+
+s0_push_plus:
+    if (SIZE0 >= capacity) FAIL(s0, ERR_STACK_OVERFLOW);
+    if (SIZE0 < 1) FAIL(s0, ERR_STACK_UNDERFLOW);
+s0_push_plus_unchecked:
+    tos = *--sp;
+    goto s1_push_plus_unchecked;
+
+s0_push_mult:
+    if (SIZE0 >= capacity) FAIL(s0, ERR_STACK_OVERFLOW);
+    if (SIZE0 < 1) FAIL(s0, ERR_STACK_UNDERFLOW);
+s0_push_mult_unchecked:
+    tos = *--sp;
+    goto s1_push_mult_unchecked;
+
+s0_dup2_plus:
+    if (SIZE0 < 2) FAIL(s0, ERR_STACK_UNDERFLOW);
+    if (SIZE0 + 1 >= capacity) FAIL(s0, ERR_STACK_OVERFLOW);
+s0_dup2_plus_unchecked:
+    tos = *--sp;
+    goto s1_dup2_plus_unchecked;
+
+s0_eq_jmp_if:
+    if (SIZE0 < 2) FAIL(s0, ERR_STACK_UNDERFLOW);
+s0_eq_jmp_if_unchecked:
+    tos = *--sp;
+    goto s1_eq_jmp_if_unchecked;
+
+    // S1: the top in `tos`
+
+s1_nop:
+    ip += 1;
+    DISPATCH(s1);
+
+s1_push:
+    if (SIZE1 >= capacity) FAIL(s1, ERR_STACK_OVERFLOW);
+s1_push_unchecked:
+    nos = tos;
+    tos = OPERAND;
+    ip += 1;
+    DISPATCH(s2);
+
+s1_dup:
+    if (SIZE1 >= capacity) FAIL(s1, ERR_STACK_OVERFLOW);
+    if (SIZE1 - OPERAND <= 0) FAIL(s1, ERR_STACK_UNDERFLOW);
+    if (OPERAND < 0) FAIL(s1, ERR_ILLEGAL_OPERAND);
+s1_dup_unchecked:
+    nos = tos;
+    tos = OPERAND == 0 ? tos : sp[-OPERAND];
+    ip += 1;
+    DISPATCH(s2);
+
+s1_plus:
+    if (SIZE1 < 2) FAIL(s1, ERR_STACK_UNDERFLOW);
+s1_plus_unchecked:
+    tos = bm_word_plus(*--sp, tos);
+    ip += 1;
+    DISPATCH(s1);
+
+s1_minus:
+    if (SIZE1 < 2) FAIL(s1, ERR_STACK_UNDERFLOW);
+s1_minus_unchecked:
+    tos = bm_word_minus(*--sp, tos);
+    ip += 1;
+    DISPATCH(s1);
+
+s1_mult:
+    if (SIZE1 < 2) FAIL(s1, ERR_STACK_UNDERFLOW);
+s1_mult_unchecked:
+    tos = bm_word_mult(*--sp, tos);
+    ip += 1;
+    DISPATCH(s1);
+
+s1_div:
+    if (SIZE1 < 2) FAIL(s1, ERR_STACK_UNDERFLOW);
+s1_div_unchecked:
+    if (tos == 0) FAIL(s1, ERR_DIV_BY_ZERO);
+    // INT64_MIN / -1 traps on x86, so -1 is handled as a wrapping negation
+    tos = tos == -1 ? (Word) (0 - (uint64_t) sp[-1]) : sp[-1] / tos;
+    sp -= 1;
+    ip += 1;
+    DISPATCH(s1);
+
+s1_jmp:
+    ip = OPERAND;
+    DISPATCH(s1);
+
+s1_jmp_if:
+    if (tos) {
+        ip = OPERAND;
+        DISPATCH(s0);
+    }
+    ip += 1;
+    DISPATCH(s1);
+
+s1_eq:
+    if (SIZE1 < 2) FAIL(s1, ERR_STACK_UNDERFLOW);
+s1_eq_unchecked:
+    tos = *--sp == tos;
+    ip += 1;
+    DISPATCH(s1);
+
+s1_halt:
+    bm->halt = 1;
+    goto s1_done;
+
+s1_print_debug:
+    bm_print_word(bm, tos);
+    ip += 1;
+    DISPATCH(s0);
+
+s1_push_plus:
+    if (SIZE1 >= capacity) FAIL(s1, ERR_STACK_OVERFLOW);
+s1_push_plus_unchecked:
+    tos = bm_word_plus(tos, OPERAND);
+    ip += 1;
+    DISPATCH(s1);
+
+s1_push_mult:
+    if (SIZE1 >= capacity) FAIL(s1, ERR_STACK_OVERFLOW);
+s1_push_mult_unchecked:
+    tos = bm_word_mult(tos, OPERAND);
+    ip += 1;
+    DISPATCH(s1);
+
+s1_dup2_plus:
+    if (SIZE1 < 2) FAIL(s1, ERR_STACK_UNDERFLOW);
+    if (SIZE1 + 1 >= capacity) FAIL(s1, ERR_STACK_OVERFLOW);
+s1_dup2_plus_unchecked:
+    nos = tos;
+    tos = bm_word_plus(sp[-1], tos);
+    ip += 1;
+    DISPATCH(s2);
+
+s1_eq_jmp_if:
+    if (SIZE1 < 2) FAIL(s1, ERR_STACK_UNDERFLOW);
+s1_eq_jmp_if_unchecked:
+    if (*--sp == tos) {
+        ip = OPERAND;
+        DISPATCH(s0);
+    }
+    tos = 0;
+    ip += 1;
+    DISPATCH(s1);
+
+    // S2: the top in `tos`, the one below in `nos`
+
+s2_nop:
+    ip += 1;
+    DISPATCH(s2);
+
+s2_push:
+    if (SIZE2 >= capacity) FAIL(s2, ERR_STACK_OVERFLOW);
+s2_push_unchecked:
+    *sp++ = nos;
+    nos = tos;
+    tos = OPERAND;
+    ip += 1;
+    DISPATCH(s2);
+
+s2_dup:
+    if (SIZE2 >= capacity) FAIL(s2, ERR_STACK_OVERFLOW);
+    if (SIZE2 - OPERAND <= 0) FAIL(s2, ERR_STACK_UNDERFLOW);
+    if (OPERAND < 0) FAIL(s2, ERR_ILLEGAL_OPERAND);
+s2_dup_unchecked:
+    {
+        const Word value = OPERAND == 0 ? tos : OPERAND == 1 ? nos : sp[1 - OPERAND];
+        *sp++ = nos;
+        nos = tos;
+        tos = value;
+    }
+    ip += 1;
+    DISPATCH(s2);
+
+s2_plus:
+    tos = bm_word_plus(nos, tos);
+    ip += 1;
+    DISPATCH(s1);
+
+s2_minus:
+    tos = bm_word_minus(nos, tos);
+    ip += 1;
+    DISPATCH(s1);
+
+s2_mult:
+    tos = bm_word_mult(nos, tos);
+    ip += 1;
+    DISPATCH(s1);
+
+s2_div:
+    if (tos == 0) FAIL(s2, ERR_DIV_BY_ZERO);
+    tos = tos == -1 ? (Word) (0 - (uint64_t) nos) : nos / tos;
+    ip += 1;
+    DISPATCH(s1);
+
+s2_jmp:
+    ip = OPERAND;
+    DISPATCH(s2);
+
+s2_jmp_if:
+    if (tos) {
+        tos = nos;
+        ip = OPERAND;
+        DISPATCH(s1);
+    }
+    ip += 1;
+    DISPATCH(s2);
+
+s2_eq:
+    tos = nos == tos;
+    ip += 1;
+    DISPATCH(s1);
+
+s2_halt:
+    bm->halt = 1;
+    goto s2_done;
+
+s2_print_debug:
+    bm_print_word(bm, tos);
+    tos = nos;
+    ip += 1;
+    DISPATCH(s1);
+
+s2_push_plus:
+    if (SIZE2 >= capacity) FAIL(s2, ERR_STACK_OVERFLOW);
+s2_push_plus_unchecked:
+    tos = bm_word_plus(tos, OPERAND);
+    ip += 1;
+    DISPATCH(s2);
+
+s2_push_mult:
+    if (SIZE2 >= capacity) FAIL(s2, ERR_STACK_OVERFLOW);
+s2_push_mult_unchecked:
+    tos = bm_word_mult(tos, OPERAND);
+    ip += 1;
+    DISPATCH(s2);
+
+s2_dup2_plus:
+    if (SIZE2 + 1 >= capacity) FAIL(s2, ERR_STACK_OVERFLOW);
+s2_dup2_plus_unchecked:
+    *sp++ = nos;
+    nos = tos;
+    tos = bm_word_plus(sp[-1], tos);
+    ip += 1;
+    DISPATCH(s2);
+
+s2_eq_jmp_if:
+    if (nos == tos) {
+        ip = OPERAND;
+        DISPATCH(s0);
+    }
+    tos = 0;
+    ip += 1;
+    DISPATCH(s1);
+
+s0_end:
+    FAIL(s0, ERR_ILLEGAL_INST_ACCESS);
+s1_end:
+    FAIL(s1, ERR_ILLEGAL_INST_ACCESS);
+s2_end:
+    FAIL(s2, ERR_ILLEGAL_INST_ACCESS);
+
+    // write the cached values back
+s2_done:
+    *sp++ = nos;
+s1_done:
+    *sp++ = tos;
+s0_done:
+    bm->ip = ip;
+    bm->stack_size = sp - stack;
+    bm_count_insts(bm, limit, fuel, err);
+    return err;
+
+#undef SIZE0
+#undef SIZE1
+#undef SIZE2
+#undef DISPATCH
+#undef FAIL
+#undef OPERAND
+}
+
+#pragma GCC diagnostic pop
+
+#undef BM_TOS_END
+
+#else
+
+Err bm_execute_program_tos(Bm *bm, int limit){
+    return bm_execute_program(bm, limit);
+}
+
+#endif
+
+// Fourth interpreter: bm_execute_program() a basic block at a time. Blocks
+// end before every jump target and after every jmp, jmp_if, eq_jmp_if,
+// halt, call and ret, and are built the first time execution reaches them.
+// Each one knows how deep the stack must be when it starts and how far it
+// can grow, so when the stack and the remaining limit allow the whole block
+// it runs without stack or limit checks; otherwise it is stepped through
+// bm_execute_inst(), which keeps errors and `limit` exact. Jumps find their
+// successor through pointers cached in the block.
+struct Bm_Block {
+    Word start;
+    Word size;          // instructions, including the one that leaves it
+    Word body;          // the ones before that: size - 1, or size if it falls through
+    Word min_stack_size;    // for every read of the block
+    Word max_growth;        // highest the stack gets above its size at the start
+    Word effect;            // how the body changes the stack size (BM_CHECK_BLOCKS)
+    int slow;           // a single instruction always run by bm_execute_inst()
+    Bm_Block *next;     // falling through or not taken, NULL until first used
+    Bm_Block *taken;    // taken jmp, jmp_if, eq_jmp_if or call
+};
+
+// How `inst` reads and moves the stack in a block, how far it grows the
+// stack while it runs and whether it leaves the block. Returns 0 for
+// instructions that need the checks of the reference: illegal types,
+// negative or oversized dups and unbound natives.
+static int bm_block_inst(const Bm *bm, Inst inst, Word *reads, Word *effect, Word *peak, int *exits){
+    *reads = 0;
+    *effect = 0;
+    *peak = 0;
+    *exits = 0;
+    switch (inst.type) {
+    case INST_NOP:
+        return 1;
+    case INST_PUSH:
+    case INST_LOAD_LOCAL:
+        *effect = 1;
+        *peak = 1;
+        return 1;
+    case INST_DUP:
+        if (inst.operand < 0 || inst.operand >= bm->stack_capacity){
+            return 0;
+        }
+        *reads = inst.operand + 1;
+        *effect = 1;
+        *peak = 1;
+        return 1;
+    case INST_PLUS:
+    case INST_MINUS:
+    case INST_MULT:
+    case INST_DIV:
+    case INST_EQ:
+        *reads = 2;
+        *effect = -1;
+        return 1;
+    case INST_PRINT_DEBUG:
+    case INST_STORE_LOCAL:
+        *reads = 1;
+        *effect = -1;
+        return 1;
+    case INST_PUSH_PLUS:
+    case INST_PUSH_MULT:
+        *reads = 1;
+        *peak = 1;
+        return 1;
+    case INST_LOAD:
+        *reads = 1;
+        return 1;
+    case INST_DUP2_PLUS:
+        *reads = 2;
+        *effect = 1;
+        *peak = 2;
+        return 1;
+    case INST_STORE:
+        *reads = 2;
+        *effect = -2;
+        return 1;
+    case INST_NATIVE: {
+        const Bm_Native_Entry *native = bm_native_at(bm, inst.operand);
+        if (native == NULL){
+            return 0;
+        }
+        *reads = native->arity;
+        *effect = native->results - native->arity;
+        *peak = *effect > 0 ? *effect : 0;
+        return 1;
+    }
+    // pops only when taken, so the stack never grows past the block
+    case INST_JMP_IF:
+        *reads = 1;
+        *exits = 1;
+        return 1;
+    case INST_EQ_JMP_IF:
+        *reads = 2;
+        *exits = 1;
+        return 1;
+    // call and ret check the frames themselves when they run
+    case INST_JMP:
+    case INST_HALT:
+    case INST_CALL:
+    case INST_RET:
+        *exits = 1;
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+// Marks jump and call targets. Returns 0 if memory ran out.
+static int bm_prepare_blocks(Bm *bm){
+    bm->block_leaders = calloc(bm->program_size > 0 ? bm->program_size : 1, sizeof(bm->block_leaders[0]));
+    bm->blocks = calloc(bm->program_size > 0 ? bm->program_size : 1, sizeof(bm->blocks[0]));
+    if (bm->block_leaders == NULL || bm->blocks == NULL){
+        bm_discard_blocks(bm);
+        return 0;
+    }
+    bm->blocks_size = bm->program_size;
+
+    for (Word i = 0; i < bm->program_size; ++i){
+        const Inst inst = bm->program[i];
+        if ((inst.type == INST_JMP || inst.type == INST_JMP_IF || inst.type == INST_EQ_JMP_IF ||
+             inst.type == INST_CALL) &&
+            inst.operand >= 0 && inst.operand < bm->program_size){
+            bm->block_leaders[inst.operand] = 1;
+        }
+    }
+    return 1;
+}
+
+// The block starting at `ip`, built on first use. NULL outside of the
+// program or if memory ran out.
+static Bm_Block *bm_block_at(Bm *bm, Word ip){
+    if (ip < 0 || ip >= bm->blocks_size){
+        return NULL;
+    }
+    if (bm->blocks[ip] != NULL){
+        return bm->blocks[ip];
+    }
+
+    Bm_Block *block = calloc(1, sizeof(*block));
+    if (block == NULL){
+        return NULL;
+    }
+    block->start = ip;
+
+    Word depth = 0;
+    Word i = ip;
+    int exits = 0;
+    while (!exits){
+        Word reads, effect, peak;
+        if (!bm_block_inst(bm, bm->program[i], &reads, &effect, &peak, &exits)){
+            block->slow = i == ip;
+            i += block->slow;
+            break;
+        }
+        if (reads - depth > block->min_stack_size){
+            block->min_stack_size = reads - depth;
+        }
+        if (depth + peak > block->max_growth){
+            block->max_growth = depth + peak;
+        }
+        depth += effect;
+        i += 1;
+        if (i >= bm->program_size || bm->block_leaders[i]){
+            break;
+        }
+    }
+    block->size = i - ip;
+    block->body = exits ? block->size - 1 : block->size;
+    // the instruction that leaves adds nothing: a taken jmp_if pops later
+    block->effect = depth;
+
+    bm->blocks[ip] = block;
+    return block;
+}
+
+// Runs the body of `block`, the instructions that don't leave it, with no
+// stack checks. On an error `*faulted` is the failing instruction.
+static Err bm_run_block_body(Bm *bm, const Bm_Block *block, const Inst **faulted){
+    Word *const stack = bm->stack;
+    Word *sp = stack + bm->stack_size;
+    const Inst *inst = bm->program + block->start;
+    const Inst *const end = inst + block->body;
+    Err err = ERR_OK;
+
+    for (; inst < end; ++inst){
+        switch (inst->type) {
+        case INST_NOP:
+            break;
+
+        case INST_PUSH:
+            *sp++ = inst->operand;
+            break;
+
+        case INST_DUP:
+            sp[0] = sp[-1 - inst->operand];
+            sp += 1;
+            break;
+
+        case INST_PLUS:
+            sp[-2] = bm_word_plus(sp[-2], sp[-1]);
+            sp -= 1;
+            break;
+
+        case INST_MINUS:
+            sp[-2] = bm_word_minus(sp[-2], sp[-1]);
+            sp -= 1;
+            break;
+
+        case INST_MULT:
+            sp[-2] = bm_word_mult(sp[-2], sp[-1]);
+            sp -= 1;
+            break;
+
+        case INST_DIV:
+            if (sp[-1] == 0) {
+                err = ERR_DIV_BY_ZERO;
+                goto out;
+            }
+            if (sp[-1] == -1) {
+                sp[-2] = (Word) (0 - (uint64_t) sp[-2]);
+            } else {
+                sp[-2] /= sp[-1];
+            }
+            sp -= 1;
+            break;
+
+        case INST_EQ:
+            sp[-2] = sp[-1] == sp[-2];
+            sp -= 1;
+            break;
+
+        case INST_PRINT_DEBUG:
+            bm_print_word(bm, sp[-1]);
+            sp -= 1;
+            break;
+
+        case INST_PUSH_PLUS:
+            sp[-1] = bm_word_plus(sp[-1], inst->operand);
+            break;
+
+        case INST_PUSH_MULT:
+            sp[-1] = bm_word_mult(sp[-1], inst->operand);
+            break;
+
+        case INST_DUP2_PLUS:
+            sp[0] = bm_word_plus(sp[-2], sp[-1]);
+            sp += 1;
+            break;
+
+        case INST_LOAD_LOCAL:
+            if (inst->operand < -bm->fp || inst->operand >= (sp - stack) - bm->fp) {
+                err = ERR_STACK_UNDERFLOW;
+                goto out;
+            }
+            sp[0] = stack[bm->fp + inst->operand];
+            sp += 1;
+            break;
+
+        case INST_STORE_LOCAL:
+            if (inst->operand < -bm->fp || inst->operand >= (sp - stack) - 1 - bm->fp) {
+                err = ERR_STACK_UNDERFLOW;
+                goto out;
+            }
+            stack[bm->fp + inst->operand] = sp[-1];
+            sp -= 1;
+            break;
+
+        case INST_LOAD:
+            if ((uint64_t) sp[-1] >= (uint64_t) bm->memory_size) {
+                err = ERR_ILLEGAL_MEMORY_ACCESS;
+                goto out;
+            }
+            sp[-1] = bm->memory[sp[-1]];
+            break;
+
+        case INST_STORE:
+            if ((uint64_t) sp[-2] >= (uint64_t) bm->memory_size) {
+                err = ERR_ILLEGAL_MEMORY_ACCESS;
+                goto out;
+            }
+            bm->memory[sp[-2]] = sp[-1];
+            sp -= 2;
+            break;
+
+        case INST_NATIVE: {
+            // bound when the block was built, or the blocks would be gone
+            const Bm_Native_Entry *native = &bm->natives[inst->operand];
+            err = native->fn(bm, sp - native->arity, native->data);
+            if (err != ERR_OK) {
+                goto out;
+            }
+            sp += native->results - native->arity;
+        } break;
+
+        case INST_JMP:
+        case INST_JMP_IF:
+        case INST_EQ_JMP_IF:
+        case INST_HALT:
+        case INST_CALL:
+        case INST_RET:
+        default:
+            assert(0 && "bm_run_block_body: Unreachable");
+        }
+    }
+#ifdef BM_CHECK_BLOCKS
+    // the body moved the stack as bm_block_at() worked out; bmfuzz builds with it
+    assert(sp - stack == bm->stack_size + block->effect);
+#endif
+
+out:
+    bm->stack_size = sp - stack;
+    *faulted = inst;
+    return err;
+}
+
+Err bm_execute_program_blocks(Bm *bm, int limit){
+    if (limit == 0 || bm->halt){
+        return ERR_OK;
+    }
+    if (bm->blocks == NULL && !bm_prepare_blocks(bm)){
+        return bm_execute_program(bm, limit);
+    }
+
+    uint64_t fuel = limit < 0 ? UINT64_MAX : (uint64_t) limit;
+    Bm_Block *block = bm_block_at(bm, bm->ip);
+    Err err = ERR_OK;
+
+    while (fuel > 0 && !bm->halt){
+        // outside of the program, or out of memory
+        if (block == NULL){
+            err = bm_execute_inst(bm);
+            if (err != ERR_OK){
+                return err;
+            }
+            fuel -= 1;
+            block = bm_block_at(bm, bm->ip);
+            continue;
+        }
+
+        if (block->slow || fuel < (uint64_t) block->size ||
+            bm->stack_size < block->min_stack_size ||
+            block->max_growth > bm->stack_capacity - bm->stack_size){
+            for (Word i = 0; i < block->size && fuel > 0 && !bm->halt; ++i){
+                err = bm_execute_inst(bm);
+                if (err != ERR_OK){
+                    return err;
+                }
+                fuel -= 1;
+            }
+            block = bm_block_at(bm, bm->ip);
+            continue;
+        }
+
+        const Inst *inst = NULL;
+        err = bm_run_block_body(bm, block, &inst);
+        if (err != ERR_OK){
+            bm->ip = inst - bm->program;
+            bm->inst_count += bm->ip - block->start;
+            return err;
+        }
+        bm->inst_count += block->body;
+        fuel -= block->size;
+
+        if (block->body == block->size){
+            bm->ip = block->start + block->size;
+            if (block->next == NULL){
+                block->next = bm_block_at(bm, bm->ip);
+            }
+            block = block->next;
+            continue;
+        }
+
+        Word *const top = bm->stack + bm->stack_size;
+        bm->ip = inst - bm->program;
+        switch (inst->type) {
+        case INST_JMP:
+            bm->ip = inst->operand;
+            break;
+
+        case INST_JMP_IF:
+            if (top[-1]) {
+                bm->stack_size -= 1;
+                bm->ip = inst->operand;
+            } else {
+                bm->ip += 1;
+            }
+            break;
+
+        case INST_EQ_JMP_IF:
+            if (top[-1] == top[-2]) {
+                bm->stack_size -= 2;
+                bm->ip = inst->operand;
+            } else {
+                top[-2] = 0;
+                bm->stack_size -= 1;
+                bm->ip += 1;
+            }
+            break;
+
+        case INST_HALT:
+            bm->halt = 1;
+            bm->inst_count += 1;
+            return ERR_OK;
+
+        case INST_CALL:
+            if (bm->frames_size >= bm->frames_capacity){
+                return ERR_STACK_OVERFLOW;
+            }
+            bm->frames[bm->frames_size++] = (Bm_Frame) {.return_ip = bm->ip + 1, .fp = bm->fp};
+            bm->fp = bm->stack_size;
+            bm->ip = inst->operand;
+            break;
+
+        case INST_RET: {
+            if (inst->operand < 0){
+                return ERR_ILLEGAL_OPERAND;
+            }
+            if (bm->frames_size == 0 || bm->stack_size <= bm->fp || bm->fp - inst->operand < 0){
+                return ERR_STACK_UNDERFLOW;
+            }
+            const Bm_Frame frame = bm->frames[--bm->frames_size];
+            bm->stack[bm->fp - inst->operand] = top[-1];
+            bm->stack_size = bm->fp - inst->operand + 1;
+            bm->fp = frame.fp;
+            bm->ip = frame.return_ip;
+        } break;
+
+        case INST_NOP:
+        case INST_PUSH:
+        case INST_DUP:
+        case INST_PLUS:
+        case INST_MINUS:
+        case INST_MULT:
+        case INST_DIV:
+        case INST_EQ:
+        case INST_PRINT_DEBUG:
+        case INST_PUSH_PLUS:
+        case INST_PUSH_MULT:
+        case INST_DUP2_PLUS:
+        case INST_LOAD_LOCAL:
+        case INST_STORE_LOCAL:
+        case INST_LOAD:
+        case INST_STORE:
+        case INST_NATIVE:
+        default:
+            assert(0 && "bm_execute_program_blocks: Unreachable");
+        }
+        bm->inst_count += 1;
+
+        // ret goes back wherever it was called from
+        if (inst->type == INST_RET){
+            block = bm_block_at(bm, bm->ip);
+            continue;
+        }
+        Bm_Block **successor = bm->ip == block->start + block->size ? &block->next : &block->taken;
+        if (*successor == NULL){
+            *successor = bm_block_at(bm, bm->ip);
+        }
+        block = *successor;
+    }
+
+    return ERR_OK;
+}
+
+// x86-64 JIT compiler.
+//
+// bm_jit_compile() turns the whole program into native code once. Register
+// assignment inside the generated code:
+//
+//     rax  top of the stack (valid when the stack is not empty)
+//     rbx  Word *stack
+//     r12  stack size; stack[0 .. size-2] live in memory, stack[size-1] in rax
+//     r13  remaining fuel (the `limit` of bm_execute_program())
+//     r14  stack capacity
+//     r15  Bm_Jit_Context *
+//
+// Every instruction starts with a fuel check, jumps become native jumps and
+// every error or limit exit goes through an out-of-line stub that records the
+// instruction index and the Err, so the state written back is exactly the
+// one bm_execute_inst() would have left. Programs using an instruction the
+// JIT does not know are rejected and run by the interpreter instead.
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__))
+#define BM_JIT_SUPPORTED 1
+#endif
+
+typedef struct {
+    Word *stack;
+    Word stack_size;
+    Word stack_capacity;
+    Word ip;
+    uint64_t fuel;
+    Bm *bm;
+    Word halt;
+} Bm_Jit_Context;
+
+typedef Err (*Bm_Jit_Entry)(Bm_Jit_Context *ctx, const uint8_t *target);
+
+struct Bm_Jit {
+    uint8_t *code;
+    size_t code_size;
+    size_t *inst_offset;    // native offset of every instruction, plus the end
+    Word program_size;
+    int unchecked;          // compiled without stack checks (program was verified)
+    Bm_Jit_Entry entry;
+};
+
+#ifdef BM_JIT_SUPPORTED
+
+typedef struct {
+    uint8_t *data;
+    size_t size;
+    size_t capacity;
+    int failed;         // ran out of memory, the code is garbage
+} Jit_Buffer;
+
+typedef struct {
+    size_t at;          // position of a rel32 to patch
+    Word target;        // instruction index it jumps to
+} Jit_Fixup;
+
+typedef struct {
+    size_t at;          // position of a rel32 to patch
+    Word ip;            // instruction index to report
+    Err err;
+    int far;            // `ip` is an out-of-range jump target, see jit_emit_stubs()
+} Jit_Stub;
+
+typedef struct {
+    Jit_Buffer buf;
+    Jit_Fixup *fixups;
+    size_t fixups_size;
+    size_t fixups_capacity;
+    Jit_Stub *stubs;
+    size_t stubs_size;
+    size_t stubs_capacity;
+    size_t exit_offset;
+} Jit_Compiler;
+
+#define JIT_RAX 0
+#define JIT_RCX 1
+
+#define JIT_CC_B  0x2
+#define JIT_CC_E  0x4
+#define JIT_CC_NE 0x5
+#define JIT_CC_L  0xC
+#define JIT_CC_GE 0xD
+#define JIT_CC_LE 0xE
+#define JIT_CC_G  0xF
+
+// Returns NULL, leaving `items` alone, if memory ran out. Emitters then mark
+// the buffer as failed and carry on doing nothing; bm_jit_compile() gives up
+// at the end.
+static void *jit_grow(void *items, size_t *capacity, size_t item_size, size_t needed){
+    if (needed <= *capacity){
+        return items;
+    }
+    size_t new_capacity = *capacity == 0 ? 256 : *capacity;
+    while (new_capacity < needed){
+        new_capacity *= 2;
+    }
+    items = realloc(items, new_capacity * item_size);
+    if (items != NULL){
+        *capacity = new_capacity;
+    }
+    return items;
+}
+
+static void jit_bytes(Jit_Buffer *buf, const uint8_t *bytes, size_t count){
+    uint8_t *data = buf->failed ? NULL : jit_grow(buf->data, &buf->capacity, 1, buf->size + count);
+    if (data == NULL){
+        buf->failed = 1;
+        return;
+    }
+    buf->data = data;
+    memcpy(buf->data + buf->size, bytes, count);
+    buf->size += count;
+}
+
+#define JIT_EMIT(buf, ...)                                              \
+    do {                                                                \
+        const uint8_t bytes_[] = {__VA_ARGS__};                         \
+        jit_bytes((buf), bytes_, sizeof(bytes_));                       \
+    } while (0)
+
+static void jit_u32(Jit_Buffer *buf, uint32_t x){
+    JIT_EMIT(buf, x & 0xFF, (x >> 8) & 0xFF, (x >> 16) & 0xFF, (x >> 24) & 0xFF);
+}
+
+static void jit_u64(Jit_Buffer *buf, uint64_t x){
+    jit_u32(buf, (uint32_t) x);
+    jit_u32(buf, (uint32_t) (x >> 32));
+}
+
+static int jit_fits_i32(Word x){
+    return x >= INT32_MIN && x <= INT32_MAX;
+}
+
+static void jit_patch_rel32(Jit_Buffer *buf, size_t at, size_t target){
+    if (buf->failed){
+        return;
+    }
+    const int32_t rel = (int32_t) ((int64_t) target - (int64_t) (at + 4));
+    memcpy(buf->data + at, &rel, sizeof(rel));
+}
+
+// Short forward jumps inside the code of one instruction.
+static size_t jit_jcc8(Jit_Buffer *buf, uint8_t cc){
+    JIT_EMIT(buf, 0x70 | cc, 0);
+    return buf->size - 1;
+}
+
+static size_t jit_jmp8(Jit_Buffer *buf){
+    JIT_EMIT(buf, 0xEB, 0);
+    return buf->size - 1;
+}
+
+static void jit_land8(Jit_Buffer *buf, size_t at){
+    if (buf->failed){
+        return;
+    }
+    const size_t rel = buf->size - (at + 1);
+    assert(rel < 128);
+    buf->data[at] = (uint8_t) rel;
+}
+
+// <opcode> reg, [rbx + r12*8 + disp]
+static void jit_stack_op(Jit_Buffer *buf, uint8_t opcode, int two_byte, int reg, Word disp){
+    const uint8_t rex = 0x48 | 0x02 | ((reg & 8) ? 0x04 : 0);
+    const int disp8 = disp >= -128 && disp <= 127;
+    if (two_byte){
+        JIT_EMIT(buf, rex, 0x0F, opcode);
+    } else {
+        JIT_EMIT(buf, rex, opcode);
+    }
+    JIT_EMIT(buf, (disp8 ? 0x40 : 0x80) | ((reg & 7) << 3) | 0x04, 0xE3);
+    if (disp8){
+        JIT_EMIT(buf, (uint8_t) disp);
+    } else {
+        jit_u32(buf, (uint32_t) disp);
+    }
+}
+
+// stack[size - 1 - depth] as a displacement from rbx + r12*8
+#define JIT_SLOT(depth) (-8 * ((Word) (depth) + 1))
+
+static void jit_load_slot(Jit_Buffer *buf, int reg, Word depth){
+    jit_stack_op(buf, 0x8B, 0, reg, JIT_SLOT(depth));
+}
+
+// Write rax back to its memory slot. `known_size` is a lower bound of the
+// stack size at this point; with an empty stack there is nothing to write.
+static void jit_spill_tos(Jit_Buffer *buf, Word known_size){
+    if (known_size >= 1){
+        jit_stack_op(buf, 0x89, 0, JIT_RAX, JIT_SLOT(0));
+    } else {
+        JIT_EMIT(buf, 0x4D, 0x85, 0xE4);                    // test r12, r12
+        const size_t skip = jit_jcc8(buf, JIT_CC_E);
+        jit_stack_op(buf, 0x89, 0, JIT_RAX, JIT_SLOT(0));
+        jit_land8(buf, skip);
+    }
+}
+
+// Reload rax after the stack shrank.
+static void jit_reload_tos(Jit_Buffer *buf, Word known_size){
+    if (known_size >= 1){
+        jit_load_slot(buf, JIT_RAX, 0);
+    } else {
+        JIT_EMIT(buf, 0x4D, 0x85, 0xE4);                    // test r12, r12
+        const size_t skip = jit_jcc8(buf, JIT_CC_E);
+        jit_load_slot(buf, JIT_RAX, 0);
+        jit_land8(buf, skip);
+    }
+}
+
+static void jit_mov_rax_imm(Jit_Buffer *buf, Word value){
+    if (jit_fits_i32(value)){
+        JIT_EMIT(buf, 0x48, 0xC7, 0xC0);                    // mov rax, imm32
+        jit_u32(buf, (uint32_t) value);
+    } else {
+        JIT_EMIT(buf, 0x48, 0xB8);                          // mov rax, imm64
+        jit_u64(buf, (uint64_t) value);
+    }
+}
+
+static void jit_mov_rcx_imm(Jit_Buffer *buf, Word value){
+    JIT_EMIT(buf, 0x48, 0xB9);                              // mov rcx, imm64
+    jit_u64(buf, (uint64_t) value);
+}
+
+static int jit_reserve_stub(Jit_Compiler *jc){
+    Jit_Stub *stubs = jit_grow(jc->stubs, &jc->stubs_capacity, sizeof(jc->stubs[0]), jc->stubs_size + 1);
+    if (stubs == NULL){
+        jc->buf.failed = 1;
+        return 0;
+    }
+    jc->stubs = stubs;
+    return 1;
+}
+
+static void jit_jcc_stub(Jit_Compiler *jc, uint8_t cc, Word ip, Err err){
+    JIT_EMIT(&jc->buf, 0x0F, 0x80 | cc, 0, 0, 0, 0);
+    if (!jit_reserve_stub(jc)){
+        return;
+    }
+    jc->stubs[jc->stubs_size++] = (Jit_Stub) {.at = jc->buf.size - 4, .ip = ip, .err = err};
+}
+
+static void jit_jmp_stub(Jit_Compiler *jc, Word ip, Err err, int far){
+    JIT_EMIT(&jc->buf, 0xE9, 0, 0, 0, 0);
+    if (!jit_reserve_stub(jc)){
+        return;
+    }
+    jc->stubs[jc->stubs_size++] = (Jit_Stub) {.at = jc->buf.size - 4, .ip = ip, .err = err, .far = far};
+}
+
+// Jump to instruction `target`. Targets outside [0, program_size] can't be
+// reached natively; they exit the way the next bm_execute_inst() would.
+static void jit_jmp_inst(Jit_Compiler *jc, Word target, Word program_size){
+    if (target < 0 || target > program_size){
+        jit_jmp_stub(jc, target, ERR_ILLEGAL_INST_ACCESS, 1);
+        return;
+    }
+    JIT_EMIT(&jc->buf, 0xE9, 0, 0, 0, 0);
+    Jit_Fixup *fixups = jit_grow(jc->fixups, &jc->fixups_capacity, sizeof(jc->fixups[0]), jc->fixups_size + 1);
+    if (fixups == NULL){
+        jc->buf.failed = 1;
+        return;
+    }
+    jc->fixups = fixups;
+    jc->fixups[jc->fixups_size++] = (Jit_Fixup) {.at = jc->buf.size - 4, .target = target};
+}
+
+static void jit_check_underflow(Jit_Compiler *jc, int unchecked, Word needed, Word ip){
+    if (unchecked){
+        return;
+    }
+    JIT_EMIT(&jc->buf, 0x49, 0x83, 0xFC, (uint8_t) needed); // cmp r12, needed
+    jit_jcc_stub(jc, JIT_CC_L, ip, ERR_STACK_UNDERFLOW);
+}
+
+static void jit_check_overflow(Jit_Compiler *jc, int unchecked, Word ip){
+    if (unchecked){
+        return;
+    }
+    JIT_EMIT(&jc->buf, 0x4D, 0x39, 0xF4);                   // cmp r12, r14
+    jit_jcc_stub(jc, JIT_CC_GE, ip, ERR_STACK_OVERFLOW);
+}
+
+static void jit_print_debug(Bm *bm, Word value){
+    bm_print_word(bm, value);
+}
+
+// Emits the code of instruction `i`. Returns 0 if the JIT can't compile it.
+static int jit_emit_inst(Jit_Compiler *jc, const Bm *bm, Word i, int unchecked){
+    Jit_Buffer *buf = &jc->buf;
+    const Inst inst = bm->program[i];
+    const Word n = bm->program_size;
+    // no path from 0 reaches it, so it has no depth: keep its checks
+    if (unchecked && bm->stack_depth[i] == BM_DEPTH_UNKNOWN){
+        unchecked = 0;
+    }
+    // lower bound of the stack size when the instruction starts
+    const Word known = unchecked ? bm->stack_depth[i] + bm->min_stack_size : 0;
+
+    JIT_EMIT(buf, 0x49, 0x83, 0xED, 0x01);                  // sub r13, 1
+    jit_jcc_stub(jc, JIT_CC_B, i, ERR_OK);
+
+    switch (inst.type) {
+    case INST_NOP:
+        break;
+
+    case INST_PUSH:
+        jit_check_overflow(jc, unchecked, i);
+        jit_spill_tos(buf, known);
+        jit_mov_rax_imm(buf, inst.operand);
+        JIT_EMIT(buf, 0x49, 0xFF, 0xC4);                    // inc r12
+        break;
+
+    case INST_DUP:
+        jit_check_overflow(jc, unchecked, i);
+        if (inst.operand < 0){
+            jit_jmp_stub(jc, i, ERR_ILLEGAL_OPERAND, 0);
+            break;
+        }
+        if (inst.operand >= INT32_MAX / 8){
+            jit_jmp_stub(jc, i, ERR_STACK_UNDERFLOW, 0);
+            break;
+        }
+        if (!unchecked){
+            JIT_EMIT(buf, 0x49, 0x81, 0xFC);                // cmp r12, imm32
+            jit_u32(buf, (uint32_t) inst.operand);
+            jit_jcc_stub(jc, JIT_CC_LE, i, ERR_STACK_UNDERFLOW);
+        }
+        jit_spill_tos(buf, inst.operand + 1);
+        if (inst.operand > 0){
+            jit_load_slot(buf, JIT_RAX, inst.operand);
+        }
+        JIT_EMIT(buf, 0x49, 0xFF, 0xC4);                    // inc r12
+        break;
+
+    case INST_PLUS:
+        jit_check_underflow(jc, unchecked, 2, i);
+        jit_stack_op(buf, 0x03, 0, JIT_RAX, JIT_SLOT(1));   // add rax, [second]
+        JIT_EMIT(buf, 0x49, 0xFF, 0xCC);                    // dec r12
+        break;
+
+    case INST_MINUS:
+        jit_check_underflow(jc, unchecked, 2, i);
+        JIT_EMIT(buf, 0x48, 0xF7, 0xD8);                    // neg rax
+        jit_stack_op(buf, 0x03, 0, JIT_RAX, JIT_SLOT(1));   // add rax, [second]
+        JIT_EMIT(buf, 0x49, 0xFF, 0xCC);                    // dec r12
+        break;
+
+    case INST_MULT:
+        jit_check_underflow(jc, unchecked, 2, i);
+        jit_stack_op(buf, 0xAF, 1, JIT_RAX, JIT_SLOT(1));   // imul rax, [second]
+        JIT_EMIT(buf, 0x49, 0xFF, 0xCC);                    // dec r12
+        break;
+
+    case INST_DIV: {
+        jit_check_underflow(jc, unchecked, 2, i);
+        JIT_EMIT(buf, 0x48, 0x85, 0xC0);                    // test rax, rax
+        jit_jcc_stub(jc, JIT_CC_E, i, ERR_DIV_BY_ZERO);
+        JIT_EMIT(buf, 0x48, 0x83, 0xF8, 0xFF);              // cmp rax, -1
+        const size_t divide = jit_jcc8(buf, JIT_CC_NE);
+        jit_load_slot(buf, JIT_RAX, 1);
+        JIT_EMIT(buf, 0x48, 0xF7, 0xD8);                    // neg rax
+        const size_t done = jit_jmp8(buf);
+        jit_land8(buf, divide);
+        JIT_EMIT(buf, 0x48, 0x89, 0xC1);                    // mov rcx, rax
+        jit_load_slot(buf, JIT_RAX, 1);
+        JIT_EMIT(buf, 0x48, 0x99);                          // cqo
+        JIT_EMIT(buf, 0x48, 0xF7, 0xF9);                    // idiv rcx
+        jit_land8(buf, done);
+        JIT_EMIT(buf, 0x49, 0xFF, 0xCC);                    // dec r12
+    } break;
+
+    case INST_EQ:
+        jit_check_underflow(jc, unchecked, 2, i);
+        jit_stack_op(buf, 0x3B, 0, JIT_RAX, JIT_SLOT(1));   // cmp rax, [second]
+        JIT_EMIT(buf, 0x0F, 0x94, 0xC0);                    // sete al
+        JIT_EMIT(buf, 0x0F, 0xB6, 0xC0);                    // movzx eax, al
+        JIT_EMIT(buf, 0x49, 0xFF, 0xCC);                    // dec r12
+        break;
+
+    case INST_JMP:
+        jit_jmp_inst(jc, inst.operand, n);
+        break;
+
+    case INST_JMP_IF: {
+        jit_check_underflow(jc, unchecked, 1, i);
+        JIT_EMIT(buf, 0x48, 0x85, 0xC0);                    // test rax, rax
+        const size_t not_taken = jit_jcc8(buf, JIT_CC_E);
+        JIT_EMIT(buf, 0x49, 0xFF, 0xCC);                    // dec r12
+        jit_reload_tos(buf, known - 1);
+        jit_jmp_inst(jc, inst.operand, n);
+        jit_land8(buf, not_taken);
+    } break;
+
+    case INST_HALT:
+        JIT_EMIT(buf, 0x49, 0xC7, 0x47, (uint8_t) offsetof(Bm_Jit_Context, halt), 1, 0, 0, 0);
+        JIT_EMIT(buf, 0xBE);                                // mov esi, i
+        jit_u32(buf, (uint32_t) i);
+        JIT_EMIT(buf, 0x31, 0xFF);                          // xor edi, edi
+        JIT_EMIT(buf, 0xE9);                                // jmp exit
+        jit_u32(buf, 0);
+        jit_patch_rel32(buf, buf->size - 4, jc->exit_offset);
+        break;
+
+    case INST_PRINT_DEBUG:
+        jit_check_underflow(jc, unchecked, 1, i);
+        JIT_EMIT(buf, 0x48, 0x89, 0xC6);                    // mov rsi, rax
+        JIT_EMIT(buf, 0x49, 0x8B, 0x7F, (uint8_t) offsetof(Bm_Jit_Context, bm));
+        JIT_EMIT(buf, 0x48, 0xB8);                          // mov rax, jit_print_debug
+        {
+            void (*print)(Bm *, Word) = jit_print_debug;
+            uint64_t address;
+            memcpy(&address, &print, sizeof(address));
+            jit_u64(buf, address);
+        }
+        JIT_EMIT(buf, 0xFF, 0xD0);                          // call rax
+        JIT_EMIT(buf, 0x49, 0xFF, 0xCC);                    // dec r12
+        jit_reload_tos(buf, known - 1);
+        break;
+
+    case INST_PUSH_PLUS:
+        jit_check_overflow(jc, unchecked, i);
+        jit_check_underflow(jc, unchecked, 1, i);
+        if (jit_fits_i32(inst.operand)){
+            JIT_EMIT(buf, 0x48, 0x05);                      // add rax, imm32
+            jit_u32(buf, (uint32_t) inst.operand);
+        } else {
+            jit_mov_rcx_imm(buf, inst.operand);
+            JIT_EMIT(buf, 0x48, 0x01, 0xC8);                // add rax, rcx
+        }
+        break;
+
+    case INST_PUSH_MULT:
+        jit_check_overflow(jc, unchecked, i);
+        jit_check_underflow(jc, unchecked, 1, i);
+        if (jit_fits_i32(inst.operand)){
+            JIT_EMIT(buf, 0x48, 0x69, 0xC0);                // imul rax, rax, imm32
+            jit_u32(buf, (uint32_t) inst.operand);
+        } else {
+            jit_mov_rcx_imm(buf, inst.operand);
+            JIT_EMIT(buf, 0x48, 0x0F, 0xAF, 0xC1);          // imul rax, rcx
+        }
+        break;
+
+    case INST_DUP2_PLUS:
+        jit_check_underflow(jc, unchecked, 2, i);
+        if (!unchecked){
+            JIT_EMIT(buf, 0x49, 0x8D, 0x4C, 0x24, 0x02);    // lea rcx, [r12 + 2]
+            JIT_EMIT(buf, 0x4C, 0x39, 0xF1);                // cmp rcx, r14
+            jit_jcc_stub(jc, JIT_CC_G, i, ERR_STACK_OVERFLOW);
+        }
+        jit_spill_tos(buf, 2);
+        jit_stack_op(buf, 0x03, 0, JIT_RAX, JIT_SLOT(1));   // add rax, [second]
+        JIT_EMIT(buf, 0x49, 0xFF, 0xC4);                    // inc r12
+        break;
+
+    case INST_EQ_JMP_IF: {
+        jit_check_underflow(jc, unchecked, 2, i);
+        jit_stack_op(buf, 0x3B, 0, JIT_RAX, JIT_SLOT(1));   // cmp rax, [second]
+        const size_t not_equal = jit_jcc8(buf, JIT_CC_NE);
+        JIT_EMIT(buf, 0x49, 0x83, 0xEC, 0x02);              // sub r12, 2
+        jit_reload_tos(buf, known - 2);
+        jit_jmp_inst(jc, inst.operand, n);
+        jit_land8(buf, not_equal);
+        JIT_EMIT(buf, 0x31, 0xC0);                          // xor eax, eax
+        JIT_EMIT(buf, 0x49, 0xFF, 0xCC);                    // dec r12
+    } break;
+
+    case INST_NATIVE: {
+        // a direct call of the bound function: binding drops the JIT code
+        const Bm_Native_Entry *native = bm_native_at(bm, inst.operand);
+        if (native == NULL){
+            jit_jmp_stub(jc, i, ERR_ILLEGAL_OPERAND, 0);
+            break;
+        }
+        const Word grows = native->results - native->arity;
+        jit_check_underflow(jc, unchecked, native->arity, i);
+        if (grows == 1){
+            jit_check_overflow(jc, unchecked, i);
+        } else if (grows > 1 && !unchecked){
+            JIT_EMIT(buf, 0x49, 0x8D, 0x4C, 0x24, (uint8_t) grows);    // lea rcx, [r12 + grows]
+            JIT_EMIT(buf, 0x4C, 0x39, 0xF1);                // cmp rcx, r14
+            jit_jcc_stub(jc, JIT_CC_G, i, ERR_STACK_OVERFLOW);
+        }
+        jit_spill_tos(buf, known);
+        JIT_EMIT(buf, 0x4A, 0x8D, 0x74, 0xE3, (uint8_t) (-8 * native->arity));  // lea rsi, [rbx + r12*8 - 8*arity]
+        JIT_EMIT(buf, 0x49, 0x8B, 0x7F, (uint8_t) offsetof(Bm_Jit_Context, bm));
+        JIT_EMIT(buf, 0x48, 0xBA);                          // mov rdx, data
+        jit_u64(buf, (uint64_t) (uintptr_t) native->data);
+        JIT_EMIT(buf, 0x48, 0xB8);                          // mov rax, fn
+        {
+            uint64_t address;
+            memcpy(&address, &native->fn, sizeof(address));
+            jit_u64(buf, address);
+        }
+        JIT_EMIT(buf, 0xFF, 0xD0);                          // call rax
+        JIT_EMIT(buf, 0x85, 0xC0);                          // test eax, eax
+        const size_t ok = jit_jcc8(buf, JIT_CC_E);
+        JIT_EMIT(buf, 0x89, 0xC7);                          // mov edi, eax
+        jit_reload_tos(buf, known);
+        JIT_EMIT(buf, 0xBE);                                // mov esi, i
+        jit_u32(buf, (uint32_t) i);
+        JIT_EMIT(buf, 0xE9);                                // jmp exit
+        jit_u32(buf, 0);
+        jit_patch_rel32(buf, buf->size - 4, jc->exit_offset);
+        jit_land8(buf, ok);
+        if (grows != 0){
+            JIT_EMIT(buf, 0x49, 0x83, 0xC4, (uint8_t) grows);   // add r12, grows
+        }
+        jit_reload_tos(buf, known + grows);
+    } break;
+
+    case INST_CALL:
+    case INST_RET:
+    case INST_LOAD_LOCAL:
+    case INST_STORE_LOCAL:
+    case INST_LOAD:
+    case INST_STORE:
+        return 0;
+
+    default:
+        jit_jmp_stub(jc, i, ERR_ILLEGAL_INST, 0);
+    }
+
+    return 1;
+}
+
+// Emits the exit stubs: each one loads the instruction index into rsi and
+// the Err into edi and jumps to the common exit. A `far` stub belongs to a
+// jump outside of the program: like bm_execute_inst() it only reports
+// ERR_ILLEGAL_INST_ACCESS if there is fuel left to execute the target, and
+// charges that fuel like any other faulting instruction.
+static void jit_emit_stubs(Jit_Compiler *jc){
+    Jit_Buffer *buf = &jc->buf;
+    for (size_t i = 0; i < jc->stubs_size; ++i){
+        const Jit_Stub *stub = &jc->stubs[i];
+        jit_patch_rel32(buf, stub->at, buf->size);
+
+        JIT_EMIT(buf, 0x48, 0xBE);                          // mov rsi, imm64
+        jit_u64(buf, (uint64_t) stub->ip);
+        if (stub->far){
+            JIT_EMIT(buf, 0x31, 0xFF);                      // xor edi, edi
+            JIT_EMIT(buf, 0x49, 0x83, 0xED, 0x01);          // sub r13, 1
+            JIT_EMIT(buf, 0x0F, 0x82);                      // jb exit
+            jit_u32(buf, 0);
+            jit_patch_rel32(buf, buf->size - 4, jc->exit_offset);
+        }
+        JIT_EMIT(buf, 0xBF);                                // mov edi, err
+        jit_u32(buf, (uint32_t) stub->err);
+        JIT_EMIT(buf, 0xE9);                                // jmp exit
+        jit_u32(buf, 0);
+        jit_patch_rel32(buf, buf->size - 4, jc->exit_offset);
+    }
+}
+
+static Bm_Jit *bm_jit_compile(const Bm *bm){
+    const Word n = bm->program_size;
+    const int unchecked = bm->verified;
+    Jit_Compiler jc = {0};
+    Jit_Buffer *buf = &jc.buf;
+
+    size_t *inst_offset = malloc(sizeof(inst_offset[0]) * (n + 1));
+    if (inst_offset == NULL){
+        return NULL;
+    }
+
+    // Err entry(Bm_Jit_Context *ctx /* rdi */, const uint8_t *target /* rsi */)
+    JIT_EMIT(buf, 0x53, 0x55, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57);  // push rbx, rbp, r12-r15
+    JIT_EMIT(buf, 0x48, 0x83, 0xEC, 0x08);                  // sub rsp, 8 (align for calls)
+    JIT_EMIT(buf, 0x49, 0x89, 0xFF);                        // mov r15, rdi
+    JIT_EMIT(buf, 0x49, 0x8B, 0x5F, (uint8_t) offsetof(Bm_Jit_Context, stack));
+    JIT_EMIT(buf, 0x4D, 0x8B, 0x67, (uint8_t) offsetof(Bm_Jit_Context, stack_size));
+    JIT_EMIT(buf, 0x4D, 0x8B, 0x77, (uint8_t) offsetof(Bm_Jit_Context, stack_capacity));
+    JIT_EMIT(buf, 0x4D, 0x8B, 0x6F, (uint8_t) offsetof(Bm_Jit_Context, fuel));
+    jit_reload_tos(buf, 0);
+    JIT_EMIT(buf, 0xFF, 0xE6);                              // jmp rsi
+
+    // exit: rsi = ip, edi = err
+    jc.exit_offset = buf->size;
+    JIT_EMIT(buf, 0x49, 0x89, 0x77, (uint8_t) offsetof(Bm_Jit_Context, ip));
+    jit_spill_tos(buf, 0);
+    JIT_EMIT(buf, 0x4D, 0x89, 0x67, (uint8_t) offsetof(Bm_Jit_Context, stack_size));
+    JIT_EMIT(buf, 0x4D, 0x89, 0x6F, (uint8_t) offsetof(Bm_Jit_Context, fuel));
+    JIT_EMIT(buf, 0x89, 0xF8);                              // mov eax, edi
+    JIT_EMIT(buf, 0x48, 0x83, 0xC4, 0x08);                  // add rsp, 8
+    JIT_EMIT(buf, 0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5D, 0x5B);  // pop r15-r12, rbp, rbx
+    JIT_EMIT(buf, 0xC3);                                    // ret
+
+    int ok = 1;
+    for (Word i = 0; i < n && ok && !buf->failed; ++i){
+        inst_offset[i] = buf->size;
+        ok = jit_emit_inst(&jc, bm, i, unchecked);
+    }
+
+    if (ok){
+        // falling off the end of the program
+        inst_offset[n] = buf->size;
+        JIT_EMIT(buf, 0x49, 0x83, 0xED, 0x01);              // sub r13, 1
+        jit_jcc_stub(&jc, JIT_CC_B, n, ERR_OK);
+        jit_jmp_stub(&jc, n, ERR_ILLEGAL_INST_ACCESS, 0);
+
+        jit_emit_stubs(&jc);
+        for (size_t i = 0; i < jc.fixups_size; ++i){
+            jit_patch_rel32(buf, jc.fixups[i].at, inst_offset[jc.fixups[i].target]);
+        }
+    }
+
+    Bm_Jit *jit = NULL;
+    if (ok && !buf->failed){
+        uint8_t *code = mmap(NULL, buf->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (code != MAP_FAILED){
+            memcpy(code, buf->data, buf->size);
+            if (mprotect(code, buf->size, PROT_READ | PROT_EXEC) == 0){
+                jit = malloc(sizeof(*jit));
+            }
+            if (jit != NULL){
+                jit->code = code;
+                jit->code_size = buf->size;
+                jit->inst_offset = inst_offset;
+                jit->program_size = n;
+                jit->unchecked = unchecked;
+                memcpy(&jit->entry, &code, sizeof(code));
+            } else {
+                munmap(code, buf->size);
+            }
+        }
+    }
+
+    if (jit == NULL){
+        free(inst_offset);
+    }
+    free(buf->data);
+    free(jc.fixups);
+    free(jc.stubs);
+    return jit;
+}
+
+static void bm_jit_free(Bm_Jit *jit){
+    if (jit == NULL){
+        return;
+    }
+    munmap(jit->code, jit->code_size);
+    free(jit->inst_offset);
+    free(jit);
+}
+
+// Runs `bm` with compiled code. Same contract as bm_execute_program().
+static Err bm_jit_execute(Bm_Jit *jit, Bm *bm, int limit){
+    assert(jit->program_size == bm->program_size);
+
+    if (limit == 0 || bm->halt){
+        return ERR_OK;
+    }
+
+    if (bm->ip < 0 || bm->ip >= bm->program_size){
+        return ERR_ILLEGAL_INST_ACCESS;
+    }
+
+    if (jit->unchecked && !bm_can_skip_checks(bm)){
+        return bm_execute_program_threaded(bm, limit);
+    }
+
+    Bm_Jit_Context ctx = {
+        .stack = bm->stack,
+        .stack_size = bm->stack_size,
+        .stack_capacity = bm->stack_capacity,
+        .ip = bm->ip,
+        .fuel = limit < 0 ? UINT64_MAX : (uint64_t) limit,
+        .bm = bm,
+        .halt = 0,
+    };
+
+    const uint64_t fuel = ctx.fuel;
+    const Err err = jit->entry(&ctx, jit->code + jit->inst_offset[bm->ip]);
+
+    bm->ip = ctx.ip;
+    bm->stack_size = ctx.stack_size;
+    if (ctx.halt){
+        bm->halt = 1;
+    }
+    // running out of fuel leaves r13 wrapped around below zero
+    bm_count_insts(bm, limit, ctx.fuel > fuel ? 0 : ctx.fuel, err);
+    return err;
+}
+
+#else
+
+static Bm_Jit *bm_jit_compile(const Bm *bm){
+    (void) bm;
+    return NULL;
+}
+
+static void bm_jit_free(Bm_Jit *jit){
+    (void) jit;
+}
+
+static Err bm_jit_execute(Bm_Jit *jit, Bm *bm, int limit){
+    (void) jit;
+    return bm_execute_program_threaded(bm, limit);
+}
+
+#endif // BM_JIT_SUPPORTED
+
+// JIT engine: compiles the program on first use and keeps the code in `bm`.
+// Falls back to the threaded interpreter if the program can't be compiled.
+Err bm_execute_program_jit(Bm *bm, int limit){
+    if (bm->jit == NULL && !bm->jit_failed){
+        bm->jit = bm_jit_compile(bm);
+        bm->jit_failed = bm->jit == NULL;
+    }
+
+    if (bm->jit == NULL){
+        return bm_execute_program_threaded(bm, limit);
+    }
+
+    return bm_jit_execute(bm->jit, bm, limit);
+}
+
+const char *bm_engine_as_cstr(Bm_Engine engine){
+    switch (engine) {
+        case BM_ENGINE_SWITCH: return "switch";
+        case BM_ENGINE_THREADED: return "threaded";
+        case BM_ENGINE_JIT: return "jit";
+        case BM_ENGINE_TOS: return "tos";
+        case BM_ENGINE_BLOCK: return "block";
+        case COUNT_BM_ENGINES:
+        default: return "unknown";
+    }
+}
+
+// Returns 0 and sets `*engine` if `name` is a known engine name.
+int bm_engine_from_cstr(const char *name, Bm_Engine *engine){
+    for (Bm_Engine e = 0; e < COUNT_BM_ENGINES; ++e){
+        if (strcmp(name, bm_engine_as_cstr(e)) == 0){
+            *engine = e;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// An `engine` that doesn't exist is ERR_ILLEGAL_OPERAND.
+Err bm_execute_program_with(Bm *bm, Bm_Engine engine, int limit){
+    switch (engine) {
+        case BM_ENGINE_SWITCH: return bm_execute_program(bm, limit);
+        case BM_ENGINE_THREADED: return bm_execute_program_threaded(bm, limit);
+        case BM_ENGINE_JIT: return bm_execute_program_jit(bm, limit);
+        case BM_ENGINE_TOS: return bm_execute_program_tos(bm, limit);
+        case BM_ENGINE_BLOCK: return bm_execute_program_blocks(bm, limit);
+        case COUNT_BM_ENGINES:
+        default: return ERR_ILLEGAL_OPERAND;
+    }
+}
+
+Err bm_execute_slice(Bm *bm, Bm_Engine engine, int fuel){
+    if (fuel < 0){
+        return ERR_ILLEGAL_OPERAND;
+    }
+    const Err err = bm_execute_program_with(bm, engine, fuel);
+    // the engines only stop early to halt or to fail
+    return err == ERR_OK && !bm->halt ? ERR_FUEL_EXHAUSTED : err;
+}
+
+long bm_scheduler_add(Bm_Scheduler *scheduler, Bm *bm, int priority){
+    if (scheduler->tasks_size >= scheduler->tasks_capacity){
+        const size_t capacity = scheduler->tasks_capacity > 0 ? scheduler->tasks_capacity * 2 : 64;
+        Bm_Task *tasks = realloc(scheduler->tasks, sizeof(tasks[0]) * capacity);
+        if (tasks == NULL){
+            return -1;
+        }
+        scheduler->tasks = tasks;
+        size_t *runnable = realloc(scheduler->runnable, sizeof(runnable[0]) * capacity);
+        if (runnable == NULL){
+            return -1;
+        }
+        scheduler->runnable = runnable;
+        scheduler->tasks_capacity = capacity;
+    }
+
+    const size_t index = scheduler->tasks_size++;
+    scheduler->tasks[index] = (Bm_Task) {
+        .bm = bm,
+        .priority = priority > 0 ? priority : 1,
+        .err = ERR_FUEL_EXHAUSTED,
+    };
+    scheduler->runnable[scheduler->runnable_size++] = index;
+    return (long) index;
+}
+
+long bm_scheduler_step(Bm_Scheduler *scheduler){
+    if (scheduler->runnable_size == 0){
+        return -1;
+    }
+    if (scheduler->next >= scheduler->runnable_size){
+        scheduler->next = 0;
+    }
+
+    const size_t index = scheduler->runnable[scheduler->next];
+    Bm_Task *task = &scheduler->tasks[index];
+    const int slice = scheduler->slice > 0 ? scheduler->slice : 1;
+    const int fuel = task->priority <= INT_MAX / slice ? task->priority * slice : INT_MAX;
+    task->err = bm_execute_slice(task->bm, scheduler->engine, fuel);
+
+    if (task->err == ERR_FUEL_EXHAUSTED){
+        scheduler->next += 1;
+    } else {
+        // the last runnable task takes its place and its turn comes next;
+        // the order changes, the share of each task doesn't
+        scheduler->runnable[scheduler->next] = scheduler->runnable[--scheduler->runnable_size];
+    }
+    return (long) index;
+}
+
+size_t bm_scheduler_run(Bm_Scheduler *scheduler, long turns){
+    for (long turn = 0; turns < 0 || turn < turns; ++turn){
+        if (bm_scheduler_step(scheduler) < 0){
+            break;
+        }
+    }
+    return scheduler->runnable_size;
+}
+
+void bm_scheduler_free(Bm_Scheduler *scheduler){
+    free(scheduler->tasks);
+    free(scheduler->runnable);
+    *scheduler = (Bm_Scheduler) {0};
+}
+
+// Profiler clock: the time stamp counter on x86, nanoseconds elsewhere.
+static uint64_t bm_profile_ticks(void){
+#if defined(__x86_64__) || defined(__i386__)
+    uint32_t lo, hi;
+    __asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((uint64_t) hi << 32) | lo;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+Err bm_profile_init(Bm_Profile *profile, Word program_size){
+    *profile = (Bm_Profile) {0};
+    profile->entries = calloc(program_size > 0 ? program_size : 1, sizeof(profile->entries[0]));
+    if (profile->entries == NULL){
+        return ERR_OUT_OF_MEMORY;
+    }
+    profile->size = program_size;
+#if defined(__x86_64__) || defined(__i386__)
+    profile->ticks_unit = "cycles";
+#else
+    profile->ticks_unit = "ns";
+#endif
+
+    // what reading the clock twice costs, so it isn't charged to every
+    // instruction
+    uint64_t overhead = UINT64_MAX;
+    for (int i = 0; i < 1000; ++i){
+        const uint64_t start = bm_profile_ticks();
+        const uint64_t elapsed = bm_profile_ticks() - start;
+        if (elapsed < overhead){
+            overhead = elapsed;
+        }
+    }
+    profile->overhead = overhead;
+    return ERR_OK;
+}
+
+void bm_profile_free(Bm_Profile *profile){
+    free(profile->entries);
+    *profile = (Bm_Profile) {0};
+}
+
+// bm_execute_program() with a clock read around every instruction. It's a
+// loop of its own, so the engines don't pay for profiling when it's off.
+Err bm_execute_program_profiled(Bm *bm, int limit, Bm_Profile *profile){
+    if (profile->size < bm->program_size){
+        return ERR_ILLEGAL_OPERAND;
+    }
+
+    while (limit != 0 && !bm->halt){
+        const Word ip = bm->ip;
+        int taken = 0;
+        if (ip >= 0 && ip < bm->program_size){
+            const Inst inst = bm->program[ip];
+            const Word *top = bm->stack + bm->stack_size;
+            taken = (inst.type == INST_JMP_IF && bm->stack_size >= 1 && top[-1] != 0) ||
+                    (inst.type == INST_EQ_JMP_IF && bm->stack_size >= 2 && top[-1] == top[-2]);
+        }
+
+        const uint64_t start = bm_profile_ticks();
+        const Err err = bm_execute_inst(bm);
+        const uint64_t elapsed = bm_profile_ticks() - start;
+        if (err != ERR_OK){
+            return err;
+        }
+
+        Bm_Profile_Entry *entry = &profile->entries[ip];
+        entry->count += 1;
+        entry->ticks += elapsed > profile->overhead ? elapsed - profile->overhead : 0;
+        entry->taken += taken;
+
+        if (limit > 0){
+            --limit;
+        }
+    }
+
+    return ERR_OK;
+}
+
+
+Err bm_set_output_fd(Bm *bm, int fd){
+    const Err err = bm_flush_output(bm);
+    bm->output_fd = fd;
+    bm->output_fn = NULL;
+    bm->output_data = NULL;
+    return err;
+}
+
+Err bm_set_output_callback(Bm *bm, Bm_Output fn, void *data){
+    const Err err = bm_flush_output(bm);
+    bm->output_fn = fn;
+    bm->output_data = data;
+    return err;
+}
+
+void bm_set_output_mode(Bm *bm, Bm_Output_Mode mode){
+    bm->output_mode = mode;
+}
+
+Err bm_flush_output(Bm *bm){
+    bm_output_drain(bm);
+    const Err err = bm->output_err;
+    bm->output_err = ERR_OK;
+    return err;
+}
+
+// Formatted like print_debug, one fwrite() per buffer
+void bm_dump_stack(FILE *stream, const Bm *bm){
+    char buffer[4096];
+    size_t size = 0;
+    fputs("Stack:\n", stream);
+    if (bm->stack_size == 0){
+        fputs(" [empty]\n", stream);
+        return;
+    }
+    for (Word i = 0; i < bm->stack_size; ++i){
+        if (sizeof(buffer) - size < BM_OUTPUT_WORD_MAX + 1){
+            fwrite(buffer, 1, size, stream);
+            size = 0;
+        }
+        buffer[size++] = ' ';
+        size += bm_format_word(buffer + size, bm->stack[i]);
+        buffer[size++] = '\n';
+    }
+    fwrite(buffer, 1, size, stream);
+}
+
+Bm *bm_create(Arena *arena, Word stack_capacity, Word program_capacity){
+    if (stack_capacity < 0 || program_capacity < 0){
+        return NULL;
+    }
+
+    Bm *bm = NULL;
+    if (arena != NULL){
+        bm = arena_alloc(arena, sizeof(*bm));
+        if (bm == NULL){
+            return NULL;
+        }
+        *bm = (Bm) {0};
+        bm->arena = arena;
+        bm->stack = arena_alloc(arena, sizeof(bm->stack[0]) * stack_capacity);
+        bm->frames = arena_alloc(arena, sizeof(bm->frames[0]) * stack_capacity);
+        bm->program = arena_alloc(arena, sizeof(bm->program[0]) * program_capacity);
+    } else {
+        bm = calloc(1, sizeof(*bm));
+        if (bm == NULL){
+            return NULL;
+        }
+        bm->stack = malloc(sizeof(bm->stack[0]) * stack_capacity);
+        bm->frames = malloc(sizeof(bm->frames[0]) * stack_capacity);
+        bm->program = malloc(sizeof(bm->program[0]) * program_capacity);
+    }
+
+    if ((stack_capacity > 0 && (bm->stack == NULL || bm->frames == NULL)) ||
+        (program_capacity > 0 && bm->program == NULL)){
+        bm_destroy(bm);
+        return NULL;
+    }
+
+    bm->stack_capacity = stack_capacity;
+    bm->frames_capacity = stack_capacity;
+    bm->program_capacity = program_capacity;
+    bm->output_fd = STDOUT_FILENO;
+    return bm;
+}
+
+void bm_reset(Bm *bm){
+    bm->stack_size = 0;
+    bm->frames_size = 0;
+    bm->fp = 0;
+    bm->ip = 0;
+    bm->halt = 0;
+    bm->inst_count = 0;
+}
+
+Word bm_inst_count(const Bm *bm){
+    return bm->inst_count;
+}
+
+Word bm_stack_size(const Bm *bm){
+    return bm->stack_size;
+}
+
+Word bm_stack_capacity(const Bm *bm){
+    return bm->stack_capacity;
+}
+
+const Word *bm_stack(const Bm *bm){
+    return bm->stack;
+}
+
+Word bm_fp(const Bm *bm){
+    return bm->fp;
+}
+
+Word bm_frames_size(const Bm *bm){
+    return bm->frames_size;
+}
+
+const Bm_Frame *bm_frames(const Bm *bm){
+    return bm->frames;
+}
+
+void bm_set_memory(Bm *bm, Word *memory, Word size){
+    bm->memory = memory;
+    bm->memory_size = memory != NULL && size > 0 ? size : 0;
+}
+
+Word *bm_memory(const Bm *bm){
+    return bm->memory;
+}
+
+Word bm_memory_size(const Bm *bm){
+    return bm->memory_size;
+}
+
+Err bm_push(Bm *bm, Word value){
+    if (bm->stack_size >= bm->stack_capacity){
+        return ERR_STACK_OVERFLOW;
+    }
+    bm->stack[bm->stack_size++] = value;
+    return ERR_OK;
+}
+
+Word bm_ip(const Bm *bm){
+    return bm->ip;
+}
+
+int bm_halted(const Bm *bm){
+    return bm->halt;
+}
+
+Word bm_program_size(const Bm *bm){
+    return bm->program_size;
+}
+
+const Inst *bm_program(const Bm *bm){
+    return bm->program;
+}
+
+const char *bm_error_message(const Bm *bm){
+    return bm->error;
+}
+
+// Records what went wrong for bm_error_message() and returns `err`.
+// Leaves errno alone.
+static Err bm_fail(Bm *bm, Err err, const char *fmt, ...){
+    const int saved_errno = errno;
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(bm->error, sizeof(bm->error), fmt, args);
+    va_end(args);
+    errno = saved_errno;
+    return err;
+}
+
+static int bm_native_name_is_valid(const char *name){
+    const size_t n = strlen(name);
+    return n > 0 && n < BM_NATIVE_NAME_CAPACITY && !isdigit((unsigned char) name[0]) && name[0] != '-' &&
+        strpbrk(name, " \t\r\n#:") == NULL;
+}
+
+Err bm_bind_native(Bm *bm, Word index, const char *name, Bm_Native fn, int arity, int results, void *data){
+    if (index < 0 || fn == NULL || arity < 0 || arity > BM_NATIVE_MAX_ARITY ||
+        results < 0 || results > BM_NATIVE_MAX_ARITY){
+        return bm_fail(bm, ERR_ILLEGAL_OPERAND, "native %ld: bad index, function, arity or results", index);
+    }
+    if (name != NULL){
+        const Word other = bm_native_index(bm, name);
+        if (!bm_native_name_is_valid(name) || (other >= 0 && other != index)){
+            return bm_fail(bm, ERR_ILLEGAL_OPERAND, "native %ld: bad or taken name `%s`", index, name);
+        }
+    }
+
+    if (index >= bm->natives_size){
+        Bm_Native_Entry *natives = realloc(bm->natives, sizeof(natives[0]) * (index + 1));
+        if (natives == NULL){
+            return bm_fail(bm, ERR_OUT_OF_MEMORY, "native %ld does not fit into memory", index);
+        }
+        memset(natives + bm->natives_size, 0, sizeof(natives[0]) * (index + 1 - bm->natives_size));
+        bm->natives = natives;
+        bm->natives_size = index + 1;
+    }
+
+    Bm_Native_Entry *native = &bm->natives[index];
+    *native = (Bm_Native_Entry) {.fn = fn, .data = data, .arity = arity, .results = results};
+    if (name != NULL){
+        memcpy(native->name, name, strlen(name) + 1);
+    }
+
+    // the proof, the blocks and the JIT code depend on the arities and the
+    // functions
+    bm_discard_verification(bm);
+    bm_discard_blocks(bm);
+    bm_jit_free(bm->jit);
+    bm->jit = NULL;
+    bm->jit_failed = 0;
+    return ERR_OK;
+}
+
+Word bm_native_index(const Bm *bm, const char *name){
+    for (Word i = 0; i < bm->natives_size; ++i){
+        if (bm->natives[i].fn != NULL && strcmp(bm->natives[i].name, name) == 0){
+            return i;
+        }
+    }
+    return -1;
+}
+
+const char *bm_native_name(const Bm *bm, Word index){
+    const Bm_Native_Entry *native = bm_native_at(bm, index);
+    return native != NULL && native->name[0] != '\0' ? native->name : NULL;
+}
+
+// Same natives as `other` as far as a stack proof goes.
+static int bm_natives_match(const Bm *bm, const Bm *other){
+    if (bm->natives_size != other->natives_size){
+        return 0;
+    }
+    for (Word i = 0; i < bm->natives_size; ++i){
+        if ((bm->natives[i].fn == NULL) != (other->natives[i].fn == NULL) ||
+            bm->natives[i].arity != other->natives[i].arity ||
+            bm->natives[i].results != other->natives[i].results){
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static Err bm_native_min(Bm *bm, Word *args, void *data){
+    (void) bm; (void) data;
+    args[0] = args[0] < args[1] ? args[0] : args[1];
+    return ERR_OK;
+}
+
+static Err bm_native_max(Bm *bm, Word *args, void *data){
+    (void) bm; (void) data;
+    args[0] = args[0] > args[1] ? args[0] : args[1];
+    return ERR_OK;
+}
+
+static Err bm_native_abs(Bm *bm, Word *args, void *data){
+    (void) bm; (void) data;
+    args[0] = args[0] < 0 ? (Word) (0 - (uint64_t) args[0]) : args[0];
+    return ERR_OK;
+}
+
+static Err bm_native_mod(Bm *bm, Word *args, void *data){
+    (void) bm; (void) data;
+    if (args[1] == 0){
+        return ERR_DIV_BY_ZERO;
+    }
+    args[0] = args[1] == -1 ? 0 : args[0] % args[1];
+    return ERR_OK;
+}
+
+// the splitmix64 finalizer
+static Err bm_native_hash(Bm *bm, Word *args, void *data){
+    (void) bm; (void) data;
+    uint64_t x = (uint64_t) args[0];
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+    args[0] = (Word) (x ^ (x >> 31));
+    return ERR_OK;
+}
+
+static int bm_memory_range_is_valid(const Bm *bm, Word addr, Word n){
+    return addr >= 0 && n >= 0 && addr <= bm->memory_size && n <= bm->memory_size - addr;
+}
+
+static Err bm_native_mem_sum(Bm *bm, Word *args, void *data){
+    (void) data;
+    if (!bm_memory_range_is_valid(bm, args[0], args[1])){
+        return ERR_ILLEGAL_MEMORY_ACCESS;
+    }
+    const Word *memory = bm->memory + args[0];
+    uint64_t sum = 0;
+    for (Word i = 0; i < args[1]; ++i){
+        sum += (uint64_t) memory[i];
+    }
+    args[0] = (Word) sum;
+    return ERR_OK;
+}
+
+static Err bm_native_mem_fill(Bm *bm, Word *args, void *data){
+    (void) data;
+    if (!bm_memory_range_is_valid(bm, args[0], args[1])){
+        return ERR_ILLEGAL_MEMORY_ACCESS;
+    }
+    Word *memory = bm->memory + args[0];
+    for (Word i = 0; i < args[1]; ++i){
+        memory[i] = args[2];
+    }
+    return ERR_OK;
+}
+
+Err bm_bind_std_natives(Bm *bm){
+    static const struct {
+        const char *name;
+        Bm_Native fn;
+        int arity;
+        int results;
+    } std_natives[COUNT_BM_STD_NATIVES] = {
+        [BM_NATIVE_MIN]      = {"min", bm_native_min, 2, 1},
+        [BM_NATIVE_MAX]      = {"max", bm_native_max, 2, 1},
+        [BM_NATIVE_ABS]      = {"abs", bm_native_abs, 1, 1},
+        [BM_NATIVE_MOD]      = {"mod", bm_native_mod, 2, 1},
+        [BM_NATIVE_HASH]     = {"hash", bm_native_hash, 1, 1},
+        [BM_NATIVE_MEM_SUM]  = {"mem_sum", bm_native_mem_sum, 2, 1},
+        [BM_NATIVE_MEM_FILL] = {"mem_fill", bm_native_mem_fill, 3, 0},
+    };
+    for (Word i = 0; i < COUNT_BM_STD_NATIVES; ++i){
+        const Err err = bm_bind_native(bm, i, std_natives[i].name, std_natives[i].fn,
+                                       std_natives[i].arity, std_natives[i].results, NULL);
+        if (err != ERR_OK){
+            return err;
+        }
+    }
+    return ERR_OK;
+}
+
+static void bm_debug_free(Bm_Debug *debug){
+    if (debug == NULL){
+        return;
+    }
+    free(debug->lines);
+    free(debug->labels);
+    free(debug->names);
+    free(debug);
+}
+
+// Every loader starts here. Drops the source locations of the old program
+// and a mapped or shared program, leaving the VM with no program storage at
+// all in that case.
+static void bm_release_program(Bm *bm){
+    bm_debug_free(bm->debug);
+    free(bm->debug_section_owned);
+    bm->debug = NULL;
+    bm->debug_section = NULL;
+    bm->debug_section_size = 0;
+    bm->debug_section_owned = NULL;
+    bm->debug_failed = 0;
+    if (bm->mapping == NULL && bm->program_owner == NULL){
+        return;
+    }
+    if (bm->mapping != NULL){
+        munmap(bm->mapping, bm->mapping_size);
+    }
+    bm->mapping = NULL;
+    bm->mapping_size = 0;
+    bm->program_owner = NULL;
+    bm->program = NULL;
+    bm->program_size = 0;
+    bm->program_capacity = 0;
+    bm_program_changed(bm);
+}
+
+void bm_destroy(Bm *bm){
+    if (bm == NULL){
+        return;
+    }
+    bm_program_changed(bm);
+    bm_debug_free(bm->debug);
+    free(bm->debug_section_owned);
+    if (bm->mapping != NULL){
+        munmap(bm->mapping, bm->mapping_size);
+    } else if (bm->arena == NULL && bm->program_owner == NULL){
+        free(bm->program);
+    }
+    if (bm->arena == NULL){
+        free(bm->stack);
+        free(bm->frames);
+    }
+    free(bm->natives);
+    bm_output_drain(bm);
+    free(bm->output);
+    if (bm->arena == NULL){
+        free(bm);
+    }
+}
+
+// Makes room for `capacity` instructions, keeping the current program. A
+// mapped or shared program is copied into storage of the VM's own. Returns 0
+// on success and -1 if the arena or memory ran out.
+static int bm_reserve_program(Bm *bm, Word capacity){
+    if (capacity <= bm->program_capacity){
+        return 0;
+    }
+
+    Word new_capacity = bm->program_capacity > 0 ? bm->program_capacity : BM_PROGRAM_CAPACITY;
+    while (new_capacity < capacity){
+        new_capacity *= 2;
+    }
+
+    Inst *program = NULL;
+    if (bm->arena != NULL || bm->mapping != NULL || bm->program_owner != NULL){
+        program = bm->arena != NULL
+            ? arena_alloc(bm->arena, sizeof(program[0]) * new_capacity)
+            : malloc(sizeof(program[0]) * new_capacity);
+        if (program == NULL){
+            return -1;
+        }
+        if (bm->program_size > 0){
+            memcpy(program, bm->program, sizeof(program[0]) * bm->program_size);
+        }
+        if (bm->mapping != NULL){
+            munmap(bm->mapping, bm->mapping_size);
+            bm->mapping = NULL;
+            bm->mapping_size = 0;
+        }
+        if (bm->program_owner != NULL){
+            // the verification may not outlive the sharing
+            bm->program_owner = NULL;
+            bm_discard_verification(bm);
+        }
+    } else {
+        program = realloc(bm->program, sizeof(program[0]) * new_capacity);
+        if (program == NULL){
+            return -1;
+        }
+    }
+
+    bm->program = program;
+    bm->program_capacity = new_capacity;
+    return 0;
+}
+
+Err bm_load_program_from_memory(Bm *bm, const Inst *program, size_t program_size){
+    bm_release_program(bm);
+    if (bm_reserve_program(bm, program_size) < 0){
+        return bm_fail(bm, ERR_OUT_OF_MEMORY, "program of %zu instructions does not fit into the VM", program_size);
+    }
+    if (program_size > 0){
+        memcpy(bm->program, program, sizeof(program[0]) * program_size);
+    }
+    bm->program_size = program_size;  
+    bm_program_changed(bm);
+    return ERR_OK;
+}
+
+void bm_share_program(Bm *bm, const Bm *owner){
+    // same program as last time: keep the caches built for it
+    if (bm->program_owner == owner && bm->program == owner->program &&
+        bm->program_size == owner->program_size && bm->verified == owner->verified){
+        return;
+    }
+
+    bm_release_program(bm);
+    if (bm->arena == NULL){
+        free(bm->program);
+    }
+    bm->program = owner->program;
+    bm->program_size = owner->program_size;
+    bm->program_capacity = 0;
+    bm->program_owner = owner;
+    bm->debug_section = owner->debug_section;
+    bm->debug_section_size = owner->debug_section_size;
+    bm_program_changed(bm);
+
+    // bm_can_skip_checks() compares the proof against this VM's own stack
+    // capacity, so it holds whatever that is; not so for other natives
+    if (owner->verified && bm_natives_match(bm, owner)){
+        bm->verified = 1;
+        bm->stack_depth = owner->stack_depth;
+        bm->stack_depth_shared = 1;
+        bm->min_stack_size = owner->min_stack_size;
+        bm->max_stack_depth = owner->max_stack_depth;
+    }
+}
+
+// .bm files come in two formats:
+//
+// v1  the raw `Inst` array as laid out in memory (16 bytes per instruction
+//     on x86-64, ABI dependent). Recognized by the absence of the magic.
+//
+// v2  a 16 byte header
+//
+//         char     magic[4]     "BMBC"
+//         uint16_t version      2
+//         uint16_t flags
+//         uint64_t inst_count
+//
+//     (all little-endian) followed by `inst_count` instructions: one opcode
+//     byte, then the operand as a zigzag LEB128 varint for the opcodes that
+//     have one (see inst_type_has_operand()).
+//
+//     With BM_FILE_FLAG_FIXED every instruction is instead a 16 byte record
+//     of a uint32_t opcode, 4 zero bytes and an int64_t operand. That is the
+//     in-memory `Inst` on little-endian LP64 hosts, so bm_map_program_from_file()
+//     can run it without decoding.
+//
+//     With BM_FILE_FLAG_DEBUG the instructions are followed by the source
+//     locations of the program, up to the end of the file, all LEB128:
+//
+//         runs                        source lines as runs of consecutive lines
+//         runs x {delta, extra}       the next instruction is on the line
+//                                     `delta` (zigzag) after the previous one,
+//                                     the `extra` ones after it on the
+//                                     following lines
+//         labels
+//         labels x {addr, size, name} `addr` relative to the previous label,
+//                                     `size` bytes of name
+//
+//     Generated code has one instruction per line, so the lines mostly take
+//     a couple of bytes for the whole program.
+
+// Whether the operand of an instruction of this type means anything.
+// Returns -1 for types that don't exist.
+int inst_type_has_operand(Inst_Type type){
+    switch (type) {
+    case INST_PUSH:
+    case INST_DUP:
+    case INST_JMP:
+    case INST_JMP_IF:
+    case INST_PUSH_PLUS:
+    case INST_PUSH_MULT:
+    case INST_EQ_JMP_IF:
+    case INST_CALL:
+    case INST_RET:
+    case INST_LOAD_LOCAL:
+    case INST_STORE_LOCAL:
+    case INST_NATIVE:
+        return 1;
+    case INST_NOP:
+    case INST_PLUS:
+    case INST_MINUS:
+    case INST_MULT:
+    case INST_DIV:
+    case INST_EQ:
+    case INST_HALT:
+    case INST_PRINT_DEBUG:
+    case INST_DUP2_PLUS:
+    case INST_LOAD:
+    case INST_STORE:
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+static int bm_bytes_reserve(Bm_Bytes *bytes, size_t extra){
+    if (bytes->size + extra <= bytes->capacity){
+        return 0;
+    }
+    size_t new_capacity = bytes->capacity > 0 ? bytes->capacity : 4096;
+    while (new_capacity < bytes->size + extra){
+        new_capacity *= 2;
+    }
+    uint8_t *data = realloc(bytes->data, new_capacity);
+    if (data == NULL){
+        return -1;
+    }
+    bytes->data = data;
+    bytes->capacity = new_capacity;
+    return 0;
+}
+
+// The writers below expect bm_bytes_reserve() to have made room already.
+static void bm_bytes_u64(Bm_Bytes *bytes, uint64_t x, size_t width){
+    for (size_t i = 0; i < width; ++i){
+        bytes->data[bytes->size++] = (uint8_t) (x >> (8 * i));
+    }
+}
+
+static void bm_bytes_uvarint(Bm_Bytes *bytes, uint64_t x){
+    while (x >= 0x80){
+        bytes->data[bytes->size++] = (uint8_t) (x | 0x80);
+        x >>= 7;
+    }
+    bytes->data[bytes->size++] = (uint8_t) x;
+}
+
+static void bm_bytes_varint(Bm_Bytes *bytes, Word x){
+    bm_bytes_uvarint(bytes, ((uint64_t) x << 1) ^ (uint64_t) (x >> 63));
+}
+
+// Reads a LEB128 value at `*p`. Returns 0 if it is truncated or too big.
+static int bm_read_uvarint(const uint8_t **p, const uint8_t *end, uint64_t *x){
+    *x = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7){
+        if (*p >= end){
+            return 0;
+        }
+        const uint8_t byte = *(*p)++;
+        *x |= (uint64_t) (byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static uint64_t bm_read_le(const uint8_t *p, size_t width){
+    uint64_t x = 0;
+    for (size_t i = 0; i < width; ++i){
+        x |= (uint64_t) p[i] << (8 * i);
+    }
+    return x;
+}
+
+// Appends the BM_FILE_FLAG_DEBUG section for the `count` instructions
+// `debug` describes. Returns 0 if out of memory.
+static int bm_debug_encode(const Bm_Debug *debug, Word count, Bm_Bytes *out){
+    uint64_t runs = 0;
+    for (Word i = 0; i < count; ++runs){
+        for (++i; i < count && debug->lines[i] == debug->lines[i - 1] + 1; ++i);
+    }
+    if (bm_bytes_reserve(out, 10) < 0){
+        return 0;
+    }
+    bm_bytes_uvarint(out, runs);
+
+    Word line = 0;
+    for (Word i = 0; i < count;){
+        const Word start = i;
+        for (++i; i < count && debug->lines[i] == debug->lines[i - 1] + 1; ++i);
+        if (bm_bytes_reserve(out, 20) < 0){
+            return 0;
+        }
+        bm_bytes_varint(out, debug->lines[start] - line);
+        bm_bytes_uvarint(out, (uint64_t) (i - start - 1));
+        line = debug->lines[i - 1];
+    }
+
+    if (bm_bytes_reserve(out, 10) < 0){
+        return 0;
+    }
+    bm_bytes_uvarint(out, debug->labels_size);
+
+    Word addr = 0;
+    for (size_t i = 0; i < debug->labels_size; ++i){
+        const Bm_Debug_Label *label = &debug->labels[i];
+        const size_t name_size = strlen(label->name);
+        if (bm_bytes_reserve(out, 20 + name_size) < 0){
+            return 0;
+        }
+        bm_bytes_uvarint(out, (uint64_t) (label->addr - addr));
+        bm_bytes_uvarint(out, name_size);
+        memcpy(out->data + out->size, label->name, name_size);
+        out->size += name_size;
+        addr = label->addr;
+    }
+    return 1;
+}
+
+// Decodes a BM_FILE_FLAG_DEBUG section for `count` instructions. Returns
+// NULL if it is malformed or does not fit into memory.
+static Bm_Debug *bm_debug_decode(const uint8_t *data, size_t size, Word count){
+    const uint8_t *p = data;
+    const uint8_t *const end = data + size;
+
+    Bm_Debug *debug = calloc(1, sizeof(*debug));
+    if (debug == NULL){
+        return NULL;
+    }
+    debug->lines_capacity = count + 1;
+    debug->lines = malloc(sizeof(debug->lines[0]) * debug->lines_capacity);
+    if (debug->lines == NULL){
+        goto fail;
+    }
+
+    uint64_t runs = 0;
+    if (!bm_read_uvarint(&p, end, &runs)){
+        goto fail;
+    }
+    Word addr = 0;
+    uint64_t line = 0;
+    for (uint64_t r = 0; r < runs; ++r){
+        uint64_t delta = 0;
+        uint64_t extra = 0;
+        if (!bm_read_uvarint(&p, end, &delta) || !bm_read_uvarint(&p, end, &extra) ||
+            addr >= count || extra >= (uint64_t) (count - addr)){
+            goto fail;
+        }
+        line += (delta >> 1) ^ -(delta & 1);
+        debug->lines[addr++] = (Word) line;
+        for (uint64_t i = 0; i < extra; ++i){
+            debug->lines[addr++] = (Word) ++line;
+        }
+    }
+    if (addr != count){
+        goto fail;
+    }
+
+    uint64_t labels_size = 0;
+    if (!bm_read_uvarint(&p, end, &labels_size) || labels_size > size){
+        goto fail;
+    }
+    debug->labels = malloc(sizeof(debug->labels[0]) * (labels_size + 1));
+    debug->names = malloc(size + labels_size + 1);
+    if (debug->labels == NULL || debug->names == NULL){
+        goto fail;
+    }
+
+    char *name = debug->names;
+    addr = 0;
+    for (; debug->labels_size < labels_size; ++debug->labels_size){
+        uint64_t delta = 0;
+        uint64_t name_size = 0;
+        if (!bm_read_uvarint(&p, end, &delta) || !bm_read_uvarint(&p, end, &name_size) ||
+            delta > (uint64_t) (count - addr) || name_size > (uint64_t) (end - p)){
+            goto fail;
+        }
+        addr += (Word) delta;
+        memcpy(name, p, name_size);
+        name[name_size] = '\0';
+        debug->labels[debug->labels_size] = (Bm_Debug_Label) {.addr = addr, .name = name};
+        name += name_size + 1;
+        p += name_size;
+    }
+
+    if (p != end){
+        goto fail;
+    }
+    return debug;
+
+fail:
+    bm_debug_free(debug);
+    return NULL;
+}
+
+// The source locations of the program, decoding the file's debug section
+// the first time they are asked for. NULL if there are none.
+static const Bm_Debug *bm_debug_info(Bm *bm){
+    if (bm->debug != NULL){
+        return bm->debug;
+    }
+    if (bm->debug_section != NULL && !bm->debug_failed){
+        bm->debug = bm_debug_decode(bm->debug_section, bm->debug_section_size, bm->program_size);
+        bm->debug_failed = bm->debug == NULL;
+        return bm->debug;
+    }
+    return bm->program_owner != NULL ? bm->program_owner->debug : NULL;
+}
+
+// Leaves the source locations in `bm->debug`, owned by `bm`, before the
+// program is edited: the encoded section and the owner's copy both describe
+// the program as it was.
+static void bm_debug_detach(Bm *bm){
+    const Bm_Debug *debug = bm_debug_info(bm);
+    if (debug != NULL && debug != bm->debug){
+        Bm_Bytes bytes = {0};
+        if (bm_debug_encode(debug, bm->program_size, &bytes)){
+            bm->debug = bm_debug_decode(bytes.data, bytes.size, bm->program_size);
+        }
+        free(bytes.data);
+    }
+    free(bm->debug_section_owned);
+    bm->debug_section = NULL;
+    bm->debug_section_size = 0;
+    bm->debug_section_owned = NULL;
+}
+
+int bm_source_location(Bm *bm, Word addr, Word *line, const char **label){
+    const Bm_Debug *debug = bm_debug_info(bm);
+    if (debug == NULL || addr < 0 || addr >= bm->program_size){
+        return 0;
+    }
+
+    *line = debug->lines[addr];
+
+    // the last label at or before `addr`
+    size_t lo = 0;
+    size_t hi = debug->labels_size;
+    while (lo < hi){
+        const size_t mid = lo + (hi - lo) / 2;
+        if (debug->labels[mid].addr <= addr){
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    *label = lo > 0 ? debug->labels[lo - 1].name : NULL;
+    return 1;
+}
+
+// Whether an `Inst` in memory is exactly a BM_FILE_FLAG_FIXED record.
+static int bm_fixed_layout_is_native(void){
+    const uint16_t one = 1;
+    return sizeof(Inst) == BM_FILE_FIXED_INST_SIZE && sizeof(Inst_Type) == 4 &&
+           offsetof(Inst, operand) == 8 && *(const uint8_t *) &one == 1;
+}
+
+// Encodes the program in the v2 format, with BM_FILE_FLAG_FIXED records if
+// `flags` has it. Returns ERR_ILLEGAL_INST with the index in `*bad_inst` (if
+// not NULL) for an instruction that has no opcode, or ERR_OUT_OF_MEMORY.
+// BM_FILE_FLAG_DEBUG appends the source locations, ERR_ILLEGAL_OPERAND if
+// the program has none.
+Err bm_encode_program(const Bm *bm, Bm_Bytes *out, uint16_t flags, Word *bad_inst){
+    const int fixed = (flags & BM_FILE_FLAG_FIXED) != 0;
+    const Bm_Debug *debug = bm->debug != NULL ? bm->debug
+        : bm->program_owner != NULL ? bm->program_owner->debug : NULL;
+    if ((flags & BM_FILE_FLAG_DEBUG) != 0 && debug == NULL && bm->debug_section == NULL){
+        return ERR_ILLEGAL_OPERAND;
+    }
+    // the most a single instruction can take: a 16 byte record, or an opcode
+    // and a 10 byte varint
+    const size_t max_inst_size = BM_FILE_FIXED_INST_SIZE;
+
+    out->size = 0;
+    if (bm_bytes_reserve(out, BM_FILE_HEADER_SIZE + bm->program_size * (fixed ? BM_FILE_FIXED_INST_SIZE : 2)) < 0){
+        return ERR_OUT_OF_MEMORY;
+    }
+    memcpy(out->data, BM_FILE_MAGIC, BM_FILE_MAGIC_SIZE);
+    out->size = BM_FILE_MAGIC_SIZE;
+    bm_bytes_u64(out, BM_FILE_VERSION, 2);
+    bm_bytes_u64(out, flags, 2);
+    bm_bytes_u64(out, (uint64_t) bm->program_size, 8);
+
+    for (Word i = 0; i < bm->program_size; ++i){
+        const Inst inst = bm->program[i];
+        const int has_operand = inst_type_has_operand(inst.type);
+        if (has_operand < 0){
+            if (bad_inst){
+                *bad_inst = i;
+            }
+            return ERR_ILLEGAL_INST;
+        }
+
+        if (bm_bytes_reserve(out, max_inst_size) < 0){
+            return ERR_OUT_OF_MEMORY;
+        }
+
+        if (fixed){
+            bm_bytes_u64(out, (uint64_t) inst.type, 4);
+            bm_bytes_u64(out, 0, 4);
+            bm_bytes_u64(out, has_operand ? (uint64_t) inst.operand : 0, 8);
+            continue;
+        }
+
+        out->data[out->size++] = (uint8_t) inst.type;
+        if (has_operand){
+            bm_bytes_varint(out, inst.operand);
+        }
+    }
+
+    if ((flags & BM_FILE_FLAG_DEBUG) != 0){
+        // a section nobody asked for yet is copied as it is
+        if (debug != NULL){
+            if (!bm_debug_encode(debug, bm->program_size, out)){
+                return ERR_OUT_OF_MEMORY;
+            }
+        } else {
+            if (bm_bytes_reserve(out, bm->debug_section_size) < 0){
+                return ERR_OUT_OF_MEMORY;
+            }
+            memcpy(out->data + out->size, bm->debug_section, bm->debug_section_size);
+            out->size += bm->debug_section_size;
+        }
+    }
+
+    return ERR_OK;
+}
+
+// Decodes a v2 program into `bm`. Returns ERR_BAD_FORMAT if the data is not
+// one, or ERR_OUT_OF_MEMORY. A debug section is kept as it is and only
+// decoded by bm_source_location().
+Err bm_decode_program(Bm *bm, const uint8_t *data, size_t size){
+    if (size < BM_FILE_HEADER_SIZE || memcmp(data, BM_FILE_MAGIC, BM_FILE_MAGIC_SIZE) != 0){
+        return bm_fail(bm, ERR_BAD_FORMAT, "not a v2 .bm file");
+    }
+
+    if (bm_read_le(data + 4, 2) != BM_FILE_VERSION){
+        return bm_fail(bm, ERR_BAD_FORMAT, "unsupported .bm version");
+    }
+
+    const uint64_t flags = bm_read_le(data + 6, 2);
+    if ((flags & ~(uint64_t) (BM_FILE_FLAG_FIXED | BM_FILE_FLAG_DEBUG)) != 0){
+        return bm_fail(bm, ERR_BAD_FORMAT, "unsupported .bm flags");
+    }
+    const int fixed = (flags & BM_FILE_FLAG_FIXED) != 0;
+
+    // every instruction takes at least one byte
+    const uint64_t count = bm_read_le(data + 8, 8);
+    if (count > (size - BM_FILE_HEADER_SIZE) / (fixed ? BM_FILE_FIXED_INST_SIZE : 1)){
+        return bm_fail(bm, ERR_BAD_FORMAT, "instruction count exceeds file size");
+    }
+
+    bm_release_program(bm);
+    if (bm_reserve_program(bm, (Word) count) < 0){
+        return bm_fail(bm, ERR_OUT_OF_MEMORY, "program of %lu instructions does not fit into the VM", (unsigned long) count);
+    }
+
+    // the old program is gone from here on, even if decoding fails
+    bm->program_size = 0;
+    bm_program_changed(bm);
+
+    const uint8_t *p = data + BM_FILE_HEADER_SIZE;
+    const uint8_t *const end = data + size;
+    uint64_t i = 0;
+    if (fixed && bm_fixed_layout_is_native()){
+        memcpy(bm->program, p, count * BM_FILE_FIXED_INST_SIZE);
+        for (; i < count; ++i){
+            if (inst_type_has_operand(bm->program[i].type) < 0){
+                return bm_fail(bm, ERR_BAD_FORMAT, "unknown opcode");
+            }
+        }
+        p += count * BM_FILE_FIXED_INST_SIZE;
+    }
+    for (; i < count; ++i){
+        if (fixed){
+            const Inst_Type type = (Inst_Type) bm_read_le(p, 4);
+            if (inst_type_has_operand(type) < 0){
+                return bm_fail(bm, ERR_BAD_FORMAT, "unknown opcode");
+            }
+            bm->program[i] = (Inst) {.type = type, .operand = (Word) bm_read_le(p + 8, 8)};
+            p += BM_FILE_FIXED_INST_SIZE;
+            continue;
+        }
+
+        if (p >= end){
+            return bm_fail(bm, ERR_BAD_FORMAT, "truncated instruction");
+        }
+
+        const Inst_Type type = *p++;
+        const int has_operand = inst_type_has_operand(type);
+        if (has_operand < 0){
+            return bm_fail(bm, ERR_BAD_FORMAT, "unknown opcode");
+        }
+
+        Word operand = 0;
+        if (has_operand){
+            uint64_t zigzag = 0;
+            unsigned shift = 0;
+            for (;;){
+                if (p >= end){
+                    return bm_fail(bm, ERR_BAD_FORMAT, "truncated operand");
+                }
+                if (shift >= 64){
+                    return bm_fail(bm, ERR_BAD_FORMAT, "operand does not fit into 64 bits");
+                }
+                const uint8_t byte = *p++;
+                zigzag |= (uint64_t) (byte & 0x7F) << shift;
+                shift += 7;
+                if ((byte & 0x80) == 0){
+                    break;
+                }
+            }
+            operand = (Word) (zigzag >> 1) ^ -(Word) (zigzag & 1);
+        }
+
+        bm->program[i] = (Inst) {.type = type, .operand = operand};
+    }
+
+    if ((flags & BM_FILE_FLAG_DEBUG) != 0 && p < end){
+        bm->debug_section_owned = malloc(end - p);
+        if (bm->debug_section_owned == NULL){
+            return bm_fail(bm, ERR_OUT_OF_MEMORY, "debug section of %lu bytes does not fit into memory",
+                           (unsigned long) (end - p));
+        }
+        memcpy(bm->debug_section_owned, p, end - p);
+        bm->debug_section = bm->debug_section_owned;
+        bm->debug_section_size = end - p;
+    } else if (p != end){
+        return bm_fail(bm, ERR_BAD_FORMAT, "trailing bytes after the last instruction");
+    }
+
+    bm->program_size = (Word) count;
+    return ERR_OK;
+}
+
+// Loads a .bm file by mapping it instead of reading it. v1 files, and v2
+// files with BM_FILE_FLAG_FIXED records on hosts where that is the `Inst`
+// layout, run straight out of the mapping: loading is one mmap() regardless
+// of size, pages are faulted in as execution reaches them and are shared by
+// every process running the same file. A debug section stays in the mapping
+// and its pages are only touched if bm_source_location() needs them. Opcodes are not looked at here; the
+// engines report ERR_ILLEGAL_INST when they reach a bad one, or run
+// bm_verify_program() to check everything up front. Compact v2 files are
+// decoded from the mapping.
+//
+// Returns ERR_IO (with errno set) if the file can't be opened or mapped,
+// ERR_BAD_FORMAT if it is not a valid .bm file and ERR_OUT_OF_MEMORY if a
+// decoded program does not fit. A failure may leave the VM without a program.
+Err bm_map_program_from_file(Bm *bm, const char *file_path){
+    const int fd = open(file_path, O_RDONLY);
+    if (fd < 0){
+        return bm_fail(bm, ERR_IO, "%s", strerror(errno));
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0){
+        const int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return bm_fail(bm, ERR_IO, "%s", strerror(errno));
+    }
+
+    const size_t size = st.st_size;
+    if (size == 0){
+        close(fd);
+        bm_release_program(bm);
+        bm->program_size = 0;
+        bm_program_changed(bm);
+        return ERR_OK;
+    }
+
+    // writable but private, so passes that patch the program in place only
+    // copy the pages they touch
+    uint8_t *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    const int saved_errno = errno;
+    close(fd);
+    if (data == MAP_FAILED){
+        errno = saved_errno;
+        return bm_fail(bm, ERR_IO, "%s", strerror(errno));
+    }
+
+    Inst *program = NULL;
+    Word program_size = 0;
+    const uint8_t *debug_section = NULL;
+    size_t debug_section_size = 0;
+    if (size >= BM_FILE_MAGIC_SIZE && memcmp(data, BM_FILE_MAGIC, BM_FILE_MAGIC_SIZE) == 0){
+        const size_t body_size = size >= BM_FILE_HEADER_SIZE ? size - BM_FILE_HEADER_SIZE : 0;
+        const uint64_t count = size >= BM_FILE_HEADER_SIZE ? bm_read_le(data + 8, 8) : 0;
+        const uint64_t flags = size >= BM_FILE_HEADER_SIZE ? bm_read_le(data + 6, 2) : 0;
+        const int zero_copy = size >= BM_FILE_HEADER_SIZE &&
+            bm_read_le(data + 4, 2) == BM_FILE_VERSION &&
+            (flags & ~(uint64_t) BM_FILE_FLAG_DEBUG) == BM_FILE_FLAG_FIXED &&
+            (flags == BM_FILE_FLAG_FIXED
+                ? body_size % BM_FILE_FIXED_INST_SIZE == 0 && count == body_size / BM_FILE_FIXED_INST_SIZE
+                : count <= body_size / BM_FILE_FIXED_INST_SIZE) &&
+            bm_fixed_layout_is_native();
+
+        if (!zero_copy){
+            const Err err = bm_decode_program(bm, data, size);
+            munmap(data, size);
+            return err;
+        }
+
+        program = (Inst *) (data + BM_FILE_HEADER_SIZE);
+        program_size = (Word) count;
+        debug_section = data + BM_FILE_HEADER_SIZE + count * BM_FILE_FIXED_INST_SIZE;
+        debug_section_size = size - BM_FILE_HEADER_SIZE - count * BM_FILE_FIXED_INST_SIZE;
+    } else {
+        if (size % sizeof(program[0]) != 0){
+            munmap(data, size);
+            return bm_fail(bm, ERR_BAD_FORMAT, "not a .bm file");
+        }
+        program = (Inst *) data;
+        program_size = size / sizeof(program[0]);
+    }
+
+    bm_release_program(bm);
+    if (bm->arena == NULL){
+        free(bm->program);
+    }
+    bm->mapping = data;
+    bm->mapping_size = size;
+    bm->program = program;
+    bm->program_size = program_size;
+    bm->program_capacity = program_size;
+    if (debug_section_size > 0){
+        bm->debug_section = debug_section;
+        bm->debug_section_size = debug_section_size;
+    }
+    bm_program_changed(bm);
+    return ERR_OK;
+}
+
+// Reads a .bm file in any format. Returns ERR_IO (with errno set),
+// ERR_BAD_FORMAT or ERR_OUT_OF_MEMORY; see bm_error_message().
+Err bm_load_program_from_file(Bm *bm, const char *file_path){
+    bm_release_program(bm);
+
+    FILE *f = fopen(file_path, "rb"); 
+    if (f == NULL){
+        return bm_fail(bm, ERR_IO, "%s", strerror(errno));
+    }
+
+    Err err = ERR_OK;
+    uint8_t *data = NULL;
+    long m = 0;
+    if (fseek(f, 0, SEEK_END) < 0 || (m = ftell(f)) < 0 || fseek(f, 0, SEEK_SET) < 0){
+        err = bm_fail(bm, ERR_IO, "%s", strerror(errno));
+        goto close;
+    }
+
+    char magic[BM_FILE_MAGIC_SIZE] = {0};
+    const size_t magic_size = fread(magic, 1, sizeof(magic), f);
+    if (ferror(f) || fseek(f, 0, SEEK_SET) < 0){
+        err = bm_fail(bm, ERR_IO, "%s", strerror(errno));
+        goto close;
+    }
+
+    if (magic_size == BM_FILE_MAGIC_SIZE && memcmp(magic, BM_FILE_MAGIC, BM_FILE_MAGIC_SIZE) == 0){
+        data = malloc(m);
+        if (data == NULL){
+            err = bm_fail(bm, ERR_OUT_OF_MEMORY, "file of %ld bytes does not fit into memory", m);
+            goto close;
+        }
+
+        const size_t n = fread(data, 1, m, f);
+        if (ferror(f)){
+            err = bm_fail(bm, ERR_IO, "%s", strerror(errno));
+            goto close;
+        }
+
+        err = bm_decode_program(bm, data, n);
+        goto close;
+    }
+
+    if (m % sizeof(bm->program[0]) != 0){
+        err = bm_fail(bm, ERR_BAD_FORMAT, "not a .bm file");
+        goto close;
+    }
+
+    if (bm_reserve_program(bm, m / sizeof(bm->program[0])) < 0){
+        err = bm_fail(bm, ERR_OUT_OF_MEMORY, "program of %ld instructions does not fit into the VM",
+                      (long) (m / sizeof(bm->program[0])));
+        goto close;
+    }
+
+    bm->program_size = fread(bm->program, sizeof(bm->program[0]), m/sizeof(bm->program[0]), f); 
+    bm_program_changed(bm);
+    if (ferror(f)){
+        err = bm_fail(bm, ERR_IO, "%s", strerror(errno));
+    }
+
+close:
+    free(data);
+    fclose(f); 
+    return err;
+}
+
+static Err bm_save_program(const Bm *bm, const char *file_path, Bm_File_Format format, uint16_t flags){
+    if (format != BM_FORMAT_V1 && format != BM_FORMAT_V2 && format != BM_FORMAT_V2_FIXED){
+        return ERR_ILLEGAL_OPERAND;
+    }
+    if (format == BM_FORMAT_V1 && flags != 0){
+        return ERR_ILLEGAL_OPERAND;
+    }
+
+    Bm_Bytes bytes = {0};
+    if (format != BM_FORMAT_V1){
+        flags |= format == BM_FORMAT_V2_FIXED ? BM_FILE_FLAG_FIXED : 0;
+        const Err err = bm_encode_program(bm, &bytes, flags, NULL);
+        if (err != ERR_OK){
+            free(bytes.data);
+            return err;
+        }
+    }
+
+    FILE *f = fopen(file_path, "wb"); 
+    if (f == NULL){
+        free(bytes.data);
+        return ERR_IO;
+    }
+
+    if (format == BM_FORMAT_V1){
+        fwrite(bm->program, sizeof(bm->program[0]), bm->program_size, f); 
+    } else {
+        fwrite(bytes.data, 1, bytes.size, f);
+    }
+    free(bytes.data);
+
+    if (ferror(f)){
+        const int saved_errno = errno;
+        fclose(f);
+        errno = saved_errno;
+        return ERR_IO;
+    }
+    return fclose(f) == 0 ? ERR_OK : ERR_IO;
+}
+
+// Returns ERR_IO (with errno set), the error of bm_encode_program(), or
+// ERR_ILLEGAL_OPERAND for a `format` that doesn't exist.
+Err bm_save_program_to_file_as(const Bm *bm, const char *file_path, Bm_File_Format format){
+    return bm_save_program(bm, file_path, format, 0);
+}
+
+// Like bm_save_program_to_file_as() with a debug section. Returns
+// ERR_ILLEGAL_OPERAND for BM_FORMAT_V1 or a program without source locations.
+Err bm_save_program_to_file_with_debug(const Bm *bm, const char *file_path, Bm_File_Format format){
+    return bm_save_program(bm, file_path, format, BM_FILE_FLAG_DEBUG);
+}
+
+Err bm_save_program_to_file(const Bm *bm, const char *file_path){
+    return bm_save_program_to_file_as(bm, file_path, BM_FORMAT_V2);
+}
+
+// Snapshots (.bmss) hold the state of a VM but not its program:
+//
+//     char     magic[4]        "BMSS"
+//     uint16_t version         1
+//     uint16_t flags           BM_SNAPSHOT_FLAG_HALT, BM_SNAPSHOT_FLAG_CALLS
+//     uint64_t program_hash    bm_program_hash() of the program
+//     uint64_t program_size
+//     int64_t  ip
+//     uint64_t inst_count      bm_inst_count()
+//     uint64_t stack_size
+//
+// (all little-endian) followed by the `stack_size` live values of the stack,
+// bottom first, as int64_t. The header is a multiple of 8 bytes, so the
+// stack is aligned in a mapping of the file. With BM_SNAPSHOT_FLAG_CALLS,
+// which is only set if there is something to keep, the stack is followed by
+//
+//     int64_t  fp
+//     uint64_t frames_size
+//     int64_t  frames[frames_size][2]   return_ip, fp; outermost first
+//     uint64_t memory_size             up to the last word that isn't 0
+//     int64_t  memory[memory_size]
+
+uint64_t bm_program_hash(Bm *bm){
+    if (!bm->program_hashed){
+        // FNV-1a, a word at a time
+        uint64_t h = 0xcbf29ce484222325ULL;
+        for (Word i = 0; i < bm->program_size; ++i){
+            h = (h ^ (uint64_t) bm->program[i].type) * 0x100000001b3ULL;
+            h = (h ^ (uint64_t) bm->program[i].operand) * 0x100000001b3ULL;
+        }
+        bm->program_hash = h ^ (uint64_t) bm->program_size;
+        bm->program_hashed = 1;
+    }
+    return bm->program_hash;
+}
+
+Err bm_encode_snapshot(Bm *bm, Bm_Bytes *out){
+    Word memory_used = bm->memory_size;
+    while (memory_used > 0 && bm->memory[memory_used - 1] == 0){
+        memory_used -= 1;
+    }
+    const int calls = bm->frames_size > 0 || bm->fp != 0 || memory_used > 0;
+    const size_t calls_size = calls ? sizeof(Word) * (3 + 2 * bm->frames_size + memory_used) : 0;
+    if (bm_bytes_reserve(out, BM_SNAPSHOT_HEADER_SIZE + sizeof(Word) * bm->stack_size + calls_size) < 0){
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    memcpy(out->data + out->size, BM_SNAPSHOT_MAGIC, BM_FILE_MAGIC_SIZE);
+    out->size += BM_FILE_MAGIC_SIZE;
+    bm_bytes_u64(out, BM_SNAPSHOT_VERSION, 2);
+    bm_bytes_u64(out, (bm->halt ? BM_SNAPSHOT_FLAG_HALT : 0) | (calls ? BM_SNAPSHOT_FLAG_CALLS : 0), 2);
+    bm_bytes_u64(out, bm_program_hash(bm), 8);
+    bm_bytes_u64(out, (uint64_t) bm->program_size, 8);
+    bm_bytes_u64(out, (uint64_t) bm->ip, 8);
+    bm_bytes_u64(out, (uint64_t) bm->inst_count, 8);
+    bm_bytes_u64(out, (uint64_t) bm->stack_size, 8);
+    for (Word i = 0; i < bm->stack_size; ++i){
+        bm_bytes_u64(out, (uint64_t) bm->stack[i], 8);
+    }
+    if (calls){
+        bm_bytes_u64(out, (uint64_t) bm->fp, 8);
+        bm_bytes_u64(out, (uint64_t) bm->frames_size, 8);
+        for (Word i = 0; i < bm->frames_size; ++i){
+            bm_bytes_u64(out, (uint64_t) bm->frames[i].return_ip, 8);
+            bm_bytes_u64(out, (uint64_t) bm->frames[i].fp, 8);
+        }
+        bm_bytes_u64(out, (uint64_t) memory_used, 8);
+        for (Word i = 0; i < memory_used; ++i){
+            bm_bytes_u64(out, (uint64_t) bm->memory[i], 8);
+        }
+    }
+    return ERR_OK;
+}
+
+Err bm_restore_snapshot(Bm *bm, const uint8_t *data, size_t size){
+    if (size < BM_SNAPSHOT_HEADER_SIZE || memcmp(data, BM_SNAPSHOT_MAGIC, BM_FILE_MAGIC_SIZE) != 0){
+        return bm_fail(bm, ERR_BAD_FORMAT, "not a .bmss snapshot");
+    }
+    if (bm_read_le(data + 4, 2) != BM_SNAPSHOT_VERSION){
+        return bm_fail(bm, ERR_BAD_FORMAT, "unsupported snapshot version");
+    }
+
+    const uint64_t flags = bm_read_le(data + 6, 2);
+    if ((flags & ~(uint64_t) (BM_SNAPSHOT_FLAG_HALT | BM_SNAPSHOT_FLAG_CALLS)) != 0){
+        return bm_fail(bm, ERR_BAD_FORMAT, "unsupported snapshot flags");
+    }
+
+    // the file in words past the header: the stack, then the frames and
+    // the memory, each after its size
+    const uint64_t words = (size - BM_SNAPSHOT_HEADER_SIZE) / sizeof(Word);
+    const uint64_t stack_size = bm_read_le(data + 40, 8);
+    uint64_t fp = 0, frames_size = 0, memory_used = 0;
+    const uint8_t *frames = NULL;
+    const uint8_t *memory = NULL;
+    if (flags & BM_SNAPSHOT_FLAG_CALLS){
+        if (stack_size > words || words - stack_size < 3){
+            return bm_fail(bm, ERR_BAD_FORMAT, "truncated snapshot");
+        }
+        const uint8_t *p = data + BM_SNAPSHOT_HEADER_SIZE + sizeof(Word) * stack_size;
+        fp = bm_read_le(p, 8);
+        frames_size = bm_read_le(p + 8, 8);
+        if (frames_size > (words - stack_size - 3) / 2){
+            return bm_fail(bm, ERR_BAD_FORMAT, "truncated snapshot");
+        }
+        frames = p + 16;
+        memory_used = bm_read_le(frames + 16 * frames_size, 8);
+        memory = frames + 16 * frames_size + 8;
+        if (memory_used != words - stack_size - 3 - 2 * frames_size){
+            return bm_fail(bm, ERR_BAD_FORMAT, "sizes do not match the file size");
+        }
+    } else if (stack_size != words){
+        return bm_fail(bm, ERR_BAD_FORMAT, "stack size does not match the file size");
+    }
+    if ((size - BM_SNAPSHOT_HEADER_SIZE) % sizeof(Word) != 0){
+        return bm_fail(bm, ERR_BAD_FORMAT, "stack size does not match the file size");
+    }
+
+    if (bm_read_le(data + 16, 8) != (uint64_t) bm->program_size ||
+        bm_read_le(data + 8, 8) != bm_program_hash(bm)){
+        return bm_fail(bm, ERR_BAD_FORMAT, "snapshot of a different program");
+    }
+
+    if (stack_size > (uint64_t) bm->stack_capacity){
+        return bm_fail(bm, ERR_STACK_OVERFLOW, "snapshot has %lu values on the stack, the VM holds %ld",
+                       (unsigned long) stack_size, bm->stack_capacity);
+    }
+    if (frames_size > (uint64_t) bm->frames_capacity){
+        return bm_fail(bm, ERR_STACK_OVERFLOW, "snapshot has %lu call frames, the VM holds %ld",
+                       (unsigned long) frames_size, bm->frames_capacity);
+    }
+    // frame pointers index the stack, so they must stay within it
+    if (fp > (uint64_t) bm->stack_capacity){
+        return bm_fail(bm, ERR_BAD_FORMAT, "frame pointer outside of the stack");
+    }
+    for (uint64_t i = 0; i < frames_size; ++i){
+        if (bm_read_le(frames + 16 * i + 8, 8) > (uint64_t) bm->stack_capacity){
+            return bm_fail(bm, ERR_BAD_FORMAT, "frame pointer outside of the stack");
+        }
+    }
+    if (memory_used > (uint64_t) bm->memory_size){
+        return bm_fail(bm, ERR_ILLEGAL_MEMORY_ACCESS, "snapshot has %lu words of memory, the VM has %ld",
+                       (unsigned long) memory_used, bm->memory_size);
+    }
+
+    const uint8_t *p = data + BM_SNAPSHOT_HEADER_SIZE;
+    if (bm_fixed_layout_is_native()){
+        memcpy(bm->stack, p, sizeof(Word) * stack_size);
+    } else {
+        for (uint64_t i = 0; i < stack_size; ++i){
+            bm->stack[i] = (Word) bm_read_le(p + sizeof(Word) * i, 8);
+        }
+    }
+    bm->stack_size = (Word) stack_size;
+    bm->fp = (Word) fp;
+    bm->frames_size = (Word) frames_size;
+    for (uint64_t i = 0; i < frames_size; ++i){
+        bm->frames[i].return_ip = (Word) bm_read_le(frames + 16 * i, 8);
+        bm->frames[i].fp = (Word) bm_read_le(frames + 16 * i + 8, 8);
+    }
+    for (uint64_t i = 0; i < memory_used; ++i){
+        bm->memory[i] = (Word) bm_read_le(memory + sizeof(Word) * i, 8);
+    }
+    if (bm->memory_size > (Word) memory_used){
+        memset(bm->memory + memory_used, 0, sizeof(Word) * (bm->memory_size - memory_used));
+    }
+    bm->ip = (Word) bm_read_le(data + 24, 8);
+    bm->inst_count = (Word) bm_read_le(data + 32, 8);
+    bm->halt = (flags & BM_SNAPSHOT_FLAG_HALT) != 0;
+    return ERR_OK;
+}
+
+Err bm_save_snapshot(Bm *bm, const char *file_path){
+    Bm_Bytes bytes = {0};
+    const Err err = bm_encode_snapshot(bm, &bytes);
+    if (err != ERR_OK){
+        return bm_fail(bm, err, "snapshot of %ld values does not fit into memory", bm->stack_size);
+    }
+
+    FILE *f = fopen(file_path, "wb");
+    if (f == NULL){
+        free(bytes.data);
+        return bm_fail(bm, ERR_IO, "%s", strerror(errno));
+    }
+    fwrite(bytes.data, 1, bytes.size, f);
+    free(bytes.data);
+
+    if (ferror(f)){
+        const int saved_errno = errno;
+        fclose(f);
+        errno = saved_errno;
+        return bm_fail(bm, ERR_IO, "%s", strerror(errno));
+    }
+    if (fclose(f) != 0){
+        return bm_fail(bm, ERR_IO, "%s", strerror(errno));
+    }
+    return ERR_OK;
+}
+
+Err bm_load_snapshot(Bm *bm, const char *file_path){
+    const int fd = open(file_path, O_RDONLY);
+    if (fd < 0){
+        return bm_fail(bm, ERR_IO, "%s", strerror(errno));
+    }
+
+    Err err = ERR_OK;
+    uint8_t *data = NULL;
+    struct stat st;
+    if (fstat(fd, &st) < 0){
+        err = bm_fail(bm, ERR_IO, "%s", strerror(errno));
+        goto close;
+    }
+
+    // refuse what can't fit before reading it
+    const size_t size = st.st_size;
+    if (size < BM_SNAPSHOT_HEADER_SIZE){
+        err = bm_fail(bm, ERR_BAD_FORMAT, "not a .bmss snapshot");
+        goto close;
+    }
+    // the stack, the frames, the memory and their sizes
+    const uint64_t most = (uint64_t) bm->stack_capacity + 3 + 2 * (uint64_t) bm->frames_capacity + (uint64_t) bm->memory_size;
+    if ((size - BM_SNAPSHOT_HEADER_SIZE) / sizeof(Word) > most){
+        err = bm_fail(bm, ERR_STACK_OVERFLOW, "snapshot of %zu bytes is larger than the state of the VM", size);
+        goto close;
+    }
+
+    data = malloc(size);
+    if (data == NULL){
+        err = bm_fail(bm, ERR_OUT_OF_MEMORY, "snapshot of %zu bytes does not fit into memory", size);
+        goto close;
+    }
+
+    // one read for anything but pipes and signals
+    size_t n = 0;
+    while (n < size){
+        const ssize_t r = read(fd, data + n, size - n);
+        if (r < 0 && errno == EINTR){
+            continue;
+        }
+        if (r < 0){
+            err = bm_fail(bm, ERR_IO, "%s", strerror(errno));
+            goto close;
+        }
+        if (r == 0){
+            break;
+        }
+        n += (size_t) r;
+    }
+
+    err = bm_restore_snapshot(bm, data, n);
+
+close:
+    free(data);
+    close(fd);
+    return err;
+}
+
+// Bm bm = {0}; 
+
+// char *source_code = 
+//     "push 0\n" 
+//     "push 1\n" 
+//     "dup 1\n" 
+//     "dup 1\n" 
+//     "plus\n" 
+//     "jmp 2\n";
+
+String_View cstr_as_sv(const char *cstr){
+    return (String_View){
+        .count = strlen(cstr),
+        .data = cstr,
+    };
+}
+
+String_View sv_trim_left(String_View sv){
+
+    size_t i = 0; 
+    while (i < sv.count && isspace(sv.data[i])){
+        i += 1;
+    }
+
+    return (String_View) {
+            .count = sv.count - i,
+            .data = sv.data + i,
+    };
+}
+
+String_View sv_trim_right(String_View sv){
+
+    size_t i = 0; 
+    while (i < sv.count && isspace(sv.data [sv.count - i - 1])){
+        i += 1;
+    }
+
+    return (String_View) {
+            .count = sv.count - i,
+            .data = sv.data,
+    };
+}
+
+String_View sv_trim(String_View sv){
+    return sv_trim_right(sv_trim_left(sv)); 
+}
+
+String_View sv_chop_by_delim(String_View *sv, char delim){
+
+    size_t i = 0;
+    while (i < sv->count && sv->data[i] != delim){
+        i += 1; 
+    }
+
+    String_View result = { 
+        .count = i,
+        .data = sv->data,
+    };
+
+    if (i < sv->count){
+        sv->count -= i + 1;
+        sv->data += i + 1;
+    } else {
+        sv->count -= i;
+        sv->data -= i;
+    }
 
     return result; 
 
 }
 
-int sv_eq(String_View a, String_View b) {
+int sv_eq(String_View a, String_View b) {
+
+    if (a.count != b.count){
+        return 0;
+    } else {
+        return memcmp(a.data, b.data, a.count) == 0; 
+    }
+
+}
+
+// Reads `sv` as a decimal number, optionally negative. Returns 0 if it is
+// empty, has anything but the digits after the sign, or does not fit into
+// a Word.
+static int bm_parse_word(String_View sv, Word *value){
+    size_t i = 0;
+    const int negative = sv.count > 0 && sv.data[0] == '-';
+    if (negative){
+        i += 1;
+    }
+    if (i == sv.count){
+        return 0;
+    }
+
+    // magnitude * 10 + digit fits while magnitude < cutoff
+    const uint64_t limit = negative ? (uint64_t) INT64_MAX + 1 : (uint64_t) INT64_MAX;
+    const uint64_t cutoff = limit / 10;
+    const unsigned cutoff_digit = limit % 10;
+    uint64_t magnitude = 0;
+    for (; i < sv.count && sv.data[i] >= '0' && sv.data[i] <= '9'; ++i){
+        const unsigned digit = sv.data[i] - '0';
+        if (magnitude > cutoff || (magnitude == cutoff && digit > cutoff_digit)){
+            return 0;
+        }
+        magnitude = magnitude * 10 + digit;
+    }
+    if (i < sv.count){
+        return 0;
+    }
+
+    *value = negative && magnitude > 0 ? -(Word) (magnitude - 1) - 1 : (Word) magnitude;
+    return 1;
+}
+
+Word sv_to_int(String_View sv){
+    Word value = 0;
+    return bm_parse_word(sv, &value) ? value : 0;
+}
+
+static size_t label_hash(String_View name){
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < name.count; ++i){
+        hash = (hash ^ (uint8_t) name.data[i]) * 1099511628211ULL;
+    }
+    return (size_t) hash;
+}
+
+static int label_table_grow(Label_Table *lt){
+    const size_t capacity = lt->slots_capacity > 0 ? lt->slots_capacity * 2 : 256;
+    size_t *slots = calloc(capacity, sizeof(slots[0]));
+    if (slots == NULL){
+        return 0;
+    }
+    for (size_t i = 0; i < lt->labels_size; ++i){
+        size_t at = label_hash(lt->labels[i].name) & (capacity - 1);
+        while (slots[at] != 0){
+            at = (at + 1) & (capacity - 1);
+        }
+        slots[at] = i + 1;
+    }
+    free(lt->slots);
+    lt->slots = slots;
+    lt->slots_capacity = capacity;
+    return 1;
+}
+
+// Label names copied out of the source. Next to each other they stay in cache
+// while the source streams past, and bm_assemble_stream() can let its buffer
+// go. Blocks are never moved, so the names stay put as more are added.
+struct Label_Names {
+    Label_Names *next;
+    size_t size;
+    size_t capacity;
+    char data[];
+};
+
+#define LABEL_NAMES_BLOCK_SIZE (64*1024)
+
+static int label_table_copy_name(Label_Table *lt, String_View *name){
+    Label_Names *block = lt->names;
+    if (block == NULL || block->capacity - block->size < name->count){
+        const size_t capacity = name->count > LABEL_NAMES_BLOCK_SIZE ? name->count : LABEL_NAMES_BLOCK_SIZE;
+        block = malloc(sizeof(*block) + capacity);
+        if (block == NULL){
+            return 0;
+        }
+        *block = (Label_Names) {.next = lt->names, .capacity = capacity};
+        lt->names = block;
+    }
+    if (name->count > 0){
+        memcpy(block->data + block->size, name->data, name->count);
+    }
+    name->data = block->data + block->size;
+    block->size += name->count;
+    return 1;
+}
+
+// The label called `name`, added as undefined first seen on `line` if there
+// is none yet. Returns NULL if out of memory.
+static Label *label_table_get(Label_Table *lt, String_View name, size_t line){
+    if (2 * (lt->labels_size + 1) > lt->slots_capacity && !label_table_grow(lt)){
+        return NULL;
+    }
+
+    const size_t mask = lt->slots_capacity - 1;
+    size_t at = label_hash(name) & mask;
+    for (; lt->slots[at] != 0; at = (at + 1) & mask){
+        Label *label = &lt->labels[lt->slots[at] - 1];
+        if (sv_eq(label->name, name)){
+            return label;
+        }
+    }
+
+    if (lt->labels_size >= lt->labels_capacity){
+        const size_t capacity = lt->labels_capacity > 0 ? lt->labels_capacity * 2 : 256;
+        Label *labels = realloc(lt->labels, sizeof(labels[0]) * capacity);
+        if (labels == NULL){
+            return NULL;
+        }
+        lt->labels = labels;
+        lt->labels_capacity = capacity;
+    }
+    if (!label_table_copy_name(lt, &name)){
+        return NULL;
+    }
+    lt->slots[at] = lt->labels_size + 1;
+    Label *label = &lt->labels[lt->labels_size++];
+    *label = (Label) {.name = name, .addr = -1, .jmps = -1, .line = line};
+    return label;
+}
+
+// Empties the table, keeping the storage of its labels and slots.
+static void label_table_clear(Label_Table *lt){
+    lt->labels_size = 0;
+    if (lt->slots != NULL){
+        memset(lt->slots, 0, sizeof(lt->slots[0]) * lt->slots_capacity);
+    }
+    while (lt->names != NULL){
+        Label_Names *next = lt->names->next;
+        free(lt->names);
+        lt->names = next;
+    }
+}
+
+void label_table_free(Label_Table *lt){
+    label_table_clear(lt);
+    free(lt->labels);
+    free(lt->slots);
+    *lt = (Label_Table) {0};
+}
+
+// Jumps to a label that is not defined yet form the label's backpatch chain:
+// the operand of each one holds the address of the previous jump to the same
+// label (-1 ends the chain) until the definition patches them all.
+
+// Defines `name` at `addr`. The jumps that were waiting for it are left in
+// `*jmps` for the caller to patch. Returns ERR_SYNTAX if it is defined
+// already, or ERR_OUT_OF_MEMORY.
+static Err label_table_define(Bm *bm, Label_Table *lt, String_View name, Word addr,
+                              size_t line, Word *jmps){
+    Label *label = label_table_get(lt, name, line);
+    if (label == NULL){
+        return bm_fail(bm, ERR_OUT_OF_MEMORY, "line %zu: no memory for labels", line);
+    }
+    if (label->addr >= 0){
+        return bm_fail(bm, ERR_SYNTAX, "line %zu: label `%.*s` is already defined on line %zu",
+                       line, (int) name.count, name.data, label->line);
+    }
+    label->addr = addr;
+    label->line = line;
+    *jmps = label->jmps;
+    label->jmps = -1;
+    return ERR_OK;
+}
+
+// The operand of the jump at `addr` to `name`: the label's address, or the
+// next link of its backpatch chain. Returns ERR_OUT_OF_MEMORY if there is no
+// room for the label.
+static Err label_table_use(Bm *bm, Label_Table *lt, String_View name, Word addr,
+                           size_t line, Word *operand){
+    Label *label = label_table_get(lt, name, line);
+    if (label == NULL){
+        return bm_fail(bm, ERR_OUT_OF_MEMORY, "line %zu: no memory for labels", line);
+    }
+    if (label->addr >= 0){
+        *operand = label->addr;
+    } else {
+        *operand = label->jmps;
+        label->jmps = addr;
+    }
+    return ERR_OK;
+}
+
+// Returns ERR_SYNTAX for the first label that was jumped to but never defined.
+static Err label_table_check(Bm *bm, const Label_Table *lt){
+    for (size_t i = 0; i < lt->labels_size; ++i){
+        const Label *label = &lt->labels[i];
+        if (label->addr < 0){
+            return bm_fail(bm, ERR_SYNTAX, "line %zu: label `%.*s` does not exist",
+                           label->line, (int) label->name.count, label->name.data);
+        }
+    }
+    return ERR_OK;
+}
+
+// One line of assembly, see bm_parse_line().
+typedef struct {
+    int has_label;
+    String_View label;      // defined on this line
+    int has_inst;
+    Inst inst;
+    int has_target;
+    String_View target;     // the jump goes to this label, not to `inst.operand`
+} Bm_Asm_Line;
+
+// The lexer. A line is split into the label it defines, the mnemonic and the
+// operand as if by sv_trim() on the line, sv_chop_by_delim() at the first
+// space (and at the next one after a label) and at `#` for the operand, which
+// is exactly what bm_lex_line_slow() does.
+//
+// Bm_Lexer gets the same tokens without looking at a line byte by byte. It
+// classifies the source 4 KiB at a time into bit masks of newlines, spaces,
+// blanks and `#`s, 64 bytes per word with AVX2, SSE2 or a plain loop, then
+// walks the newline bits from line to line. Within a line the tokens are
+// found with bit operations on the masks shifted to its start, so the next
+// line never waits for the bytes of this one. Lines of 64 bytes or more take
+// the slow path.
+typedef struct {
+    int has_label;
+    String_View label;
+    String_View name;
+    String_View operand;
+} Bm_Tokens;
+
+#define BM_LEX_BLOCKS 64    // 64 byte blocks classified at a time
+#define BM_LEX_BATCH 64     // lines lexed at a time
+
+// Bit i of word w stands for byte 64 * w + i from `base`. One block more
+// than BM_LEX_BLOCKS, so every line that starts in the window can be shifted
+// into a single word.
+typedef struct {
+    uint64_t newline[BM_LEX_BLOCKS + 1];
+    uint64_t space[BM_LEX_BLOCKS + 1];      // ' ', what tokens are split at
+    uint64_t blank[BM_LEX_BLOCKS + 1];      // everything sv_trim() removes
+    uint64_t hash[BM_LEX_BLOCKS + 1];
+} Bm_Lex_Masks;
+
+typedef struct {
+    const char *data;
+    size_t size;
+    size_t pos;         // start of the next line
+    size_t base;        // where the masks start
+    size_t limit;       // lines that start before it are in the masks
+    size_t word;        // the newline word being walked
+    uint64_t newlines;  // its newlines after `pos`
+    Bm_Lex_Masks masks;
+} Bm_Lexer;
+
+static void bm_lex_block(const char *p, Bm_Lex_Masks *masks, size_t w){
+    uint64_t newline = 0;
+    uint64_t space = 0;
+    uint64_t blank = 0;
+    uint64_t hash = 0;
+#if defined(__AVX2__)
+    for (int i = 0; i < 2; ++i){
+        const __m256i bytes = _mm256_loadu_si256((const __m256i *) (p + 32 * i));
+        // '\t' to '\r' are the bytes where byte - '\t' <= 4 unsigned
+        const __m256i control = _mm256_sub_epi8(bytes, _mm256_set1_epi8('\t'));
+        const __m256i is_control = _mm256_cmpeq_epi8(_mm256_min_epu8(control, _mm256_set1_epi8(4)), control);
+        const uint64_t spaces = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(' ')));
+        newline |= (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('\n'))) << (32 * i);
+        space |= spaces << (32 * i);
+        blank |= (spaces | (uint32_t) _mm256_movemask_epi8(is_control)) << (32 * i);
+        hash |= (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('#'))) << (32 * i);
+    }
+#elif defined(__SSE2__)
+    for (int i = 0; i < 4; ++i){
+        const __m128i bytes = _mm_loadu_si128((const __m128i *) (p + 16 * i));
+        const __m128i control = _mm_sub_epi8(bytes, _mm_set1_epi8('\t'));
+        const __m128i is_control = _mm_cmpeq_epi8(_mm_min_epu8(control, _mm_set1_epi8(4)), control);
+        const uint64_t spaces = (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(' ')));
+        newline |= (uint64_t) (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8('\n'))) << (16 * i);
+        space |= spaces << (16 * i);
+        blank |= (spaces | (uint32_t) _mm_movemask_epi8(is_control)) << (16 * i);
+        hash |= (uint64_t) (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8('#'))) << (16 * i);
+    }
+#else
+    for (unsigned i = 0; i < 64; ++i){
+        const uint64_t bit = (uint64_t) 1 << i;
+        newline |= p[i] == '\n' ? bit : 0;
+        space |= p[i] == ' ' ? bit : 0;
+        blank |= p[i] == ' ' || (p[i] >= '\t' && p[i] <= '\r') ? bit : 0;
+        hash |= p[i] == '#' ? bit : 0;
+    }
+#endif
+    masks->newline[w] = newline;
+    masks->space[w] = space;
+    masks->blank[w] = blank;
+    masks->hash[w] = hash;
+}
+
+// Classifies the window that starts at `pos`. Past the end of the input
+// everything is a newline, which ends the last line there.
+static void bm_lexer_fill(Bm_Lexer *lexer){
+    lexer->base = lexer->pos;
+    lexer->limit = lexer->base + 64 * BM_LEX_BLOCKS;
+    for (size_t w = 0; w <= BM_LEX_BLOCKS; ++w){
+        const size_t at = lexer->base + 64 * w;
+        if (at + 64 <= lexer->size){
+            bm_lex_block(lexer->data + at, &lexer->masks, w);
+        } else {
+            char padded[64];
+            const size_t avail = at < lexer->size ? lexer->size - at : 0;
+            if (avail > 0){
+                memcpy(padded, lexer->data + at, avail);
+            }
+            memset(padded + avail, '\n', sizeof(padded) - avail);
+            bm_lex_block(padded, &lexer->masks, w);
+        }
+    }
+    lexer->word = 0;
+    lexer->newlines = lexer->masks.newline[0];
+}
+
+static void bm_lexer_init(Bm_Lexer *lexer, const char *data, size_t size){
+    lexer->data = data;
+    lexer->size = size;
+    lexer->pos = 0;
+    lexer->base = 0;
+    lexer->limit = 0;
+}
+
+// The 64 bits of `mask` from bit `at` (at < 64 * BM_LEX_BLOCKS).
+static inline uint64_t bm_lex_bits(const uint64_t *mask, size_t at){
+    const size_t w = at / 64;
+    const unsigned shift = at % 64;
+    // shifting by 64 is undefined, so the next word goes in two steps
+    return (mask[w] >> shift) | ((mask[w + 1] << 1) << (63 - shift));
+}
+
+// Bits lo to hi - 1, lo <= hi < 64.
+static inline uint64_t bm_bits(unsigned lo, unsigned hi){
+    return (((uint64_t) 1 << hi) - 1) & ~(((uint64_t) 1 << lo) - 1);
+}
+
+// Index of the lowest and the highest set bit of x != 0.
+static inline unsigned bm_first_bit(uint64_t x){
+#if defined(__GNUC__)
+    return (unsigned) __builtin_ctzll(x);
+#else
+    unsigned i = 0;
+    while ((x & 1) == 0){
+        x >>= 1;
+        i += 1;
+    }
+    return i;
+#endif
+}
+
+static inline unsigned bm_last_bit(uint64_t x){
+#if defined(__GNUC__)
+    return 63 - (unsigned) __builtin_clzll(x);
+#else
+    unsigned i = 63;
+    while ((x >> i) == 0){
+        i -= 1;
+    }
+    return i;
+#endif
+}
+
+// Bytes lo to hi - 1 of the line with the blanks at both ends removed.
+static inline String_View bm_lex_trimmed(const char *line, uint64_t blank, unsigned lo, unsigned hi){
+    const uint64_t solid = ~blank & bm_bits(lo, hi);
+    if (solid == 0){
+        return (String_View) {.count = 0, .data = line + hi};
+    }
+    const unsigned first = bm_first_bit(solid);
+    return (String_View) {.count = bm_last_bit(solid) + 1 - first, .data = line + first};
+}
 
-    if (a.count != b.count){
-        return 0;
-    } else {
-        return memcmp(a.data, b.data, a.count) == 0; 
+// The tokens of the `length` < 64 bytes at `at` from the start of the masks.
+static inline void bm_lex_line_fast(const Bm_Lexer *lexer, size_t at, unsigned length, Bm_Tokens *tokens){
+    const char *line = lexer->data + lexer->base + at;
+    const uint64_t blank = bm_lex_bits(lexer->masks.blank, at);
+    const uint64_t space = bm_lex_bits(lexer->masks.space, at);
+    const uint64_t hash = bm_lex_bits(lexer->masks.hash, at);
+
+    tokens->has_label = 0;
+    tokens->operand.count = 0;
+    const uint64_t solid = ~blank & bm_bits(0, length);
+    if (solid == 0 || line[bm_first_bit(solid)] == '#'){
+        tokens->name.count = 0;
+        return;
+    }
+    const unsigned start = bm_first_bit(solid);
+    const unsigned end = bm_last_bit(solid) + 1;
+
+    const uint64_t spaces = space & bm_bits(start, end);
+    unsigned name_end = spaces != 0 ? bm_first_bit(spaces) : end;
+    unsigned rest = spaces != 0 ? name_end + 1 : end;
+    tokens->name = (String_View) {.count = name_end - start, .data = line + start};
+
+    if (line[name_end - 1] == ':'){
+        tokens->has_label = 1;
+        tokens->label = (String_View) {.count = name_end - 1 - start, .data = line + start};
+        const uint64_t next_spaces = space & bm_bits(rest, end);
+        name_end = next_spaces != 0 ? bm_first_bit(next_spaces) : end;
+        tokens->name = bm_lex_trimmed(line, blank, rest, name_end);
+        rest = next_spaces != 0 ? name_end + 1 : end;
+    }
+
+    if (tokens->name.count > 0){
+        const uint64_t hashes = hash & bm_bits(rest, end);
+        tokens->operand = bm_lex_trimmed(line, blank, rest, hashes != 0 ? bm_first_bit(hashes) : end);
+    }
+}
+
+static void bm_lex_line_slow(String_View line, Bm_Tokens *tokens){
+    *tokens = (Bm_Tokens) {0};
+    line = sv_trim(line);
+    if (line.count == 0 || *line.data == '#'){
+        return;
     }
 
+    tokens->name = sv_chop_by_delim(&line, ' ');
+    if (tokens->name.count > 0 && tokens->name.data[tokens->name.count-1] == ':'){
+        tokens->has_label = 1;
+        tokens->label = (String_View) {
+            .count = tokens->name.count-1,
+            .data = tokens->name.data,
+        };
+        tokens->name = sv_trim(sv_chop_by_delim(&line, ' '));
+    }
+    if (tokens->name.count > 0){
+        tokens->operand = sv_trim(sv_chop_by_delim(&line, '#'));
+    }
 }
 
-int sv_to_int(String_View sv){
-    
-    int result = 0; 
+// The tokens of the next lines, at most `capacity` of them. Lines are lexed
+// a batch at a time so the walk from one to the next stays in registers.
+// Returns 0 at the end of the input.
+static size_t bm_lexer_next(Bm_Lexer *lexer, Bm_Tokens *tokens, size_t capacity){
+    size_t count = 0;
+    while (count < capacity && lexer->pos < lexer->size){
+        if (lexer->pos >= lexer->limit){
+            bm_lexer_fill(lexer);
+        }
 
+        const size_t base = lexer->base;
+        size_t pos = lexer->pos;
+        size_t word = lexer->word;
+        uint64_t newlines = lexer->newlines;
+        while (count < capacity && pos < lexer->limit && pos < lexer->size){
+            while (newlines == 0 && word < BM_LEX_BLOCKS){
+                word += 1;
+                newlines = lexer->masks.newline[word];
+            }
+            if (newlines == 0){
+                break;
+            }
+            const size_t end = base + 64 * word + bm_first_bit(newlines);
+            newlines &= newlines - 1;
+            if (end - pos < 64){
+                bm_lex_line_fast(lexer, pos - base, (unsigned) (end - pos), &tokens[count]);
+            } else {
+                const size_t length = (end < lexer->size ? end : lexer->size) - pos;
+                bm_lex_line_slow((String_View) {.count = length, .data = lexer->data + pos}, &tokens[count]);
+            }
+            count += 1;
+            pos = end + 1;
+        }
+        lexer->pos = pos;
+        lexer->word = word;
+        lexer->newlines = newlines;
 
-    for (size_t i = 0; i < sv.count && isdigit(sv.data[i]);++i){
-        result = result * 10 + sv.data[i] - '0'; 
+        if (newlines == 0 && count < capacity && pos < lexer->limit && pos < lexer->size){
+            // a line longer than the rest of the window
+            const char *start = lexer->data + pos;
+            const char *newline = memchr(start, '\n', lexer->size - pos);
+            const size_t length = newline != NULL ? (size_t) (newline - start) : lexer->size - pos;
+            bm_lex_line_slow((String_View) {.count = length, .data = start}, &tokens[count]);
+            count += 1;
+            lexer->pos += length + 1;
+            lexer->limit = 0;
+        }
     }
-    
-    return result;
+    return count;
 }
 
-typedef struct {
-    String_View name; 
-    Word addr;
-} Label; 
+// The mnemonics by length, so a lookup is one switch and a couple of memcmp()s
+// of constant size.
+static int bm_lookup_mnemonic(String_View name, Inst_Type *type){
+    const char *s = name.data;
+    switch (name.count){
+    case 2:
+        if (memcmp(s, "eq", 2) == 0){ *type = INST_EQ; return 1; }
+        break;
+    case 3:
+        if (memcmp(s, "nop", 3) == 0){ *type = INST_NOP; return 1; }
+        if (memcmp(s, "dup", 3) == 0){ *type = INST_DUP; return 1; }
+        if (memcmp(s, "div", 3) == 0){ *type = INST_DIV; return 1; }
+        if (memcmp(s, "jmp", 3) == 0){ *type = INST_JMP; return 1; }
+        if (memcmp(s, "ret", 3) == 0){ *type = INST_RET; return 1; }
+        break;
+    case 4:
+        if (memcmp(s, "push", 4) == 0){ *type = INST_PUSH; return 1; }
+        if (memcmp(s, "plus", 4) == 0){ *type = INST_PLUS; return 1; }
+        if (memcmp(s, "mult", 4) == 0){ *type = INST_MULT; return 1; }
+        if (memcmp(s, "halt", 4) == 0){ *type = INST_HALT; return 1; }
+        if (memcmp(s, "call", 4) == 0){ *type = INST_CALL; return 1; }
+        if (memcmp(s, "load", 4) == 0){ *type = INST_LOAD; return 1; }
+        break;
+    case 5:
+        if (memcmp(s, "minus", 5) == 0){ *type = INST_MINUS; return 1; }
+        if (memcmp(s, "store", 5) == 0){ *type = INST_STORE; return 1; }
+        break;
+    case 6:
+        if (memcmp(s, "jmp_if", 6) == 0){ *type = INST_JMP_IF; return 1; }
+        if (memcmp(s, "native", 6) == 0){ *type = INST_NATIVE; return 1; }
+        break;
+    case 9:
+        if (memcmp(s, "push_plus", 9) == 0){ *type = INST_PUSH_PLUS; return 1; }
+        if (memcmp(s, "push_mult", 9) == 0){ *type = INST_PUSH_MULT; return 1; }
+        if (memcmp(s, "dup2_plus", 9) == 0){ *type = INST_DUP2_PLUS; return 1; }
+        if (memcmp(s, "eq_jmp_if", 9) == 0){ *type = INST_EQ_JMP_IF; return 1; }
+        break;
+    case 10:
+        if (memcmp(s, "load_local", 10) == 0){ *type = INST_LOAD_LOCAL; return 1; }
+        break;
+    case 11:
+        if (memcmp(s, "print_debug", 11) == 0){ *type = INST_PRINT_DEBUG; return 1; }
+        if (memcmp(s, "store_local", 11) == 0){ *type = INST_STORE_LOCAL; return 1; }
+        break;
+    }
+    return 0;
+}
 
-typedef struct {
-    Word addr;
-    String_View label; 
-} Unresolved_Jmp; 
+// The numeric operand of the instruction on `line_number`.
+static Err bm_parse_operand(Bm *bm, String_View operand, size_t line_number, Word *out){
+    if (bm_parse_word(operand, out)){
+        return ERR_OK;
+    }
+    if (operand.count == 0){
+        return bm_fail(bm, ERR_SYNTAX, "line %zu: missing operand", line_number);
+    }
 
-typedef struct {
-    Label labels[LABEL_CAPACITY]; 
-    size_t labels_size; 
-    Unresolved_Jmp unresolved_jmps[UNRESOLVED_JMPS_CAPACITY]; 
-    size_t unresolved_jmps_size; 
-} Label_Table; 
+    // all digits, so it must be too big
+    const size_t start = operand.data[0] == '-';
+    size_t i = start;
+    while (i < operand.count && isdigit((unsigned char) operand.data[i])){
+        i += 1;
+    }
+    if (i == operand.count && i > start){
+        return bm_fail(bm, ERR_SYNTAX, "line %zu: `%.*s` does not fit into 64 bits",
+                       line_number, (int) operand.count, operand.data);
+    }
+    return bm_fail(bm, ERR_SYNTAX, "line %zu: `%.*s` is not a decimal number",
+                   line_number, (int) operand.count, operand.data);
+}
 
-Word label_table_find(const Label_Table *lt, String_View name){
-    for (size_t i = 0; i < lt->labels_size; ++i){
-        if (sv_eq(lt->labels[i].name, name)) {
-            return lt->labels[i].addr; 
+// The instruction on a line. Returns ERR_SYNTAX for an instruction that
+// doesn't exist or an operand that does not fit into a Word.
+static Err bm_parse_line(Bm *bm, const Bm_Tokens *line, size_t line_number, Bm_Asm_Line *out){
+    const Bm_Tokens tokens = *line;
+    *out = (Bm_Asm_Line) {.has_label = tokens.has_label, .label = tokens.label};
+    if (tokens.name.count == 0){
+        return ERR_OK;
+    }
+
+    Inst inst = {0};
+    if (!bm_lookup_mnemonic(tokens.name, &inst.type)){
+        return bm_fail(bm, ERR_SYNTAX, "line %zu: unknown instruction `%.*s`",
+                       line_number, (int) tokens.name.count, tokens.name.data);
+    }
+
+    const String_View operand = tokens.operand;
+    switch (inst.type){
+    case INST_JMP:
+    case INST_JMP_IF:
+    case INST_EQ_JMP_IF:
+    case INST_CALL:
+        // an absolute address or a label
+        if (operand.count == 0 || !isdigit((unsigned char) *operand.data)){
+            out->has_target = 1;
+            out->target = operand;
+            break;
+        }
+        if (bm_parse_operand(bm, operand, line_number, &inst.operand) != ERR_OK){
+            return ERR_SYNTAX;
+        }
+        break;
+    case INST_NATIVE:
+        // an index or the name of a bound native
+        if (operand.count > 0 && !isdigit((unsigned char) *operand.data) && *operand.data != '-'){
+            char name[BM_NATIVE_NAME_CAPACITY];
+            Word index = -1;
+            if (operand.count < sizeof(name)){
+                memcpy(name, operand.data, operand.count);
+                name[operand.count] = '\0';
+                index = bm_native_index(bm, name);
+            }
+            if (index < 0){
+                return bm_fail(bm, ERR_SYNTAX, "line %zu: unknown native `%.*s`",
+                               line_number, (int) operand.count, operand.data);
+            }
+            inst.operand = index;
+            break;
+        }
+        if (bm_parse_operand(bm, operand, line_number, &inst.operand) != ERR_OK){
+            return ERR_SYNTAX;
+        }
+        break;
+    case INST_PUSH:
+    case INST_DUP:
+    case INST_PUSH_PLUS:
+    case INST_PUSH_MULT:
+    case INST_RET:
+    case INST_LOAD_LOCAL:
+    case INST_STORE_LOCAL:
+        if (bm_parse_operand(bm, operand, line_number, &inst.operand) != ERR_OK){
+            return ERR_SYNTAX;
+        }
+        break;
+    case INST_NOP:
+    case INST_PLUS:
+    case INST_MINUS:
+    case INST_MULT:
+    case INST_DIV:
+    case INST_EQ:
+    case INST_HALT:
+    case INST_PRINT_DEBUG:
+    case INST_DUP2_PLUS:
+    case INST_LOAD:
+    case INST_STORE:
+        if (operand.count > 0){
+            return bm_fail(bm, ERR_SYNTAX, "line %zu: `%.*s` takes no operand",
+                           line_number, (int) tokens.name.count, tokens.name.data);
         }
+        break;
     }
-    fprintf(stderr, "Error: label `%.*s` does not exist\n",(int) name.count, name.data); 
-    exit(1);  
+
+    out->has_inst = 1;
+    out->inst = inst;
+    return ERR_OK;
 }
 
-void label_table_push(Label_Table *lt, String_View name, Word addr){
-    assert(lt->labels_size < LABEL_CAPACITY); 
-    lt->labels[lt->labels_size++] = (Label){.name = name, .addr = addr}; 
-}   
+static int bm_debug_record_line(Bm_Debug *debug, Word addr, Word line){
+    if (addr >= debug->lines_capacity){
+        const Word capacity = debug->lines_capacity > 0 ? debug->lines_capacity * 2 : BM_PROGRAM_CAPACITY;
+        Word *lines = realloc(debug->lines, sizeof(lines[0]) * capacity);
+        if (lines == NULL){
+            return 0;
+        }
+        debug->lines = lines;
+        debug->lines_capacity = capacity;
+    }
+    debug->lines[addr] = line;
+    return 1;
+}
 
-void label_table_push_unresolved_jmp(Label_Table *lt, Word addr, String_View label){
-    assert(lt->unresolved_jmps_size < UNRESOLVED_JMPS_CAPACITY); 
-    lt->unresolved_jmps[lt->unresolved_jmps_size++] = 
-                                (Unresolved_Jmp){.addr = addr, .label = label}; 
+static int bm_debug_label_compare(const void *a, const void *b){
+    const Bm_Debug_Label *x = a;
+    const Bm_Debug_Label *y = b;
+    if (x->addr != y->addr){
+        return x->addr < y->addr ? -1 : 1;
+    }
+    // the names are laid out in table order
+    return x->name < y->name ? -1 : x->name > y->name;
 }
 
-void bm_translate_source(String_View source, Bm *bm,  Label_Table *lt){
+// The table is in order of first appearance, which puts labels that are
+// jumped to before their definition out of address order.
+static int bm_debug_copy_labels(Bm_Debug *debug, const Label_Table *lt){
+    size_t names_size = 0;
+    for (size_t i = 0; i < lt->labels_size; ++i){
+        names_size += lt->labels[i].name.count + 1;
+    }
+
+    debug->labels = malloc(sizeof(debug->labels[0]) * (lt->labels_size + 1));
+    debug->names = malloc(names_size + 1);
+    if (debug->labels == NULL || debug->names == NULL){
+        return 0;
+    }
+
+    char *name = debug->names;
+    for (size_t i = 0; i < lt->labels_size; ++i){
+        memcpy(name, lt->labels[i].name.data, lt->labels[i].name.count);
+        name[lt->labels[i].name.count] = '\0';
+        debug->labels[i] = (Bm_Debug_Label) {.addr = lt->labels[i].addr, .name = name};
+        name += lt->labels[i].name.count + 1;
+    }
+    debug->labels_size = lt->labels_size;
+    qsort(debug->labels, debug->labels_size, sizeof(debug->labels[0]), bm_debug_label_compare);
+    return 1;
+}
 
-    //first pass
+// Assembles `source` into the program of `bm`. Returns ERR_SYNTAX or
+// ERR_OUT_OF_MEMORY with the line in bm_error_message(). The line and label
+// of every instruction are kept for bm_source_location().
+Err bm_translate_source(String_View source, Bm *bm,  Label_Table *lt){
+    label_table_clear(lt);
+    bm_release_program(bm);
     bm->program_size = 0; 
-    while (source.count > 0){
-        assert(bm->program_size < BM_PROGRAM_CAPACITY); 
-        String_View line = sv_trim(sv_chop_by_delim(&source, '\n'));
-        // printf("#%.*s#\n", (int)line.count, line.data); 
-        if (line.count > 0 && *line.data != '#') { //making sure to ignore comments
-            String_View inst_name = sv_chop_by_delim(&line, ' '); 
-
-            if (inst_name.count > 0 && inst_name.data[inst_name.count-1] == ':'){
-                String_View label = {
-                    .count = inst_name.count-1,
-                    .data = inst_name.data,
-                }; 
-
-                label_table_push(lt, label, bm->program_size); 
-                inst_name = sv_trim(sv_chop_by_delim(&line, ' ')); 
-
-            } 
-            if (inst_name.count > 0) {
-            String_View operand = sv_trim(sv_chop_by_delim(&line, '#')); 
-            if (sv_eq(inst_name, cstr_as_sv("push"))){
-                bm->program[bm->program_size++] = (Inst) {.type = INST_PUSH, .operand = sv_to_int(operand)};     
-            } else if (sv_eq(inst_name, cstr_as_sv("nop"))) {
-                bm->program[bm->program_size++] = (Inst) {.type = INST_NOP};     
-            }else if (sv_eq(inst_name, cstr_as_sv("dup"))){
-                bm->program[bm->program_size++] = (Inst) {.type = INST_DUP, .operand = sv_to_int(operand)};     
-            } else if (sv_eq(inst_name, cstr_as_sv("plus"))){
-                bm->program[bm->program_size++] = (Inst) {.type = INST_PLUS};     
-            } else if (sv_eq(inst_name, cstr_as_sv("jmp"))){
-                if (operand.count > 0 && isdigit(*operand.data)) {
-                    bm->program[bm->program_size++] = (Inst) {
-                        .type = INST_JMP,
-                        .operand = sv_to_int(operand),
-                        };     
+    bm_program_changed(bm);
+    bm->debug = calloc(1, sizeof(*bm->debug));
+    if (bm->debug == NULL){
+        return bm_fail(bm, ERR_OUT_OF_MEMORY, "no memory for source locations");
+    }
+    Bm_Lexer lexer;
+    bm_lexer_init(&lexer, source.data, source.count);
 
-                } else {
-                    label_table_push_unresolved_jmp(lt, bm->program_size, operand); 
+    size_t line_number = 0;
+    Bm_Tokens tokens[BM_LEX_BATCH];
+    size_t count;
+    while ((count = bm_lexer_next(&lexer, tokens, BM_LEX_BATCH)) > 0){
+        for (size_t i = 0; i < count; ++i){
+            line_number += 1;
 
-                    bm->program[bm->program_size++] = (Inst) {.type = INST_JMP};     
-                }
-            }
-            
-            else {
-                fprintf(stderr, "ERROR: Unknown Instruction `%.*s`\n", (int) inst_name.count, inst_name.data);
-                exit(1);  
+            Bm_Asm_Line line;
+            Err err = bm_parse_line(bm, &tokens[i], line_number, &line);
+            if (err != ERR_OK){
+                return err;
             }
+
+            if (line.has_label){
+                Word jmp = -1;
+                err = label_table_define(bm, lt, line.label, bm->program_size, line_number, &jmp);
+                if (err != ERR_OK){
+                    return err;
+                }
+                while (jmp >= 0){
+                    const Word next = bm->program[jmp].operand;
+                    bm->program[jmp].operand = bm->program_size;
+                    jmp = next;
+                }
             }
 
+            if (line.has_inst){
+                if (bm_reserve_program(bm, bm->program_size + 1) < 0 ||
+                    !bm_debug_record_line(bm->debug, bm->program_size, line_number)){
+                    return bm_fail(bm, ERR_OUT_OF_MEMORY, "line %zu: program does not fit into the VM", line_number);
+                }
+                if (line.has_target){
+                    err = label_table_use(bm, lt, line.target, bm->program_size, line_number, &line.inst.operand);
+                    if (err != ERR_OK){
+                        return err;
+                    }
+                }
+                bm->program[bm->program_size++] = line.inst;
+            }
         }
-    } 
+    }
+
+    const Err err = label_table_check(bm, lt);
+    if (err != ERR_OK){
+        return err;
+    }
 
-    //second pass
-    for (size_t i = 0; i < lt->unresolved_jmps_size; ++i){
-        Word addr = label_table_find(lt, lt->unresolved_jmps[i].label); 
-        bm->program[lt->unresolved_jmps[i].addr].operand = addr; 
+    if (!bm_debug_copy_labels(bm->debug, lt)){
+        return bm_fail(bm, ERR_OUT_OF_MEMORY, "no memory for source locations");
     }
-   
+
+    return ERR_OK;
 }  
 
 
-String_View slurp_file(const char *file_path){
+#define BM_ASM_CHUNK_SIZE (64*1024)
+#define BM_ASM_WINDOW 4096          // instructions held back before writing
 
-    FILE *f = fopen(file_path, "r"); 
-    if (f == NULL){
-        fprintf(stderr, "ERROR: Could not read file `%s` %s\n", file_path, strerror(errno)); 
-        exit(1); 
+// The BM_FORMAT_V2_FIXED file bm_assemble_stream() writes through `fd`, at
+// `base`. The last instructions stay in `window` until it is full; jumps
+// that were written already are patched in the file.
+typedef struct {
+    int fd;
+    off_t base;
+    uint8_t window[BM_ASM_WINDOW * BM_FILE_FIXED_INST_SIZE];
+    Word window_start;
+    Word size;
+} Bm_Asm_Output;
+
+static void bm_write_le(uint8_t *p, uint64_t x, size_t width){
+    for (size_t i = 0; i < width; ++i){
+        p[i] = (uint8_t) (x >> (8 * i));
+    }
+}
+
+static int bm_pwrite_all(int fd, const uint8_t *data, size_t size, off_t offset){
+    while (size > 0){
+        const ssize_t n = pwrite(fd, data, size, offset);
+        if (n < 0 && errno == EINTR){
+            continue;
+        }
+        if (n <= 0){
+            return 0;
+        }
+        data += n;
+        size -= n;
+        offset += n;
+    }
+    return 1;
+}
+
+static off_t bm_asm_offset(const Bm_Asm_Output *out, Word inst){
+    return out->base + BM_FILE_HEADER_SIZE + (off_t) inst * BM_FILE_FIXED_INST_SIZE;
+}
+
+static int bm_asm_flush(Bm_Asm_Output *out){
+    const size_t size = (size_t) (out->size - out->window_start) * BM_FILE_FIXED_INST_SIZE;
+    if (!bm_pwrite_all(out->fd, out->window, size, bm_asm_offset(out, out->window_start))){
+        return 0;
     }
+    out->window_start = out->size;
+    return 1;
+}
+
+static int bm_asm_emit(Bm_Asm_Output *out, Inst inst){
+    if (out->size - out->window_start == BM_ASM_WINDOW && !bm_asm_flush(out)){
+        return 0;
+    }
+    uint8_t *record = out->window + (out->size - out->window_start) * BM_FILE_FIXED_INST_SIZE;
+    bm_write_le(record, (uint64_t) inst.type, 4);
+    bm_write_le(record + 4, 0, 4);
+    bm_write_le(record + 8, inst_type_has_operand(inst.type) ? (uint64_t) inst.operand : 0, 8);
+    out->size += 1;
+    return 1;
+}
 
-    if (fseek(f, 0, SEEK_END) < 0){
-        fprintf(stderr, "ERROR: Could not read file `%s` %s\n", file_path, strerror(errno));
-        exit(1);   
+// Sets the operand of instruction `inst` to `operand`, returning the old one
+// (the next link of a backpatch chain) in `*old`.
+static int bm_asm_patch(Bm_Asm_Output *out, Word inst, Word operand, Word *old){
+    uint8_t bytes[8];
+    uint8_t *at = bytes;
+    if (inst >= out->window_start){
+        at = out->window + (inst - out->window_start) * BM_FILE_FIXED_INST_SIZE + 8;
+    } else if (pread(out->fd, bytes, sizeof(bytes), bm_asm_offset(out, inst) + 8) != sizeof(bytes)){
+        return 0;
     }
+    *old = (Word) bm_read_le(at, 8);
+    bm_write_le(at, (uint64_t) operand, 8);
+    return at != bytes || bm_pwrite_all(out->fd, bytes, sizeof(bytes), bm_asm_offset(out, inst) + 8);
+}
 
-    long m = ftell(f);
-    if (m < 0){
-        fprintf(stderr, "ERROR: Could not read file `%s` %s\n", file_path, strerror(errno));
-        exit(1);   
+static int bm_copy_fd(int from, FILE *to){
+    uint8_t buffer[BM_ASM_CHUNK_SIZE];
+    if (lseek(from, 0, SEEK_SET) < 0){
+        return 0;
     }
+    for (;;){
+        const ssize_t n = read(from, buffer, sizeof(buffer));
+        if (n < 0 && errno == EINTR){
+            continue;
+        }
+        if (n < 0){
+            return 0;
+        }
+        if (n == 0){
+            return fflush(to) == 0;
+        }
+        if (fwrite(buffer, 1, n, to) != (size_t) n){
+            return 0;
+        }
+    }
+}
 
-    char *buffer = malloc(m);
+static Err bm_assemble_lines(Bm *bm, FILE *in, Bm_Asm_Output *out, Label_Table *lt){
+    size_t capacity = BM_ASM_CHUNK_SIZE;
+    char *buffer = malloc(capacity);
     if (buffer == NULL){
-        fprintf(stderr, "ERROR: Could not allocate memory for file `%s` %s\n", strerror(errno));
-        exit(1);      
+        return bm_fail(bm, ERR_OUT_OF_MEMORY, "no memory for the input buffer");
+    }
+
+    Err err = ERR_OK;
+    Bm_Lexer lexer;
+    Bm_Tokens tokens[BM_LEX_BATCH];
+    size_t size = 0;
+    size_t line_number = 0;
+    int eof = 0;
+    while (err == ERR_OK){
+        // every complete line in the buffer, and the rest at the end of the input
+        size_t complete = size;
+        while (!eof && complete > 0 && buffer[complete - 1] != '\n'){
+            complete -= 1;
+        }
+        bm_lexer_init(&lexer, buffer, complete);
+        size_t count = 0;
+        size_t next = 0;
+        while (err == ERR_OK){
+            if (next == count){
+                count = bm_lexer_next(&lexer, tokens, BM_LEX_BATCH);
+                next = 0;
+                if (count == 0){
+                    break;
+                }
+            }
+            line_number += 1;
+
+            Bm_Asm_Line line;
+            err = bm_parse_line(bm, &tokens[next++], line_number, &line);
+            if (err == ERR_OK && line.has_label){
+                Word jmp = -1;
+                err = label_table_define(bm, lt, line.label, out->size, line_number, &jmp);
+                while (err == ERR_OK && jmp >= 0){
+                    if (!bm_asm_patch(out, jmp, out->size, &jmp)){
+                        err = bm_fail(bm, ERR_IO, "%s", strerror(errno));
+                    }
+                }
+            }
+            if (err == ERR_OK && line.has_inst){
+                if (line.has_target){
+                    err = label_table_use(bm, lt, line.target, out->size, line_number, &line.inst.operand);
+                }
+                if (err == ERR_OK && !bm_asm_emit(out, line.inst)){
+                    err = bm_fail(bm, ERR_IO, "%s", strerror(errno));
+                }
+            }
+        }
+        if (err != ERR_OK || eof){
+            break;
+        }
+
+        // keep the unfinished line and read more after it
+        size -= complete;
+        memmove(buffer, buffer + complete, size);
+        if (size == capacity){
+            char *bigger = realloc(buffer, capacity * 2);
+            if (bigger == NULL){
+                err = bm_fail(bm, ERR_OUT_OF_MEMORY, "line %zu does not fit into memory", line_number + 1);
+                break;
+            }
+            buffer = bigger;
+            capacity *= 2;
+        }
+        const size_t n = fread(buffer + size, 1, capacity - size, in);
+        if (n == 0 && ferror(in)){
+            err = bm_fail(bm, ERR_IO, "%s", strerror(errno));
+        }
+        eof = n == 0;
+        size += n;
+    }
+
+    free(buffer);
+    return err;
+}
+
+// Assembles the source read from `in` into a BM_FORMAT_V2_FIXED program
+// written to `out`, without holding either in memory: the input is read in
+// chunks, label names are copied into `lt` and instructions are written as
+// they are assembled, with forward jumps patched in the output afterwards.
+// Memory grows with the number of labels and the longest line only. `out`
+// is written through its file descriptor; if it can't seek (a pipe) or is
+// not open for reading as well ("w+b"), the program goes through a
+// temporary file first. The number of instructions
+// is left in `*program_size`.
+//
+// Returns ERR_SYNTAX, ERR_IO (with errno set) or ERR_OUT_OF_MEMORY with the
+// details in bm_error_message(bm). The program of `bm` is not touched. On
+// failure part of the output may have been written.
+Err bm_assemble_stream(Bm *bm, FILE *in, FILE *out, Label_Table *lt, Word *program_size){
+    label_table_clear(lt);
+    *program_size = 0;
+
+    Bm_Asm_Output *output = malloc(sizeof(*output));
+    if (output == NULL){
+        return bm_fail(bm, ERR_OUT_OF_MEMORY, "no memory for the output buffer");
     }
+    *output = (Bm_Asm_Output) {.fd = fileno(out)};
 
-    if (fseek(f, 0, SEEK_SET) < 0){
-        fprintf(stderr, "ERROR: Could not read file `%s` %s\n", file_path, strerror(errno));
-        exit(1);           
+    FILE *temp = NULL;
+    Err err = ERR_OK;
+    if (fflush(out) != 0){
+        err = bm_fail(bm, ERR_IO, "%s", strerror(errno));
+        goto done;
+    }
+    // jumps are patched by reading them back, so `out` has to be readable too
+    output->base = lseek(output->fd, 0, SEEK_CUR);
+    const int flags = fcntl(output->fd, F_GETFL);
+    if (output->base < 0 || flags < 0 || (flags & O_ACCMODE) != O_RDWR){
+        temp = tmpfile();
+        if (temp == NULL){
+            err = bm_fail(bm, ERR_IO, "%s", strerror(errno));
+            goto done;
+        }
+        output->fd = fileno(temp);
+        output->base = 0;
     }
 
-    size_t n = fread(buffer, 1, m, f);
-    if (ferror(f)){
-        fprintf(stderr, "ERROR: Could not read file `%s` %s\n", file_path, strerror(errno));
-        exit(1);
+    err = bm_assemble_lines(bm, in, output, lt);
+    if (err == ERR_OK){
+        err = label_table_check(bm, lt);
+    }
+    if (err != ERR_OK){
+        goto done;
     }
 
-    fclose(f); 
+    uint8_t header[BM_FILE_HEADER_SIZE];
+    memcpy(header, BM_FILE_MAGIC, BM_FILE_MAGIC_SIZE);
+    bm_write_le(header + 4, BM_FILE_VERSION, 2);
+    bm_write_le(header + 6, BM_FILE_FLAG_FIXED, 2);
+    bm_write_le(header + 8, (uint64_t) output->size, 8);
+    if (!bm_asm_flush(output) || !bm_pwrite_all(output->fd, header, sizeof(header), output->base) ||
+        (temp != NULL
+            ? !bm_copy_fd(output->fd, out)
+            : lseek(output->fd, bm_asm_offset(output, output->size), SEEK_SET) < 0)){
+        err = bm_fail(bm, ERR_IO, "%s", strerror(errno));
+        goto done;
+    }
+    *program_size = output->size;
 
-    return (String_View){
-        .count = n,
-        .data = buffer, 
-    }; 
+done:
+    if (temp != NULL){
+        fclose(temp);
+    }
+    free(output);
+    return err;
+}
+
+// The instructions whose operand is an address in the program. Returns
+// after a `call` land on the instruction that follows it.
+static int bm_inst_is_jump(Inst_Type type){
+    return type == INST_JMP || type == INST_JMP_IF || type == INST_EQ_JMP_IF || type == INST_CALL;
+}
+
+// Superinstruction fusion. Rewrites
+//
+//     push K; plus        -> push_plus K
+//     push K; mult        -> push_mult K
+//     dup 1; dup 1; plus  -> dup2_plus
+//     eq; jmp_if L        -> eq_jmp_if L
+//
+// in place. A sequence is only fused if none of its instructions but the first
+// is a jump target or has a label, so control never enters a superinstruction
+// in the middle; no `call` is part of one, so no `ret` does that either.
+// Jump and call operands and the addresses in `lt` (may be NULL) are
+// remapped to the new numbering. Returns the number of superinstructions
+// created (none if memory ran out).
+size_t bm_fuse_program(Bm *bm, Label_Table *lt){
+    const Word n = bm->program_size;
+    if (n == 0){
+        return 0;
+    }
+
+    // a shared program is never written in place
+    bm_debug_detach(bm);
+    if (bm_reserve_program(bm, n) < 0){
+        return 0;
+    }
+
+    // boundary[i]: something other than falling through reaches instruction i
+    char *boundary = calloc(n, 1);
+    // new_index[i]: the address instruction i ends up at (new_index[n] is the end)
+    Word *new_index = malloc(sizeof(new_index[0]) * (n + 1));
+    if (boundary == NULL || new_index == NULL){
+        free(boundary);
+        free(new_index);
+        return 0;
+    }
+
+    for (Word i = 0; i < n; ++i){
+        const Inst inst = bm->program[i];
+        if (bm_inst_is_jump(inst.type) && inst.operand >= 0 && inst.operand < n){
+            boundary[inst.operand] = 1;
+        }
+    }
+    if (lt != NULL){
+        for (size_t i = 0; i < lt->labels_size; ++i){
+            if (lt->labels[i].addr >= 0 && lt->labels[i].addr < n){
+                boundary[lt->labels[i].addr] = 1;
+            }
+        }
+    }
+
+    size_t fused = 0;
+    Word out = 0;
+    Word i = 0;
+    while (i < n){
+        const Inst *p = &bm->program[i];
+        const Word left = n - i;
+        Inst result = *p;
+        Word length = 1;
+
+        if (left >= 3 && !boundary[i + 1] && !boundary[i + 2] &&
+            p[0].type == INST_DUP && p[0].operand == 1 &&
+            p[1].type == INST_DUP && p[1].operand == 1 &&
+            p[2].type == INST_PLUS){
+            result = (Inst) {.type = INST_DUP2_PLUS};
+            length = 3;
+        } else if (left >= 2 && !boundary[i + 1]){
+            if (p[0].type == INST_PUSH && p[1].type == INST_PLUS){
+                result = (Inst) {.type = INST_PUSH_PLUS, .operand = p[0].operand};
+                length = 2;
+            } else if (p[0].type == INST_PUSH && p[1].type == INST_MULT){
+                result = (Inst) {.type = INST_PUSH_MULT, .operand = p[0].operand};
+                length = 2;
+            } else if (p[0].type == INST_EQ && p[1].type == INST_JMP_IF){
+                result = (Inst) {.type = INST_EQ_JMP_IF, .operand = p[1].operand};
+                length = 2;
+            }
+        }
+
+        for (Word j = 0; j < length; ++j){
+            new_index[i + j] = out;
+        }
+        if (length > 1){
+            fused += 1;
+        }
+        bm->program[out++] = result;
+        i += length;
+    }
+    new_index[n] = out;
+
+    for (Word j = 0; j < out; ++j){
+        Inst *inst = &bm->program[j];
+        if (bm_inst_is_jump(inst->type) && inst->operand >= 0 && inst->operand <= n){
+            inst->operand = new_index[inst->operand];
+        }
+    }
+    if (lt != NULL){
+        for (size_t j = 0; j < lt->labels_size; ++j){
+            if (lt->labels[j].addr >= 0 && lt->labels[j].addr <= n){
+                lt->labels[j].addr = new_index[lt->labels[j].addr];
+            }
+        }
+    }
+    if (bm->debug != NULL){
+        // a fused instruction keeps the line of its first part
+        for (Word j = 0; j < n; ++j){
+            if (j == 0 || new_index[j] != new_index[j - 1]){
+                bm->debug->lines[new_index[j]] = bm->debug->lines[j];
+            }
+        }
+        for (size_t j = 0; j < bm->debug->labels_size; ++j){
+            Bm_Debug_Label *label = &bm->debug->labels[j];
+            if (label->addr >= 0 && label->addr <= n){
+                label->addr = new_index[label->addr];
+            }
+        }
+    }
+
+    free(boundary);
+    free(new_index);
+
+    bm->program_size = out;
+    bm_program_changed(bm);
+    return fused;
+}
+
+// `a op b` as the VM computes it, if that is not an error.
+static int bm_fold(Inst_Type op, Word a, Word b, Word *result){
+    switch (op){
+    case INST_PLUS:
+    case INST_PUSH_PLUS:
+        *result = bm_word_plus(a, b);
+        return 1;
+    case INST_MINUS:
+        *result = bm_word_minus(a, b);
+        return 1;
+    case INST_MULT:
+    case INST_PUSH_MULT:
+        *result = bm_word_mult(a, b);
+        return 1;
+    case INST_DIV:
+        if (b == 0){
+            return 0;
+        }
+        *result = b == -1 ? (Word) (0 - (uint64_t) a) : a / b;
+        return 1;
+    case INST_NOP:
+    case INST_PUSH:
+    case INST_DUP:
+    case INST_JMP:
+    case INST_JMP_IF:
+    case INST_EQ:
+    case INST_HALT:
+    case INST_PRINT_DEBUG:
+    case INST_DUP2_PLUS:
+    case INST_EQ_JMP_IF:
+    case INST_CALL:
+    case INST_RET:
+    case INST_LOAD_LOCAL:
+    case INST_STORE_LOCAL:
+    case INST_LOAD:
+    case INST_STORE:
+    case INST_NATIVE:
+    default:
+        return 0;
+    }
 }
 
-// #endif
\ No newline at end of file
+// The optimizer works on the whole program at once:
+//
+// 1. Jump threading: a jump to a `jmp` (possibly through `nop`s) jumps to
+//    where that one goes instead, unless the chain loops.
+// 2. Reachability from instruction 0 over the threaded control flow graph.
+//    `halt`, `jmp` and `ret` don't fall through, `call` does, since that is
+//    where its `ret` lands; jumps outside of the program lead nowhere.
+// 3. `jmp`s over nothing but removed instructions are removed too.
+// 4. Emission of the reachable instructions but `nop`s, folding
+//    `push a; push b; op` (and `push a; push_plus b`, `push a; push_mult b`)
+//    into `push (a op b)` as long as control can only enter the sequence at
+//    its first instruction. Folds repeat on what they emit, so nested
+//    constant expressions become a single push. Division by zero is left
+//    for run time.
+//
+// new_index[i] is where instruction i ends up, or the next instruction that
+// is kept if it is removed, so jumps and labels to removed `nop`s move on
+// to what follows them.
+Err bm_optimize_program(Bm *bm, Label_Table *lt, Bm_Optimize_Stats *stats){
+    *stats = (Bm_Optimize_Stats) {0};
+    const Word n = bm->program_size;
+    if (n == 0){
+        return ERR_OK;
+    }
+
+    // a shared program is never written in place
+    bm_debug_detach(bm);
+    if (bm_reserve_program(bm, n) < 0){
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    Word *new_index = malloc(sizeof(new_index[0]) * (n + 1));
+    Word *origin = malloc(sizeof(origin[0]) * n);       // origin[j]: the first instruction behind output j
+    Word *entries = malloc(sizeof(entries[0]) * (n + 1)); // entries[i]: jump targets before instruction i
+    Word *work = malloc(sizeof(work[0]) * n);
+    char *live = calloc(n, 1);
+    if (new_index == NULL || origin == NULL || entries == NULL || work == NULL || live == NULL){
+        free(new_index);
+        free(origin);
+        free(entries);
+        free(work);
+        free(live);
+        return ERR_OUT_OF_MEMORY;
+    }
+    Inst *program = bm->program;
+
+    for (Word i = 0; i < n; ++i){
+        if (!bm_inst_is_jump(program[i].type)){
+            continue;
+        }
+        Word target = program[i].operand;
+        for (Word steps = 0; steps <= n && target >= 0 && target < n; ++steps){
+            if (program[target].type == INST_NOP){
+                target += 1;
+            } else if (program[target].type == INST_JMP){
+                target = program[target].operand;
+            } else {
+                break;
+            }
+        }
+        // the chain ends in a loop of jmps and nops: keep the original jump
+        if (target >= 0 && target < n && (program[target].type == INST_NOP || program[target].type == INST_JMP)){
+            continue;
+        }
+        if (target != program[i].operand){
+            // only jumps past a `jmp` count; skipping `nop`s is their removal
+            Word t = program[i].operand;
+            while (t >= 0 && t < n && program[t].type == INST_NOP){
+                t += 1;
+            }
+            stats->threaded += t != target;
+            program[i].operand = target;
+        }
+    }
+
+    Word work_size = 0;
+    live[0] = 1;
+    work[work_size++] = 0;
+    while (work_size > 0){
+        const Word i = work[--work_size];
+        const Inst inst = program[i];
+        Word next[2];
+        size_t next_size = 0;
+        if (bm_inst_is_jump(inst.type)){
+            next[next_size++] = inst.operand;
+        }
+        if (inst.type != INST_JMP && inst.type != INST_HALT && inst.type != INST_RET){
+            next[next_size++] = i + 1;
+        }
+        for (size_t k = 0; k < next_size; ++k){
+            if (next[k] >= 0 && next[k] < n && !live[next[k]]){
+                live[next[k]] = 1;
+                work[work_size++] = next[k];
+            }
+        }
+    }
+
+    // live[i] == 2: removed; `entries` counts the kept instructions first
+    entries[0] = 0;
+    for (Word i = 0; i < n; ++i){
+        entries[i + 1] = entries[i] + (live[i] && program[i].type != INST_NOP);
+    }
+    for (Word i = 0; i < n; ++i){
+        const Word target = program[i].operand;
+        if (live[i] && program[i].type == INST_JMP && target > i && target <= n &&
+            entries[target] - entries[i + 1] == 0){
+            live[i] = 2;
+            stats->jumps += 1;
+        }
+    }
+
+    memset(entries, 0, sizeof(entries[0]) * (n + 1));
+    for (Word i = 0; i < n; ++i){
+        if (live[i] == 1 && bm_inst_is_jump(program[i].type) && program[i].operand >= 0 && program[i].operand < n){
+            entries[program[i].operand + 1] += 1;
+        }
+    }
+    for (Word i = 0; i < n; ++i){
+        entries[i + 1] += entries[i];
+    }
+
+    // the output never gets ahead of the input, so it is written in place
+    Word out = 0;
+    for (Word i = 0; i < n; ++i){
+        new_index[i] = out;
+        const Inst inst = program[i];
+        if (!live[i]){
+            stats->unreachable += 1;
+            continue;
+        }
+        if (live[i] == 2){
+            continue;
+        }
+        if (inst.type == INST_NOP){
+            stats->nops += 1;
+            continue;
+        }
+
+        // push a; push b; op (the two pushes are the last two outputs)
+        Word folded = 0;
+        if (out >= 2 && program[out - 2].type == INST_PUSH && program[out - 1].type == INST_PUSH &&
+            entries[i + 1] - entries[origin[out - 2] + 1] == 0 &&
+            bm_fold(inst.type, program[out - 2].operand, program[out - 1].operand, &folded) &&
+            inst.type != INST_PUSH_PLUS && inst.type != INST_PUSH_MULT){
+            program[out - 2].operand = folded;
+            out -= 1;
+            stats->folded += 1;
+            continue;
+        }
+        // push a; push_plus b or push_mult b
+        if (out >= 1 && program[out - 1].type == INST_PUSH &&
+            (inst.type == INST_PUSH_PLUS || inst.type == INST_PUSH_MULT) &&
+            entries[i + 1] - entries[origin[out - 1] + 1] == 0 &&
+            bm_fold(inst.type, program[out - 1].operand, inst.operand, &folded)){
+            program[out - 1].operand = folded;
+            stats->folded += 1;
+            continue;
+        }
+
+        origin[out] = i;
+        program[out++] = inst;
+    }
+    new_index[n] = out;
+
+    for (Word j = 0; j < out; ++j){
+        Inst *inst = &program[j];
+        if (bm_inst_is_jump(inst->type) && inst->operand >= 0 && inst->operand <= n){
+            inst->operand = new_index[inst->operand];
+        }
+    }
+    if (lt != NULL){
+        for (size_t j = 0; j < lt->labels_size; ++j){
+            if (lt->labels[j].addr >= 0 && lt->labels[j].addr <= n){
+                lt->labels[j].addr = new_index[lt->labels[j].addr];
+            }
+        }
+    }
+    if (bm->debug != NULL){
+        // a folded instruction keeps the line of its first push
+        for (Word j = 0; j < out; ++j){
+            bm->debug->lines[j] = bm->debug->lines[origin[j]];
+        }
+        for (size_t j = 0; j < bm->debug->labels_size; ++j){
+            Bm_Debug_Label *label = &bm->debug->labels[j];
+            if (label->addr >= 0 && label->addr <= n){
+                label->addr = new_index[label->addr];
+            }
+        }
+    }
+
+    free(new_index);
+    free(origin);
+    free(entries);
+    free(work);
+    free(live);
+
+    bm->program_size = out;
+    bm_program_changed(bm);
+    return ERR_OK;
+}
@@ -1,100 +1,387 @@
 #ifndef BM_H_
 #define BM_H_
 
+// libbm: the bm virtual machine as a library.
+//
+// Every VM lives behind its own `Bm` handle and the library keeps no other
+// state, so any number of VMs can run at once as long as each one is only
+// used by one thread at a time. Nothing here exits or asserts on bad input:
+// loaders and the assembler return an `Err` and leave a description in
+// bm_error_message(), execution errors are returned as an `Err`.
+
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 
 #define ARRAY_SIZE(xs) (sizeof(xs)/sizeof((xs)[0]))
-#define BM_STACK_CAPACITY 1024
-#define BM_PROGRAM_CAPACITY 1024
-#define LABEL_CAPACITY 1024
-#define UNRESOLVED_JMPS_CAPACITY 1024
-
+#define BM_STACK_CAPACITY 1024      // default for bm_create()
+#define BM_PROGRAM_CAPACITY 1024    // default for bm_create(), programs grow past it
 
 typedef int64_t Word;
 
 typedef enum {
     ERR_OK = 0,          // everything is okay :)
-    ERR_STACK_OVERFLOW, 
-    ERR_STACK_UNDERFLOW, 
+    ERR_STACK_OVERFLOW,
+    ERR_STACK_UNDERFLOW,
     ERR_ILLEGAL_INST,
-    ERR_DIV_BY_ZERO, 
-    ERR_ILLEGAL_INST_ACCESS, 
-    ERR_ILLEGAL_OPERAND, 
+    ERR_DIV_BY_ZERO,
+    ERR_ILLEGAL_INST_ACCESS,
+    ERR_ILLEGAL_OPERAND,
+    ERR_IO,                 // the OS refused, details in errno
+    ERR_BAD_FORMAT,         // not a .bm file, or a corrupted one
+    ERR_OUT_OF_MEMORY,
+    ERR_SYNTAX,             // the assembler did not understand its input
+    ERR_FUEL_EXHAUSTED,     // bm_execute_slice(): the limit ran out first
+    ERR_ILLEGAL_MEMORY_ACCESS,  // load or store outside of bm_set_memory()
 } Err;
 
 const char *err_as_cstr(Err err);
 
 typedef enum {
-    INST_NOP = 0, 
-    INST_PUSH, 
-    INST_DUP, 
+    INST_NOP = 0,
+    INST_PUSH,
+    INST_DUP,
     INST_PLUS,
     INST_MINUS,
     INST_MULT,
-    INST_DIV, 
+    INST_DIV,
     INST_JMP,         // unconditional jmp for loops
-    INST_JMP_IF, 
-    INST_EQ, 
-    INST_HALT, 
-    INST_PRINT_DEBUG,  
+    INST_JMP_IF,
+    INST_EQ,
+    INST_HALT,
+    INST_PRINT_DEBUG,
+
+    // Superinstructions produced by bm_fuse_program(). Each one is a single
+    // instruction that fails with the error of its sequence, but before it
+    // changes anything: at its own `ip`, with the stack it started from.
+    INST_PUSH_PLUS,     // push K; plus
+    INST_PUSH_MULT,     // push K; mult
+    INST_DUP2_PLUS,     // dup 1; dup 1; plus
+    INST_EQ_JMP_IF,     // eq; jmp_if L
+
+    // Calls, locals and memory. `call L` saves the return address and the
+    // frame pointer in a frame of its own and points the frame pointer at
+    // the top of the stack, so the arguments are locals -1, -2, ... and the
+    // values the function pushes are locals 0, 1, ... `ret N` returns the
+    // top of the stack in place of everything the function pushed and its
+    // N arguments. Outside of calls the frame pointer is 0, so locals are
+    // the stack from the bottom.
+    INST_CALL,          // call L
+    INST_RET,           // ret N
+    INST_LOAD_LOCAL,    // load_local K: push stack[fp + K]
+    INST_STORE_LOCAL,   // store_local K: pop into stack[fp + K]
+    INST_LOAD,          // addr -- memory[addr]
+    INST_STORE,         // addr value --
+
+    INST_NATIVE,        // native N: the host function bound to N, see bm_bind_native()
 } Inst_Type;
 
 const char *inst_type_as_cstr(Inst_Type type);
 
+// Whether the operand of an instruction of this type means anything.
+// Returns -1 for types that don't exist.
+int inst_type_has_operand(Inst_Type type);
+
 typedef struct {
-    Inst_Type type; 
-    Word operand; 
+    Inst_Type type;
+    Word operand;
 } Inst;
 
+#define MAKE_INST_PUSH(value) {.type = INST_PUSH, .operand = (value)}
+#define MAKE_INST_PLUS {.type = INST_PLUS }
+#define MAKE_INST_MINUS {.type = INST_MINUS }
+#define MAKE_INST_MULT {.type = INST_MULT }
+#define MAKE_INST_DIV {.type = INST_DIV }
+#define MAKE_INST_JMP(addr) {.type = INST_JMP, .operand = (addr)}
+#define MAKE_INST_HALT(addr) {.type = INST_HALT, .operand = (addr)}
+#define MAKE_INST_DUP(addr) {.type = INST_DUP, .operand = (addr)}
+
+// Bump allocator for callers that want every VM in one caller-owned block.
+// Nothing is freed individually; reset `size` to reuse the whole block.
 typedef struct {
-    Word stack[BM_STACK_CAPACITY]; 
-    Word stack_size; 
+    char *data;
+    size_t capacity;
+    size_t size;
+} Arena;
+
+Arena arena_from_buffer(void *buffer, size_t capacity);
+void *arena_alloc(Arena *arena, size_t size);
+
+// A virtual machine: a stack, a program and the caches built from it.
+typedef struct Bm Bm;
+
+// Creates an empty VM with room for `stack_capacity` values, as many nested
+// calls and `program_capacity` instructions (the program grows past it).
+// With an `arena` the VM itself, its stack, frames and program storage are
+// allocated from it; otherwise from malloc. Returns NULL if that fails.
+Bm *bm_create(Arena *arena, Word stack_capacity, Word program_capacity);
+
+// Empties the stack and the call frames, rewinds to the first instruction
+// and zeroes bm_inst_count(). The program, everything derived from it and
+// the memory stay.
+void bm_reset(Bm *bm);
+
+void bm_destroy(Bm *bm);
+
+Word bm_stack_size(const Bm *bm);
+Word bm_stack_capacity(const Bm *bm);
+const Word *bm_stack(const Bm *bm);     // bottom first
+Err bm_push(Bm *bm, Word value);
+Word bm_ip(const Bm *bm);
+int bm_halted(const Bm *bm);
+Word bm_program_size(const Bm *bm);
+const Inst *bm_program(const Bm *bm);   // valid until the program changes
+
+typedef struct {
+    Word return_ip;
+    Word fp;        // frame pointer of the caller
+} Bm_Frame;
+
+Word bm_fp(const Bm *bm);
+Word bm_frames_size(const Bm *bm);
+const Bm_Frame *bm_frames(const Bm *bm);    // outermost first
+
+// The memory of `load` and `store`: `size` words at `memory`, owned by the
+// caller and used in place, so VMs may share it. A VM has none until this
+// is called.
+void bm_set_memory(Bm *bm, Word *memory, Word size);
+Word *bm_memory(const Bm *bm);
+Word bm_memory_size(const Bm *bm);
 
-    Inst program[BM_PROGRAM_CAPACITY]; 
-    Word program_size; 
-    Word ip; 
+// A host function for `native N`. `args` points at its arguments on the
+// stack, bottom first, and it leaves its results in args[0], args[1], ...
+// in their place; there is room for as many as it declared. It may use the
+// memory of `bm`, but the rest of the VM is not up to date while it runs.
+// Anything but ERR_OK stops the VM at the `native` with the arguments
+// still on the stack.
+typedef Err (*Bm_Native)(Bm *bm, Word *args, void *data);
 
-    int halt; 
-} Bm;
+#define BM_NATIVE_MAX_ARITY 16      // of arguments and of results
+#define BM_NATIVE_NAME_CAPACITY 32  // including the NUL
 
-#define MAKE_INST_PUSH(value)    ((Inst) {.type = INST_PUSH, .operand = (value)})
-#define MAKE_INST_PLUS           ((Inst) {.type = INST_PLUS})
-#define MAKE_INST_MINUS          ((Inst) {.type = INST_MINUS})
-#define MAKE_INST_MULT           ((Inst) {.type = INST_MULT})
-#define MAKE_INST_DIV            ((Inst) {.type = INST_DIV})
-#define MAKE_INST_JMP(addr)      ((Inst) {.type = INST_JMP, .operand = (addr)})
-#define MAKE_INST_HALT(addr)     ((Inst) {.type = INST_HALT, .operand = (addr)})
-#define MAKE_INST_DUP(addr)      ((Inst) {.type = INST_DUP, .operand = (addr)})
+// Binds `fn` to `native index`, replacing what was there, taking `arity`
+// arguments and leaving `results`. With a `name` the assembler also accepts
+// `native name`; names can't start with a digit or `-`. Returns
+// ERR_ILLEGAL_OPERAND for a negative index, an arity or name out of bounds
+// or a name bound to another index, and ERR_OUT_OF_MEMORY. Binding drops
+// the verification and the JIT code of the program, so bind first.
+Err bm_bind_native(Bm *bm, Word index, const char *name, Bm_Native fn, int arity, int results, void *data);
+// -1 if nothing is bound under `name`.
+Word bm_native_index(const Bm *bm, const char *name);
+// NULL if nothing is bound to `index` or it has no name.
+const char *bm_native_name(const Bm *bm, Word index);
 
+// Natives that come with libbm, at these indices after bm_bind_std_natives():
+//
+//     min       a b -- min(a, b)
+//     max       a b -- max(a, b)
+//     abs       a -- |a|                wrapping like the VM
+//     mod       a b -- a % b            ERR_DIV_BY_ZERO for b = 0
+//     hash      a -- hash(a)            a 64 bit mix of a
+//     mem_sum   addr n -- sum           of memory[addr .. addr+n), wrapping
+//     mem_fill  addr n value --         memory[addr .. addr+n) = value
+//
+// mem_sum and mem_fill return ERR_ILLEGAL_MEMORY_ACCESS unless the whole
+// range is in the memory. Hosts bind their own from COUNT_BM_STD_NATIVES up.
+typedef enum {
+    BM_NATIVE_MIN = 0,
+    BM_NATIVE_MAX,
+    BM_NATIVE_ABS,
+    BM_NATIVE_MOD,
+    BM_NATIVE_HASH,
+    BM_NATIVE_MEM_SUM,
+    BM_NATIVE_MEM_FILL,
+    COUNT_BM_STD_NATIVES,
+} Bm_Std_Native;
+
+Err bm_bind_std_natives(Bm *bm);
+
+// Where `print_debug` goes. Values are formatted into a buffer of the VM,
+// which goes out in one piece when it fills up, on bm_flush_output() and on
+// bm_destroy(). By default that is a write() to stdout, after flushing the
+// stdio buffer of stdout so output stays in order; flush the VM before
+// writing to stdout yourself.
+#define BM_OUTPUT_CAPACITY (16*1024)
+
+typedef enum {
+    BM_OUTPUT_TEXT = 0,     // one decimal per line, as printf("%ld\n")
+    BM_OUTPUT_BINARY,       // the raw Word, in host byte order
+} Bm_Output_Mode;
+
+// Takes one batch of output. Anything but ERR_OK is reported by the next
+// bm_flush_output(); the batch is dropped either way.
+typedef Err (*Bm_Output)(void *data, const char *bytes, size_t size);
+
+// Both flush what is buffered first and return what that flush returns. A
+// NULL `fn` goes back to the file descriptor.
+Err bm_set_output_fd(Bm *bm, int fd);
+Err bm_set_output_callback(Bm *bm, Bm_Output fn, void *data);
+void bm_set_output_mode(Bm *bm, Bm_Output_Mode mode);
+// Sends out what is buffered. Returns the first error since the last call:
+// ERR_IO with errno set if a write() failed, or what the callback returned.
+Err bm_flush_output(Bm *bm);
+
+// Instructions the engines completed since bm_create() or bm_reset(). The
+// one that stopped execution with an error is not counted.
+Word bm_inst_count(const Bm *bm);
+
+// What went wrong in the last failed load, decode or assembly.
+const char *bm_error_message(const Bm *bm);
+
+typedef enum {
+    BM_ENGINE_SWITCH = 0,   // bm_execute_program(), the reference
+    BM_ENGINE_THREADED,     // bm_execute_program_threaded()
+    BM_ENGINE_JIT,          // bm_execute_program_jit()
+    BM_ENGINE_TOS,          // bm_execute_program_tos()
+    BM_ENGINE_BLOCK,        // bm_execute_program_blocks()
+    COUNT_BM_ENGINES,
+} Bm_Engine;
+
+const char *bm_engine_as_cstr(Bm_Engine engine);
+int bm_engine_from_cstr(const char *name, Bm_Engine *engine);
+
+// The engines run at most `limit` instructions (no limit if negative) and
+// stop at the first error, leaving `ip` at the faulting instruction.
 Err bm_execute_inst(Bm *bm);
 Err bm_execute_program(Bm *bm, int limit);
-void bm_dump_stack(FILE *stream, const Bm *bm);
-void bm_load_program_from_memory(Bm *bm, Inst *program, size_t program_size);
-void bm_load_program_from_file(Bm *bm, const char *file_path);
-void bm_save_program_to_file(const Bm *bm, const char *file_path);
+Err bm_execute_program_threaded(Bm *bm, int limit);
+Err bm_execute_program_jit(Bm *bm, int limit);
+// Keeps the top two values of the stack in registers while it runs.
+Err bm_execute_program_tos(Bm *bm, int limit);
+// Checks the stack and the limit once per basic block instead of once per
+// instruction, wherever they allow the whole block.
+Err bm_execute_program_blocks(Bm *bm, int limit);
+Err bm_execute_program_with(Bm *bm, Bm_Engine engine, int limit);
 
+// bm_execute_program_with() for programs that are run a piece at a time:
+// returns ERR_FUEL_EXHAUSTED instead of ERR_OK if the VM used up all of
+// `fuel` (at least 0) without halting, so it can be resumed with another call.
+Err bm_execute_slice(Bm *bm, Bm_Engine engine, int fuel);
+
+// Runs many VMs on one thread in slices of bm_execute_slice(): each turn
+// goes to the next VM that hasn't stopped, round-robin, with `slice` times
+// its priority in fuel. Zero-initialize, set `engine` and `slice`, then
+// bm_scheduler_add() the VMs. They stay owned by the caller.
 typedef struct {
-    size_t count;
-    const char *data;
-} String_View;
+    Bm *bm;
+    int priority;   // slices per turn, at least 1
+    Err err;        // ERR_FUEL_EXHAUSTED until the VM halts or fails
+} Bm_Task;
+
+typedef struct {
+    Bm_Engine engine;
+    int slice;              // fuel per slice, at least 1
+    Bm_Task *tasks;         // in order of bm_scheduler_add()
+    size_t tasks_size;
+    size_t tasks_capacity;
+    size_t *runnable;       // indices into `tasks`, in turn order
+    size_t runnable_size;
+    size_t next;            // position in `runnable` of the next turn
+} Bm_Scheduler;
+
+// Returns the index of the task or -1 if out of memory.
+long bm_scheduler_add(Bm_Scheduler *scheduler, Bm *bm, int priority);
+// Gives one turn to the next runnable task and returns its index, or -1 if
+// none is left.
+long bm_scheduler_step(Bm_Scheduler *scheduler);
+// Runs turns until no task is runnable or `turns` of them ran (no limit if
+// negative). Returns the number of runnable tasks left.
+size_t bm_scheduler_run(Bm_Scheduler *scheduler, long turns);
+void bm_scheduler_free(Bm_Scheduler *scheduler);
+
+// Per-instruction counters of bm_execute_program_profiled().
+typedef struct {
+    uint64_t count;     // executions that completed
+    uint64_t ticks;     // time spent in them, see Bm_Profile.ticks_unit
+    uint64_t taken;     // jmp_if and eq_jmp_if: executions that jumped
+} Bm_Profile_Entry;
 
 typedef struct {
-    String_View name; 
-    Word addr;
-} Label; 
+    Bm_Profile_Entry *entries;  // entries[i] belongs to instruction i
+    Word size;
+    const char *ticks_unit;     // "cycles" (time stamp counter) or "ns"
+    uint64_t overhead;          // clock cost subtracted from every sample
+} Bm_Profile;
+
+// Zeroed counters for a program of up to `program_size` instructions.
+// Counters add up over any number of runs until bm_profile_free().
+Err bm_profile_init(Bm_Profile *profile, Word program_size);
+void bm_profile_free(Bm_Profile *profile);
+
+// The reference engine with every instruction counted and timed. Returns
+// ERR_ILLEGAL_OPERAND if the profile is smaller than the program.
+Err bm_execute_program_profiled(Bm *bm, int limit, Bm_Profile *profile);
+
+Err bm_verify_program(Bm *bm, Word *fault_inst);
+// The stack, one value per line. Does not flush the output of `bm`.
+void bm_dump_stack(FILE *stream, const Bm *bm);
+
+#define BM_FILE_MAGIC "BMBC"
+#define BM_FILE_MAGIC_SIZE 4
+#define BM_FILE_HEADER_SIZE 16
+#define BM_FILE_VERSION 2
+#define BM_FILE_FLAG_FIXED 0x1
+#define BM_FILE_FLAG_DEBUG 0x2    // source locations after the instructions
+#define BM_FILE_FIXED_INST_SIZE 16
+
+typedef enum {
+    BM_FORMAT_V1 = 1,
+    BM_FORMAT_V2 = 2,
+    BM_FORMAT_V2_FIXED = 3,
+} Bm_File_Format;
 
 typedef struct {
-    Word addr;
-    String_View label; 
-} Unresolved_Jmp; 
+    uint8_t *data;
+    size_t size;
+    size_t capacity;
+} Bm_Bytes;
+
+Err bm_load_program_from_memory(Bm *bm, const Inst *program, size_t program_size);
+
+// Makes `bm` run the program of `owner` without copying it, together with
+// its bm_verify_program() result. Any number of VMs on any threads can share
+// one program as long as `owner` outlives them and its program is neither
+// changed nor re-verified meanwhile. Sharing ends with the next load into
+// `bm`; editing the program (bm_fuse_program()) copies it first. Sharing the
+// same program again keeps the threaded and JIT code built for it.
+void bm_share_program(Bm *bm, const Bm *owner);
+Err bm_load_program_from_file(Bm *bm, const char *file_path);
+Err bm_map_program_from_file(Bm *bm, const char *file_path);
+Err bm_save_program_to_file(const Bm *bm, const char *file_path);
+Err bm_save_program_to_file_as(const Bm *bm, const char *file_path, Bm_File_Format format);
+// Also stores bm_source_location() information; v2 formats only.
+Err bm_save_program_to_file_with_debug(const Bm *bm, const char *file_path, Bm_File_Format format);
+Err bm_encode_program(const Bm *bm, Bm_Bytes *out, uint16_t flags, Word *bad_inst);
+Err bm_decode_program(Bm *bm, const uint8_t *data, size_t size);
+
+// Snapshots: the stack, ip, halt flag and bm_inst_count() of a VM, its call
+// frames and the used part of its memory, tied to its program by
+// bm_program_hash() instead of a copy of it.
+#define BM_SNAPSHOT_MAGIC "BMSS"
+#define BM_SNAPSHOT_VERSION 1
+#define BM_SNAPSHOT_HEADER_SIZE 48
+#define BM_SNAPSHOT_FLAG_HALT 0x1
+#define BM_SNAPSHOT_FLAG_CALLS 0x2    // frames and memory follow the stack
+
+// 64 bit hash of the program, the same on every host. Computed once per
+// program and VM.
+uint64_t bm_program_hash(Bm *bm);
+Err bm_encode_snapshot(Bm *bm, Bm_Bytes *out);
+// Puts `bm` back into the state of the snapshot at `data`, which can be a
+// read-only mapping shared by any number of VMs and processes: only the live
+// stack values are copied. Returns ERR_BAD_FORMAT for a broken snapshot or
+// one of a different program, ERR_STACK_OVERFLOW if its stack or frames
+// don't fit and ERR_ILLEGAL_MEMORY_ACCESS if its memory doesn't; `bm` is left
+// alone in all of these cases. Memory past what the snapshot holds is zeroed.
+Err bm_restore_snapshot(Bm *bm, const uint8_t *data, size_t size);
+Err bm_save_snapshot(Bm *bm, const char *file_path);
+// bm_restore_snapshot() of a file, read with a single read().
+Err bm_load_snapshot(Bm *bm, const char *file_path);
 
 typedef struct {
-    Label labels[LABEL_CAPACITY]; 
-    size_t labels_size; 
-    Unresolved_Jmp unresolved_jmps[UNRESOLVED_JMPS_CAPACITY]; 
-    size_t unresolved_jmps_size; 
-} Label_Table; 
+    size_t count;
+    const char *data;
+} String_View;
 
 String_View cstr_as_sv(const char *cstr);
 String_View sv_trim_left(String_View sv);
@@ -102,9 +389,65 @@ String_View sv_trim_right(String_View sv);
 String_View sv_trim(String_View sv);
 String_View sv_chop_by_delim(String_View *sv, char delim);
 int sv_eq(String_View a, String_View b);
-int sv_to_int(String_View sv);
+// `sv` as a decimal number, optionally negative; 0 if it is anything else
+// or does not fit into a Word.
+Word sv_to_int(String_View sv);
+
+typedef struct {
+    String_View name;
+    Word addr;      // -1 until the label is defined
+    Word jmps;      // until then the last jump to it, see bm_translate_source()
+    size_t line;    // where it is defined, or first jumped to
+} Label;
+
+typedef struct Label_Names Label_Names;
+
+// Labels of the program being assembled, hashed by name. Zero-initialize
+// before use and release with label_table_free(). The names are copies kept
+// in `names`, so the table does not depend on the source.
+typedef struct {
+    Label *labels;          // in order of first appearance
+    size_t labels_size;
+    size_t labels_capacity;
+    size_t *slots;          // open addressing: index into `labels` + 1, 0 if free
+    size_t slots_capacity;  // a power of two, at least twice `labels_size`
+    Label_Names *names;
+} Label_Table;
+
+void label_table_free(Label_Table *lt);
+
+// Assembles `source`, emptying `lt` first and leaving the labels in it.
+Err bm_translate_source(String_View source, Bm *bm, Label_Table *lt);
+
+// Assembles `in` straight into a BM_FORMAT_V2_FIXED file on `out`, reading
+// and writing as it goes, so neither the source nor the program is ever held
+// in memory. `out` may be a pipe. Errors are described in bm_error_message(bm);
+// the program of `bm` is left alone.
+Err bm_assemble_stream(Bm *bm, FILE *in, FILE *out, Label_Table *lt, Word *program_size);
+size_t bm_fuse_program(Bm *bm, Label_Table *lt);
+
+// What bm_optimize_program() did.
+typedef struct {
+    size_t folded;          // arithmetic instructions computed at compile time
+    size_t nops;            // nops removed
+    size_t unreachable;     // instructions removed that execution can't reach
+    size_t threaded;        // jumps retargeted past the jmps they led to
+    size_t jumps;           // jmps removed because they led to the next instruction
+} Bm_Optimize_Stats;
+
+// Optimizes the program in place, keeping its results and errors: except
+// for bm_inst_count(), a program that only overflowed the stack in the
+// middle of a folded expression and `ip` inside the removed code, nothing a
+// caller can see changes. Jump operands, the addresses in `lt` (may be
+// NULL) and the source locations follow the new numbering. Returns
+// ERR_OUT_OF_MEMORY with the program untouched if memory ran out.
+Err bm_optimize_program(Bm *bm, Label_Table *lt, Bm_Optimize_Stats *stats);
 
-void bm_translate_source(String_View source, Bm *bm,  Label_Table *lt);
-String_View slurp_file(const char *file_path);
+// Source line (1-based) and enclosing label of instruction `addr` of a
+// program assembled by bm_translate_source() or loaded from a file saved
+// with bm_save_program_to_file_with_debug(); `label` is NULL before the first
+// label. A file's information is decoded on the first call. Returns 0 if
+// the VM has no such information.
+int bm_source_location(Bm *bm, Word addr, Word *line, const char **label);
 
 #endif // BM_H_
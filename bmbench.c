@@ -0,0 +1,1301 @@
+#define _DEFAULT_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+
+#include "./bm.h"
+
+char *shift(int *argc, char ***argv){
+    assert(*argc > 0);
+    char *result = **argv; 
+    *argv += 1; 
+    *argc -= 1; 
+    return result; 
+}
+
+void usage(FILE *stream, const char *program){
+    fprintf(stream, "Usage: %s <exec|asm|load|startup|snapshot|sched|calls|natives|print|all> [-n <instructions>] [-r <runs>] [-d <dir>] [-f <text|json>] [-h]\n", program);
+    fprintf(stream, "    exec       ns and cycles per instruction of every engine on dispatch, arithmetic, dup and branch loops\n");
+    fprintf(stream, "    asm        assembler throughput on a generated .ebasm source of about <instructions> lines\n");
+    fprintf(stream, "    load       size on disk and load time of a generated program in every .bm format\n");
+    fprintf(stream, "    startup    time to the first executed instructions, reading vs mapping the file\n");
+    fprintf(stream, "    snapshot   time to the state after <instructions>, running them vs restoring a snapshot\n");
+    fprintf(stream, "    sched      cost of running 1000 VMs round-robin in slices instead of one after the other\n");
+    fprintf(stream, "    calls      code size and instructions of recursive fib inlined, with call/ret and memoized\n");
+    fprintf(stream, "    natives    summing memory with a BM loop and with `native mem_sum`\n");
+    fprintf(stream, "    print      print_debug into /dev/null as text, as raw words and to a callback, against printf\n");
+    fprintf(stream, "    all        all of the above\n");
+    fprintf(stream, "    -f json    print every measurement as one JSON document instead of tables\n");
+}
+
+static double now_secs(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Cycle counter: the CPU cycles this thread spent in user space if the
+// kernel lets us count them, else the time stamp counter on x86, else none.
+// The TSC ticks at a fixed rate, so with it "cycles" are reference cycles.
+static int cycles_fd = -1;
+static const char *cycles_source = "none";
+
+static void cycles_init(void){
+#if defined(__linux__)
+    struct perf_event_attr attr = {0};
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CPU_CYCLES;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    cycles_fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (cycles_fd >= 0){
+        cycles_source = "perf";
+        return;
+    }
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+    cycles_source = "rdtsc";
+#endif
+}
+
+static uint64_t cycles_now(void){
+#if defined(__linux__)
+    uint64_t count = 0;
+    if (cycles_fd >= 0 && read(cycles_fd, &count, sizeof(count)) == sizeof(count)){
+        return count;
+    }
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+    uint32_t lo, hi;
+    __asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((uint64_t) hi << 32) | lo;
+#else
+    return 0;
+#endif
+}
+
+static int has_cycles(void){
+    return strcmp(cycles_source, "none") != 0;
+}
+
+// With -f json every measurement becomes one object of
+// {"cycles": <source>, "results": [...]} and the tables are not printed.
+static int json = 0;
+static size_t json_results = 0;
+
+typedef struct {
+    const char *key;
+    double value;
+} Metric;
+
+static void json_begin(void){
+    printf("{\n  \"cycles\": \"%s\",\n  \"results\": [", cycles_source);
+}
+
+static void json_result(const char *suite, const char *name, const char *variant, const Metric *metrics, size_t metrics_size){
+    printf("%s\n    {\"suite\": \"%s\", \"name\": \"%s\", \"variant\": \"%s\"",
+           json_results > 0 ? "," : "", suite, name, variant);
+    for (size_t i = 0; i < metrics_size; ++i){
+        // NAN marks a metric that can't be measured here, like cycles
+        // without a counter
+        if (!isnan(metrics[i].value)){
+            printf(", \"%s\": %.17g", metrics[i].key, metrics[i].value);
+        }
+    }
+    printf("}");
+    json_results += 1;
+}
+
+static void json_end(void){
+    printf("\n  ]\n}\n");
+}
+
+static uint64_t bench_rng = 0x9E3779B97F4A7C15ull;
+
+static uint64_t bench_random(void){
+    bench_rng ^= bench_rng << 13;
+    bench_rng ^= bench_rng >> 7;
+    bench_rng ^= bench_rng << 17;
+    return bench_rng;
+}
+
+// A program that looks like generated code: mostly small pushes and dups,
+// arithmetic, and jumps to random addresses.
+static void generate_program(Bm *bm, Word size){
+    Inst *program = malloc(sizeof(program[0]) * size);
+    if (program == NULL){
+        fprintf(stderr, "ERROR: Could not allocate a program of %ld instructions\n", size);
+        exit(1);
+    }
+
+    for (Word i = 0; i < size; ++i){
+        Inst inst = {0};
+        switch (bench_random() % 8) {
+        case 0: case 1: inst = (Inst) {.type = INST_PUSH, .operand = (Word) (bench_random() % 1000)}; break;
+        case 2:         inst = (Inst) {.type = INST_DUP, .operand = (Word) (bench_random() % 4)}; break;
+        case 3:         inst = (Inst) {.type = INST_PLUS}; break;
+        case 4:         inst = (Inst) {.type = INST_MINUS}; break;
+        case 5:         inst = (Inst) {.type = INST_EQ}; break;
+        case 6:         inst = (Inst) {.type = INST_JMP_IF, .operand = (Word) (bench_random() % size)}; break;
+        case 7:         inst = (Inst) {.type = INST_JMP, .operand = (Word) (bench_random() % size)}; break;
+        }
+        program[i] = inst;
+    }
+
+    if (bm_load_program_from_memory(bm, program, size) != ERR_OK){
+        fprintf(stderr, "ERROR: %s\n", bm_error_message(bm));
+        exit(1);
+    }
+    free(program);
+}
+
+// Creates a VM or dies.
+static Bm *create_vm(Word stack_capacity, Word program_capacity){
+    Bm *bm = bm_create(NULL, stack_capacity, program_capacity);
+    if (bm == NULL){
+        fprintf(stderr, "ERROR: Could not allocate a VM\n");
+        exit(1);
+    }
+    return bm;
+}
+
+static void save_program(const Bm *bm, const char *file_path, Bm_File_Format format){
+    if (bm_save_program_to_file_as(bm, file_path, format) != ERR_OK){
+        fprintf(stderr, "ERROR: Could not write to file `%s` %s\n", file_path, strerror(errno));
+        exit(1);
+    }
+}
+
+static void load_program(Bm *bm, const char *file_path){
+    if (bm_load_program_from_file(bm, file_path) != ERR_OK){
+        fprintf(stderr, "ERROR: Could not load `%s`: %s\n", file_path, bm_error_message(bm));
+        exit(1);
+    }
+}
+
+static long file_size(const char *file_path){
+    FILE *f = fopen(file_path, "rb");
+    if (f == NULL || fseek(f, 0, SEEK_END) < 0){
+        fprintf(stderr, "ERROR: Could not read file `%s` %s\n", file_path, strerror(errno));
+        exit(1);
+    }
+    long size = ftell(f);
+    fclose(f);
+    return size;
+}
+
+static const struct {
+    const char *name;
+    Bm_File_Format format;
+} formats[] = {
+    {"v1", BM_FORMAT_V1},
+    {"v2", BM_FORMAT_V2},
+    {"v2-fixed", BM_FORMAT_V2_FIXED},
+};
+
+static int same_program(const Bm *a, const Bm *b){
+    if (bm_program_size(a) != bm_program_size(b)){
+        return 0;
+    }
+    const Inst *pa = bm_program(a);
+    const Inst *pb = bm_program(b);
+    for (Word i = 0; i < bm_program_size(a); ++i){
+        if (pa[i].type != pb[i].type || pa[i].operand != pb[i].operand){
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void bench_load(Word size, int runs, const char *dir){
+    Bm *bm = create_vm(0, size);
+    generate_program(bm, size);
+
+    if (!json){
+        printf("%ld instructions, best of %d runs\n", size, runs);
+        printf("%-8s %14s %12s %14s %14s\n", "format", "size (bytes)", "bytes/inst", "load (ms)", "ns/inst");
+    }
+
+    for (size_t i = 0; i < ARRAY_SIZE(formats); ++i){
+        char file_path[4096];
+        snprintf(file_path, sizeof(file_path), "%s/bmbench-%s.bm", dir, formats[i].name);
+        save_program(bm, file_path, formats[i].format);
+        const long bytes = file_size(file_path);
+
+        Bm *loaded = create_vm(0, BM_PROGRAM_CAPACITY);
+        double best = -1.0;
+        for (int run = 0; run < runs; ++run){
+            const double start = now_secs();
+            load_program(loaded, file_path);
+            const double elapsed = now_secs() - start;
+            if (best < 0 || elapsed < best){
+                best = elapsed;
+            }
+        }
+
+        if (!same_program(loaded, bm)){
+            fprintf(stderr, "ERROR: `%s` did not load back the same program\n", file_path);
+            exit(1);
+        }
+
+        if (json){
+            const Metric metrics[] = {
+                {"instructions", size},
+                {"bytes", bytes},
+                {"bytes_per_inst", (double) bytes / size},
+                {"seconds", best},
+                {"ns_per_inst", best * 1e9 / size},
+            };
+            json_result("load", "generated", formats[i].name, metrics, ARRAY_SIZE(metrics));
+        } else {
+            printf("%-8s %14ld %12.2f %14.3f %14.2f\n", formats[i].name, bytes,
+                   (double) bytes / size, best * 1e3, best * 1e9 / size);
+        }
+
+        bm_destroy(loaded);
+        remove(file_path);
+    }
+
+    bm_destroy(bm);
+}
+
+#define STARTUP_INSTRUCTIONS 1000
+
+// What a short-lived `bmi` pays before its program does anything: a fresh VM,
+// loading the file and the first STARTUP_INSTRUCTIONS instructions (fewer if
+// the generated program faults early). The file stays in the page cache
+// between runs, so this measures the loader, not the disk.
+static void bench_startup(Word size, int runs, const char *dir){
+    Bm *bm = create_vm(0, size);
+    generate_program(bm, size);
+
+    if (!json){
+        printf("%ld instructions, best of %d runs, up to %d instructions executed\n",
+               size, runs, STARTUP_INSTRUCTIONS);
+        printf("%-8s %14s %14s %10s\n", "format", "read (ms)", "mmap (ms)", "speedup");
+    }
+
+    for (size_t i = 0; i < ARRAY_SIZE(formats); ++i){
+        char file_path[4096];
+        snprintf(file_path, sizeof(file_path), "%s/bmbench-%s.bm", dir, formats[i].name);
+        save_program(bm, file_path, formats[i].format);
+
+        double best[2] = {-1.0, -1.0};
+        for (int map = 0; map <= 1; ++map){
+            for (int run = 0; run < runs; ++run){
+                const double start = now_secs();
+                Bm *vm = NULL;
+                if (map){
+                    vm = create_vm(BM_STACK_CAPACITY, 0);
+                    if (bm_map_program_from_file(vm, file_path) != ERR_OK){
+                        fprintf(stderr, "ERROR: Could not map `%s`: %s\n", file_path, bm_error_message(vm));
+                        exit(1);
+                    }
+                } else {
+                    vm = create_vm(BM_STACK_CAPACITY, BM_PROGRAM_CAPACITY);
+                    load_program(vm, file_path);
+                }
+                bm_execute_program(vm, STARTUP_INSTRUCTIONS);
+                const double elapsed = now_secs() - start;
+
+                if (run == 0){
+                    // bm_execute_program() doesn't touch the program
+                    if (!same_program(vm, bm)){
+                        fprintf(stderr, "ERROR: `%s` did not load back the same program\n", file_path);
+                        exit(1);
+                    }
+                }
+                bm_destroy(vm);
+
+                if (best[map] < 0 || elapsed < best[map]){
+                    best[map] = elapsed;
+                }
+            }
+        }
+
+        if (json){
+            const Metric metrics[] = {
+                {"instructions", size},
+                {"read_seconds", best[0]},
+                {"mmap_seconds", best[1]},
+            };
+            json_result("startup", "generated", formats[i].name, metrics, ARRAY_SIZE(metrics));
+        } else {
+            printf("%-8s %14.3f %14.3f %9.1fx\n", formats[i].name,
+                   best[0] * 1e3, best[1] * 1e3, best[0] / best[1]);
+        }
+        remove(file_path);
+    }
+
+    bm_destroy(bm);
+}
+
+// Workloads of the exec benchmark. Each one runs its body in a loop around a
+// counter on top of the stack, with `depth` values pushed below the counter
+// first. Bodies leave the stack as they found it; their jump operands are
+// relative to the start of the body.
+typedef struct {
+    const char *name;
+    Word depth;
+    const Inst *body;
+    size_t body_size;
+} Workload;
+
+// nothing but dispatch
+static const Inst dispatch_body[] = {
+    {.type = INST_NOP}, {.type = INST_NOP}, {.type = INST_NOP}, {.type = INST_NOP},
+    {.type = INST_NOP}, {.type = INST_NOP}, {.type = INST_NOP}, {.type = INST_NOP},
+};
+
+// ((n*3 + 7) / 2 - 1) * 0 + n
+static const Inst arith_body[] = {
+    {.type = INST_DUP, .operand = 0},
+    {.type = INST_PUSH, .operand = 3},
+    {.type = INST_MULT},
+    {.type = INST_PUSH, .operand = 7},
+    {.type = INST_PLUS},
+    {.type = INST_PUSH, .operand = 2},
+    {.type = INST_DIV},
+    {.type = INST_PUSH, .operand = 1},
+    {.type = INST_MINUS},
+    {.type = INST_PUSH, .operand = 0},
+    {.type = INST_MULT},
+    {.type = INST_PLUS},
+};
+
+// reads far below the top of a 64 deep stack
+static const Inst dup_body[] = {
+    {.type = INST_DUP, .operand = 16},
+    {.type = INST_DUP, .operand = 40},
+    {.type = INST_PLUS},
+    {.type = INST_DUP, .operand = 62},
+    {.type = INST_MINUS},
+    {.type = INST_PUSH, .operand = 0},
+    {.type = INST_MULT},
+    {.type = INST_PLUS},
+};
+
+// a different path for even and odd counters
+static const Inst branch_body[] = {
+    {.type = INST_DUP, .operand = 0},
+    {.type = INST_PUSH, .operand = 2},
+    {.type = INST_DIV},
+    {.type = INST_PUSH, .operand = 2},
+    {.type = INST_MULT},
+    {.type = INST_DUP, .operand = 1},
+    {.type = INST_EQ},
+    {.type = INST_JMP_IF, .operand = 10},
+    {.type = INST_PLUS},                    // odd: drop the 0 jmp_if left
+    {.type = INST_JMP, .operand = 11},
+    {.type = INST_NOP},                     // even
+    {.type = INST_NOP},
+};
+
+// the step of examples/fib.ebasm (dup 1; dup 1; plus) on the two values
+// under the counter, dropping the sum
+static const Inst fib_body[] = {
+    {.type = INST_DUP, .operand = 2},
+    {.type = INST_DUP, .operand = 2},
+    {.type = INST_PLUS},
+    {.type = INST_PUSH, .operand = 0},
+    {.type = INST_MULT},
+    {.type = INST_PLUS},
+};
+
+static const Workload workloads[] = {
+    {"dispatch", 0, dispatch_body, ARRAY_SIZE(dispatch_body)},
+    {"arith", 0, arith_body, ARRAY_SIZE(arith_body)},
+    {"dup", 64, dup_body, ARRAY_SIZE(dup_body)},
+    {"branch", 0, branch_body, ARRAY_SIZE(branch_body)},
+    {"fib", 2, fib_body, ARRAY_SIZE(fib_body)},
+};
+
+// Loads `workload` into `bm` with a loop running about `size` instructions.
+static void build_workload(Bm *bm, const Workload *workload, Word size){
+    // counter bookkeeping: push -1; plus; dup 0; jmp_if loop
+    const Word iterations = size / (Word) (workload->body_size + 4) + 1;
+    const size_t n = workload->depth + 1 + workload->body_size + 4 + 1;
+    Inst *program = malloc(sizeof(program[0]) * n);
+    if (program == NULL){
+        fprintf(stderr, "ERROR: Could not allocate a program of %zu instructions\n", n);
+        exit(1);
+    }
+
+    size_t i = 0;
+    for (Word d = 0; d < workload->depth; ++d){
+        program[i++] = (Inst) {.type = INST_PUSH, .operand = d};
+    }
+    program[i++] = (Inst) {.type = INST_PUSH, .operand = iterations};
+    const Word loop = i;
+    for (size_t j = 0; j < workload->body_size; ++j){
+        Inst inst = workload->body[j];
+        if (inst.type == INST_JMP || inst.type == INST_JMP_IF){
+            inst.operand += loop;
+        }
+        program[i++] = inst;
+    }
+    program[i++] = (Inst) {.type = INST_PUSH, .operand = -1};
+    program[i++] = (Inst) {.type = INST_PLUS};
+    program[i++] = (Inst) {.type = INST_DUP, .operand = 0};
+    program[i++] = (Inst) {.type = INST_JMP_IF, .operand = loop};
+    program[i++] = (Inst) {.type = INST_HALT};
+    assert(i == n);
+
+    if (bm_load_program_from_memory(bm, program, n) != ERR_OK){
+        fprintf(stderr, "ERROR: %s\n", bm_error_message(bm));
+        exit(1);
+    }
+    free(program);
+
+    Word fault_inst = 0;
+    if (bm_verify_program(bm, &fault_inst) != ERR_OK){
+        fprintf(stderr, "ERROR: workload `%s` does not verify at instruction %ld\n", workload->name, fault_inst);
+        exit(1);
+    }
+}
+
+// Instructions per second of every engine on every workload. Programs are
+// verified like `bmi` does, and the first run also builds the engine's
+// caches (threaded code, JIT code), so the best run measures execution only.
+static void bench_exec(Word size, int runs){
+    if (!json){
+        printf("about %ld instructions per run, best of %d runs, cycles from %s\n", size, runs, cycles_source);
+        printf("%-10s %-10s %14s %12s %16s %12s\n", "workload", "engine", "instructions", "ns/inst", "inst/s", "cycles/inst");
+    }
+
+    for (size_t w = 0; w < ARRAY_SIZE(workloads); ++w){
+        Bm *bm = create_vm(BM_STACK_CAPACITY, BM_PROGRAM_CAPACITY);
+        build_workload(bm, &workloads[w], size);
+
+        for (Bm_Engine engine = 0; engine < COUNT_BM_ENGINES; ++engine){
+            double best = -1.0;
+            uint64_t best_cycles = 0;
+            Word instructions = 0;
+            for (int run = 0; run < runs; ++run){
+                bm_reset(bm);
+                const uint64_t cycles = cycles_now();
+                const double start = now_secs();
+                const Err err = bm_execute_program_with(bm, engine, -1);
+                const double elapsed = now_secs() - start;
+                const uint64_t elapsed_cycles = cycles_now() - cycles;
+                if (err != ERR_OK || !bm_halted(bm)){
+                    fprintf(stderr, "ERROR: workload `%s` failed on engine %s: %s\n",
+                            workloads[w].name, bm_engine_as_cstr(engine), err_as_cstr(err));
+                    exit(1);
+                }
+                instructions = bm_inst_count(bm);
+                if (best < 0 || elapsed < best){
+                    best = elapsed;
+                    best_cycles = elapsed_cycles;
+                }
+            }
+
+            const double cycles_per_inst = has_cycles() ? (double) best_cycles / instructions : NAN;
+            if (json){
+                const Metric metrics[] = {
+                    {"instructions", instructions},
+                    {"seconds", best},
+                    {"ns_per_inst", best * 1e9 / instructions},
+                    {"inst_per_sec", instructions / best},
+                    {"cycles", has_cycles() ? (double) best_cycles : NAN},
+                    {"cycles_per_inst", cycles_per_inst},
+                };
+                json_result("exec", workloads[w].name, bm_engine_as_cstr(engine), metrics, ARRAY_SIZE(metrics));
+            } else {
+                printf("%-10s %-10s %14ld %12.3f %16.0f %12.2f\n", workloads[w].name, bm_engine_as_cstr(engine),
+                       instructions, best * 1e9 / instructions, instructions / best, cycles_per_inst);
+            }
+        }
+
+        bm_destroy(bm);
+    }
+}
+
+// Writes an .ebasm source of `lines` lines into `out`: comments, blank lines,
+// every mnemonic and a label every 32 lines, with jumps to labels anywhere
+// in the program, before or after their definition. Every line takes less
+// than 32 bytes.
+static size_t generate_source(char *out, size_t capacity, Word lines){
+    static const char *const simple[] = {"nop", "plus", "minus", "mult", "div", "eq", "halt", "print_debug"};
+    size_t size = 0;
+    Word labels = 0;
+    const Word total_labels = (lines + 31) / 32;
+
+    for (Word line = 0; line < lines && size + 64 < capacity; ++line){
+        const uint64_t r = bench_random();
+        char *at = out + size;
+        const size_t left = capacity - size;
+        int n = 0;
+        if (line % 32 == 0){
+            n = snprintf(at, left, "l%ld:\n", labels++);
+        } else if (r % 50 == 0){
+            n = snprintf(at, left, "# comment %lu\n", (unsigned long) (r >> 8));
+        } else if (r % 50 == 1){
+            n = snprintf(at, left, "\n");
+        } else if (r % 8 < 3){
+            n = snprintf(at, left, "push %lu\n", (unsigned long) ((r >> 8) % 100000));
+        } else if (r % 8 == 3){
+            n = snprintf(at, left, "dup %lu\n", (unsigned long) ((r >> 8) % 8));
+        } else if (r % 8 == 4 && r % 3 != 0){
+            n = snprintf(at, left, "jmp_if l%lu\n", (unsigned long) ((r >> 8) % total_labels));
+        } else if (r % 8 == 4){
+            n = snprintf(at, left, "jmp %lu\n", (unsigned long) ((r >> 8) % (line + 1)));
+        } else {
+            n = snprintf(at, left, "%s\n", simple[(r >> 8) % ARRAY_SIZE(simple)]);
+        }
+        size += n;
+    }
+    return size;
+}
+
+// Assembler throughput: source lines and bytes per second of
+// bm_translate_source() on a generated source.
+static void bench_asm(Word lines, int runs){
+    const size_t capacity = (size_t) lines * 32 + 64;
+    char *source = malloc(capacity);
+    if (source == NULL){
+        fprintf(stderr, "ERROR: Could not allocate a source of %ld lines\n", lines);
+        exit(1);
+    }
+    const size_t bytes = generate_source(source, capacity, lines);
+
+    Bm *bm = create_vm(0, BM_PROGRAM_CAPACITY);
+    double best = -1.0;
+    uint64_t best_cycles = 0;
+    size_t labels = 0;
+    for (int run = 0; run < runs; ++run){
+        // a fresh table every run, so growing it is measured too
+        Label_Table lt = {0};
+        const uint64_t cycles = cycles_now();
+        const double start = now_secs();
+        const Err err = bm_translate_source((String_View) {.count = bytes, .data = source}, bm, &lt);
+        const double elapsed = now_secs() - start;
+        const uint64_t elapsed_cycles = cycles_now() - cycles;
+        if (err != ERR_OK){
+            fprintf(stderr, "ERROR: generated source: %s\n", bm_error_message(bm));
+            exit(1);
+        }
+        if (best < 0 || elapsed < best){
+            best = elapsed;
+            best_cycles = elapsed_cycles;
+        }
+        labels = lt.labels_size;
+        label_table_free(&lt);
+    }
+
+    const double cycles_per_line = has_cycles() ? (double) best_cycles / lines : NAN;
+    if (json){
+        const Metric metrics[] = {
+            {"lines", lines},
+            {"bytes", bytes},
+            {"labels", labels},
+            {"instructions", bm_program_size(bm)},
+            {"seconds", best},
+            {"ns_per_line", best * 1e9 / lines},
+            {"lines_per_sec", lines / best},
+            {"mb_per_sec", bytes / best / 1e6},
+            {"cycles_per_line", cycles_per_line},
+        };
+        json_result("asm", "generated", "translate", metrics, ARRAY_SIZE(metrics));
+    } else {
+        printf("%ld lines (%zu bytes, %ld instructions, %zu labels), best of %d runs, cycles from %s\n",
+               lines, bytes, bm_program_size(bm), labels, runs, cycles_source);
+        printf("%14s %12s %16s %10s %14s\n", "translate (ms)", "ns/line", "lines/s", "MB/s", "cycles/line");
+        printf("%14.3f %12.2f %16.0f %10.1f %14.2f\n", best * 1e3, best * 1e9 / lines,
+               lines / best, bytes / best / 1e6, cycles_per_line);
+    }
+
+    bm_destroy(bm);
+    free(source);
+}
+
+#define SCHED_VMS 1000
+
+// Cost of time slicing: SCHED_VMS VMs sharing one arith program run `size`
+// instructions between them, to completion one after the other and then
+// round-robin with bm_scheduler_run() in slices of various sizes.
+static void bench_sched(Word size, int runs){
+    static const int slices[] = {0, 10000, 1000, 100, 10};
+    Bm *owner = create_vm(BM_STACK_CAPACITY, BM_PROGRAM_CAPACITY);
+    build_workload(owner, &workloads[1], size / SCHED_VMS);
+
+    Bm **vms = malloc(sizeof(vms[0]) * SCHED_VMS);
+    if (vms == NULL){
+        fprintf(stderr, "ERROR: Could not allocate memory\n");
+        exit(1);
+    }
+    for (size_t i = 0; i < SCHED_VMS; ++i){
+        vms[i] = create_vm(BM_STACK_CAPACITY, 0);
+        bm_share_program(vms[i], owner);
+    }
+
+    if (!json){
+        printf("%d VMs, about %ld instructions in total, best of %d runs, threaded engine\n", SCHED_VMS, size, runs);
+        printf("%-10s %14s %12s %12s %10s\n", "slice", "instructions", "ns/inst", "turns", "overhead");
+    }
+
+    double base = 0.0;
+    for (size_t k = 0; k < ARRAY_SIZE(slices); ++k){
+        double best = -1.0;
+        Word instructions = 0;
+        long turns = 0;
+        for (int run = 0; run < runs; ++run){
+            Bm_Scheduler scheduler = {.engine = BM_ENGINE_THREADED, .slice = slices[k]};
+            for (size_t i = 0; i < SCHED_VMS; ++i){
+                bm_reset(vms[i]);
+                if (slices[k] > 0 && bm_scheduler_add(&scheduler, vms[i], 1) < 0){
+                    fprintf(stderr, "ERROR: Could not allocate memory\n");
+                    exit(1);
+                }
+            }
+
+            const double start = now_secs();
+            turns = 0;
+            if (slices[k] > 0){
+                while (bm_scheduler_step(&scheduler) >= 0){
+                    turns += 1;
+                }
+            } else {
+                for (size_t i = 0; i < SCHED_VMS; ++i){
+                    bm_execute_program_with(vms[i], BM_ENGINE_THREADED, -1);
+                }
+            }
+            const double elapsed = now_secs() - start;
+
+            instructions = 0;
+            for (size_t i = 0; i < SCHED_VMS; ++i){
+                if (!bm_halted(vms[i])){
+                    fprintf(stderr, "ERROR: a VM did not finish with slices of %d\n", slices[k]);
+                    exit(1);
+                }
+                instructions += bm_inst_count(vms[i]);
+            }
+            bm_scheduler_free(&scheduler);
+            if (best < 0 || elapsed < best){
+                best = elapsed;
+            }
+        }
+
+        const double ns_per_inst = best * 1e9 / instructions;
+        if (k == 0){
+            base = ns_per_inst;
+        }
+        char name[32];
+        snprintf(name, sizeof(name), "%d", slices[k]);
+        if (json){
+            const Metric metrics[] = {
+                {"instructions", instructions},
+                {"seconds", best},
+                {"ns_per_inst", ns_per_inst},
+                {"turns", turns},
+            };
+            json_result("sched", "arith", slices[k] > 0 ? name : "none", metrics, ARRAY_SIZE(metrics));
+        } else {
+            printf("%-10s %14ld %12.3f %12ld %9.1f%%\n", slices[k] > 0 ? name : "none", instructions,
+                   ns_per_inst, turns, (ns_per_inst / base - 1.0) * 100.0);
+        }
+    }
+
+    for (size_t i = 0; i < SCHED_VMS; ++i){
+        bm_destroy(vms[i]);
+    }
+    free(vms);
+    bm_destroy(owner);
+}
+
+// Warm starts: getting a VM into the state it has after running a prefix of
+// `size` instructions (the dup workload, 65 values on the stack), by running
+// the prefix on the threaded engine again or with bm_load_snapshot().
+static void bench_snapshot(Word size, int runs, const char *dir){
+    Bm *bm = create_vm(BM_STACK_CAPACITY, BM_PROGRAM_CAPACITY);
+    const Workload *workload = &workloads[2];
+    build_workload(bm, workload, size * 2);
+    const int prefix = size < INT32_MAX ? (int) size : INT32_MAX;
+
+    char file_path[4096];
+    snprintf(file_path, sizeof(file_path), "%s/bmbench.bmss", dir);
+    if (bm_execute_program_with(bm, BM_ENGINE_THREADED, prefix) != ERR_OK ||
+        bm_save_snapshot(bm, file_path) != ERR_OK){
+        fprintf(stderr, "ERROR: Could not snapshot workload `%s`: %s\n", workload->name, bm_error_message(bm));
+        exit(1);
+    }
+    const Word ip = bm_ip(bm);
+    const Word stack_size = bm_stack_size(bm);
+    const Word inst_count = bm_inst_count(bm);
+
+    double best[2] = {-1.0, -1.0};
+    for (int restore = 0; restore <= 1; ++restore){
+        for (int run = 0; run < runs; ++run){
+            bm_reset(bm);
+            const double start = now_secs();
+            const Err err = restore
+                ? bm_load_snapshot(bm, file_path)
+                : bm_execute_program_with(bm, BM_ENGINE_THREADED, prefix);
+            const double elapsed = now_secs() - start;
+            if (err != ERR_OK || bm_ip(bm) != ip || bm_stack_size(bm) != stack_size ||
+                bm_inst_count(bm) != inst_count){
+                fprintf(stderr, "ERROR: %s did not reach the snapshot state: %s\n",
+                        restore ? "restoring" : "running", err_as_cstr(err));
+                exit(1);
+            }
+            if (best[restore] < 0 || elapsed < best[restore]){
+                best[restore] = elapsed;
+            }
+        }
+    }
+
+    if (json){
+        const Metric metrics[] = {
+            {"instructions", inst_count},
+            {"stack_size", stack_size},
+            {"rerun_seconds", best[0]},
+            {"restore_seconds", best[1]},
+        };
+        json_result("snapshot", workload->name, "threaded", metrics, ARRAY_SIZE(metrics));
+    } else {
+        printf("prefix of %ld instructions leaving %ld values on the stack, best of %d runs\n",
+               inst_count, stack_size, runs);
+        printf("%14s %14s %10s\n", "rerun (ms)", "restore (ms)", "speedup");
+        printf("%14.3f %14.3f %9.1fx\n", best[0] * 1e3, best[1] * 1e3, best[0] / best[1]);
+    }
+
+    remove(file_path);
+    bm_destroy(bm);
+}
+
+// fib(n) the naive recursive way, three ways: inlined into one expression
+// tree, as code generators emit it without call and ret; with call and ret;
+// and with call and ret memoizing into memory. The first instruction pushes
+// n. The argument is local -1 of every frame, and the zeros not taken
+// jmp_ifs leave behind are locals too, dropped by ret.
+static const Inst fib_call_program[] = {
+    {.type = INST_PUSH, .operand = 0},
+    {.type = INST_CALL, .operand = 3},
+    {.type = INST_HALT},
+    {.type = INST_LOAD_LOCAL, .operand = -1},   // fib:
+    {.type = INST_PUSH, .operand = 0},
+    {.type = INST_EQ},
+    {.type = INST_JMP_IF, .operand = 21},
+    {.type = INST_LOAD_LOCAL, .operand = -1},
+    {.type = INST_PUSH, .operand = 1},
+    {.type = INST_EQ},
+    {.type = INST_JMP_IF, .operand = 21},
+    {.type = INST_LOAD_LOCAL, .operand = -1},
+    {.type = INST_PUSH, .operand = -1},
+    {.type = INST_PLUS},
+    {.type = INST_CALL, .operand = 3},
+    {.type = INST_LOAD_LOCAL, .operand = -1},
+    {.type = INST_PUSH, .operand = -2},
+    {.type = INST_PLUS},
+    {.type = INST_CALL, .operand = 3},
+    {.type = INST_PLUS},
+    {.type = INST_RET, .operand = 1},
+    {.type = INST_LOAD_LOCAL, .operand = -1},   // base: n < 2
+    {.type = INST_RET, .operand = 1},
+};
+
+// memory[n] is fib(n) + 1 once known, 0 before
+static const Inst fib_memo_program[] = {
+    {.type = INST_PUSH, .operand = 0},
+    {.type = INST_CALL, .operand = 3},
+    {.type = INST_HALT},
+    {.type = INST_LOAD_LOCAL, .operand = -1},   // fib:
+    {.type = INST_LOAD},
+    {.type = INST_DUP, .operand = 0},
+    {.type = INST_JMP_IF, .operand = 30},
+    {.type = INST_LOAD_LOCAL, .operand = -1},
+    {.type = INST_PUSH, .operand = 0},
+    {.type = INST_EQ},
+    {.type = INST_JMP_IF, .operand = 33},
+    {.type = INST_LOAD_LOCAL, .operand = -1},
+    {.type = INST_PUSH, .operand = 1},
+    {.type = INST_EQ},
+    {.type = INST_JMP_IF, .operand = 33},
+    {.type = INST_LOAD_LOCAL, .operand = -1},
+    {.type = INST_PUSH, .operand = -1},
+    {.type = INST_PLUS},
+    {.type = INST_CALL, .operand = 3},
+    {.type = INST_LOAD_LOCAL, .operand = -1},
+    {.type = INST_PUSH, .operand = -2},
+    {.type = INST_PLUS},
+    {.type = INST_CALL, .operand = 3},
+    {.type = INST_PLUS},
+    {.type = INST_LOAD_LOCAL, .operand = -1},   // memory[n] = fib(n) + 1
+    {.type = INST_LOAD_LOCAL, .operand = 4},
+    {.type = INST_PUSH, .operand = 1},
+    {.type = INST_PLUS},
+    {.type = INST_STORE},
+    {.type = INST_RET, .operand = 1},
+    {.type = INST_PUSH, .operand = -1},         // hit:
+    {.type = INST_PLUS},
+    {.type = INST_RET, .operand = 1},
+    {.type = INST_LOAD_LOCAL, .operand = -1},   // base: n < 2
+    {.type = INST_RET, .operand = 1},
+};
+
+static Word fib_inline_size(Word n){
+    return n < 2 ? 1 : fib_inline_size(n - 1) + fib_inline_size(n - 2) + 1;
+}
+
+static size_t fib_inline(Inst *program, size_t i, Word n){
+    if (n < 2){
+        program[i++] = (Inst) {.type = INST_PUSH, .operand = n};
+    } else {
+        i = fib_inline(program, i, n - 1);
+        i = fib_inline(program, i, n - 2);
+        program[i++] = (Inst) {.type = INST_PLUS};
+    }
+    return i;
+}
+
+// Code size and dispatches of recursion: fib(n) for the largest n whose
+// inlined program has at most `size` instructions, on every engine. The JIT
+// and tos engines leave programs with calls to the threaded one.
+static void bench_calls(Word size, int runs){
+    Word n = 2;
+    while (n < 30 && fib_inline_size(n + 1) + 1 <= size){
+        n += 1;
+    }
+
+    const size_t inline_size = fib_inline_size(n) + 1;
+    Inst *inline_program = malloc(sizeof(inline_program[0]) * inline_size);
+    Word *memory = calloc(n + 1, sizeof(memory[0]));
+    if (inline_program == NULL || memory == NULL){
+        fprintf(stderr, "ERROR: Could not allocate a program of %zu instructions\n", inline_size);
+        exit(1);
+    }
+    inline_program[fib_inline(inline_program, 0, n)] = (Inst) {.type = INST_HALT};
+
+    const struct {
+        const char *name;
+        const Inst *program;
+        size_t program_size;
+        int pushes_n;       // the first instruction is the `push n`
+    } variants[] = {
+        {"inline", inline_program, inline_size, 0},
+        {"call", fib_call_program, ARRAY_SIZE(fib_call_program), 1},
+        {"memo", fib_memo_program, ARRAY_SIZE(fib_memo_program), 1},
+    };
+
+    if (!json){
+        printf("fib(%ld), best of %d runs\n", n, runs);
+        printf("%-10s %-10s %12s %14s %14s %12s\n", "variant", "engine", "program", "instructions", "ns/run", "ns/inst");
+    }
+
+    Word expected = -1;
+    for (size_t v = 0; v < ARRAY_SIZE(variants); ++v){
+        Bm *bm = create_vm(BM_STACK_CAPACITY, BM_PROGRAM_CAPACITY);
+        Inst *program = malloc(sizeof(program[0]) * variants[v].program_size);
+        if (program == NULL){
+            fprintf(stderr, "ERROR: Could not allocate a program of %zu instructions\n", variants[v].program_size);
+            exit(1);
+        }
+        memcpy(program, variants[v].program, sizeof(program[0]) * variants[v].program_size);
+        if (variants[v].pushes_n){
+            program[0].operand = n;
+        }
+        if (bm_load_program_from_memory(bm, program, variants[v].program_size) != ERR_OK){
+            fprintf(stderr, "ERROR: %s\n", bm_error_message(bm));
+            exit(1);
+        }
+        free(program);
+        bm_set_memory(bm, memory, n + 1);
+        bm_verify_program(bm, NULL);
+
+        for (Bm_Engine engine = 0; engine < COUNT_BM_ENGINES; ++engine){
+            double best = -1.0;
+            Word instructions = 0;
+            for (int run = 0; run < runs; ++run){
+                bm_reset(bm);
+                memset(memory, 0, sizeof(memory[0]) * (n + 1));
+                const double start = now_secs();
+                const Err err = bm_execute_program_with(bm, engine, -1);
+                const double elapsed = now_secs() - start;
+                if (err != ERR_OK || !bm_halted(bm) || bm_stack_size(bm) != 1 ||
+                    (expected >= 0 && bm_stack(bm)[0] != expected)){
+                    fprintf(stderr, "ERROR: fib `%s` failed on engine %s: %s\n",
+                            variants[v].name, bm_engine_as_cstr(engine), err_as_cstr(err));
+                    exit(1);
+                }
+                expected = bm_stack(bm)[0];
+                instructions = bm_inst_count(bm);
+                if (best < 0 || elapsed < best){
+                    best = elapsed;
+                }
+            }
+
+            if (json){
+                const Metric metrics[] = {
+                    {"n", n},
+                    {"program_size", variants[v].program_size},
+                    {"instructions", instructions},
+                    {"seconds", best},
+                    {"ns_per_inst", best * 1e9 / instructions},
+                };
+                json_result("calls", variants[v].name, bm_engine_as_cstr(engine), metrics, ARRAY_SIZE(metrics));
+            } else {
+                printf("%-10s %-10s %12zu %14ld %14.0f %12.3f\n", variants[v].name, bm_engine_as_cstr(engine),
+                       variants[v].program_size, instructions, best * 1e9, best * 1e9 / instructions);
+            }
+        }
+
+        bm_destroy(bm);
+    }
+
+    free(memory);
+    free(inline_program);
+}
+
+// Summing memory[0 .. n) as a BM loop, counting i down from n with the sum
+// and i as locals 0 and 1, and as one `native mem_sum`. The second
+// instruction pushes n.
+static const Inst sum_loop_program[] = {
+    {.type = INST_PUSH, .operand = 0},
+    {.type = INST_PUSH, .operand = 0},
+    {.type = INST_LOAD_LOCAL, .operand = 1},    // loop:
+    {.type = INST_JMP_IF, .operand = 5},
+    {.type = INST_HALT},
+    {.type = INST_LOAD_LOCAL, .operand = 1},
+    {.type = INST_PUSH, .operand = -1},
+    {.type = INST_PLUS},
+    {.type = INST_DUP, .operand = 0},
+    {.type = INST_STORE_LOCAL, .operand = 1},
+    {.type = INST_LOAD},
+    {.type = INST_LOAD_LOCAL, .operand = 0},
+    {.type = INST_PLUS},
+    {.type = INST_STORE_LOCAL, .operand = 0},
+    {.type = INST_JMP, .operand = 2},
+};
+
+static const Inst sum_native_program[] = {
+    {.type = INST_PUSH, .operand = 0},
+    {.type = INST_PUSH, .operand = 0},
+    {.type = INST_NATIVE, .operand = BM_NATIVE_MEM_SUM},
+    {.type = INST_HALT},
+};
+
+// What a native saves over the loop it replaces: the sum of `size` words of
+// memory both ways, on every engine. The JIT calls the native directly; the
+// tos engine leaves both programs to the threaded one.
+static void bench_natives(Word size, int runs){
+    Word *memory = malloc(sizeof(memory[0]) * size);
+    if (memory == NULL){
+        fprintf(stderr, "ERROR: Could not allocate %ld words of memory\n", size);
+        exit(1);
+    }
+    Word expected = 0;
+    for (Word i = 0; i < size; ++i){
+        memory[i] = (Word) (bench_random() % 1000);
+        expected += memory[i];
+    }
+
+    const struct {
+        const char *name;
+        const Inst *program;
+        size_t program_size;
+    } variants[] = {
+        {"loop", sum_loop_program, ARRAY_SIZE(sum_loop_program)},
+        {"native", sum_native_program, ARRAY_SIZE(sum_native_program)},
+    };
+
+    if (!json){
+        printf("sum of %ld words of memory, best of %d runs\n", size, runs);
+        printf("%-10s %-10s %14s %14s %12s\n", "variant", "engine", "instructions", "ns/run", "ns/word");
+    }
+
+    for (size_t v = 0; v < ARRAY_SIZE(variants); ++v){
+        Bm *bm = create_vm(BM_STACK_CAPACITY, BM_PROGRAM_CAPACITY);
+        Inst program[ARRAY_SIZE(sum_loop_program)];
+        memcpy(program, variants[v].program, sizeof(program[0]) * variants[v].program_size);
+        program[1].operand = size;
+        if (bm_bind_std_natives(bm) != ERR_OK ||
+            bm_load_program_from_memory(bm, program, variants[v].program_size) != ERR_OK){
+            fprintf(stderr, "ERROR: %s\n", bm_error_message(bm));
+            exit(1);
+        }
+        bm_set_memory(bm, memory, size);
+        bm_verify_program(bm, NULL);
+
+        for (Bm_Engine engine = 0; engine < COUNT_BM_ENGINES; ++engine){
+            double best = -1.0;
+            Word instructions = 0;
+            for (int run = 0; run < runs; ++run){
+                bm_reset(bm);
+                const double start = now_secs();
+                const Err err = bm_execute_program_with(bm, engine, -1);
+                const double elapsed = now_secs() - start;
+                if (err != ERR_OK || !bm_halted(bm) || bm_stack(bm)[0] != expected){
+                    fprintf(stderr, "ERROR: sum `%s` failed on engine %s: %s\n",
+                            variants[v].name, bm_engine_as_cstr(engine), err_as_cstr(err));
+                    exit(1);
+                }
+                instructions = bm_inst_count(bm);
+                if (best < 0 || elapsed < best){
+                    best = elapsed;
+                }
+            }
+
+            if (json){
+                const Metric metrics[] = {
+                    {"words", size},
+                    {"instructions", instructions},
+                    {"seconds", best},
+                    {"ns_per_word", best * 1e9 / size},
+                };
+                json_result("natives", variants[v].name, bm_engine_as_cstr(engine), metrics, ARRAY_SIZE(metrics));
+            } else {
+                printf("%-10s %-10s %14ld %14.0f %12.3f\n", variants[v].name, bm_engine_as_cstr(engine),
+                       instructions, best * 1e9, best * 1e9 / size);
+            }
+        }
+
+        bm_destroy(bm);
+    }
+
+    free(memory);
+}
+
+// Counts down from n, printing every value times 7777 so most take several
+// digits. The first instruction pushes n.
+static const Inst print_program[] = {
+    {.type = INST_PUSH, .operand = 0},
+    {.type = INST_DUP, .operand = 0},           // loop:
+    {.type = INST_JMP_IF, .operand = 4},
+    {.type = INST_HALT},
+    {.type = INST_DUP, .operand = 0},
+    {.type = INST_PUSH_MULT, .operand = 7777},
+    {.type = INST_PRINT_DEBUG},
+    {.type = INST_PUSH_PLUS, .operand = -1},
+    {.type = INST_JMP, .operand = 1},
+};
+
+static Err discard_output(void *data, const char *bytes, size_t size){
+    (void) bytes;
+    *(size_t *) data += size;
+    return ERR_OK;
+}
+
+// Cost of print_debug: `size` values into /dev/null through the output
+// buffer of the VM as text and as raw Words, and to a callback that drops
+// them, on every engine. `printf` is what each value cost before, without
+// the VM: a fprintf("%ld\n") to the same file.
+static void bench_print(Word size, int runs){
+    FILE *null = fopen("/dev/null", "w");
+    if (null == NULL){
+        fprintf(stderr, "ERROR: Could not open /dev/null: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    if (!json){
+        printf("%ld values, best of %d runs\n", size, runs);
+        printf("%-10s %-10s %14s %12s\n", "variant", "engine", "ns/run", "ns/value");
+    }
+
+    double best = -1.0;
+    for (int run = 0; run < runs; ++run){
+        const double start = now_secs();
+        for (Word i = size; i > 0; --i){
+            fprintf(null, "%ld\n", i * 7777);
+        }
+        fflush(null);
+        const double elapsed = now_secs() - start;
+        if (best < 0 || elapsed < best){
+            best = elapsed;
+        }
+    }
+    if (json){
+        const Metric metrics[] = {
+            {"values", size},
+            {"seconds", best},
+            {"ns_per_value", best * 1e9 / size},
+        };
+        json_result("print", "printf", "none", metrics, ARRAY_SIZE(metrics));
+    } else {
+        printf("%-10s %-10s %14.0f %12.3f\n", "printf", "-", best * 1e9, best * 1e9 / size);
+    }
+
+    static const char *const variants[] = {"text", "binary", "callback"};
+    for (size_t v = 0; v < ARRAY_SIZE(variants); ++v){
+        Bm *bm = create_vm(BM_STACK_CAPACITY, BM_PROGRAM_CAPACITY);
+        Inst program[ARRAY_SIZE(print_program)];
+        memcpy(program, print_program, sizeof(program));
+        program[0].operand = size;
+        if (bm_load_program_from_memory(bm, program, ARRAY_SIZE(program)) != ERR_OK){
+            fprintf(stderr, "ERROR: %s\n", bm_error_message(bm));
+            exit(1);
+        }
+        bm_verify_program(bm, NULL);
+        size_t discarded = 0;
+        if (v == 2){
+            bm_set_output_callback(bm, discard_output, &discarded);
+        } else {
+            bm_set_output_fd(bm, fileno(null));
+            bm_set_output_mode(bm, v == 1 ? BM_OUTPUT_BINARY : BM_OUTPUT_TEXT);
+        }
+
+        for (Bm_Engine engine = 0; engine < COUNT_BM_ENGINES; ++engine){
+            best = -1.0;
+            for (int run = 0; run < runs; ++run){
+                bm_reset(bm);
+                const double start = now_secs();
+                Err err = bm_execute_program_with(bm, engine, -1);
+                if (err == ERR_OK){
+                    err = bm_flush_output(bm);
+                }
+                const double elapsed = now_secs() - start;
+                if (err != ERR_OK || !bm_halted(bm)){
+                    fprintf(stderr, "ERROR: print `%s` failed on engine %s: %s\n",
+                            variants[v], bm_engine_as_cstr(engine), err_as_cstr(err));
+                    exit(1);
+                }
+                if (best < 0 || elapsed < best){
+                    best = elapsed;
+                }
+            }
+
+            if (json){
+                const Metric metrics[] = {
+                    {"values", size},
+                    {"seconds", best},
+                    {"ns_per_value", best * 1e9 / size},
+                };
+                json_result("print", variants[v], bm_engine_as_cstr(engine), metrics, ARRAY_SIZE(metrics));
+            } else {
+                printf("%-10s %-10s %14.0f %12.3f\n", variants[v], bm_engine_as_cstr(engine),
+                       best * 1e9, best * 1e9 / size);
+            }
+        }
+
+        bm_destroy(bm);
+    }
+
+    fclose(null);
+}
+
+int main(int argc, char **argv){
+    const char *program = shift(&argc, &argv);
+
+    if (argc == 0){
+        usage(stderr, program);
+        fprintf(stderr, "ERROR: No benchmark is provided\n");
+        exit(1);
+    }
+    const char *benchmark = shift(&argc, &argv);
+    if (strcmp(benchmark, "-h") == 0){
+        usage(stdout, program);
+        exit(0);
+    }
+
+    Word size = 1000000;
+    int runs = 10;
+    const char *dir = "/tmp";
+
+    while (argc > 0){
+        const char *flag = shift(&argc, &argv);
+        if (strcmp(flag, "-h") == 0){
+            usage(stdout, program);
+            exit(0);
+        }
+        if (argc == 0){
+            usage(stderr, program);
+            fprintf(stderr, "ERROR: No argument is provided for flag `%s`\n", flag);
+            exit(1);
+        }
+        const char *value = shift(&argc, &argv);
+
+        if (strcmp(flag, "-n") == 0){
+            size = atol(value);
+        } else if (strcmp(flag, "-r") == 0){
+            runs = atoi(value);
+        } else if (strcmp(flag, "-d") == 0){
+            dir = value;
+        } else if (strcmp(flag, "-f") == 0){
+            if (strcmp(value, "json") == 0){
+                json = 1;
+            } else if (strcmp(value, "text") != 0){
+                usage(stderr, program);
+                fprintf(stderr, "ERROR: Unknown output format `%s`\n", value);
+                exit(1);
+            }
+        } else {
+            usage(stderr, program);
+            fprintf(stderr, "ERROR: Unknown Flag `%s`\n", flag);
+            exit(1);
+        }
+    }
+
+    if (size <= 0 || runs <= 0){
+        usage(stderr, program);
+        fprintf(stderr, "ERROR: -n and -r must be positive\n");
+        exit(1);
+    }
+
+    const int all = strcmp(benchmark, "all") == 0;
+    if (!all && strcmp(benchmark, "exec") != 0 && strcmp(benchmark, "asm") != 0 &&
+        strcmp(benchmark, "load") != 0 && strcmp(benchmark, "startup") != 0 &&
+        strcmp(benchmark, "snapshot") != 0 && strcmp(benchmark, "sched") != 0 &&
+        strcmp(benchmark, "calls") != 0 && strcmp(benchmark, "natives") != 0 &&
+        strcmp(benchmark, "print") != 0){
+        usage(stderr, program);
+        fprintf(stderr, "ERROR: Unknown benchmark `%s`\n", benchmark);
+        exit(1);
+    }
+
+    cycles_init();
+    if (json){
+        json_begin();
+    }
+
+    if (all || strcmp(benchmark, "exec") == 0){
+        bench_exec(size, runs);
+    }
+    if (all || strcmp(benchmark, "asm") == 0){
+        if (all && !json) printf("\n");
+        bench_asm(size, runs);
+    }
+    if (all || strcmp(benchmark, "load") == 0){
+        if (all && !json) printf("\n");
+        bench_load(size, runs, dir);
+    }
+    if (all || strcmp(benchmark, "startup") == 0){
+        if (all && !json) printf("\n");
+        bench_startup(size, runs, dir);
+    }
+    if (all || strcmp(benchmark, "snapshot") == 0){
+        if (all && !json) printf("\n");
+        bench_snapshot(size, runs, dir);
+    }
+    if (all || strcmp(benchmark, "sched") == 0){
+        if (all && !json) printf("\n");
+        bench_sched(size, runs);
+    }
+    if (all || strcmp(benchmark, "calls") == 0){
+        if (all && !json) printf("\n");
+        bench_calls(size, runs);
+    }
+    if (all || strcmp(benchmark, "natives") == 0){
+        if (all && !json) printf("\n");
+        bench_natives(size, runs);
+    }
+    if (all || strcmp(benchmark, "print") == 0){
+        if (all && !json) printf("\n");
+        bench_print(size, runs);
+    }
+
+    if (json){
+        json_end();
+    }
+
+    return 0;
+}
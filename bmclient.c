@@ -0,0 +1,318 @@
+#define _DEFAULT_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// Client of `bmi --serve`, and the exec-per-job baseline it saves: sends the
+// same request again and again and reports the latency of every one.
+
+char *shift(int *argc, char ***argv){
+    assert(*argc > 0);
+    char *result = **argv;
+    *argv += 1;
+    *argc -= 1;
+    return result;
+}
+
+void usage(FILE *stream, const char *program){
+    fprintf(stream, "Usage: %s (-c <socket> | -x <bmi> -i <input.bm>) [-n <requests>] [-p <depth>] [-l <limit>] [-S <stack>] [-v] [-h]\n", program);
+    fprintf(stream, "    -c <socket>    send the requests to `bmi --serve` listening on <socket>\n");
+    fprintf(stream, "    -x <bmi>       run `<bmi> -i <input.bm> -l <limit>` once per request instead (ignores -S and -p)\n");
+    fprintf(stream, "    -n <requests>  number of requests (default 1000)\n");
+    fprintf(stream, "    -p <depth>     requests sent ahead of their answers (default 1)\n");
+    fprintf(stream, "    -l <limit>     instruction limit of every request (default -1, none)\n");
+    fprintf(stream, "    -S <stack>     initial stack of every request, bottom first, e.g. \"10 20\"\n");
+    fprintf(stream, "    -v             print every answer\n");
+}
+
+static uint64_t now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void *xmalloc(size_t size){
+    void *result = malloc(size > 0 ? size : 1);
+    if (result == NULL){
+        fprintf(stderr, "ERROR: Could not allocate memory\n");
+        exit(1);
+    }
+    return result;
+}
+
+static int compare_u64(const void *a, const void *b){
+    const uint64_t x = *(const uint64_t *) a;
+    const uint64_t y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+// Percentiles and a histogram with a row per power of two microseconds.
+static void print_latencies(uint64_t *latencies, size_t n, uint64_t elapsed){
+    qsort(latencies, n, sizeof(latencies[0]), compare_u64);
+    printf("%zu requests in %.3f s, %.0f requests/s\n", n, elapsed * 1e-9, n / (elapsed * 1e-9));
+    printf("latency: p50 %.1f us, p99 %.1f us, max %.1f us\n",
+           latencies[n / 2] * 1e-3, latencies[n - 1 - n / 100] * 1e-3, latencies[n - 1] * 1e-3);
+
+    size_t buckets[64] = {0};
+    size_t top = 0;
+    for (size_t i = 0; i < n; ++i){
+        size_t b = 0;
+        while ((latencies[i] / 1000) >> b > 0){
+            b += 1;
+        }
+        buckets[b] += 1;
+        top = b > top ? b : top;
+    }
+
+    printf("\n%16s %10s\n", "us", "requests");
+    for (size_t b = 0; b <= top; ++b){
+        char range[48];
+        snprintf(range, sizeof(range), "%lu-%lu", b > 0 ? 1UL << (b - 1) : 0UL, 1UL << b);
+        printf("%16s %10zu ", range, buckets[b]);
+        for (size_t k = 0; k < buckets[b] * 50 / n; ++k){
+            putchar('#');
+        }
+        putchar('\n');
+    }
+}
+
+static int connect_to(const char *socket_path){
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(socket_path) >= sizeof(addr.sun_path)){
+        fprintf(stderr, "ERROR: Socket path `%s` is too long\n", socket_path);
+        exit(1);
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0){
+        fprintf(stderr, "ERROR: Could not connect to `%s`: %s\n", socket_path, strerror(errno));
+        exit(1);
+    }
+    return fd;
+}
+
+// Keeps up to `depth` requests in flight, sending as many as that allows in
+// one write. Answers come back in order, so the n-th line answers the n-th
+// request.
+static void run_server(const char *socket_path, const char *request, size_t n, size_t depth, int verbose){
+    const int fd = connect_to(socket_path);
+    const size_t request_size = strlen(request);
+    char *batch = xmalloc(request_size * depth);
+    uint64_t *sent_at = xmalloc(sizeof(sent_at[0]) * n);
+    uint64_t *latencies = xmalloc(sizeof(latencies[0]) * n);
+
+    size_t in_capacity = 64 * 1024;
+    char *in = xmalloc(in_capacity);
+    size_t in_size = 0;
+
+    size_t sent = 0;
+    size_t answered = 0;
+    const uint64_t start = now_ns();
+    while (answered < n){
+        struct pollfd pfd = {.fd = fd, .events = POLLIN};
+        if (sent < n && sent - answered < depth){
+            pfd.events |= POLLOUT;
+        }
+        if (poll(&pfd, 1, -1) < 0){
+            if (errno == EINTR){
+                continue;
+            }
+            fprintf(stderr, "ERROR: poll: %s\n", strerror(errno));
+            exit(1);
+        }
+
+        if (pfd.revents & POLLOUT){
+            size_t count = 0;
+            while (sent + count < n && sent + count - answered < depth){
+                memcpy(batch + count * request_size, request, request_size);
+                count += 1;
+            }
+            const uint64_t now = now_ns();
+            for (size_t i = 0; i < count; ++i){
+                sent_at[sent + i] = now;
+            }
+            for (size_t off = 0; off < count * request_size;){
+                const ssize_t w = write(fd, batch + off, count * request_size - off);
+                if (w < 0 && errno == EINTR){
+                    continue;
+                }
+                if (w < 0){
+                    fprintf(stderr, "ERROR: Could not send requests: %s\n", strerror(errno));
+                    exit(1);
+                }
+                off += w;
+            }
+            sent += count;
+        }
+
+        if (pfd.revents & (POLLIN | POLLHUP | POLLERR)){
+            if (in_size == in_capacity){
+                in_capacity *= 2;
+                in = realloc(in, in_capacity);
+                if (in == NULL){
+                    fprintf(stderr, "ERROR: Could not allocate memory\n");
+                    exit(1);
+                }
+            }
+            const ssize_t r = read(fd, in + in_size, in_capacity - in_size);
+            if (r < 0 && errno == EINTR){
+                continue;
+            }
+            if (r <= 0){
+                fprintf(stderr, "ERROR: The server closed the connection after %zu answers\n", answered);
+                exit(1);
+            }
+            in_size += r;
+
+            const uint64_t now = now_ns();
+            size_t start_of_line = 0;
+            char *newline = NULL;
+            while ((newline = memchr(in + start_of_line, '\n', in_size - start_of_line)) != NULL){
+                if (verbose){
+                    fwrite(in + start_of_line, 1, newline - in + 1 - start_of_line, stdout);
+                }
+                latencies[answered] = now - sent_at[answered];
+                answered += 1;
+                start_of_line = newline - in + 1;
+            }
+            memmove(in, in + start_of_line, in_size - start_of_line);
+            in_size -= start_of_line;
+        }
+    }
+    const uint64_t elapsed = now_ns() - start;
+
+    close(fd);
+    printf("%zu in flight\n", depth);
+    print_latencies(latencies, n, elapsed);
+    free(batch);
+    free(sent_at);
+    free(latencies);
+    free(in);
+}
+
+static void run_exec(const char *bmi, const char *input_path, const char *limit, size_t n){
+    uint64_t *latencies = xmalloc(sizeof(latencies[0]) * n);
+
+    const uint64_t start = now_ns();
+    for (size_t i = 0; i < n; ++i){
+        const uint64_t begin = now_ns();
+        const pid_t pid = fork();
+        if (pid < 0){
+            fprintf(stderr, "ERROR: Could not fork: %s\n", strerror(errno));
+            exit(1);
+        }
+        if (pid == 0){
+            const int null = open("/dev/null", O_WRONLY);
+            if (null >= 0){
+                dup2(null, STDOUT_FILENO);
+                dup2(null, STDERR_FILENO);
+            }
+            execl(bmi, bmi, "-i", input_path, "-l", limit, (char *) NULL);
+            _exit(127);
+        }
+
+        int status = 0;
+        while (waitpid(pid, &status, 0) < 0){
+            if (errno != EINTR){
+                fprintf(stderr, "ERROR: waitpid: %s\n", strerror(errno));
+                exit(1);
+            }
+        }
+        if (!WIFEXITED(status) || WEXITSTATUS(status) == 127){
+            fprintf(stderr, "ERROR: Could not run `%s`\n", bmi);
+            exit(1);
+        }
+        latencies[i] = now_ns() - begin;
+    }
+    const uint64_t elapsed = now_ns() - start;
+
+    printf("exec per request\n");
+    print_latencies(latencies, n, elapsed);
+    free(latencies);
+}
+
+int main(int argc, char **argv){
+    const char *program = shift(&argc, &argv);
+    const char *socket_path = NULL;
+    const char *bmi = NULL;
+    const char *input_path = NULL;
+    const char *limit = "-1";
+    const char *stack = "";
+    long n = 1000;
+    long depth = 1;
+    int verbose = 0;
+
+    while (argc > 0){
+        const char *flag = shift(&argc, &argv);
+
+        if (strcmp(flag, "-v") == 0){
+            verbose = 1;
+            continue;
+        } else if (strcmp(flag, "-h") == 0){
+            usage(stdout, program);
+            exit(0);
+        }
+
+        if (argc == 0){
+            usage(stderr, program);
+            fprintf(stderr, "ERROR: No argument is provided for flag `%s`\n", flag);
+            exit(1);
+        }
+        const char *value = shift(&argc, &argv);
+
+        if (strcmp(flag, "-c") == 0){
+            socket_path = value;
+        } else if (strcmp(flag, "-x") == 0){
+            bmi = value;
+        } else if (strcmp(flag, "-i") == 0){
+            input_path = value;
+        } else if (strcmp(flag, "-n") == 0){
+            n = atol(value);
+        } else if (strcmp(flag, "-p") == 0){
+            depth = atol(value);
+        } else if (strcmp(flag, "-l") == 0){
+            limit = value;
+        } else if (strcmp(flag, "-S") == 0){
+            stack = value;
+        } else {
+            usage(stderr, program);
+            fprintf(stderr, "ERROR: Unknown Flag `%s`\n", flag);
+            exit(1);
+        }
+    }
+
+    if ((socket_path == NULL) == (bmi == NULL) || (bmi != NULL && input_path == NULL)){
+        usage(stderr, program);
+        fprintf(stderr, "ERROR: Either -c, or -x with -i, is required\n");
+        exit(1);
+    }
+    if (n <= 0 || depth <= 0){
+        usage(stderr, program);
+        fprintf(stderr, "ERROR: -n and -p must be positive\n");
+        exit(1);
+    }
+
+    if (bmi != NULL){
+        run_exec(bmi, input_path, limit, n);
+        return 0;
+    }
+
+    const size_t request_size = strlen(limit) + strlen(stack) + 3;
+    char *request = xmalloc(request_size);
+    snprintf(request, request_size, "%s %s\n", limit, stack);
+    run_server(socket_path, request, n, depth, verbose);
+    free(request);
+    return 0;
+}
@@ -0,0 +1,575 @@
+#define _DEFAULT_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bm.h"
+
+// Differential fuzzer of the engines. Every case, a program and an
+// instruction limit, runs on bm_execute_inst() one instruction at a time and
+// on every engine, with and without bm_verify_program(), twice in a row so
+// that resuming is covered too. Any difference in the error, ip, halt flag,
+// instruction count, stack, call frames, memory or print_debug output is a bug: the case is
+// shrunk while it still diverges and saved as a v1 .bm file, which keeps
+// illegal instructions. Both VMs have the standard natives and three of
+// the fuzzer's own.
+//
+// Built with -DBMFUZZ_LIBFUZZER (`make bmfuzz-libfuzzer`) it is a libFuzzer
+// target instead, reading cases from the fuzzer's bytes.
+
+#define FUZZ_STACK_CAPACITY 16
+#define FUZZ_PROGRAM_CAPACITY 256
+#define FUZZ_DEFAULT_LIMIT 1000
+#define FUZZ_MEMORY_SIZE 8
+
+typedef struct {
+    Inst program[FUZZ_PROGRAM_CAPACITY];
+    size_t program_size;
+    int limit;
+} Case;
+
+typedef struct {
+    Err err;
+    Word ip;
+    int halt;
+    Word inst_count;
+    Word stack_size;
+    Word stack[FUZZ_STACK_CAPACITY];
+    Word fp;
+    Word frames_size;
+    Bm_Frame frames[FUZZ_STACK_CAPACITY];
+    Word memory[FUZZ_MEMORY_SIZE];
+    Word output_size;
+    uint64_t output_hash;
+} Outcome;
+
+// print_debug output of a VM since the case started: its length and an
+// FNV-1a hash of it
+typedef struct {
+    Word size;
+    uint64_t hash;
+} Fuzz_Output;
+
+static Bm *reference_bm = NULL;
+static Bm *engine_bm = NULL;
+static Word reference_memory[FUZZ_MEMORY_SIZE];
+static Word engine_memory[FUZZ_MEMORY_SIZE];
+static Fuzz_Output reference_output;
+static Fuzz_Output engine_output;
+static int inst_types = 0;          // types that exist: 0 .. inst_types - 1
+static const char *output_dir = ".";
+
+static const Case *current_case = NULL;   // for the crash handler
+
+// Natives past the standard ones, for shapes those don't have: more results
+// than arguments, no arguments, and failing.
+static Err fuzz_spread(Bm *bm, Word *args, void *data){
+    (void) bm; (void) data;
+    args[1] = args[0] + 1;
+    args[2] = args[0] + 2;
+    return ERR_OK;
+}
+
+static Err fuzz_seven(Bm *bm, Word *args, void *data){
+    (void) bm; (void) data;
+    args[0] = 7;
+    return ERR_OK;
+}
+
+static Err fuzz_fail_if_eq(Bm *bm, Word *args, void *data){
+    (void) bm; (void) data;
+    return args[0] == args[1] ? ERR_ILLEGAL_OPERAND : ERR_OK;
+}
+
+static Err fuzz_output(void *data, const char *bytes, size_t size){
+    Fuzz_Output *output = data;
+    output->size += size;
+    for (size_t i = 0; i < size; ++i){
+        output->hash = (output->hash ^ (uint8_t) bytes[i]) * 0x100000001B3ull;
+    }
+    return ERR_OK;
+}
+
+static Err fuzz_bind_natives(Bm *bm){
+    Err err = bm_bind_std_natives(bm);
+    if (err == ERR_OK) err = bm_bind_native(bm, COUNT_BM_STD_NATIVES + 0, "spread", fuzz_spread, 1, 3, NULL);
+    if (err == ERR_OK) err = bm_bind_native(bm, COUNT_BM_STD_NATIVES + 1, "seven", fuzz_seven, 0, 1, NULL);
+    if (err == ERR_OK) err = bm_bind_native(bm, COUNT_BM_STD_NATIVES + 2, "fail_if_eq", fuzz_fail_if_eq, 2, 0, NULL);
+    return err;
+}
+
+static void fuzz_init(void){
+    if (reference_bm != NULL){
+        return;
+    }
+    reference_bm = bm_create(NULL, FUZZ_STACK_CAPACITY, FUZZ_PROGRAM_CAPACITY);
+    engine_bm = bm_create(NULL, FUZZ_STACK_CAPACITY, FUZZ_PROGRAM_CAPACITY);
+    if (reference_bm == NULL || engine_bm == NULL){
+        fprintf(stderr, "ERROR: Could not allocate memory\n");
+        exit(1);
+    }
+    bm_set_memory(reference_bm, reference_memory, FUZZ_MEMORY_SIZE);
+    bm_set_memory(engine_bm, engine_memory, FUZZ_MEMORY_SIZE);
+    if (fuzz_bind_natives(reference_bm) != ERR_OK || fuzz_bind_natives(engine_bm) != ERR_OK){
+        fprintf(stderr, "ERROR: Could not allocate memory\n");
+        exit(1);
+    }
+    bm_set_output_callback(reference_bm, fuzz_output, &reference_output);
+    bm_set_output_callback(engine_bm, fuzz_output, &engine_output);
+    while (inst_type_has_operand((Inst_Type) inst_types) >= 0){
+        inst_types += 1;
+    }
+
+    setvbuf(stdout, NULL, _IOLBF, 0);
+}
+
+static Err run_reference(Bm *bm, int limit){
+    while (limit != 0 && !bm_halted(bm)){
+        const Err err = bm_execute_inst(bm);
+        if (err != ERR_OK){
+            return err;
+        }
+        if (limit > 0){
+            limit -= 1;
+        }
+    }
+    return ERR_OK;
+}
+
+static void record(Bm *bm, Err err, const Fuzz_Output *output, Outcome *outcome){
+    memset(outcome, 0, sizeof(*outcome));
+    outcome->err = err;
+    outcome->ip = bm_ip(bm);
+    outcome->halt = bm_halted(bm);
+    outcome->inst_count = bm_inst_count(bm);
+    outcome->stack_size = bm_stack_size(bm);
+    memcpy(outcome->stack, bm_stack(bm), sizeof(Word) * outcome->stack_size);
+    outcome->fp = bm_fp(bm);
+    outcome->frames_size = bm_frames_size(bm);
+    memcpy(outcome->frames, bm_frames(bm), sizeof(Bm_Frame) * outcome->frames_size);
+    memcpy(outcome->memory, bm_memory(bm), sizeof(outcome->memory));
+    bm_flush_output(bm);
+    outcome->output_size = output->size;
+    outcome->output_hash = output->hash;
+}
+
+static int outcome_eq(const Outcome *a, const Outcome *b){
+    return a->err == b->err && a->ip == b->ip && a->halt == b->halt &&
+        a->inst_count == b->inst_count && a->stack_size == b->stack_size &&
+        memcmp(a->stack, b->stack, sizeof(Word) * a->stack_size) == 0 &&
+        a->fp == b->fp && a->frames_size == b->frames_size &&
+        memcmp(a->frames, b->frames, sizeof(Bm_Frame) * a->frames_size) == 0 &&
+        memcmp(a->memory, b->memory, sizeof(a->memory)) == 0 &&
+        a->output_size == b->output_size && a->output_hash == b->output_hash;
+}
+
+static void print_outcome(FILE *stream, const char *name, const Outcome *outcome){
+    fprintf(stream, "    %-18s %s, ip %ld, halt %d, %ld instructions, stack [",
+            name, err_as_cstr(outcome->err), (long) outcome->ip, outcome->halt, (long) outcome->inst_count);
+    for (Word i = 0; i < outcome->stack_size; ++i){
+        fprintf(stream, i > 0 ? " %ld" : "%ld", (long) outcome->stack[i]);
+    }
+    fprintf(stream, "], fp %ld, frames [", (long) outcome->fp);
+    for (Word i = 0; i < outcome->frames_size; ++i){
+        fprintf(stream, i > 0 ? " %ld:%ld" : "%ld:%ld", (long) outcome->frames[i].return_ip, (long) outcome->frames[i].fp);
+    }
+    fprintf(stream, "], memory [");
+    for (size_t i = 0; i < FUZZ_MEMORY_SIZE; ++i){
+        fprintf(stream, i > 0 ? " %ld" : "%ld", (long) outcome->memory[i]);
+    }
+    fprintf(stream, "], output %ld bytes %016llx\n", (long) outcome->output_size,
+            (unsigned long long) outcome->output_hash);
+}
+
+// Runs `c` on the reference and on `engine`, and returns 1 if they differ
+// after either run. With a `stream` the difference is printed there.
+static int diverges_on(const Case *c, Bm_Engine engine, int verified, FILE *stream){
+    if (bm_load_program_from_memory(reference_bm, c->program, c->program_size) != ERR_OK ||
+        bm_load_program_from_memory(engine_bm, c->program, c->program_size) != ERR_OK){
+        fprintf(stderr, "ERROR: Could not load a case: %s\n", bm_error_message(engine_bm));
+        exit(1);
+    }
+    bm_reset(reference_bm);
+    bm_reset(engine_bm);
+    memset(reference_memory, 0, sizeof(reference_memory));
+    memset(engine_memory, 0, sizeof(engine_memory));
+    reference_output = engine_output = (Fuzz_Output) {.hash = 0xCBF29CE484222325ull};
+    if (verified){
+        bm_verify_program(engine_bm, NULL);
+    }
+
+    for (int run = 1; run <= 2; ++run){
+        Outcome expected, actual;
+        record(reference_bm, run_reference(reference_bm, c->limit), &reference_output, &expected);
+        record(engine_bm, bm_execute_program_with(engine_bm, engine, c->limit), &engine_output, &actual);
+        if (!outcome_eq(&expected, &actual)){
+            if (stream != NULL){
+                char name[64];
+                snprintf(name, sizeof(name), "%s%s:", bm_engine_as_cstr(engine), verified ? " (verified)" : "");
+                fprintf(stream, "  run %d of %d instructions:\n", run, c->limit);
+                print_outcome(stream, "reference:", &expected);
+                print_outcome(stream, name, &actual);
+            }
+            return 1;
+        }
+        if (expected.err != ERR_OK || expected.halt){
+            break;
+        }
+    }
+    return 0;
+}
+
+static int diverges(const Case *c, FILE *stream){
+    current_case = c;
+    int result = 0;
+    for (Bm_Engine engine = 0; engine < COUNT_BM_ENGINES && !result; ++engine){
+        for (int verified = 0; verified <= 1 && !result; ++verified){
+            result = diverges_on(c, engine, verified, stream);
+        }
+    }
+    current_case = NULL;
+    return result;
+}
+
+// Shrinks a diverging case: drops runs of instructions (halving their
+// length), zeroes and halves operands, lowers the limit, for as long as any
+// of that keeps it diverging. Jump operands are left as they are.
+static void minimize(Case *c){
+    Case candidate;
+    int changed = 1;
+    while (changed){
+        changed = 0;
+
+        for (size_t chunk = c->program_size / 2 > 0 ? c->program_size / 2 : 1; chunk > 0; chunk /= 2){
+            for (size_t start = 0; start + chunk <= c->program_size && c->program_size > 1;){
+                candidate = *c;
+                memmove(candidate.program + start, candidate.program + start + chunk,
+                        sizeof(Inst) * (c->program_size - start - chunk));
+                candidate.program_size -= chunk;
+                if (candidate.program_size > 0 && diverges(&candidate, NULL)){
+                    *c = candidate;
+                    changed = 1;
+                } else {
+                    start += 1;
+                }
+            }
+        }
+
+        for (size_t i = 0; i < c->program_size; ++i){
+            while (c->program[i].operand != 0){
+                candidate = *c;
+                const Word operand = candidate.program[i].operand;
+                candidate.program[i].operand = 0;
+                if (!diverges(&candidate, NULL)){
+                    candidate.program[i].operand = operand / 2;
+                    if (!diverges(&candidate, NULL)){
+                        break;
+                    }
+                }
+                *c = candidate;
+                changed = 1;
+            }
+        }
+
+        while (c->limit > 1){
+            candidate = *c;
+            candidate.limit = c->limit / 2;
+            if (!diverges(&candidate, NULL)){
+                candidate.limit = c->limit - 1;
+                if (!diverges(&candidate, NULL)){
+                    break;
+                }
+            }
+            *c = candidate;
+            changed = 1;
+        }
+    }
+}
+
+static uint64_t case_hash(const Case *c){
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < c->program_size; ++i){
+        hash = (hash ^ (uint64_t) c->program[i].type) * 1099511628211ULL;
+        hash = (hash ^ (uint64_t) c->program[i].operand) * 1099511628211ULL;
+    }
+    return (hash ^ (uint64_t) c->limit) * 1099511628211ULL;
+}
+
+// Minimizes `c`, saves it and describes it on stderr.
+static void report(Case *c){
+    fprintf(stderr, "DIVERGENCE: %zu instructions, limit %d\n", c->program_size, c->limit);
+    diverges(c, stderr);
+    minimize(c);
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/bmfuzz-%016llx.bm", output_dir, (unsigned long long) case_hash(c));
+    if (bm_load_program_from_memory(engine_bm, c->program, c->program_size) != ERR_OK ||
+        bm_save_program_to_file_as(engine_bm, path, BM_FORMAT_V1) != ERR_OK){
+        fprintf(stderr, "ERROR: Could not save `%s`: %s\n", path, strerror(errno));
+        exit(1);
+    }
+
+    fprintf(stderr, "  minimized to %zu instructions, limit %d:\n", c->program_size, c->limit);
+    for (size_t i = 0; i < c->program_size; ++i){
+        const Inst inst = c->program[i];
+        if (inst_type_has_operand(inst.type) < 0){
+            fprintf(stderr, "    %4zu: illegal type %d, operand %ld\n", i, (int) inst.type, (long) inst.operand);
+        } else {
+            fprintf(stderr, "    %4zu: %s %ld\n", i, inst_type_as_cstr(inst.type), (long) inst.operand);
+        }
+    }
+    diverges(c, stderr);
+    fprintf(stderr, "  saved to %s, replay with `./bmfuzz -l %d %s`\n", path, c->limit, path);
+}
+
+#ifdef BMFUZZ_LIBFUZZER
+
+// Two bytes of limit, then per instruction a type byte and an operand: one
+// signed byte, or eight bytes if the top bit of the type byte is set. Types
+// past the last one are illegal instructions.
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size){
+    fuzz_init();
+    if (size < 2){
+        return 0;
+    }
+
+    static Case c;
+    c.limit = (data[0] | data[1] << 8) % (FUZZ_DEFAULT_LIMIT + 1);
+    c.program_size = 0;
+    for (size_t i = 2; i + 1 < size && c.program_size < FUZZ_PROGRAM_CAPACITY;){
+        Inst *inst = &c.program[c.program_size++];
+        const uint8_t type = data[i++];
+        inst->type = (Inst_Type) ((type & 0x7f) % (inst_types + 2));
+        if ((type & 0x80) && i + 8 <= size){
+            uint64_t operand = 0;
+            for (int k = 7; k >= 0; --k){
+                operand = operand << 8 | data[i + k];
+            }
+            inst->operand = (Word) operand;
+            i += 8;
+        } else {
+            inst->operand = (int8_t) data[i++];
+        }
+    }
+    if (c.program_size == 0){
+        return 0;
+    }
+
+    if (diverges(&c, NULL)){
+        report(&c);
+        abort();
+    }
+    return 0;
+}
+
+#else
+
+char *shift(int *argc, char ***argv){
+    assert(*argc > 0);
+    char *result = **argv;
+    *argv += 1;
+    *argc -= 1;
+    return result;
+}
+
+void usage(FILE *stream, const char *program){
+    fprintf(stream, "Usage: %s [-n <cases>] [-s <seed>] [-m <size>] [-l <limit>] [-o <dir>] [-k] [-h] [replay.bm...]\n", program);
+    fprintf(stream, "    -n <cases>   random cases to run (default 100000)\n");
+    fprintf(stream, "    -s <seed>    seed of the generator (default: the time)\n");
+    fprintf(stream, "    -m <size>    largest program, in instructions (default 32, at most %d)\n", FUZZ_PROGRAM_CAPACITY);
+    fprintf(stream, "    -l <limit>   instruction limit of every run (default: random up to %d)\n", FUZZ_DEFAULT_LIMIT);
+    fprintf(stream, "    -o <dir>     where diverging cases are saved (default .)\n");
+    fprintf(stream, "    -k           keep going after a divergence\n");
+    fprintf(stream, "Files given instead of -n are replayed with the limit of -l (default %d).\n", FUZZ_DEFAULT_LIMIT);
+}
+
+static char crash_path[4096];
+static char crash_message[4200];
+
+// Saves the case an engine crashed on, as the raw v1 instructions, with
+// async-signal-safe calls only.
+static void on_crash(int signal){
+    if (current_case != NULL){
+        const int fd = open(crash_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd >= 0){
+            const ssize_t ignored = write(fd, current_case->program, sizeof(Inst) * current_case->program_size);
+            (void) ignored;
+            close(fd);
+        }
+        const ssize_t ignored = write(STDERR_FILENO, crash_message, strlen(crash_message));
+        (void) ignored;
+    }
+    raise(signal);
+}
+
+static void catch_crashes(void){
+    snprintf(crash_path, sizeof(crash_path), "%s/bmfuzz-crash.bm", output_dir);
+    snprintf(crash_message, sizeof(crash_message), "ERROR: An engine crashed; the case is in %s\n", crash_path);
+    struct sigaction action = {0};
+    action.sa_handler = on_crash;
+    action.sa_flags = SA_RESETHAND;
+    sigaction(SIGSEGV, &action, NULL);
+    sigaction(SIGBUS, &action, NULL);
+    sigaction(SIGILL, &action, NULL);
+    sigaction(SIGFPE, &action, NULL);
+    sigaction(SIGABRT, &action, NULL);
+}
+
+static uint64_t rng = 0;
+
+static uint64_t rnd(void){
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+// Mostly legal programs heavy on push, so that the arithmetic has
+// something to work on, with operands that are small numbers or addresses
+// around the program, now and then anything.
+static void random_case(Case *c, size_t max_size, int limit){
+    c->program_size = 1 + rnd() % max_size;
+    for (size_t i = 0; i < c->program_size; ++i){
+        const uint64_t kind = rnd() % 32;
+        if (kind == 0){
+            c->program[i].type = (Inst_Type) (inst_types + rnd() % 4);
+        } else if (kind < 12){
+            c->program[i].type = INST_PUSH;
+        } else {
+            c->program[i].type = (Inst_Type) (rnd() % inst_types);
+        }
+
+        const uint64_t operand = rnd() % 10;
+        if (operand < 6){
+            c->program[i].operand = (Word) (rnd() % 5) - 1;
+        } else if (operand < 9){
+            c->program[i].operand = (Word) (rnd() % (c->program_size + 2)) - 1;
+        } else {
+            c->program[i].operand = (Word) rnd();
+        }
+    }
+    c->limit = limit >= 0 ? limit : (int) (rnd() % (FUZZ_DEFAULT_LIMIT + 1));
+}
+
+static int replay(const char *file_path, int limit){
+    Bm *bm = bm_create(NULL, FUZZ_STACK_CAPACITY, FUZZ_PROGRAM_CAPACITY);
+    if (bm == NULL || bm_load_program_from_file(bm, file_path) != ERR_OK){
+        fprintf(stderr, "ERROR: Could not load `%s`: %s\n", file_path, bm == NULL ? "out of memory" : bm_error_message(bm));
+        exit(1);
+    }
+    if (bm_program_size(bm) > FUZZ_PROGRAM_CAPACITY){
+        fprintf(stderr, "ERROR: `%s` has more than %d instructions\n", file_path, FUZZ_PROGRAM_CAPACITY);
+        exit(1);
+    }
+
+    static Case c;
+    c.program_size = bm_program_size(bm);
+    memcpy(c.program, bm_program(bm), sizeof(Inst) * c.program_size);
+    c.limit = limit >= 0 ? limit : FUZZ_DEFAULT_LIMIT;
+    bm_destroy(bm);
+
+    if (diverges(&c, NULL)){
+        fprintf(stderr, "%s: ", file_path);
+        report(&c);
+        return 1;
+    }
+    printf("%s: ok\n", file_path);
+    return 0;
+}
+
+int main(int argc, char **argv){
+    const char *program = shift(&argc, &argv);
+    long cases = 100000;
+    long max_size = 32;
+    long limit = -1;
+    int keep_going = 0;
+    uint64_t seed = (uint64_t) time(NULL);
+    const char *replays[256];
+    size_t replays_size = 0;
+
+    while (argc > 0){
+        const char *flag = shift(&argc, &argv);
+
+        if (strcmp(flag, "-k") == 0){
+            keep_going = 1;
+            continue;
+        } else if (strcmp(flag, "-h") == 0){
+            usage(stdout, program);
+            exit(0);
+        } else if (flag[0] != '-'){
+            if (replays_size >= ARRAY_SIZE(replays)){
+                fprintf(stderr, "ERROR: Too many files to replay\n");
+                exit(1);
+            }
+            replays[replays_size++] = flag;
+            continue;
+        }
+
+        if (argc == 0){
+            usage(stderr, program);
+            fprintf(stderr, "ERROR: No argument is provided for flag `%s`\n", flag);
+            exit(1);
+        }
+        const char *value = shift(&argc, &argv);
+
+        if (strcmp(flag, "-n") == 0){
+            cases = atol(value);
+        } else if (strcmp(flag, "-s") == 0){
+            seed = strtoull(value, NULL, 10);
+        } else if (strcmp(flag, "-m") == 0){
+            max_size = atol(value);
+        } else if (strcmp(flag, "-l") == 0){
+            limit = atol(value);
+        } else if (strcmp(flag, "-o") == 0){
+            output_dir = value;
+        } else {
+            usage(stderr, program);
+            fprintf(stderr, "ERROR: Unknown Flag `%s`\n", flag);
+            exit(1);
+        }
+    }
+
+    if (max_size <= 0 || max_size > FUZZ_PROGRAM_CAPACITY || limit > FUZZ_DEFAULT_LIMIT * 1000L){
+        usage(stderr, program);
+        fprintf(stderr, "ERROR: -m must be within 1..%d and -l at most %d\n", FUZZ_PROGRAM_CAPACITY, FUZZ_DEFAULT_LIMIT * 1000);
+        exit(1);
+    }
+
+    fuzz_init();
+    catch_crashes();
+
+    if (replays_size > 0){
+        int failed = 0;
+        for (size_t i = 0; i < replays_size; ++i){
+            failed |= replay(replays[i], (int) limit);
+        }
+        return failed;
+    }
+
+    printf("seed %llu, %ld cases of up to %ld instructions\n", (unsigned long long) seed, cases, max_size);
+    rng = seed != 0 ? seed : 88172645463325252ULL;
+    static Case c;
+    long found = 0;
+    for (long i = 0; i < cases; ++i){
+        random_case(&c, (size_t) max_size, (int) limit);
+        if (diverges(&c, NULL)){
+            found += 1;
+            report(&c);
+            if (!keep_going){
+                break;
+            }
+        }
+    }
+    printf("%ld divergences\n", found);
+    return found > 0;
+}
+
+#endif // BMFUZZ_LIBFUZZER
@@ -1,5 +1,20 @@
-#include "./bm.c"
-Bm bm = {0}; 
+#define _DEFAULT_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "./bm.h"
+
+Label_Table lt = {0};
 
 char *shift(int *argc, char ***argv){
     assert(*argc > 0);
@@ -9,8 +24,524 @@ char *shift(int *argc, char ***argv){
     return result; 
 }
 
+#define BMI_MEMORY_SIZE (64*1024)
+
 void usage(FILE *stream, const char *program){
-    fprintf(stream, "Usage: ./bmi -i <input.bm> [-l <limit>] [-h]\n", program); 
+    fprintf(stream, "Usage: %s -i <input.bm> [-l <limit>] [-e <engine>] [-s <stack capacity>] [-m] [-h]\n", program); 
+    fprintf(stream, "    -e <engine>    execution engine: switch (default), threaded, jit, tos or block\n");
+    fprintf(stream, "    -s <capacity>  maximum stack size in words (default %d)\n", BM_STACK_CAPACITY);
+    fprintf(stream, "    --memory <words>  size of the memory of `load` and `store` (default %d)\n", BMI_MEMORY_SIZE);
+    fprintf(stream, "    --binary-output  print_debug writes each value as 8 raw bytes instead of a line\n");
+    fprintf(stream, "    -m             map the file instead of reading it and skip the up-front verification\n");
+    fprintf(stream, "    --profile      count and time every instruction (on the switch engine) and print the hot spots\n");
+    fprintf(stream, "    --folded <file>  with --profile, also write the profile as folded stacks for flamegraph.pl\n");
+    fprintf(stream, "    --source <file.ebasm>  with --profile, the source of the program, for lines and labels\n");
+    fprintf(stream, "                   (not needed for files assembled with `ebasm -g`)\n");
+    fprintf(stream, "    --restore <file.bmss>   start from the state in a snapshot of the same program\n");
+    fprintf(stream, "    --snapshot <file.bmss>  save the state of the VM when it stops without an error\n");
+    fprintf(stream, "    --serve <socket>  answer requests on a Unix domain socket instead of running once\n");
+    fprintf(stream, "    -j <workers>   with --serve, pre-forked worker processes (default: one per core)\n");
+}
+
+String_View slurp_file(const char *file_path){
+    FILE *f = fopen(file_path, "r");
+    if (f == NULL || fseek(f, 0, SEEK_END) < 0){
+        fprintf(stderr, "ERROR: Could not read file `%s` %s\n", file_path, strerror(errno));
+        exit(1);
+    }
+
+    long m = ftell(f);
+    if (m < 0 || fseek(f, 0, SEEK_SET) < 0){
+        fprintf(stderr, "ERROR: Could not read file `%s` %s\n", file_path, strerror(errno));
+        exit(1);
+    }
+
+    char *buffer = malloc(m > 0 ? m : 1);
+    if (buffer == NULL){
+        fprintf(stderr, "ERROR: Could not allocate memory for file `%s` %s\n", file_path, strerror(errno));
+        exit(1);
+    }
+
+    size_t n = fread(buffer, 1, m, f);
+    if (ferror(f)){
+        fprintf(stderr, "ERROR: Could not read file `%s` %s\n", file_path, strerror(errno));
+        exit(1);
+    }
+    fclose(f);
+
+    return (String_View) {
+        .count = n,
+        .data = buffer,
+    };
+}
+
+// Prints `err` at instruction `inst`, with its source line and label when
+// `src` knows them.
+static void report_error(const char *input_file_path, Bm *src, Word inst, Err err){
+    Word line = 0;
+    const char *label = NULL;
+    if (!bm_source_location(src, inst, &line, &label)){
+        fprintf(stderr, "ERROR: %s: instruction %ld: %s\n", input_file_path, inst, err_as_cstr(err));
+    } else if (label == NULL){
+        fprintf(stderr, "ERROR: %s: instruction %ld (line %ld): %s\n", input_file_path, inst, line, err_as_cstr(err));
+    } else {
+        fprintf(stderr, "ERROR: %s: instruction %ld (line %ld, in %s): %s\n", input_file_path, inst, line, label, err_as_cstr(err));
+    }
+}
+
+// Assembles the source of `bm`'s program for its lines and labels. Returns
+// NULL with a warning if the source doesn't produce the same program, even
+// after fusing (`ebasm -f`).
+static Bm *assemble_source(const Bm *bm, const char *source_path){
+    Bm *src = bm_create(NULL, 0, BM_PROGRAM_CAPACITY);
+    if (src == NULL || bm_bind_std_natives(src) != ERR_OK){
+        fprintf(stderr, "ERROR: Could not allocate a VM\n");
+        exit(1);
+    }
+    if (bm_translate_source(slurp_file(source_path), src, &lt) != ERR_OK){
+        fprintf(stderr, "ERROR: %s: %s\n", source_path, bm_error_message(src));
+        exit(1);
+    }
+
+    for (int fused = 0; fused <= 1; ++fused){
+        if (fused){
+            bm_fuse_program(src, &lt);
+        }
+        if (bm_program_size(src) == bm_program_size(bm) &&
+            memcmp(bm_program(src), bm_program(bm), sizeof(Inst) * bm_program_size(bm)) == 0){
+            return src;
+        }
+    }
+
+    fprintf(stderr, "WARNING: `%s` is not the source of this program, the profile has no lines\n", source_path);
+    bm_destroy(src);
+    return NULL;
+}
+
+static void format_inst(char *buffer, size_t size, Inst inst){
+    if (inst_type_has_operand(inst.type) > 0){
+        snprintf(buffer, size, "%s %ld", inst_type_as_cstr(inst.type), inst.operand);
+    } else {
+        snprintf(buffer, size, "%s", inst_type_as_cstr(inst.type));
+    }
+}
+
+#define PROFILE_HOT_SPOTS 20
+
+static uint64_t *sort_ticks;
+
+static int compare_by_ticks(const void *a, const void *b){
+    const uint64_t ta = sort_ticks[*(const Word *) a];
+    const uint64_t tb = sort_ticks[*(const Word *) b];
+    return ta < tb ? 1 : ta > tb ? -1 : 0;
+}
+
+typedef struct {
+    Inst_Type type;
+    uint64_t count;
+    uint64_t ticks;
+} Type_Total;
+
+// Per type totals, then the instructions with the most ticks.
+static void print_profile(FILE *stream, const Bm *bm, const Bm_Profile *profile, Bm *src){
+    const Inst *program = bm_program(bm);
+    const Word n = bm_program_size(bm);
+
+    uint64_t total_count = 0;
+    uint64_t total_ticks = 0;
+    Type_Total types[64];
+    size_t types_size = 0;
+
+    for (Word i = 0; i < n; ++i){
+        const Bm_Profile_Entry *entry = &profile->entries[i];
+        if (entry->count == 0){
+            continue;
+        }
+        total_count += entry->count;
+        total_ticks += entry->ticks;
+
+        size_t t = 0;
+        while (t < types_size && types[t].type != program[i].type){
+            t += 1;
+        }
+        if (t == types_size){
+            if (types_size == ARRAY_SIZE(types)){
+                continue;
+            }
+            types[types_size++].type = program[i].type;
+            types[t].count = 0;
+            types[t].ticks = 0;
+        }
+        types[t].count += entry->count;
+        types[t].ticks += entry->ticks;
+    }
+
+    const double count_pct = total_count > 0 ? 100.0 / total_count : 0.0;
+    const double ticks_pct = total_ticks > 0 ? 100.0 / total_ticks : 0.0;
+
+    fprintf(stream, "Profile: %lu instructions, %lu %s (%lu %s of clock overhead per instruction not counted)\n",
+            (unsigned long) total_count, (unsigned long) total_ticks, profile->ticks_unit,
+            (unsigned long) profile->overhead, profile->ticks_unit);
+
+    fprintf(stream, "\n%-20s %14s %7s %16s %7s %10s\n", "type", "count", "%", profile->ticks_unit, "%", "per inst");
+    for (size_t i = 0; i < types_size; ++i){
+        for (size_t j = i + 1; j < types_size; ++j){
+            if (types[j].ticks > types[i].ticks){
+                const Type_Total tmp = types[i];
+                types[i] = types[j];
+                types[j] = tmp;
+            }
+        }
+    }
+    for (size_t i = 0; i < types_size; ++i){
+        fprintf(stream, "%-20s %14lu %6.1f%% %16lu %6.1f%% %10.1f\n", inst_type_as_cstr(types[i].type),
+                (unsigned long) types[i].count, types[i].count * count_pct,
+                (unsigned long) types[i].ticks, types[i].ticks * ticks_pct,
+                (double) types[i].ticks / types[i].count);
+    }
+
+    Word *order = malloc(sizeof(order[0]) * (n > 0 ? n : 1));
+    uint64_t *ticks = malloc(sizeof(ticks[0]) * (n > 0 ? n : 1));
+    if (order == NULL || ticks == NULL){
+        fprintf(stderr, "ERROR: Could not allocate memory\n");
+        exit(1);
+    }
+    Word executed = 0;
+    for (Word i = 0; i < n; ++i){
+        ticks[i] = profile->entries[i].ticks;
+        if (profile->entries[i].count > 0){
+            order[executed++] = i;
+        }
+    }
+    sort_ticks = ticks;
+    qsort(order, executed, sizeof(order[0]), compare_by_ticks);
+
+    fprintf(stream, "\n%-8s %-8s %-16s %-24s %14s %16s %7s %16s\n",
+            "addr", "line", "label", "instruction", "count", profile->ticks_unit, "%", "taken/not");
+    for (Word k = 0; k < executed && k < PROFILE_HOT_SPOTS; ++k){
+        const Word i = order[k];
+        const Bm_Profile_Entry *entry = &profile->entries[i];
+
+        char line[32] = "-";
+        const char *label = NULL;
+        Word line_number = 0;
+        if (src != NULL && bm_source_location(src, i, &line_number, &label)){
+            snprintf(line, sizeof(line), "%ld", line_number);
+        }
+
+        char inst[64];
+        format_inst(inst, sizeof(inst), program[i]);
+
+        char taken[48] = "";
+        if (program[i].type == INST_JMP_IF || program[i].type == INST_EQ_JMP_IF){
+            snprintf(taken, sizeof(taken), "%lu/%lu", (unsigned long) entry->taken,
+                     (unsigned long) (entry->count - entry->taken));
+        }
+
+        fprintf(stream, "%-8ld %-8s %-16s %-24s %14lu %16lu %6.1f%% %16s\n", i, line,
+                label != NULL ? label : "-", inst, (unsigned long) entry->count,
+                (unsigned long) entry->ticks, entry->ticks * ticks_pct, taken);
+    }
+
+    free(order);
+    free(ticks);
+}
+
+// One line per executed instruction, `program;label;instruction ticks`, the
+// input of flamegraph.pl.
+static void write_folded(const char *file_path, const char *input_path, const Bm *bm,
+                         const Bm_Profile *profile, Bm *src){
+    FILE *f = fopen(file_path, "w");
+    if (f == NULL){
+        fprintf(stderr, "ERROR: Could not write to file `%s` %s\n", file_path, strerror(errno));
+        exit(1);
+    }
+
+    const Inst *program = bm_program(bm);
+    for (Word i = 0; i < bm_program_size(bm); ++i){
+        const Bm_Profile_Entry *entry = &profile->entries[i];
+        if (entry->count == 0){
+            continue;
+        }
+
+        char inst[64];
+        format_inst(inst, sizeof(inst), program[i]);
+
+        const char *label = NULL;
+        Word line = 0;
+        if (src != NULL && bm_source_location(src, i, &line, &label)){
+            fprintf(f, "%s;%s;%ld: %s (line %ld) %lu\n", input_path, label != NULL ? label : "-",
+                    i, inst, line, (unsigned long) entry->ticks);
+        } else {
+            fprintf(f, "%s;%ld: %s %lu\n", input_path, i, inst, (unsigned long) entry->ticks);
+        }
+    }
+
+    if (fclose(f) != 0){
+        fprintf(stderr, "ERROR: Could not write to file `%s` %s\n", file_path, strerror(errno));
+        exit(1);
+    }
+}
+
+// --serve: pre-forked workers accept connections on one Unix domain socket
+// and answer every request line of a connection in order, so clients can
+// send many before reading the answers:
+//
+//     request   <limit> [<value> ...]             limit -1 for none, then the
+//                                                 initial stack, bottom first
+//     response  <Err> <instructions> [<value> ...]  the final stack
+//
+// Each worker runs every request on the one VM the program was loaded into
+// (copy-on-write after the fork), so loading, verification and the engine
+// caches are paid once per worker. With --restore requests start from the
+// snapshot instead of an empty stack; programs that store to memory get it
+// zeroed (or restored) for every request.
+
+#define SERVE_LINE_CAPACITY (64*1024)
+
+typedef struct {
+    char *data;
+    size_t size;
+    size_t capacity;
+} Output;
+
+static void output_cstr(Output *out, const char *cstr){
+    const size_t n = strlen(cstr);
+    if (out->size + n > out->capacity){
+        out->capacity = out->capacity > 0 ? out->capacity : 4096;
+        while (out->size + n > out->capacity){
+            out->capacity *= 2;
+        }
+        out->data = realloc(out->data, out->capacity);
+        if (out->data == NULL){
+            fprintf(stderr, "ERROR: Could not allocate memory\n");
+            exit(1);
+        }
+    }
+    memcpy(out->data + out->size, cstr, n);
+    out->size += n;
+}
+
+static int write_all(int fd, const char *data, size_t size){
+    while (size > 0){
+        const ssize_t n = write(fd, data, size);
+        if (n < 0 && errno == EINTR){
+            continue;
+        }
+        if (n < 0){
+            return 0;
+        }
+        data += n;
+        size -= n;
+    }
+    return 1;
+}
+
+typedef struct {
+    Bm *bm;
+    Bm_Engine engine;
+    String_View snapshot;   // empty without --restore
+    int writes_memory;      // the program has a `store` or calls natives, which may write it
+} Server;
+
+static void serve_request(Server *server, char *line, Output *out){
+    Bm *bm = server->bm;
+    char *end = NULL;
+    errno = 0;
+    const long long limit = strtoll(line, &end, 10);
+    if (end == line || errno != 0 || limit < INT_MIN || limit > INT_MAX){
+        output_cstr(out, "ERR_SYNTAX 0\n");
+        return;
+    }
+
+    if (server->snapshot.count > 0){
+        bm_restore_snapshot(bm, (const uint8_t *) server->snapshot.data, server->snapshot.count);
+    } else {
+        bm_reset(bm);
+        if (server->writes_memory){
+            memset(bm_memory(bm), 0, sizeof(Word) * bm_memory_size(bm));
+        }
+    }
+    const Word inst_count = bm_inst_count(bm);
+
+    Err err = ERR_OK;
+    for (char *p = end; err == ERR_OK;){
+        while (*p == ' ' || *p == '\t' || *p == '\r'){
+            p += 1;
+        }
+        if (*p == '\0'){
+            break;
+        }
+        errno = 0;
+        const Word value = strtoll(p, &end, 10);
+        if (end == p || errno != 0){
+            output_cstr(out, "ERR_SYNTAX 0\n");
+            return;
+        }
+        p = end;
+        err = bm_push(bm, value);
+    }
+    if (err == ERR_OK){
+        err = limit >= 0
+            ? bm_execute_slice(bm, server->engine, (int) limit)
+            : bm_execute_program_with(bm, server->engine, -1);
+    }
+
+    char buffer[64];
+    snprintf(buffer, sizeof(buffer), "%s %ld", err_as_cstr(err), bm_inst_count(bm) - inst_count);
+    output_cstr(out, buffer);
+    const Word *stack = bm_stack(bm);
+    for (Word i = 0; i < bm_stack_size(bm); ++i){
+        snprintf(buffer, sizeof(buffer), " %ld", stack[i]);
+        output_cstr(out, buffer);
+    }
+    output_cstr(out, "\n");
+}
+
+// Answers the requests of one connection until the client closes it. Every
+// read is answered with a single write, however many requests it held.
+static void serve_connection(Server *server, int fd, char *in, Output *out){
+    size_t in_size = 0;
+    for (;;){
+        const ssize_t n = read(fd, in + in_size, SERVE_LINE_CAPACITY - in_size);
+        if (n < 0 && errno == EINTR){
+            continue;
+        }
+        if (n <= 0){
+            return;
+        }
+        in_size += n;
+
+        size_t start = 0;
+        char *newline = NULL;
+        out->size = 0;
+        while ((newline = memchr(in + start, '\n', in_size - start)) != NULL){
+            *newline = '\0';
+            if (newline > in + start){
+                serve_request(server, in + start, out);
+            }
+            start = newline - in + 1;
+        }
+        memmove(in, in + start, in_size - start);
+        in_size -= start;
+
+        const int too_long = in_size == SERVE_LINE_CAPACITY;
+        if (too_long){
+            output_cstr(out, "ERR_SYNTAX 0\n");
+        }
+        // print_debug output of the batch goes to our stdout
+        bm_flush_output(server->bm);
+        if (!write_all(fd, out->data, out->size) || too_long){
+            return;
+        }
+    }
+}
+
+static void serve_worker(Server *server, int listener){
+    char *in = malloc(SERVE_LINE_CAPACITY);
+    if (in == NULL){
+        fprintf(stderr, "ERROR: Could not allocate memory\n");
+        exit(1);
+    }
+    Output out = {0};
+
+    for (;;){
+        const int fd = accept(listener, NULL, NULL);
+        if (fd < 0){
+            if (errno == EINTR || errno == ECONNABORTED){
+                continue;
+            }
+            fprintf(stderr, "ERROR: Could not accept a connection: %s\n", strerror(errno));
+            exit(1);
+        }
+        serve_connection(server, fd, in, &out);
+        close(fd);
+    }
+}
+
+static volatile sig_atomic_t serve_stopped = 0;
+
+static void serve_stop(int sig){
+    (void) sig;
+    serve_stopped = 1;
+}
+
+// Runs until SIGINT or SIGTERM, then stops the workers and removes the socket.
+static int serve(Server *server, const char *socket_path, long workers){
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(socket_path) >= sizeof(addr.sun_path)){
+        fprintf(stderr, "ERROR: Socket path `%s` is too long\n", socket_path);
+        return 1;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    // a socket left behind by a server that did not stop cleanly
+    struct stat st;
+    if (stat(socket_path, &st) == 0 && S_ISSOCK(st.st_mode)){
+        unlink(socket_path);
+    }
+
+    const int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0 || bind(listener, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+        listen(listener, SOMAXCONN) < 0){
+        fprintf(stderr, "ERROR: Could not listen on `%s`: %s\n", socket_path, strerror(errno));
+        return 1;
+    }
+
+    // clients that go away are the connection's problem, not the worker's
+    signal(SIGPIPE, SIG_IGN);
+
+    pid_t *pids = malloc(sizeof(pids[0]) * workers);
+    if (pids == NULL){
+        fprintf(stderr, "ERROR: Could not allocate memory\n");
+        return 1;
+    }
+    for (long i = 0; i < workers; ++i){
+        pids[i] = fork();
+        if (pids[i] < 0){
+            fprintf(stderr, "ERROR: Could not start a worker: %s\n", strerror(errno));
+            workers = i;
+            serve_stopped = 1;
+            break;
+        }
+        if (pids[i] == 0){
+            serve_worker(server, listener);
+        }
+    }
+
+    struct sigaction action = {.sa_handler = serve_stop};
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    fprintf(stderr, "INFO: serving on `%s` with %ld workers\n", socket_path, workers);
+
+    long alive = workers;
+    int killed = 0;
+    while (alive > 0){
+        if (serve_stopped && !killed){
+            for (long i = 0; i < workers; ++i){
+                kill(pids[i], SIGTERM);
+            }
+            killed = 1;
+        }
+        if (waitpid(-1, NULL, 0) > 0){
+            alive -= 1;
+        } else if (errno != EINTR){
+            break;
+        }
+    }
+
+    free(pids);
+    close(listener);
+    unlink(socket_path);
+    return 0;
+}
+
+static void save_snapshot(Bm *bm, const char *file_path){
+    if (bm_save_snapshot(bm, file_path) != ERR_OK){
+        fprintf(stderr, "ERROR: Could not write snapshot `%s`: %s\n", file_path, bm_error_message(bm));
+        exit(1);
+    }
 }
 
 int main(int argc, char **argv){
@@ -18,6 +549,18 @@ int main(int argc, char **argv){
     const char *program = shift(&argc, &argv);
     char *input_file_path = NULL; 
     int limit = -1; 
+    Bm_Engine engine = BM_ENGINE_SWITCH;
+    Word stack_capacity = BM_STACK_CAPACITY;
+    Word memory_size = BMI_MEMORY_SIZE;
+    int map = 0;
+    int binary_output = 0;
+    int profile = 0;
+    const char *folded_path = NULL;
+    const char *source_path = NULL;
+    const char *restore_path = NULL;
+    const char *snapshot_path = NULL;
+    const char *serve_path = NULL;
+    long workers = sysconf(_SC_NPROCESSORS_ONLN);
 
     while (argc > 0){
         const char *flag = shift(&argc, &argv); 
@@ -37,6 +580,85 @@ int main(int argc, char **argv){
                 exit(1); 
             }
             limit = atoi(shift(&argc, &argv)); 
+        } else if (strcmp(flag, "-e") == 0){
+            if (argc == 0){
+                usage(stderr, program);
+                fprintf(stderr, "ERROR: No argument is provided for flag `%s`\n", flag);
+                exit(1); 
+            }
+            const char *name = shift(&argc, &argv);
+            if (bm_engine_from_cstr(name, &engine) < 0){
+                usage(stderr, program);
+                fprintf(stderr, "ERROR: Unknown engine `%s`\n", name);
+                exit(1);
+            }
+        } else if (strcmp(flag, "-s") == 0){
+            if (argc == 0){
+                usage(stderr, program);
+                fprintf(stderr, "ERROR: No argument is provided for flag `%s`\n", flag);
+                exit(1); 
+            }
+            stack_capacity = atol(shift(&argc, &argv));
+            if (stack_capacity < 0){
+                usage(stderr, program);
+                fprintf(stderr, "ERROR: Stack capacity can't be negative\n");
+                exit(1);
+            }
+        } else if (strcmp(flag, "--memory") == 0){
+            if (argc == 0){
+                usage(stderr, program);
+                fprintf(stderr, "ERROR: No argument is provided for flag `%s`\n", flag);
+                exit(1); 
+            }
+            memory_size = atol(shift(&argc, &argv));
+            if (memory_size < 0){
+                usage(stderr, program);
+                fprintf(stderr, "ERROR: Memory size can't be negative\n");
+                exit(1);
+            }
+        } else if (strcmp(flag, "-m") == 0){
+            map = 1;
+        } else if (strcmp(flag, "--binary-output") == 0){
+            binary_output = 1;
+        } else if (strcmp(flag, "--profile") == 0){
+            profile = 1;
+        } else if (strcmp(flag, "--folded") == 0 || strcmp(flag, "--source") == 0){
+            if (argc == 0){
+                usage(stderr, program);
+                fprintf(stderr, "ERROR: No argument is provided for flag `%s`\n", flag);
+                exit(1); 
+            }
+            if (strcmp(flag, "--folded") == 0){
+                folded_path = shift(&argc, &argv);
+            } else {
+                source_path = shift(&argc, &argv);
+            }
+        } else if (strcmp(flag, "--restore") == 0 || strcmp(flag, "--snapshot") == 0 ||
+                   strcmp(flag, "--serve") == 0){
+            if (argc == 0){
+                usage(stderr, program);
+                fprintf(stderr, "ERROR: No argument is provided for flag `%s`\n", flag);
+                exit(1); 
+            }
+            if (strcmp(flag, "--restore") == 0){
+                restore_path = shift(&argc, &argv);
+            } else if (strcmp(flag, "--snapshot") == 0){
+                snapshot_path = shift(&argc, &argv);
+            } else {
+                serve_path = shift(&argc, &argv);
+            }
+        } else if (strcmp(flag, "-j") == 0){
+            if (argc == 0){
+                usage(stderr, program);
+                fprintf(stderr, "ERROR: No argument is provided for flag `%s`\n", flag);
+                exit(1); 
+            }
+            workers = atol(shift(&argc, &argv));
+            if (workers <= 0){
+                usage(stderr, program);
+                fprintf(stderr, "ERROR: -j must be positive\n");
+                exit(1);
+            }
         } else if (strcmp(flag, "-h") == 0) {
             usage(stdout, program); 
             exit(0); 
@@ -53,11 +675,109 @@ int main(int argc, char **argv){
         exit(1); 
     }
 
-    bm_load_program_from_file(&bm, input_file_path); 
-    Err err = bm_execute_program(&bm, limit); 
-    bm_dump_stack(stdout, &bm); 
+    Bm *bm = bm_create(NULL, stack_capacity, map ? 0 : BM_PROGRAM_CAPACITY);
+    if (bm == NULL || bm_bind_std_natives(bm) != ERR_OK){
+        fprintf(stderr, "ERROR: Could not allocate a VM with a stack of %ld\n", stack_capacity);
+        return 1;
+    }
+    Word *memory = calloc(memory_size > 0 ? memory_size : 1, sizeof(Word));
+    if (memory == NULL){
+        fprintf(stderr, "ERROR: Could not allocate a memory of %ld words\n", memory_size);
+        return 1;
+    }
+    bm_set_memory(bm, memory, memory_size);
+    if (binary_output){
+        bm_set_output_mode(bm, BM_OUTPUT_BINARY);
+    }
+
+    // -m: the mapping replaces the program storage and validation is left to
+    // the engines
+    Err load_err = map
+        ? bm_map_program_from_file(bm, input_file_path)
+        : bm_load_program_from_file(bm, input_file_path);
+    if (load_err != ERR_OK){
+        fprintf(stderr, "ERROR: Could not load `%s`: %s\n", input_file_path, bm_error_message(bm));
+        return 1;
+    }
+
+    if (!map){
+        Word fault_inst = 0;
+        Err verify_err = bm_verify_program(bm, &fault_inst);
+        if (verify_err != ERR_OK && verify_err != ERR_OUT_OF_MEMORY){
+            report_error(input_file_path, bm, fault_inst, verify_err);
+            return 1;
+        }
+    }
+
+    if (restore_path != NULL && bm_load_snapshot(bm, restore_path) != ERR_OK){
+        fprintf(stderr, "ERROR: Could not restore `%s`: %s\n", restore_path, bm_error_message(bm));
+        return 1;
+    }
+
+    if (serve_path != NULL){
+        if (profile || snapshot_path != NULL){
+            fprintf(stderr, "ERROR: --serve can't be combined with --profile or --snapshot\n");
+            return 1;
+        }
+        // checked by bm_load_snapshot() above, restored for every request
+        Server server = {
+            .bm = bm,
+            .engine = engine,
+            .snapshot = restore_path != NULL ? slurp_file(restore_path) : (String_View) {0},
+        };
+        for (Word i = 0; i < bm_program_size(bm); ++i){
+            const Inst_Type type = bm_program(bm)[i].type;
+            server.writes_memory = server.writes_memory || type == INST_STORE || type == INST_NATIVE;
+        }
+        const int result = serve(&server, serve_path, workers);
+        free((char *) server.snapshot.data);
+        bm_destroy(bm);
+        free(memory);
+        return result;
+    }
+
+    if (profile){
+        Bm_Profile prof;
+        if (bm_profile_init(&prof, bm_program_size(bm)) != ERR_OK){
+            fprintf(stderr, "ERROR: Could not allocate a profile\n");
+            return 1;
+        }
+        // without --source, the debug section of the file if it has one
+        Bm *src = source_path != NULL ? assemble_source(bm, source_path) : bm;
+
+        Err err = bm_execute_program_profiled(bm, limit, &prof);
+        bm_flush_output(bm);
+        bm_dump_stack(stdout, bm);
+        print_profile(stderr, bm, &prof, src);
+        if (folded_path != NULL){
+            write_folded(folded_path, input_file_path, bm, &prof, src);
+        }
+
+        bm_profile_free(&prof);
+        if (err != ERR_OK){
+            report_error(input_file_path, src != NULL ? src : bm, bm_ip(bm), err);
+        } else if (snapshot_path != NULL){
+            save_snapshot(bm, snapshot_path);
+        }
+        if (src != bm){
+            bm_destroy(src);
+        }
+        bm_destroy(bm);
+        free(memory);
+        return err != ERR_OK;
+    }
+
+    Err err = bm_execute_program_with(bm, engine, limit); 
+    bm_flush_output(bm);
+    bm_dump_stack(stdout, bm); 
+    if (err != ERR_OK){
+        report_error(input_file_path, bm, bm_ip(bm), err);
+    } else if (snapshot_path != NULL){
+        save_snapshot(bm, snapshot_path);
+    }
+    bm_destroy(bm);
+    free(memory);
     if (err != ERR_OK){
-        fprintf(stderr, "ERROR: %s\n", err_as_cstr(err));
         return 1;
     }
 
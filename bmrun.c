@@ -0,0 +1,474 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "./bm.h"
+
+char *shift(int *argc, char ***argv){
+    assert(*argc > 0);
+    char *result = **argv;
+    *argv += 1;
+    *argc -= 1;
+    return result;
+}
+
+void usage(FILE *stream, const char *program){
+    fprintf(stream, "Usage: %s -i <manifest> [-j <threads>] [-l <limit>] [-e <engine>] [-s <stack capacity>] [-b] [-r <repeat>] [-h]\n", program);
+    fprintf(stream, "    -i <manifest>  one job per line: a .bm file and its initial stack, bottom first\n");
+    fprintf(stream, "    -j <threads>   worker threads (default: one per core)\n");
+    fprintf(stream, "    -e <engine>    execution engine: switch (default), threaded, jit, tos or block\n");
+    fprintf(stream, "    -s <capacity>  maximum stack size in words (default %d)\n", BM_STACK_CAPACITY);
+    fprintf(stream, "    -b             print jobs per second for 1 up to <threads> threads instead of the results\n");
+    fprintf(stream, "    -r <repeat>    with -b, run the manifest this many times per measurement (default 1)\n");
+}
+
+static double now_secs(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void *xmalloc(size_t size){
+    void *result = malloc(size > 0 ? size : 1);
+    if (result == NULL){
+        fprintf(stderr, "ERROR: Could not allocate memory\n");
+        exit(1);
+    }
+    return result;
+}
+
+String_View slurp_file(const char *file_path){
+    FILE *f = fopen(file_path, "r");
+    if (f == NULL || fseek(f, 0, SEEK_END) < 0){
+        fprintf(stderr, "ERROR: Could not read file `%s` %s\n", file_path, strerror(errno));
+        exit(1);
+    }
+
+    long m = ftell(f);
+    if (m < 0 || fseek(f, 0, SEEK_SET) < 0){
+        fprintf(stderr, "ERROR: Could not read file `%s` %s\n", file_path, strerror(errno));
+        exit(1);
+    }
+
+    char *buffer = xmalloc(m);
+    size_t n = fread(buffer, 1, m, f);
+    if (ferror(f)){
+        fprintf(stderr, "ERROR: Could not read file `%s` %s\n", file_path, strerror(errno));
+        exit(1);
+    }
+    fclose(f);
+
+    return (String_View) {
+        .count = n,
+        .data = buffer,
+    };
+}
+
+// A program named by the manifest, loaded and verified once. Workers run it
+// through bm_share_program(), so it is never copied or changed.
+typedef struct {
+    char *path;
+    Bm *bm;
+} Program;
+
+typedef struct {
+    size_t program;
+    Word *stack;
+    Word stack_size;
+} Job;
+
+typedef struct {
+    Err err;
+    Word inst_count;
+    Word *stack;
+    Word stack_size;
+} Result;
+
+typedef struct {
+    Program *programs;
+    size_t programs_size;
+    Job *jobs;
+    size_t jobs_size;
+} Manifest;
+
+static size_t manifest_find_program(Manifest *manifest, String_View path){
+    // jobs of one program tend to come together
+    for (size_t i = manifest->programs_size; i > 0; --i){
+        const char *name = manifest->programs[i - 1].path;
+        if (strlen(name) == path.count && memcmp(name, path.data, path.count) == 0){
+            return i - 1;
+        }
+    }
+
+    char *name = xmalloc(path.count + 1);
+    memcpy(name, path.data, path.count);
+    name[path.count] = '\0';
+
+    manifest->programs = realloc(manifest->programs, sizeof(Program) * (manifest->programs_size + 1));
+    if (manifest->programs == NULL){
+        fprintf(stderr, "ERROR: Could not allocate memory\n");
+        exit(1);
+    }
+    manifest->programs[manifest->programs_size] = (Program) {.path = name};
+    return manifest->programs_size++;
+}
+
+static void parse_manifest(Manifest *manifest, const char *file_path){
+    const String_View file = slurp_file(file_path);
+    String_View source = file;
+    size_t jobs_capacity = 0;
+    int line_number = 0;
+
+    while (source.count > 0){
+        String_View line = sv_chop_by_delim(&source, '\n');
+        line = sv_trim(sv_chop_by_delim(&line, '#'));
+        line_number += 1;
+        if (line.count == 0){
+            continue;
+        }
+
+        String_View path = sv_chop_by_delim(&line, ' ');
+        Job job = {.program = manifest_find_program(manifest, sv_trim(path))};
+
+        // every value takes at least two characters with its separator
+        job.stack = xmalloc(sizeof(Word) * (line.count / 2 + 1));
+        line = sv_trim(line);
+        while (line.count > 0){
+            String_View token = sv_chop_by_delim(&line, ' ');
+            line = sv_trim(line);
+
+            char value[32];
+            char *end = NULL;
+            if (token.count >= sizeof(value)){
+                fprintf(stderr, "ERROR: %s:%d: value `%.*s` is too long\n", file_path, line_number, (int) token.count, token.data);
+                exit(1);
+            }
+            memcpy(value, token.data, token.count);
+            value[token.count] = '\0';
+
+            errno = 0;
+            job.stack[job.stack_size++] = strtoll(value, &end, 10);
+            if (*end != '\0' || errno != 0){
+                fprintf(stderr, "ERROR: %s:%d: `%s` is not a word\n", file_path, line_number, value);
+                exit(1);
+            }
+        }
+
+        if (manifest->jobs_size >= jobs_capacity){
+            jobs_capacity = jobs_capacity > 0 ? jobs_capacity * 2 : 256;
+            manifest->jobs = realloc(manifest->jobs, sizeof(Job) * jobs_capacity);
+            if (manifest->jobs == NULL){
+                fprintf(stderr, "ERROR: Could not allocate memory\n");
+                exit(1);
+            }
+        }
+        manifest->jobs[manifest->jobs_size++] = job;
+    }
+
+    free((char *) file.data);
+}
+
+static void manifest_free(Manifest *manifest){
+    for (size_t i = 0; i < manifest->programs_size; ++i){
+        free(manifest->programs[i].path);
+        bm_destroy(manifest->programs[i].bm);
+    }
+    for (size_t i = 0; i < manifest->jobs_size; ++i){
+        free(manifest->jobs[i].stack);
+    }
+    free(manifest->programs);
+    free(manifest->jobs);
+}
+
+static void load_programs(Manifest *manifest, Word stack_capacity){
+    for (size_t i = 0; i < manifest->programs_size; ++i){
+        Program *p = &manifest->programs[i];
+        p->bm = bm_create(NULL, stack_capacity, 0);
+        if (p->bm == NULL || bm_bind_std_natives(p->bm) != ERR_OK){
+            fprintf(stderr, "ERROR: Could not allocate a VM with a stack of %ld\n", stack_capacity);
+            exit(1);
+        }
+
+        if (bm_load_program_from_file(p->bm, p->path) != ERR_OK){
+            fprintf(stderr, "ERROR: Could not load `%s`: %s\n", p->path, bm_error_message(p->bm));
+            exit(1);
+        }
+
+        Word fault_inst = 0;
+        Err verify_err = bm_verify_program(p->bm, &fault_inst);
+        if (verify_err != ERR_OK && verify_err != ERR_OUT_OF_MEMORY){
+            fprintf(stderr, "ERROR: %s: instruction %ld: %s\n", p->path, fault_inst, err_as_cstr(verify_err));
+            exit(1);
+        }
+    }
+}
+
+// Work-stealing pool. The job indices are split into one contiguous slice
+// per worker; a worker takes the next job of its own slice and, once that is
+// empty, steals the next job of the other slices, so uneven jobs still keep
+// every core busy. Indices run over `jobs_size * repeat` jobs.
+typedef struct {
+    _Atomic size_t next;
+    size_t end;
+} Slice;
+
+typedef struct {
+    const Manifest *manifest;
+    Result *results;          // NULL when only throughput is measured
+    Slice *slices;
+    size_t threads;
+    Bm_Engine engine;
+    int limit;
+    Word stack_capacity;
+    _Atomic int failed;
+} Pool;
+
+typedef struct {
+    Pool *pool;
+    size_t index;
+    pthread_t thread;
+} Worker;
+
+static int slice_take(Slice *slice, size_t *job){
+    // cheap check first, so idle thieves don't keep bumping `next`
+    if (atomic_load_explicit(&slice->next, memory_order_relaxed) >= slice->end){
+        return 0;
+    }
+    *job = atomic_fetch_add_explicit(&slice->next, 1, memory_order_relaxed);
+    return *job < slice->end;
+}
+
+static void run_job(Pool *pool, Bm *bm, size_t index, const Job *job){
+    bm_reset(bm);
+
+    Err err = ERR_OK;
+    for (Word i = 0; i < job->stack_size && err == ERR_OK; ++i){
+        err = bm_push(bm, job->stack[i]);
+    }
+    if (err == ERR_OK){
+        err = bm_execute_program_with(bm, pool->engine, pool->limit);
+    }
+
+    if (pool->results != NULL){
+        Result *result = &pool->results[index];
+        result->err = err;
+        result->inst_count = bm_inst_count(bm);
+        result->stack_size = bm_stack_size(bm);
+        result->stack = malloc(sizeof(Word) * (result->stack_size > 0 ? result->stack_size : 1));
+        if (result->stack == NULL){
+            atomic_store(&pool->failed, 1);
+            return;
+        }
+        if (result->stack_size > 0){
+            memcpy(result->stack, bm_stack(bm), sizeof(Word) * result->stack_size);
+        }
+    }
+}
+
+static void *worker_run(void *arg){
+    Worker *worker = arg;
+    Pool *pool = worker->pool;
+    const Manifest *manifest = pool->manifest;
+
+    // A worker keeps one VM per program it has run and reuses it for every
+    // later job of that program, so the threaded and JIT code built for the
+    // shared bytecode survives however the manifest interleaves programs.
+    Bm **vms = calloc(manifest->programs_size, sizeof(vms[0]));
+    if (vms == NULL){
+        atomic_store(&pool->failed, 1);
+        return NULL;
+    }
+
+    size_t index = 0;
+    for (size_t k = 0; k < pool->threads && !atomic_load(&pool->failed); ++k){
+        Slice *slice = &pool->slices[(worker->index + k) % pool->threads];
+        while (slice_take(slice, &index)){
+            const Job *job = &manifest->jobs[index % manifest->jobs_size];
+            if (vms[job->program] == NULL){
+                vms[job->program] = bm_create(NULL, pool->stack_capacity, 0);
+                if (vms[job->program] == NULL || bm_bind_std_natives(vms[job->program]) != ERR_OK){
+                    atomic_store(&pool->failed, 1);
+                    break;
+                }
+                bm_share_program(vms[job->program], manifest->programs[job->program].bm);
+            }
+            run_job(pool, vms[job->program], index, job);
+        }
+    }
+
+    for (size_t i = 0; i < manifest->programs_size; ++i){
+        bm_destroy(vms[i]);
+    }
+    free(vms);
+    return NULL;
+}
+
+// Runs every job `repeat` times on `threads` workers. Returns the wall time.
+static double run_pool(Pool *pool, size_t threads, size_t repeat){
+    const size_t total = pool->manifest->jobs_size * repeat;
+    Slice *slices = xmalloc(sizeof(Slice) * threads);
+    Worker *workers = xmalloc(sizeof(Worker) * threads);
+
+    for (size_t i = 0; i < threads; ++i){
+        atomic_init(&slices[i].next, total * i / threads);
+        slices[i].end = total * (i + 1) / threads;
+    }
+    pool->slices = slices;
+    pool->threads = threads;
+
+    const double start = now_secs();
+    for (size_t i = 0; i < threads; ++i){
+        workers[i] = (Worker) {.pool = pool, .index = i};
+        if (pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]) != 0){
+            fprintf(stderr, "ERROR: Could not start a worker thread\n");
+            exit(1);
+        }
+    }
+    for (size_t i = 0; i < threads; ++i){
+        pthread_join(workers[i].thread, NULL);
+    }
+    const double elapsed = now_secs() - start;
+
+    if (atomic_load(&pool->failed)){
+        fprintf(stderr, "ERROR: Could not allocate memory\n");
+        exit(1);
+    }
+
+    free(workers);
+    free(slices);
+    return elapsed;
+}
+
+static void print_result(FILE *stream, const char *path, const Result *result){
+    fprintf(stream, "%s: %s, %ld instructions\n", path, err_as_cstr(result->err), result->inst_count);
+    fprintf(stream, "Stack:\n");
+    if (result->stack_size > 0){
+        for (Word i = 0; i < result->stack_size; ++i){
+            fprintf(stream, " %ld\n", result->stack[i]);
+        }
+    } else {
+        fprintf(stream, " [empty]\n");
+    }
+}
+
+int main(int argc, char **argv){
+
+    const char *program = shift(&argc, &argv);
+    const char *manifest_path = NULL;
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int limit = -1;
+    Bm_Engine engine = BM_ENGINE_SWITCH;
+    Word stack_capacity = BM_STACK_CAPACITY;
+    int bench = 0;
+    long repeat = 1;
+
+    while (argc > 0){
+        const char *flag = shift(&argc, &argv);
+
+        if (strcmp(flag, "-b") == 0){
+            bench = 1;
+            continue;
+        } else if (strcmp(flag, "-h") == 0){
+            usage(stdout, program);
+            exit(0);
+        }
+
+        if (argc == 0){
+            usage(stderr, program);
+            fprintf(stderr, "ERROR: No argument is provided for flag `%s`\n", flag);
+            exit(1);
+        }
+        const char *value = shift(&argc, &argv);
+
+        if (strcmp(flag, "-i") == 0){
+            manifest_path = value;
+        } else if (strcmp(flag, "-j") == 0){
+            threads = atol(value);
+        } else if (strcmp(flag, "-l") == 0){
+            limit = atoi(value);
+        } else if (strcmp(flag, "-e") == 0){
+            if (bm_engine_from_cstr(value, &engine) < 0){
+                usage(stderr, program);
+                fprintf(stderr, "ERROR: Unknown engine `%s`\n", value);
+                exit(1);
+            }
+        } else if (strcmp(flag, "-s") == 0){
+            stack_capacity = atol(value);
+        } else if (strcmp(flag, "-r") == 0){
+            repeat = atol(value);
+        } else {
+            usage(stderr, program);
+            fprintf(stderr, "ERROR: Unknown Flag `%s`\n", flag);
+            exit(1);
+        }
+    }
+
+    if (manifest_path == NULL){
+        usage(stderr, program);
+        fprintf(stderr, "ERROR: Manifest was not provided\n");
+        exit(1);
+    }
+
+    if (threads <= 0 || repeat <= 0 || stack_capacity < 0){
+        usage(stderr, program);
+        fprintf(stderr, "ERROR: -j and -r must be positive, -s can't be negative\n");
+        exit(1);
+    }
+
+    Manifest manifest = {0};
+    parse_manifest(&manifest, manifest_path);
+    load_programs(&manifest, stack_capacity);
+    if (manifest.jobs_size == 0){
+        manifest_free(&manifest);
+        return 0;
+    }
+
+    Pool pool = {
+        .manifest = &manifest,
+        .engine = engine,
+        .limit = limit,
+        .stack_capacity = stack_capacity,
+    };
+
+    if (bench){
+        printf("%zu jobs x %ld, engine %s\n", manifest.jobs_size, repeat, bm_engine_as_cstr(engine));
+        printf("%8s %14s %10s\n", "threads", "jobs/s", "speedup");
+        double base = 0.0;
+        // 1, 2, 4, ... and `threads` itself
+        for (long t = 1; ; t = t * 2 < threads ? t * 2 : threads){
+            const double elapsed = run_pool(&pool, t, repeat);
+            const double rate = manifest.jobs_size * repeat / elapsed;
+            if (t == 1){
+                base = rate;
+            }
+            printf("%8ld %14.0f %9.2fx\n", t, rate, rate / base);
+            if (t == threads){
+                break;
+            }
+        }
+        manifest_free(&manifest);
+        return 0;
+    }
+
+    pool.results = xmalloc(sizeof(Result) * manifest.jobs_size);
+    run_pool(&pool, threads, 1);
+
+    int failed = 0;
+    for (size_t i = 0; i < manifest.jobs_size; ++i){
+        const Result *result = &pool.results[i];
+        print_result(stdout, manifest.programs[manifest.jobs[i].program].path, result);
+        failed |= result->err != ERR_OK;
+        free(result->stack);
+    }
+
+    free(pool.results);
+    manifest_free(&manifest);
+    return failed;
+}
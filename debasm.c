@@ -1,29 +1,71 @@
-#include "./bm.c"
+#include <stdlib.h>
+#include <string.h>
 
-Bm bm = {0};
+#include "./bm.h"
 
-int main(int argc, char *argv[]){
+void usage(FILE *stream, const char *program){
+    fprintf(stream, "Usage: %s [-h] <input.bm>\n", program);
+    fprintf(stream, "Prints the program as ebasm source, with labels and lines if it has a debug section.\n");
+}
 
+int main(int argc, char *argv[]){
     if (argc < 2){
-        fprintf(stderr, "Usage: ./debasm <input.bm>\n");
+        usage(stderr, argv[0]);
         fprintf(stderr, "ERROR: no input is provided\n");
         exit(1);
     }
+    if (strcmp(argv[1], "-h") == 0){
+        usage(stdout, argv[0]);
+        exit(0);
+    }
+    if (argv[1][0] == '-'){
+        usage(stderr, argv[0]);
+        fprintf(stderr, "ERROR: Unknown Flag `%s`\n", argv[1]);
+        exit(1);
+    }
 
     const char *input_file_path = argv[1]; 
-    bm_load_program_from_file(&bm, input_file_path);
+    Bm *bm = bm_create(NULL, 0, BM_PROGRAM_CAPACITY);
+    // natives print by name where ebasm knows one
+    if (bm == NULL || bm_bind_std_natives(bm) != ERR_OK){
+        fprintf(stderr, "ERROR: Could not allocate a VM\n");
+        exit(1);
+    }
+    if (bm_load_program_from_file(bm, input_file_path) != ERR_OK){
+        fprintf(stderr, "ERROR: Could not load `%s`: %s\n", input_file_path, bm_error_message(bm));
+        exit(1);
+    }
+
+    // with a debug section (ebasm -g): the labels, and the source line
+    // wherever it does not simply follow the previous instruction
+    const char *prev_label = NULL;
+    Word prev_line = 0;
+
+    const Inst *program = bm_program(bm);
+    for (Word i = 0; i < bm_program_size(bm); ++i){
+        Word line = 0;
+        const char *label = NULL;
+        if (bm_source_location(bm, i, &line, &label)){
+            if (label != NULL && label != prev_label){
+                printf("%s:\n", label);
+            }
+            if (line != prev_line + 1){
+                printf("# line %ld\n", line);
+            }
+            prev_label = label;
+            prev_line = line;
+        }
 
-    for (Word i = 0; i < bm.program_size; ++i){
-        switch (bm.program[i].type)
+        switch (program[i].type)
         {
             case INST_NOP:
                 printf("nop\n"); 
                 break; 
             case INST_PUSH:
-                printf("push %ld \n", bm.program->operand); 
+                printf("push %ld\n", program[i].operand); 
                 break;
             case INST_DUP:
-                printf("dup %ld \n", bm.program->operand); 
+                printf("dup %ld\n", program[i].operand); 
                 break;
             case INST_PLUS:
                 printf("plus\n");  
@@ -38,25 +80,64 @@ int main(int argc, char *argv[]){
                 printf("div\n");  
                 break;
             case INST_JMP:
-                printf("jmp %ld \n", bm.program->operand); 
+                printf("jmp %ld\n", program[i].operand); 
                 break;
             case INST_JMP_IF:
-                printf("jmpif %ld \n", bm.program->operand); 
+                printf("jmp_if %ld\n", program[i].operand); 
                 break;
             case INST_EQ:
-                printf("eq \n"); 
+                printf("eq\n"); 
                 break;
             case INST_HALT:
-                printf("halt \n"); 
+                printf("halt\n"); 
                 break;
             case INST_PRINT_DEBUG:
-                printf("print_debug \n"); 
+                printf("print_debug\n"); 
+                break;
+            case INST_PUSH_PLUS:
+                printf("push_plus %ld\n", program[i].operand);
+                break;
+            case INST_PUSH_MULT:
+                printf("push_mult %ld\n", program[i].operand);
+                break;
+            case INST_DUP2_PLUS:
+                printf("dup2_plus\n");
+                break;
+            case INST_EQ_JMP_IF:
+                printf("eq_jmp_if %ld\n", program[i].operand);
+                break;
+            case INST_CALL:
+                printf("call %ld\n", program[i].operand);
+                break;
+            case INST_RET:
+                printf("ret %ld\n", program[i].operand);
+                break;
+            case INST_LOAD_LOCAL:
+                printf("load_local %ld\n", program[i].operand);
+                break;
+            case INST_STORE_LOCAL:
+                printf("store_local %ld\n", program[i].operand);
+                break;
+            case INST_LOAD:
+                printf("load\n");
+                break;
+            case INST_STORE:
+                printf("store\n");
+                break;
+            case INST_NATIVE:
+                if (bm_native_name(bm, program[i].operand) != NULL){
+                    printf("native %s\n", bm_native_name(bm, program[i].operand));
+                } else {
+                    printf("native %ld\n", program[i].operand);
+                }
                 break;
         default:
+            printf("# illegal instruction %d\n", program[i].type);
             break;
         }
     }
 
+    bm_destroy(bm);
     return 0;
 
 }
@@ -1,6 +1,10 @@
-#include "./bm.c"
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "./bm.h"
 
-Bm bm = {0};
 Label_Table lt = {0};  
 
 char *shift(int *argc, char ***argv){
@@ -11,31 +15,247 @@ char *shift(int *argc, char ***argv){
     return result; 
 }
 
+String_View slurp_file(const char *file_path){
+
+    FILE *f = fopen(file_path, "r"); 
+    if (f == NULL){
+        fprintf(stderr, "ERROR: Could not read file `%s` %s\n", file_path, strerror(errno)); 
+        exit(1); 
+    }
+
+    if (fseek(f, 0, SEEK_END) < 0){
+        fprintf(stderr, "ERROR: Could not read file `%s` %s\n", file_path, strerror(errno));
+        exit(1);   
+    }
+
+    long m = ftell(f);
+    if (m < 0){
+        fprintf(stderr, "ERROR: Could not read file `%s` %s\n", file_path, strerror(errno));
+        exit(1);   
+    }
+
+    char *buffer = malloc(m);
+    if (buffer == NULL){
+        fprintf(stderr, "ERROR: Could not allocate memory for file `%s` %s\n", file_path, strerror(errno));
+        exit(1);      
+    }
+
+    if (fseek(f, 0, SEEK_SET) < 0){
+        fprintf(stderr, "ERROR: Could not read file `%s` %s\n", file_path, strerror(errno));
+        exit(1);           
+    }
+
+    size_t n = fread(buffer, 1, m, f);
+    if (ferror(f)){
+        fprintf(stderr, "ERROR: Could not read file `%s` %s\n", file_path, strerror(errno));
+        exit(1);
+    }
+
+    fclose(f); 
+
+    return (String_View){
+        .count = n,
+        .data = buffer, 
+    }; 
+}
+
 void usage(FILE *stream, const char *program){
-    fprintf(stream, "Usage: %s <input.ebasm> <output.bm>\n", program); 
+    fprintf(stream, "Usage: %s [-O] [-f] [-g] [-s] [-F <format>] <input.ebasm|input.bm> <output.bm>\n", program); 
+    fprintf(stream, "    -O             fold constants, remove nops and unreachable code, thread jumps\n");
+    fprintf(stream, "    -f             fuse common instruction sequences into superinstructions\n");
+    fprintf(stream, "    -g             keep the source line and label of every instruction (v2 formats)\n");
+    fprintf(stream, "    -F <format>    output format: v2 (default, compact), v2-fixed (mappable) or v1 (raw, legacy)\n");
+    fprintf(stream, "    -s             stream: assemble while reading, in bounded memory, into v2-fixed;\n");
+    fprintf(stream, "                   `-` reads the source from stdin or writes the program to stdout\n");
+    fprintf(stream, "An input ending in .bm is read as bytecode (either format) and re-encoded.\n");
+}
+
+// ebasm -s: `-` is stdin or stdout. A partly written output file is removed.
+static int assemble_stream(const char *input_file_path, const char *output_file_path){
+    FILE *in = stdin;
+    if (strcmp(input_file_path, "-") != 0){
+        in = fopen(input_file_path, "r");
+        if (in == NULL){
+            fprintf(stderr, "ERROR: Could not read file `%s` %s\n", input_file_path, strerror(errno));
+            exit(1);
+        }
+    }
+    FILE *out = stdout;
+    if (strcmp(output_file_path, "-") != 0){
+        // readable too, so jumps are patched in place
+        out = fopen(output_file_path, "w+b");
+        if (out == NULL){
+            fprintf(stderr, "ERROR: Could not write to file `%s` %s\n", output_file_path, strerror(errno));
+            exit(1);
+        }
+    }
+
+    Bm *bm = bm_create(NULL, 0, 0);
+    if (bm == NULL || bm_bind_std_natives(bm) != ERR_OK){
+        fprintf(stderr, "ERROR: Could not allocate a VM\n");
+        exit(1);
+    }
+
+    Word program_size = 0;
+    const Err err = bm_assemble_stream(bm, in, out, &lt, &program_size);
+    if (err != ERR_OK || (out != stdout && fclose(out) != 0)){
+        fprintf(stderr, "ERROR: %s: %s\n", input_file_path, err != ERR_OK ? bm_error_message(bm) : strerror(errno));
+        if (out != stdout){
+            remove(output_file_path);
+        }
+        exit(1);
+    }
+
+    if (in != stdin){
+        fclose(in);
+    }
+    label_table_free(&lt);
+    bm_destroy(bm);
+    return 0;
 }
 
 int main(int argc, char **argv){
 
     const char *program = shift(&argc, &argv);  
+    int optimize = 0;
+    int fuse = 0;
+    int debug = 0;
+    int stream = 0;
+    int format_given = 0;
+    Bm_File_Format format = BM_FORMAT_V2;
+
+    while (argc > 0 && argv[0][0] == '-' && argv[0][1] != '\0'){
+        const char *flag = shift(&argc, &argv);
+
+        if (strcmp(flag, "-O") == 0){
+            optimize = 1;
+        } else if (strcmp(flag, "-f") == 0){
+            fuse = 1;
+        } else if (strcmp(flag, "-g") == 0){
+            debug = 1;
+        } else if (strcmp(flag, "-s") == 0){
+            stream = 1;
+        } else if (strcmp(flag, "-F") == 0){
+            if (argc == 0){
+                usage(stderr, program);
+                fprintf(stderr, "ERROR: No argument is provided for flag `%s`\n", flag);
+                exit(1);
+            }
+            const char *name = shift(&argc, &argv);
+            format_given = 1;
+            if (strcmp(name, "v1") == 0){
+                format = BM_FORMAT_V1;
+            } else if (strcmp(name, "v2") == 0){
+                format = BM_FORMAT_V2;
+            } else if (strcmp(name, "v2-fixed") == 0){
+                format = BM_FORMAT_V2_FIXED;
+            } else {
+                usage(stderr, program);
+                fprintf(stderr, "ERROR: Unknown format `%s`\n", name);
+                exit(1);
+            }
+        } else if (strcmp(flag, "-h") == 0){
+            usage(stdout, program);
+            exit(0);
+        } else {
+            usage(stderr, program);
+            fprintf(stderr, "ERROR: Unknown Flag `%s`\n", flag);
+            exit(1);
+        }
+    }
+
+    if (debug && format == BM_FORMAT_V1){
+        usage(stderr, program);
+        fprintf(stderr, "ERROR: -g needs a v2 format\n");
+        exit(1);
+    }
 
     if (argc == 0){
         usage(stderr, program); 
-        fprintf(stderr, "ERROR: Expected input and output"); 
+        fprintf(stderr, "ERROR: Expected input and output\n"); 
         exit(1); 
     }
     const char *input_file_path = shift(&argc, &argv);
 
     if (argc == 0){
         usage(stderr, program); 
-        fprintf(stderr, "ERROR: Expected input and output"); 
+        fprintf(stderr, "ERROR: Expected input and output\n"); 
         exit(1); 
     }
     const char *output_file_path = shift(&argc, &argv); 
 
-    String_View source = slurp_file(input_file_path); 
+    if (stream){
+        if (optimize || fuse || debug || (format_given && format != BM_FORMAT_V2_FIXED)){
+            usage(stderr, program);
+            fprintf(stderr, "ERROR: -s only writes v2-fixed, without -O, -f or -g\n");
+            exit(1);
+        }
+        return assemble_stream(input_file_path, output_file_path);
+    }
+    if (strcmp(input_file_path, "-") == 0 || strcmp(output_file_path, "-") == 0){
+        usage(stderr, program);
+        fprintf(stderr, "ERROR: `-` for stdin or stdout needs -s\n");
+        exit(1);
+    }
+
+    // `native <name>` resolves against the natives of libbm
+    Bm *bm = bm_create(NULL, 0, BM_PROGRAM_CAPACITY);
+    if (bm == NULL || bm_bind_std_natives(bm) != ERR_OK){
+        fprintf(stderr, "ERROR: Could not allocate a VM\n");
+        exit(1);
+    }
+
+    String_View source = {0};
+    const size_t input_len = strlen(input_file_path);
+    if (input_len >= 3 && strcmp(input_file_path + input_len - 3, ".bm") == 0){
+        if (bm_load_program_from_file(bm, input_file_path) != ERR_OK){
+            fprintf(stderr, "ERROR: Could not load `%s`: %s\n", input_file_path, bm_error_message(bm));
+            exit(1);
+        }
+    } else {
+        source = slurp_file(input_file_path); 
+        if (bm_translate_source(source, bm, &lt) != ERR_OK){
+            fprintf(stderr, "ERROR: %s: %s\n", input_file_path, bm_error_message(bm));
+            exit(1);
+        }
+    }
+
+    if (optimize){
+        const Word before = bm_program_size(bm);
+        Bm_Optimize_Stats stats;
+        if (bm_optimize_program(bm, &lt, &stats) != ERR_OK){
+            fprintf(stderr, "ERROR: Could not allocate memory to optimize `%s`\n", input_file_path);
+            exit(1);
+        }
+        printf("INFO: folded %zu, removed %zu nops, %zu unreachable and %zu jmps to the next instruction, "
+               "threaded %zu jumps, %ld -> %ld instructions\n", stats.folded, stats.nops, stats.unreachable,
+               stats.jumps, stats.threaded, before, bm_program_size(bm));
+    }
+
+    if (fuse){
+        const Word before = bm_program_size(bm);
+        const size_t fused = bm_fuse_program(bm, &lt);
+        printf("INFO: fused %zu superinstructions, %ld -> %ld instructions\n", fused, before, bm_program_size(bm));
+    }
+
+    Err err = debug
+        ? bm_save_program_to_file_with_debug(bm, output_file_path, format)
+        : bm_save_program_to_file_as(bm, output_file_path, format);
+    if (err == ERR_IO){
+        fprintf(stderr, "ERROR: Could not write to file `%s` %s\n", output_file_path, strerror(errno));
+        exit(1);
+    }
+    if (err == ERR_ILLEGAL_OPERAND && debug){
+        fprintf(stderr, "ERROR: `%s` has no source locations to keep\n", input_file_path);
+        exit(1);
+    }
+    if (err != ERR_OK){
+        fprintf(stderr, "ERROR: Could not encode `%s`: %s\n", output_file_path, err_as_cstr(err));
+        exit(1);
+    }
 
-    bm_translate_source(source, &bm, &lt);
-    bm_save_program_to_file(&bm, output_file_path);
+    label_table_free(&lt);
+    bm_destroy(bm);
+    free((char *) source.data);
     return 0; 
-}
\ No newline at end of file
+}
@@ -0,0 +1,137 @@
+#!/bin/sh
+# `make check`: end-to-end checks of the tools that the fuzzer can't cover.
+# Run from the root of the repo after `make`.
+
+set -u
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+failed=0
+
+fail(){
+    echo "FAIL: $*"
+    failed=1
+}
+
+# --serve must start every request from zeroed memory, whatever wrote it
+serve_isolated(){
+    name=$1
+    printf '%s\n' "$2" > "$tmp/$name.ebasm"
+    ./ebasm "$tmp/$name.ebasm" "$tmp/$name.bm" || { fail "$name: does not assemble"; return; }
+    sock="$tmp/$name.sock"
+    ./bmi -i "$tmp/$name.bm" --serve "$sock" -j 1 > /dev/null 2>&1 &
+    pid=$!
+    i=0
+    while [ ! -S "$sock" ] && [ $i -lt 50 ]; do
+        sleep 0.1
+        i=$((i + 1))
+    done
+    answers=$(./bmclient -c "$sock" -n 3 -v 2> /dev/null | grep '^ERR_' | sort -u | wc -l)
+    kill "$pid"
+    wait "$pid" 2> /dev/null
+    [ "$answers" -eq 1 ] || fail "$name: repeated requests got different answers"
+}
+
+serve_isolated store 'push 0
+load
+push 0
+push 42
+store
+halt'
+
+serve_isolated mem_fill 'push 0
+load
+push 0
+push 1
+push 42
+native mem_fill
+halt'
+
+# ebasm must reject the line with ERR_SYNTAX and its number, in both modes
+asm_rejects(){
+    printf 'push 1\n%s\nhalt\n' "$1" > "$tmp/bad.ebasm"
+    for mode in "" -s; do
+        if ./ebasm $mode "$tmp/bad.ebasm" "$tmp/bad.bm" > "$tmp/bad.out" 2>&1; then
+            fail "ebasm $mode accepted \`$1\`"
+        elif ! grep -q "line 2:" "$tmp/bad.out"; then
+            fail "ebasm $mode: no line number for \`$1\`: $(cat "$tmp/bad.out")"
+        fi
+    done
+}
+
+asm_rejects 'push 0x10'
+asm_rejects 'push 12abc'
+asm_rejects 'push'
+asm_rejects 'push -'
+asm_rejects 'push 1 2'
+asm_rejects 'push 9223372036854775808'
+asm_rejects 'push min'
+asm_rejects 'dup max'
+asm_rejects 'ret'
+asm_rejects 'jmp 3x'
+asm_rejects 'halt 5'
+asm_rejects 'plus 1'
+asm_rejects 'native nope'
+
+# and take these as they are
+asm_accepts(){
+    printf '%s\n' "$1" > "$tmp/good.ebasm"
+    ./ebasm "$tmp/good.ebasm" "$tmp/good.bm" > /dev/null 2>&1 || { fail "ebasm rejected \`$1\`"; return; }
+    got=$(./debasm "$tmp/good.bm")
+    [ "$got" = "$2" ] || fail "\`$1\` assembled to \`$got\`"
+}
+
+asm_accepts 'push -9223372036854775808' 'push -9223372036854775808'
+asm_accepts 'push 42 # answer' 'push 42'
+asm_accepts 'halt # done' 'halt'
+asm_accepts 'native max' 'native max'
+asm_accepts 'native 3' 'native mod'
+
+# a fused program must fail with the same error as the sequences it replaces,
+# on every engine
+fused_fails_alike(){
+    name=$1
+    printf '%s\n' "$3" > "$tmp/$name.ebasm"
+    ./ebasm "$tmp/$name.ebasm" "$tmp/$name.bm" > /dev/null 2>&1 || { fail "$name: does not assemble"; return; }
+    ./ebasm -f "$tmp/$name.ebasm" "$tmp/$name.f.bm" > /dev/null 2>&1 || { fail "$name: does not fuse"; return; }
+    for engine in switch threaded jit tos block; do
+        want=$(./bmi -i "$tmp/$name.bm" -s "$2" -e $engine 2>&1 | grep -o 'ERR_[A-Z_]*')
+        got=$(./bmi -i "$tmp/$name.f.bm" -s "$2" -e $engine 2>&1 | grep -o 'ERR_[A-Z_]*')
+        [ "$got" = "$want" ] || fail "$name on $engine: fused \`${got:-ok}\`, unfused \`${want:-ok}\`"
+    done
+}
+
+fused_fails_alike push_plus_full 1 'push 1
+push 2
+plus
+halt'
+
+fused_fails_alike push_mult_full 1 'push 1
+push 2
+mult
+halt'
+
+fused_fails_alike push_plus_empty 4 'push 2
+plus
+halt'
+
+fused_fails_alike dup2_plus_room_for_one 3 'push 1
+push 2
+dup 1
+dup 1
+plus
+halt'
+
+fused_fails_alike dup2_plus_short 2 'push 1
+dup 1
+dup 1
+plus
+halt'
+
+# -h prints the usage to stdout and succeeds
+for tool in ebasm debasm bmi bmbench; do
+    ./$tool -h 2> /dev/null | grep -q '^Usage' || fail "$tool -h does not print its usage"
+done
+
+[ $failed -eq 0 ] && echo "all checks passed"
+exit $failed